@@ -22,7 +22,8 @@ echo "cloudvpndir = src/" >>$OUT
 echo "cloudvpn_SOURCES = `echo src/*.c`" >>$OUT
 echo "cloudvpn_CPPFLAGS = ${COMMON_CPPFLAGS}" >>$OUT
 echo "cloudvpn_CFLAGS = ${COMMON_CFLAGS}" >>$OUT
-echo "cloudvpn_LDFLAGS = ${COMMON_LDFLAGS}" >>$OUT
+# plugins call back into the core, so it has to export its symbols
+echo "cloudvpn_LDFLAGS = ${COMMON_LDFLAGS} -export-dynamic" >>$OUT
 echo "cloudvpn_LDADD = -lev -lpthread -ldl " >>$OUT
 [ -f src/Makefile.am.extra ] &&
 	while read l ; do
@@ -43,5 +44,31 @@ for i in $PLUGINS ; do
 		done < src/$i/Makefile.am.extra
 done
 
+cd bench
+BENCHES=`echo *.c | sed 's/\.c//g'`
+cd ..
+
+echo "EXTRA_PROGRAMS = `for i in ${BENCHES}; do echo -n \"bench_$i \" ; done`" >>$OUT
+echo "noinst_HEADERS += `echo bench/*.h`" >>$OUT
+
+for i in $BENCHES ; do
+	echo "bench_${i}_SOURCES = bench/$i.c" >>$OUT
+	echo "bench_${i}_CPPFLAGS = -I\$(srcdir)/bench/ ${COMMON_CPPFLAGS}" >>$OUT
+	echo "bench_${i}_CFLAGS = ${COMMON_CFLAGS}" >>$OUT
+	echo "bench_${i}_LDFLAGS = ${COMMON_LDFLAGS}" >>$OUT
+	echo "bench_${i}_LDADD = -lpthread " >>$OUT
+	[ -f bench/$i.am.extra ] &&
+		while read l ; do
+			[ "$l" ] && echo "bench_${i}_${l}" >>$OUT
+		done < bench/$i.am.extra
+done
+
+# benchmarks are not built by default, 'make bench' builds and runs them.
+# 'make bench BENCHES=bench_core' runs just some of them.
+echo "BENCHES = \$(EXTRA_PROGRAMS)" >>$OUT
+echo ".PHONY: bench" >>$OUT
+echo "bench: \$(BENCHES)" >>$OUT
+printf '\t@for i in $(BENCHES) ; do ./$$i || exit 1 ; done\n' >>$OUT
+
 libtoolize --force && aclocal && autoconf && automake --add-missing
 
@@ -0,0 +1,146 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_BENCH_H
+#define _CVPN_BENCH_H
+
+/*
+ * tiny helpers shared by the benchmarks. Every result is printed as one
+ * line "bench case threads value unit", so outputs of two runs can be
+ * simply diffed or pasted side by side (bench/compare.sh does that).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "atomic.h"
+
+/* include/sched.h shadows the system one, so this is declared by hand */
+int sched_yield (void);
+
+static const int bench_thread_counts[] = {1, 2, 4, 8, 0};
+
+static inline uint64_t bench_now_ns()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_report (const char*bench, const char*what,
+                                 int threads, double value, const char*unit)
+{
+	printf ("%-10s %-28s %3d %14.3f %s\n",
+	        bench, what, threads, value, unit);
+	fflush (stdout);
+}
+
+static inline void bench_fail (const char*bench, const char*what)
+{
+	fprintf (stderr, "%s: %s\n", bench, what);
+	exit (1);
+}
+
+/*
+ * samples of something measured over and over, reported as percentiles:
+ * lines "case_p50", "case_p90" and "case_p99". A sample is usually a round
+ * of many operations divided by their count, single ones are too short
+ * for the clock.
+ */
+
+#define BENCH_SAMPLES 4096
+
+struct bench_samples {
+	double v[BENCH_SAMPLES];
+	int n;
+};
+
+static inline void bench_sample (struct bench_samples*s, double v)
+{
+	if (s->n < BENCH_SAMPLES) s->v[s->n++] = v;
+}
+
+static int bench_cmp_double (const void*a, const void*b)
+{
+	double x = * (const double*) a, y = * (const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+static inline double bench_percentile (struct bench_samples*s, int p)
+{
+	/* the samples are sorted by then */
+	if (!s->n) return 0;
+	return s->v[ (s->n - 1) * p / 100];
+}
+
+static inline void bench_report_samples (const char*bench, const char*what,
+        int threads, struct bench_samples*s,
+        const char*unit)
+{
+	static const int p[] = {50, 90, 99, 0};
+	char name[64];
+	int i;
+
+	qsort (s->v, s->n, sizeof (double), bench_cmp_double);
+	for (i = 0;p[i];++i) {
+		snprintf (name, sizeof (name), "%s_p%d", what, p[i]);
+		bench_report (bench, name, threads, bench_percentile (s, p[i]), unit);
+	}
+	s->n = 0;
+}
+
+/*
+ * run n threads of fn(args[i]) that all start at the same moment.
+ * Returns the wall time in nanoseconds.
+ */
+
+struct bench_thread {
+	void* (*fn) (void*);
+	void*arg;
+	int*go;
+};
+
+static void* bench_thread_start (void*a)
+{
+	struct bench_thread*t = a;
+	while (!cl_atomic_load_acq (t->go) ) sched_yield();
+	return t->fn (t->arg);
+}
+
+static inline uint64_t bench_run_threads (int n, void* (*fn) (void*),
+        void**args)
+{
+	pthread_t th[n];
+	struct bench_thread bt[n];
+	int i, go = 0;
+	uint64_t start;
+
+	for (i = 0;i < n;++i) {
+		bt[i].fn = fn;
+		bt[i].arg = args[i];
+		bt[i].go = &go;
+		if (pthread_create (th + i, 0, bench_thread_start, bt + i) )
+			bench_fail ("bench", "can't create threads");
+	}
+
+	start = bench_now_ns();
+	cl_atomic_store_rel (&go, 1);
+	for (i = 0;i < n;++i) pthread_join (th[i], 0);
+
+	return bench_now_ns() - start;
+}
+
+#endif
+
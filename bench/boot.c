@@ -0,0 +1,128 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * boot of a config with 1000 parts of the real plugins (from .libs, so
+ * run this from the build directory after make): 450 dvr, 500 lsr that
+ * link to each other, and 50 name parts as the control plane.
+ *	eager	everything is made at boot
+ *	lazy	only 50 lsr are, they link to 50 others that get made because
+ *		of that; the remaining 400 never are
+ * Reported are the times of the boot phases, and how much later than
+ * the forwarding parts the control plane was ready. Every run is a fresh
+ * process.
+ */
+
+#include "bench.h"
+#include "boot.h"
+#include "core.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define DVR 450
+#define LSR 500
+#define EAGER_LSR 50
+#define NAME 50
+
+static const char*dir = ".libs";
+
+static void write_config (const char*file, int workers, int lazy)
+{
+	FILE*f = fopen (file, "w");
+	int i;
+
+	if (!f) bench_fail ("boot", "can't write the config");
+	fprintf (f, "workers %d\n", workers);
+	fprintf (f, "plugin dvr %s/libdvr.so\n", dir);
+	fprintf (f, "plugin lsr %s/liblsr.so\n", dir);
+	fprintf (f, "plugin name %s/libname.so\n", dir);
+
+	for (i = 0;i < DVR;++i) fprintf (f, "part d%d dvr\n", i);
+	for (i = 0;i < LSR;++i) {
+		fprintf (f, "part r%d lsr%s\n", i,
+		         lazy && i >= EAGER_LSR ? " lazy" : "");
+		fprintf (f, "command r%d id %d\n", i, i + 1);
+		if (!lazy || i < EAGER_LSR)
+			fprintf (f, "command r%d link r%d\n", i, (i + EAGER_LSR) % LSR);
+	}
+	for (i = 0;i < NAME;++i) {
+		fprintf (f, "part n%d name control\n", i);
+		fprintf (f, "command n%d ttl 60\n", i);
+	}
+	fclose (f);
+}
+
+static void run (int workers, int lazy)
+{
+	char file[] = "/tmp/bench_bootXXXXXX", what[64];
+	char*argv[] = {"bench_boot", file, 0};
+	struct cloudvpn_boot_times*t;
+	uint64_t start, ready;
+	int fd, st;
+	pid_t pid;
+
+	if ( (fd = mkstemp (file) ) < 0) bench_fail ("boot", "no temp file");
+	close (fd);
+	write_config (file, workers, lazy);
+
+	fflush (stdout);
+	if ( (pid = fork() ) < 0) bench_fail ("boot", "can't fork");
+	if (!pid) {
+		/* the phases say what they did on stderr, that's not needed */
+		if ( (fd = open ("/dev/null", O_WRONLY) ) >= 0) dup2 (fd, 2);
+
+		start = bench_now_ns();
+		if (cloudvpn_core_init() ) bench_fail ("boot", "core init");
+		if (cloudvpn_boot (2, argv) ) bench_fail ("boot", "boot failed");
+		ready = bench_now_ns() - start;
+
+		t = cloudvpn_boot_times();
+		while (!cl_atomic_load (&t->control_us) ) usleep (1000);
+
+		sprintf (what, "%s_plugins", lazy ? "lazy" : "eager");
+		bench_report ("boot", what, t->workers, t->plugins_us / 1e3, "ms");
+		sprintf (what, "%s_parts", lazy ? "lazy" : "eager");
+		bench_report ("boot", what, t->workers, t->parts_us / 1e3, "ms");
+		sprintf (what, "%s_forwarding_ready", lazy ? "lazy" : "eager");
+		bench_report ("boot", what, t->workers, ready / 1e6, "ms");
+		sprintf (what, "%s_control_after", lazy ? "lazy" : "eager");
+		bench_report ("boot", what, t->workers, t->control_us / 1e3, "ms");
+		sprintf (what, "%s_parts_made", lazy ? "lazy" : "eager");
+		bench_report ("boot", what, t->workers, t->parts, "parts");
+		_exit (0);
+	}
+
+	waitpid (pid, &st, 0);
+	unlink (file);
+	if (!WIFEXITED (st) || WEXITSTATUS (st) ) bench_fail ("boot", "child failed");
+}
+
+int main (int argc, char**argv)
+{
+	char lib[256];
+
+	if (argc > 1) dir = argv[1];
+	snprintf (lib, sizeof (lib), "%s/liblsr.so", dir);
+	if (access (lib, R_OK) ) {
+		fprintf (stderr, "boot: no plugins in %s, run make first\n", dir);
+		return 1;
+	}
+
+	run (2, 0);
+	run (4, 0);
+	run (2, 1);
+	run (4, 1);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# compares two outputs of the benchmarks, line by line:
+#	make bench BENCHES=bench_core > before
+#	(change something)
+#	make bench BENCHES=bench_core > after
+#	sh bench/compare.sh before after
+# Results are matched by the bench, the case, the thread count and the
+# unit. The change is in percent of the first value, mind that for some
+# units less is better (ns, us, ms) and for others more (x/s).
+
+[ $# -eq 2 ] || { echo "usage: $0 <before> <after>" >&2 ; exit 1 ; }
+
+awk '
+# anything else (make saying what it builds) is not a result
+NF != 5 || $3 !~ /^[0-9]+$/ || $4 !~ /^-?[0-9.]+$/ { next }
+NR == FNR { old[$1 " " $2 " " $3 " " $5] = $4 ; next }
+{
+	k = $1 " " $2 " " $3 " " $5
+	if (! (k in old) ) { printf "%-10s %-28s %3d %14s %14.3f %s\n", $1, $2, $3, "-", $4, $5 ; next }
+	d = old[k] != 0 ? 100 * ($4 - old[k]) / old[k] : 0
+	printf "%-10s %-28s %3d %14.3f %14.3f %+7.1f%% %s\n", $1, $2, $3, old[k], $4, d, $5
+}' "$1" "$2"
@@ -0,0 +1,223 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * the control socket of the init plugin, with 5000 parts around:
+ *	send		round trip of "send <part> <command>" (median, p99)
+ *	stats_parts	how long the whole list of parts takes to stream, and
+ *			how much of it there is (the part never holds more
+ *			than its 16k buffer of it)
+ *	forwarding	packets a second that go through a worker while a
+ *			client reads "stats" in a loop, against nobody asking,
+ *			and how many of the "stats" it got meanwhile
+ */
+
+#include "harness.h"
+#include "boot.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PARTS 5000
+#define SENDS 2000
+#define STREAMS 20
+#define FORWARD_NS 500000000ULL
+
+static char path[] = "/tmp/bench_control.sock";
+
+static int connect_control()
+{
+	struct sockaddr_un sa;
+	int fd, i;
+
+	memset (&sa, 0, sizeof (sa) );
+	sa.sun_family = AF_UNIX;
+	strcpy (sa.sun_path, path);
+
+	for (i = 0;i < 100;++i) {
+		fd = socket (AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) bench_fail ("control", "no socket");
+		if (!connect (fd, (struct sockaddr*) &sa, sizeof (sa) ) ) return fd;
+		close (fd);
+		usleep (10000);
+	}
+	bench_fail ("control", "can't connect");
+	return -1;
+}
+
+/* reads a whole reply, returns its length; lines are counted in *lines */
+static size_t request (int fd, const char*req, int*lines)
+{
+	static char buf[65536];
+	char last[3] = {0, 0, 0};
+	size_t total = 0;
+	ssize_t n, i;
+
+	if (write (fd, req, strlen (req) ) != (ssize_t) strlen (req) )
+		bench_fail ("control", "can't write");
+	if (lines) *lines = 0;
+
+	for (;;) {
+		n = read (fd, buf, sizeof (buf) );
+		if (n <= 0) bench_fail ("control", "connection lost");
+		for (i = 0;i < n;++i) {
+			last[0] = last[1];
+			last[1] = last[2];
+			last[2] = buf[i];
+			if (buf[i] == '\n' && lines) ++*lines;
+		}
+		total += n;
+		/* a reply ends with "\n.\n" (or is just ".\n") */
+		if (last[1] == '.' && last[2] == '\n' &&
+		        (last[0] == '\n' || total == 2) ) break;
+	}
+	return total;
+}
+
+static int cmp_u64 (const void*a, const void*b)
+{
+	uint64_t x = * (const uint64_t*) a, y = * (const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void sends (int fd)
+{
+	static uint64_t lat[SENDS];
+	char req[64];
+	uint64_t t;
+	int i;
+
+	for (i = 0;i < SENDS;++i) {
+		sprintf (req, "send s%d ping %d\n", i % PARTS, i);
+		t = bench_now_ns();
+		request (fd, req, 0);
+		lat[i] = bench_now_ns() - t;
+	}
+	qsort (lat, SENDS, sizeof (uint64_t), cmp_u64);
+	bench_report ("control", "send_median", 1, lat[SENDS / 2] / 1e3, "us");
+	bench_report ("control", "send_p99", 1, lat[SENDS * 99 / 100] / 1e3, "us");
+}
+
+static void stream (int fd)
+{
+	uint64_t t;
+	size_t bytes = 0;
+	int i, lines = 0;
+
+	t = bench_now_ns();
+	for (i = 0;i < STREAMS;++i) bytes = request (fd, "stats parts\n", &lines);
+	t = bench_now_ns() - t;
+
+	/* the parts, init and the dot */
+	if (lines != PARTS + 2) bench_fail ("control", "parts are missing");
+	bench_report ("control", "stats_parts", 1, t / 1e6 / STREAMS, "ms");
+	bench_report ("control", "stats_parts_size", 1, bytes / 1024.0, "KiB");
+}
+
+/*
+ * forwarding: a part that sends its packet around again and again
+ */
+
+static uint64_t loops;
+static int looping;
+
+static void loop_process (struct part*pt, struct work*w)
+{
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_packet) return;
+	cl_atomic_inc (&loops);
+	if (!cl_atomic_load (&looping) ) {
+		cloudvpn_packet_free (w->p);
+		return;
+	}
+	bench_send_packet (pt, 64, 0);
+	cloudvpn_packet_free (w->p);
+}
+
+static struct plugin loop_plugin = {
+	"bench_loop", {0}, loop_process, 0, 0
+};
+
+static int reader_quit;
+static uint64_t replies;
+
+static void* reader (void*arg)
+{
+	int fd = * (int*) arg;
+	while (!cl_atomic_load_acq (&reader_quit) ) {
+		request (fd, "stats\n", 0);
+		cl_atomic_inc (&replies);
+		sched_yield();
+	}
+	return 0;
+}
+
+static double forward (struct part*loop, int fd)
+{
+	uint64_t n, t;
+	pthread_t th;
+	int i;
+
+	cl_atomic_store (&reader_quit, 0);
+	if (fd >= 0 && pthread_create (&th, 0, reader, &fd) )
+		bench_fail ("control", "no thread");
+
+	cl_atomic_store (&loops, 0);
+	cl_atomic_store (&looping, 1);
+	for (i = 0;i < 4;++i) bench_send_packet (loop, 64, 0);
+	t = bench_now_ns();
+	usleep (FORWARD_NS / 1000);
+	n = cl_atomic_load (&loops);
+	t = bench_now_ns() - t;
+	cl_atomic_store (&looping, 0);
+
+	cl_atomic_store_rel (&reader_quit, 1);
+	if (fd >= 0) pthread_join (th, 0);
+	usleep (50000);
+	return n / (t / 1e9);
+}
+
+int main()
+{
+	struct part*init, *loop;
+	char name[32], cmd[64];
+	int i, fd;
+
+	bench_core_start (2);
+	if (cloudvpn_plugin_init() ) bench_fail ("control", "plugin init");
+	init = cloudvpn_part_init (cloudvpn_plugin_get(), "init");
+	loop = cloudvpn_part_init (&loop_plugin, "loop");
+	if (!init || !init->data || !loop) bench_fail ("control", "no parts");
+	for (i = 0;i < PARTS - 1;++i) {
+		sprintf (name, "s%d", i);
+		if (!bench_sink_part (name) ) bench_fail ("control", "no parts");
+	}
+
+	sprintf (cmd, "control %s", path);
+	bench_command (init, cmd);
+	fd = connect_control();
+
+	sends (fd);
+	stream (fd);
+
+	bench_report ("control", "forwarding_idle", 2, forward (loop, -1),
+	              "packets/s");
+	bench_report ("control", "forwarding_streaming", 2, forward (loop, fd),
+	              "packets/s");
+	bench_report ("control", "stats_while_forwarding", 1,
+	              replies / (FORWARD_NS / 1e9), "replies/s");
+
+	close (fd);
+	unlink (path);
+	return 0;
+}
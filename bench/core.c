@@ -0,0 +1,405 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * the core primitives one by one, for telling whether a change to the
+ * scheduler, events, packets, pool or mutexes made them faster or slower:
+ *	sched_<mix>	works through the scheduler to a part that counts
+ *			them, by priority mix and worker count: all the
+ *			same, two priorities, and spread over 0-254
+ *	event_timer	registering a 0us timer until its work runs
+ *	event_fd	registering a pipe and writing to it until the
+ *			readable event's work runs
+ *	packet_pooled	alloc_buf and free on one thread
+ *	packet_handoff_alloc
+ *			alloc_buf on a thread whose packets another one
+ *			frees, so its pool never gets them back
+ *	packet_plain	cloudvpn_packet_alloc with its data, and free
+ *	lookup_<n>	cloudvpn_find_part_by_name among n parts
+ *	refcount	part acquire and close on one part, by thread count
+ *	mutex		cl_mutex lock and unlock around almost nothing
+ *
+ * Everything runs in rounds that are timed one by one and reported as
+ * percentiles; the first round of each is a warmup that isn't counted.
+ * Random numbers have fixed seeds. Every scheduler worker count gets a
+ * fresh process.
+ */
+
+#include "harness.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define ROUNDS 200
+#define SCHED_ROUND 1000
+#define EVENTS 2000
+#define PACKET_ROUND 1000
+#define LOOKUP_ROUND 1000
+#define SPIN_ROUND 10000
+#define MAX_THREADS 8
+
+static struct bench_samples samples;
+
+static uint64_t xorshift (uint64_t*s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* waits for a counter, yielding (the workers may share the cpu with us) */
+static void wait_for (uint64_t*counter, uint64_t value)
+{
+	while (cl_atomic_load_acq (counter) < value) sched_yield();
+}
+
+/*
+ * scheduler
+ */
+
+static uint64_t counted;
+
+static void count_process (struct part*pt, struct work*w)
+{
+	if (w->type == work_packet || w->type == work_command)
+		cloudvpn_packet_free (w->p);
+	cl_atomic_add (&counted, 1);
+}
+
+static struct plugin count_plugin = {
+	"bench_count", {0}, count_process, 0, 0
+};
+
+static int workers_running;
+
+static void* worker (void*a)
+{
+	cloudvpn_scheduler_run (&workers_running);
+	return 0;
+}
+
+enum { mix_same, mix_two, mix_spread };
+static const char*mix_name[] = {"sched_same", "sched_two", "sched_spread"};
+
+static void sched_mix (struct part*counter, int mix, int workers)
+{
+	uint64_t seed = 1, t, start, target = 0;
+	struct work*w;
+	int r, i;
+
+	start = bench_now_ns();
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < SCHED_ROUND;++i) {
+			if (! (w = cloudvpn_new_work() ) ) bench_fail ("core", "no memory");
+			w->type = work_event;
+			w->is_static = 0;
+			w->e.owner = counter;
+			w->priority = mix == mix_same ? 0 :
+			              mix == mix_two ? (i & 1) * 128 :
+			              xorshift (&seed) % LOWEST_PRIORITY;
+			if (cloudvpn_schedule_work (w) ) bench_fail ("core", "schedule");
+		}
+		target += SCHED_ROUND;
+		wait_for (&counted, target);
+		if (r) bench_sample (&samples,
+			                     (bench_now_ns() - t) / (double) SCHED_ROUND);
+		else start = bench_now_ns();
+	}
+
+	bench_report ("core", mix_name[mix], workers,
+	              ROUNDS * SCHED_ROUND / ( (bench_now_ns() - start) / 1e9),
+	              "works/s");
+	bench_report_samples ("core", mix_name[mix], workers, &samples, "ns/work");
+}
+
+/*
+ * events, they need the poll and a worker for it
+ */
+
+static uint64_t fired;
+static int pipe_fd[2];
+
+static void event_process (struct part*pt, struct work*w)
+{
+	char c;
+
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_event) return;
+	if (w->e.type == event_fd_readable)
+		if (read (pipe_fd[0], &c, 1) != 1) bench_fail ("core", "pipe");
+	cl_atomic_add (&fired, 1);
+}
+
+static struct plugin event_plugin = {
+	"bench_event", {0}, event_process, 0, 0
+};
+
+static void event_round_trips (struct part*owner, int type, const char*what,
+                              int workers)
+{
+	struct event*e = cloudvpn_new_event();
+	uint64_t t;
+	int i;
+
+	if (!e) bench_fail ("core", "no event");
+	e->priority = 0;
+	e->is_static = 1;
+	e->data.type = type;
+	e->data.owner = owner;
+	if (type == event_time) e->data.time = 0;
+	else e->data.fd = pipe_fd[0];
+
+	for (i = 0;i <= EVENTS;++i) {
+		t = bench_now_ns();
+		if (cloudvpn_register_event (e) ) bench_fail ("core", "register");
+		if (type == event_fd_readable && write (pipe_fd[1], "x", 1) != 1)
+			bench_fail ("core", "pipe");
+		wait_for (&fired, i + 1);
+		if (i) bench_sample (&samples, (bench_now_ns() - t) / 1e3);
+	}
+	bench_report_samples ("core", what, workers, &samples, "us");
+	cloudvpn_dispose_event (e);
+	cl_atomic_store (&fired, 0);
+}
+
+static void scheduler (int workers)
+{
+	struct part*counter, *owner;
+	pthread_t t;
+	int i;
+
+	if (cloudvpn_core_init() ) bench_fail ("core", "init failed");
+	counter = cloudvpn_part_init (&count_plugin, "counter");
+	owner = cloudvpn_part_init (&event_plugin, "events");
+	if (!counter || !owner) bench_fail ("core", "no parts");
+
+	workers_running = 1;
+	for (i = 0;i < workers;++i)
+		if (pthread_create (&t, 0, worker, 0) )
+			bench_fail ("core", "can't start workers");
+
+	/* no poll yet, it would keep one of the workers */
+	sched_mix (counter, mix_same, workers);
+	sched_mix (counter, mix_two, workers);
+	sched_mix (counter, mix_spread, workers);
+
+	if (workers != 2) return;
+	if (pipe (pipe_fd) ) bench_fail ("core", "no pipe");
+	cloudvpn_schedule_event_poll();
+	event_round_trips (owner, event_time, "event_timer", workers);
+	event_round_trips (owner, event_fd_readable, "event_fd", workers);
+}
+
+static void scheduler_fresh (int workers)
+{
+	pid_t pid;
+	int st;
+
+	fflush (stdout);
+	if ( (pid = fork() ) < 0) bench_fail ("core", "can't fork");
+	if (!pid) {
+		scheduler (workers);
+		fflush (stdout);
+		_exit (0);
+	}
+	waitpid (pid, &st, 0);
+	if (!WIFEXITED (st) || WEXITSTATUS (st) ) bench_fail ("core", "child failed");
+}
+
+/*
+ * packets
+ */
+
+static struct packet*handoff[PACKET_ROUND];
+static int handoff_state; /* 1 when the packets are there to be freed */
+
+static void* handoff_free (void*arg)
+{
+	int r, i;
+
+	for (r = 0;r <= ROUNDS;++r) {
+		while (cl_atomic_load_acq (&handoff_state) != 1) sched_yield();
+		for (i = 0;i < PACKET_ROUND;++i) cloudvpn_packet_free (handoff[i]);
+		cl_atomic_store_rel (&handoff_state, 0);
+	}
+	return 0;
+}
+
+static void packets()
+{
+	struct packet*p;
+	pthread_t th;
+	uint64_t t, spent;
+	int r, i;
+
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < PACKET_ROUND;++i) {
+			p = cloudvpn_packet_alloc_buf (1500);
+			if (!p) bench_fail ("core", "no packet");
+			cloudvpn_packet_free (p);
+		}
+		if (r) bench_sample (&samples,
+			                     (bench_now_ns() - t) / (double) PACKET_ROUND);
+	}
+	bench_report_samples ("core", "packet_pooled", 1, &samples, "ns/packet");
+
+	if (pthread_create (&th, 0, handoff_free, 0) ) bench_fail ("core", "thread");
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < PACKET_ROUND;++i)
+			if (! (handoff[i] = cloudvpn_packet_alloc_buf (1500) ) )
+				bench_fail ("core", "no packet");
+		spent = bench_now_ns() - t;
+
+		/* the other thread's time is its own, waiting isn't counted */
+		cl_atomic_store_rel (&handoff_state, 1);
+		while (cl_atomic_load_acq (&handoff_state) ) sched_yield();
+		if (r) bench_sample (&samples, spent / (double) PACKET_ROUND);
+	}
+	pthread_join (th, 0);
+	bench_report_samples ("core", "packet_handoff_alloc", 1, &samples,
+	                      "ns/packet");
+
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < PACKET_ROUND;++i) {
+			p = cloudvpn_packet_alloc();
+			if (!p) bench_fail ("core", "no packet");
+			p->len = 1500;
+			if (cloudvpn_alloc_data (p) ) bench_fail ("core", "no data");
+			cloudvpn_packet_free (p);
+		}
+		if (r) bench_sample (&samples,
+			                     (bench_now_ns() - t) / (double) PACKET_ROUND);
+	}
+	bench_report_samples ("core", "packet_plain", 1, &samples, "ns/packet");
+}
+
+/*
+ * pool
+ */
+
+static void lookups()
+{
+	static const int sizes[] = {10, 1000, 10000, 0};
+	char name[32], what[32];
+	uint64_t seed = 1, t;
+	int made = 0, s, r, i;
+
+	for (s = 0;sizes[s];++s) {
+		for (;made < sizes[s];++made) {
+			sprintf (name, "p%d", made);
+			if (!bench_sink_part (name) ) bench_fail ("core", "no parts");
+		}
+
+		for (r = 0;r <= ROUNDS;++r) {
+			t = bench_now_ns();
+			for (i = 0;i < LOOKUP_ROUND;++i) {
+				sprintf (name, "p%d", (int) (xorshift (&seed) % made) );
+				if (!cloudvpn_find_part_by_name (name) )
+					bench_fail ("core", "part not found");
+			}
+			if (r) bench_sample (&samples,
+				                     (bench_now_ns() - t) / (double) LOOKUP_ROUND);
+		}
+		sprintf (what, "lookup_%d", sizes[s]);
+		bench_report_samples ("core", what, 1, &samples, "ns/lookup");
+	}
+}
+
+/*
+ * refcounts and mutexes, every thread samples its own rounds
+ */
+
+static struct bench_samples thread_samples[MAX_THREADS];
+static struct part*shared_part;
+static cl_mutex shared_mutex;
+static uint64_t shared_counter;
+
+static void* refcount_thread (void*arg)
+{
+	struct bench_samples*s = arg;
+	uint64_t t;
+	int r, i;
+
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < SPIN_ROUND;++i) {
+			cloudvpn_part_acquire (shared_part);
+			cloudvpn_part_close (shared_part);
+		}
+		if (r) bench_sample (s, (bench_now_ns() - t) / (double) SPIN_ROUND);
+	}
+	return 0;
+}
+
+static void* mutex_thread (void*arg)
+{
+	struct bench_samples*s = arg;
+	uint64_t t;
+	int r, i;
+
+	for (r = 0;r <= ROUNDS;++r) {
+		t = bench_now_ns();
+		for (i = 0;i < SPIN_ROUND;++i) {
+			cl_mutex_lock (&shared_mutex);
+			++shared_counter;
+			cl_mutex_unlock (&shared_mutex);
+		}
+		if (r) bench_sample (s, (bench_now_ns() - t) / (double) SPIN_ROUND);
+	}
+	return 0;
+}
+
+static void threaded (const char*what, void* (*fn) (void*) )
+{
+	void*args[MAX_THREADS];
+	int n, i, j;
+
+	for (n = 0;bench_thread_counts[n];++n) {
+		for (i = 0;i < bench_thread_counts[n];++i) {
+			thread_samples[i].n = 0;
+			args[i] = thread_samples + i;
+		}
+		bench_run_threads (bench_thread_counts[n], fn, args);
+
+		for (i = 0;i < bench_thread_counts[n];++i)
+			for (j = 0;j < thread_samples[i].n;++j)
+				bench_sample (&samples, thread_samples[i].v[j]);
+		bench_report_samples ("core", what, bench_thread_counts[n], &samples,
+		                      "ns/op");
+	}
+}
+
+int main()
+{
+	int i;
+
+	for (i = 1;i <= 4;i *= 2) scheduler_fresh (i);
+
+	if (cloudvpn_core_init() ) bench_fail ("core", "init failed");
+	packets();
+	lookups();
+
+	shared_part = cloudvpn_find_part_by_name ("p0");
+	threaded ("refcount", refcount_thread);
+
+	if (cl_mutex_init (&shared_mutex, 0) ) bench_fail ("core", "no mutex");
+	threaded ("mutex", mutex_thread);
+	if (shared_counter != (uint64_t) SPIN_ROUND * (ROUNDS + 1) * 15)
+		bench_fail ("core", "mutex let two threads in");
+	return 0;
+}
@@ -0,0 +1,427 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * distance-vector routing on a chain of routers connected by in-process
+ * wires. The last router gets lots of addresses; measured is how long the
+ * routes take to get to the first router and how much the routers talk,
+ * when loading the table, when idle, and when a few routes change.
+ *
+ * A few routes then flap on the far end for a while, without and with flap
+ * damping; measured is the CPU time and messages it costs, and how long it
+ * takes for the routes to work from the other end after it stops.
+ *
+ * Then a diamond of routers checks equal-cost multipath: how evenly flows
+ * spread over the two paths, that they don't move while nothing changes,
+ * and that when one path fails, only the flows that used it move.
+ */
+
+#include "harness.h"
+
+#include <sys/resource.h>
+
+#define WORKERS 2
+#define ROUTERS 4
+#define ADDRESSES 10000
+#define CHANGES 100
+#define QUIET_NS 300000000ULL
+#define FLOWS 1000
+#define FLAPPING 100
+#define FLAP_US 120000 /* more than the trigger window, or they'd merge */
+#define FLAP_NS 3000000000ULL
+
+/*
+ * wire connects two routers, each router has its end as a link. Whatever
+ * a router sends to its end comes out at the other router, from the other
+ * end.
+ */
+
+struct wire {
+	struct part*other; /* the other end */
+	struct part*router; /* router on the other side */
+	int id; /* nonzero ones note which flows went through */
+};
+
+static uint64_t wire_msgs, wire_bytes, wire_last;
+static int flow_path[FLOWS];
+
+static void wire_process (struct part*pt, struct work*w)
+{
+	struct wire*e = pt->data;
+	struct packet*p = w->p;
+	struct work*nw;
+
+	if (w->type != work_packet) {
+		if (w->type == work_command) cloudvpn_packet_free (p);
+		return;
+	}
+
+	if (!p->soff) {
+		cl_atomic_inc (&wire_msgs);
+		cl_atomic_add (&wire_bytes, p->len);
+		cl_atomic_store (&wire_last, bench_now_ns() );
+	} else if (e->id && p->doff == 8)
+		cl_atomic_store (flow_path + ( (uint8_t) p->data[6] << 8 |
+		                               (uint8_t) p->data[7]), e->id);
+
+	nw = cloudvpn_new_work();
+	if (!nw) bench_fail ("dvr", "no memory");
+	p->src_part = e->other;
+	p->next_part = e->router;
+	nw->type = work_packet;
+	nw->priority = w->priority;
+	nw->is_static = 0;
+	nw->p = p;
+	cloudvpn_schedule_work (nw);
+}
+
+static struct plugin wire_plugin = {
+	"bench_wire", {0}, wire_process, 0, 0
+};
+
+static void connect (struct part*x, int xi, struct part*y, int yi, int id)
+{
+	/* wire ends are named wX_Y, X is the router that has it as a link */
+	struct part*a, *b;
+	struct wire*wa, *wb;
+	char name[32], cmd[64];
+
+	sprintf (name, "w%d_%d", xi, yi);
+	a = cloudvpn_part_init (&wire_plugin, name);
+	sprintf (name, "w%d_%d", yi, xi);
+	b = cloudvpn_part_init (&wire_plugin, name);
+	wa = calloc (1, sizeof (struct wire) );
+	wb = calloc (1, sizeof (struct wire) );
+	if (!a || !b || !wa || !wb) bench_fail ("dvr", "can't create parts");
+
+	wa->other = b;
+	wa->router = y;
+	wa->id = id;
+	wb->other = a;
+	wb->router = x;
+	a->data = wa;
+	b->data = wb;
+
+	sprintf (cmd, "link w%d_%d", xi, yi);
+	bench_command (x, cmd);
+	sprintf (cmd, "link w%d_%d", yi, xi);
+	bench_command (y, cmd);
+}
+
+static uint64_t cpu_ns()
+{
+	/* process cpu time, user+system */
+	struct rusage r;
+	getrusage (RUSAGE_SELF, &r);
+	return (r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000000000ULL
+	       + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void addr_hex (char*s, int net, int i)
+{
+	sprintf (s, "%02x:%02x:%02x:%02x", net,
+	         (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+}
+
+static void send_to (struct part*router, int net, int i)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (64);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("dvr", "no memory");
+	memset (p->data, 0, 64);
+	p->data[0] = net;
+	p->data[1] = i >> 16;
+	p->data[2] = i >> 8;
+	p->data[3] = i;
+	p->soff = p->doff = 4;
+	p->next_part = router;
+	p->src_part = 0;
+
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+static void send_flow (struct part*router, int f)
+{
+	/* destination 0b.., source is the flow number */
+	struct packet*p = cloudvpn_packet_alloc_buf (64);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("dvr", "no memory");
+	memset (p->data, 0, 64);
+	p->data[0] = 0x0b;
+	p->data[6] = f >> 8;
+	p->data[7] = f;
+	p->soff = 4;
+	p->doff = 8;
+	p->next_part = router;
+	p->src_part = 0;
+
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+static void send_flows (struct part*router, int*path)
+{
+	/* and remember where they went */
+	uint64_t n0 = cl_atomic_load (&bench_sink_packets), t;
+	int f;
+
+	for (f = 0;f < FLOWS;++f) {
+		flow_path[f] = 0;
+		send_flow (router, f);
+	}
+	for (t = bench_now_ns();
+	        cl_atomic_load (&bench_sink_packets) - n0 < FLOWS &&
+	        bench_now_ns() - t < 2000000000ULL;) usleep (1000);
+	if (cl_atomic_load (&bench_sink_packets) - n0 < FLOWS)
+		bench_fail ("dvr", "flows didn't get through");
+	for (f = 0;f < FLOWS;++f) path[f] = cl_atomic_load (flow_path + f);
+}
+
+static uint64_t wait_quiet (uint64_t start)
+{
+	/* returns when the routers stopped talking */
+	uint64_t last;
+
+	for (;;) {
+		usleep (10000);
+		last = cl_atomic_load (&wire_last);
+		if (last < start) last = start;
+		if (bench_now_ns() - last > QUIET_NS) return last - start;
+	}
+}
+
+static uint64_t wait_reachable (struct part*router, int net, int n)
+{
+	/* until all of them get through at once */
+	uint64_t start = bench_now_ns(), n0, t;
+	int i;
+
+	for (;;) {
+		n0 = cl_atomic_load (&bench_sink_packets);
+		for (i = 0;i < n;++i) send_to (router, net, i);
+		for (t = bench_now_ns();
+		        cl_atomic_load (&bench_sink_packets) - n0 < n &&
+		        bench_now_ns() - t < 20000000ULL;) usleep (1000);
+		if (cl_atomic_load (&bench_sink_packets) - n0 == n)
+			return bench_now_ns() - start;
+		if (bench_now_ns() - start > 60000000000ULL)
+			bench_fail ("dvr", "routes didn't converge");
+		usleep (10000);
+	}
+}
+
+static void report_phase (const char*what, uint64_t msgs, uint64_t bytes,
+                          uint64_t ns)
+{
+	char s[64];
+
+	sprintf (s, "%s_time", what);
+	bench_report ("dvr", s, WORKERS, ns / 1e6, "ms");
+	sprintf (s, "%s_msgs", what);
+	bench_report ("dvr", s, WORKERS, msgs, "messages");
+	sprintf (s, "%s_bytes", what);
+	bench_report ("dvr", s, WORKERS, bytes, "bytes");
+}
+
+static void flapping (struct part**r, int net, const char*damping)
+{
+	/* last router's routes come and go, and stay in the end */
+	uint64_t start, t, cpu, m0, b0;
+	char cmd[64], addr[32], what[32];
+	int i, on = 0;
+
+	for (i = 0;i < ROUTERS;++i) bench_command (r[i], damping);
+	for (i = 0;i < FLAPPING;++i) {
+		addr_hex (addr, net, i);
+		sprintf (cmd, "address %s sink", addr);
+		bench_command (r[ROUTERS - 1], cmd);
+	}
+	wait_quiet (bench_now_ns() );
+
+	m0 = cl_atomic_load (&wire_msgs);
+	b0 = cl_atomic_load (&wire_bytes);
+	cpu = cpu_ns();
+	start = bench_now_ns();
+	while (bench_now_ns() - start < FLAP_NS || on) {
+		for (i = 0;i < FLAPPING;++i) {
+			addr_hex (addr, net, i);
+			sprintf (cmd, on ? "address %s sink" : "forget %s", addr);
+			bench_command (r[ROUTERS - 1], cmd);
+		}
+		on = !on;
+		usleep (FLAP_US);
+	}
+	t = bench_now_ns() - start;
+	cpu = cpu_ns() - cpu;
+
+	sprintf (what, "flap_%s", damping);
+	for (i = 0;what[i];++i) if (what[i] == ' ') what[i] = '_';
+	report_phase (what, cl_atomic_load (&wire_msgs) - m0,
+	              cl_atomic_load (&wire_bytes) - b0, t);
+	strcat (what, "_cpu");
+	bench_report ("dvr", what, WORKERS, 100.0 * cpu / t, "%");
+
+	/* after it calms down */
+	t = wait_reachable (r[0], net, FLAPPING);
+	sprintf (what, "flap_%s_converge", damping);
+	for (i = 0;what[i];++i) if (what[i] == ' ') what[i] = '_';
+	bench_report ("dvr", what, WORKERS, t / 1e6, "ms");
+}
+
+static void ecmp (struct plugin*pl)
+{
+	/*
+	 *	   10
+	 *	 /    \
+	 *	9      12 - sink
+	 *	 \    /
+	 *	   11
+	 */
+	static int before[FLOWS], after[FLOWS];
+	struct part*r[4];
+	char name[32];
+	int i, n1 = 0, moved = 0, wrong = 0;
+
+	for (i = 0;i < 4;++i) {
+		sprintf (name, "r%d", 9 + i);
+		r[i] = cloudvpn_part_init (pl, name);
+		if (!r[i]) bench_fail ("dvr", "can't create parts");
+		bench_command (r[i], "refresh 0");
+	}
+	connect (r[0], 9, r[1], 10, 1);
+	connect (r[0], 9, r[2], 11, 2);
+	connect (r[1], 10, r[3], 12, 0);
+	connect (r[2], 11, r[3], 12, 0);
+	usleep (100000);
+
+	bench_command (r[3], "address 0b/8 sink");
+	wait_quiet (bench_now_ns() );
+
+	send_flows (r[0], before);
+	for (i = 0;i < FLOWS;++i) n1 += before[i] == 1;
+	bench_report ("dvr", "ecmp_path1_share", WORKERS,
+	              100.0 * n1 / FLOWS, "%");
+
+	/* nothing changed, nothing may move */
+	send_flows (r[0], after);
+	for (i = 0;i < FLOWS;++i) moved += before[i] != after[i];
+	bench_report ("dvr", "ecmp_moved_stable", WORKERS, moved, "flows");
+	if (moved) bench_fail ("dvr", "flows moved without a change");
+
+	/* path 1 fails, its flows must go to 2 and the others stay */
+	bench_command (r[0], "unlink w9_10");
+	send_flows (r[0], after);
+	for (i = 0, moved = 0;i < FLOWS;++i) {
+		moved += before[i] != after[i];
+		if (after[i] != 2) ++wrong;
+	}
+	bench_report ("dvr", "ecmp_moved_failover", WORKERS, moved, "flows");
+	if (wrong || moved != n1) bench_fail ("dvr", "failover moved other flows");
+}
+
+int main()
+{
+	struct plugin*pl;
+	struct part*r[ROUTERS], *sink;
+	uint64_t start, t, m0, b0, n0;
+	char cmd[64], addr[32], name[32];
+	int i;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("dvr", "plugin init");
+	pl = cloudvpn_plugin_get();
+
+	sink = bench_sink_part ("sink");
+	if (!sink) bench_fail ("dvr", "can't create parts");
+
+	for (i = 0;i < ROUTERS;++i) {
+		sprintf (name, "r%d", i);
+		r[i] = cloudvpn_part_init (pl, name);
+		if (!r[i]) bench_fail ("dvr", "can't create parts");
+		/* refresh would make noise in the idle phase */
+		bench_command (r[i], "refresh 0");
+	}
+
+	/* chain r0 - r1 - ... */
+	for (i = 0;i + 1 < ROUTERS;++i) connect (r[i], i, r[i + 1], i + 1, 0);
+	usleep (100000);
+
+	/* load the table */
+	start = bench_now_ns();
+	for (i = 0;i < ADDRESSES;++i) {
+		addr_hex (addr, 0x0a, i);
+		sprintf (cmd, "address %s sink", addr);
+		bench_command (r[ROUTERS - 1], cmd);
+	}
+	t = wait_quiet (start);
+	report_phase ("load", cl_atomic_load (&wire_msgs),
+	              cl_atomic_load (&wire_bytes), t);
+
+	/* everything must be reachable from the other end */
+	n0 = cl_atomic_load (&bench_sink_packets);
+	for (i = 0;i < ADDRESSES;++i) send_to (r[0], 0x0a, i);
+	for (t = bench_now_ns();
+	        cl_atomic_load (&bench_sink_packets) - n0 < ADDRESSES &&
+	        bench_now_ns() - t < 2000000000ULL;) usleep (1000);
+	if (cl_atomic_load (&bench_sink_packets) - n0 < ADDRESSES)
+		bench_fail ("dvr", "routes didn't converge");
+
+	/* nothing changes, nothing should be sent */
+	m0 = cl_atomic_load (&wire_msgs);
+	start = bench_now_ns();
+	sleep (2);
+	bench_report ("dvr", "idle", WORKERS,
+	              (cl_atomic_load (&wire_msgs) - m0) * 1e9
+	              / (bench_now_ns() - start), "messages/s");
+
+	/* few routes go away and come back */
+	m0 = cl_atomic_load (&wire_msgs);
+	b0 = cl_atomic_load (&wire_bytes);
+	start = bench_now_ns();
+	for (i = 0;i < CHANGES;++i) {
+		addr_hex (addr, 0x0a, i * (ADDRESSES / CHANGES) );
+		sprintf (cmd, "forget %s", addr);
+		bench_command (r[ROUTERS - 1], cmd);
+	}
+	t = wait_quiet (start);
+	report_phase ("withdraw", cl_atomic_load (&wire_msgs) - m0,
+	              cl_atomic_load (&wire_bytes) - b0, t);
+
+	m0 = cl_atomic_load (&wire_msgs);
+	b0 = cl_atomic_load (&wire_bytes);
+	start = bench_now_ns();
+	for (i = 0;i < CHANGES;++i) {
+		addr_hex (addr, 0x0a, i * (ADDRESSES / CHANGES) );
+		sprintf (cmd, "address %s sink", addr);
+		bench_command (r[ROUTERS - 1], cmd);
+	}
+	t = wait_quiet (start);
+	report_phase ("announce", cl_atomic_load (&wire_msgs) - m0,
+	              cl_atomic_load (&wire_bytes) - b0, t);
+
+	/* short half-life, so it doesn't take minutes */
+	flapping (r, 0x0c, "damping 0");
+	flapping (r, 0x0d, "damping 2");
+
+	ecmp (pl);
+	return 0;
+}
@@ -0,0 +1,200 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * route lookup of packets of few long-lived flows, straight from the trie
+ * (as dvr did before) and through the per-worker flow cache in front of it.
+ * Packets pick flows randomly; with more flows than the cache has entries,
+ * it starts evicting. One more run keeps invalidating the cache 1000 times
+ * a second, like a busy route table would.
+ */
+
+#include "bench.h"
+#include "lpm.h"
+#include "flowcache.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define ADDR_LEN 16
+#define PREFIXES 100000
+#define CACHE 4096
+#define LOOKUPS (1<<21)
+#define PARTS 4
+
+static const int flow_counts[] = {64, 1024, 16384, 0};
+
+static struct cl_lpm lpm;
+static struct cl_flow_cache cache;
+static uint8_t (*flows) [ADDR_LEN];
+static int nflows, invalidating;
+static int parts[PARTS]; /* incoming parts, only the addresses matter */
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint64_t rnd()
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static void make_table()
+{
+	uint8_t key[ADDR_LEN];
+	int i, j;
+
+	if (cl_lpm_init (&lpm, 16) ) bench_fail ("flowcache", "no memory");
+	for (i = 0;i < PREFIXES;++i) {
+		for (j = 0;j < ADDR_LEN;++j) key[j] = rnd();
+		if (cl_lpm_insert (&lpm, key, 16 + rnd() % 48, parts + i % PARTS) )
+			bench_fail ("flowcache", "insert failed");
+	}
+}
+
+static void make_flows (int n)
+{
+	/* somewhere under the prefixes, so all of them resolve */
+	uint8_t key[ADDR_LEN];
+	int i, j;
+
+	flows = realloc (flows, n * ADDR_LEN);
+	if (!flows) bench_fail ("flowcache", "no memory");
+	for (i = 0;i < n;) {
+		for (j = 0;j < ADDR_LEN;++j) key[j] = rnd();
+		if (!cl_lpm_lookup (&lpm, key, ADDR_LEN) ) continue;
+		memcpy (flows[i++], key, ADDR_LEN);
+	}
+	nflows = n;
+}
+
+struct job {
+	int worker, cached;
+	uint64_t seed, missed;
+};
+
+static void* lookup_thread (void*a)
+{
+	struct job*j = a;
+	uint64_t s = j->seed;
+	uint32_t gen;
+	unsigned t;
+	void*v;
+	int i, f;
+
+	for (i = 0;i < LOOKUPS;++i) {
+		s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+		f = (s >> 33) % nflows;
+
+		v = 0;
+		if (j->cached) v = cl_flow_cache_get (&cache, j->worker, flows[f],
+			                                      ADDR_LEN, parts + (f % PARTS), &gen);
+		if (!v) {
+			t = cl_lpm_enter (&lpm);
+			v = cl_lpm_lookup (&lpm, flows[f], ADDR_LEN);
+			cl_lpm_leave (&lpm, t);
+			if (v && j->cached)
+				cl_flow_cache_put (&cache, j->worker, flows[f], ADDR_LEN,
+				                   parts + (f % PARTS), v, gen);
+		}
+		if (!v) ++j->missed;
+	}
+	return 0;
+}
+
+static void* invalidate_thread (void*a)
+{
+	while (cl_atomic_load_acq (&invalidating) ) {
+		cl_flow_cache_invalidate (&cache);
+		usleep (1000);
+	}
+	return 0;
+}
+
+static double run (const char*what, int threads, int cached)
+{
+	struct job jobs[16];
+	void*args[16];
+	uint64_t t;
+	char s[64];
+	int i;
+
+	for (i = 0;i < threads;++i) {
+		jobs[i].worker = i;
+		jobs[i].cached = cached;
+		jobs[i].seed = rnd();
+		jobs[i].missed = 0;
+		args[i] = jobs + i;
+	}
+	t = bench_run_threads (threads, lookup_thread, args);
+	for (i = 0;i < threads;++i)
+		if (jobs[i].missed) bench_fail ("flowcache", "flow didn't resolve");
+
+	sprintf (s, "%s_%d", what, nflows);
+	bench_report ("flowcache", s, threads,
+	              (double) LOOKUPS * threads * 1e3 / t, "Mops/s");
+	return t;
+}
+
+static void report_stats (const char*what, struct cl_flow_stats*before)
+{
+	struct cl_flow_stats st;
+	uint64_t n;
+	char s[64];
+
+	cl_flow_cache_stats (&cache, &st);
+	n = st.hits - before->hits + st.misses - before->misses;
+
+	sprintf (s, "%s_hit_rate_%d", what, nflows);
+	bench_report ("flowcache", s, 1,
+	              100.0 * (st.hits - before->hits) / n, "%");
+	sprintf (s, "%s_evictions_%d", what, nflows);
+	bench_report ("flowcache", s, 1,
+	              100.0 * (st.evictions - before->evictions) / n, "%");
+	*before = st;
+}
+
+int main()
+{
+	struct cl_flow_stats st;
+	pthread_t inv;
+	const int*fc, *th;
+
+	make_table();
+	if (cl_flow_cache_init (&cache, CACHE) )
+		bench_fail ("flowcache", "no memory");
+
+	for (fc = flow_counts;*fc;++fc) {
+		make_flows (*fc);
+		cl_flow_cache_stats (&cache, &st);
+
+		for (th = bench_thread_counts;*th;++th) {
+			run ("uncached", *th, 0);
+			run ("cached", *th, 1);
+		}
+		report_stats ("cached", &st);
+
+		invalidating = 1;
+		if (pthread_create (&inv, 0, invalidate_thread, 0) )
+			bench_fail ("flowcache", "can't start thread");
+		run ("cached_churn", 1, 1);
+		cl_atomic_store_rel (&invalidating, 0);
+		pthread_join (inv, 0);
+		report_stats ("cached_churn", &st);
+	}
+
+	cl_flow_cache_destroy (&cache);
+	cl_lpm_destroy (&lpm);
+	free (flows);
+	return 0;
+}
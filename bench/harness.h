@@ -0,0 +1,119 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_BENCH_HARNESS_H
+#define _CVPN_BENCH_HARNESS_H
+
+/*
+ * for benchmarks that run the real core (scheduler, event loop, pool) with
+ * a plugin compiled in. The plugin source is linked directly into the
+ * benchmark, so its cloudvpn_plugin_* functions are callable from here.
+ *
+ * Also has a "sink" plugin that just counts whatever packets it gets.
+ */
+
+#include "bench.h"
+#include "core.h"
+#include "sched.h"
+#include "plugin.h"
+#include "pool.h"
+#include "api.h"
+
+#include <unistd.h>
+
+static int bench_core_running;
+
+static void* bench_core_worker (void*a)
+{
+	cloudvpn_scheduler_run (&bench_core_running);
+	return 0;
+}
+
+static inline void bench_core_start (int workers)
+{
+	pthread_t t;
+
+	if (cloudvpn_core_init() ) bench_fail ("core", "init failed");
+
+	bench_core_running = 1;
+	while (workers--)
+		if (pthread_create (&t, 0, bench_core_worker, 0) )
+			bench_fail ("core", "can't start workers");
+
+	cloudvpn_schedule_event_poll();
+}
+
+/* sends a text command to the part */
+static inline void bench_command (struct part*pt, const char*cmd)
+{
+	struct packet*p = cloudvpn_packet_alloc();
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("core", "no memory");
+	p->len = strlen (cmd);
+	if (cloudvpn_alloc_data (p) ) bench_fail ("core", "no memory");
+	memcpy (p->data, cmd, p->len);
+	p->next_part = pt;
+
+	w->type = work_command;
+	w->priority = 0;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+/* pushes a packet of given size to the part */
+static inline int bench_send_packet (struct part*pt, int size, uint8_t prio)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (size);
+	struct work*w;
+
+	if (!p) return 1;
+	memset (p->data, 0x55, size);
+	p->next_part = pt;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		cloudvpn_packet_free (p);
+		return 1;
+	}
+	w->type = work_packet;
+	w->priority = prio;
+	w->is_static = 0;
+	w->p = p;
+	return cloudvpn_schedule_work (w);
+}
+
+/*
+ * sink
+ */
+
+static uint64_t bench_sink_packets, bench_sink_bytes;
+
+static void bench_sink_process (struct part*pt, struct work*w)
+{
+	if (w->type != work_packet && w->type != work_command) return;
+	cl_atomic_add (&bench_sink_bytes, w->p->len);
+	cl_atomic_inc (&bench_sink_packets);
+	cloudvpn_packet_free (w->p);
+}
+
+static struct plugin bench_sink_plugin = {
+	"bench_sink", {0}, bench_sink_process, 0, 0
+};
+
+static inline struct part* bench_sink_part (const char*name) {
+	return cloudvpn_part_init (&bench_sink_plugin, name);
+}
+
+#endif
+
@@ -0,0 +1,260 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * liveness of 10k peers at 100ms, 3 misses. Two sets of peers probe each
+ * other in virtual time (1ms ticks, 1ms one way), then 100 of the far ones
+ * die. Measured is the CPU the near side spends (timers, probes, hearing;
+ * not the packets themselves), how many probes it sends, and how long it
+ * takes to notice the dead ones.
+ *
+ * Then the real thing: a triangle of lsr routers with liveness at 50ms,
+ * the direct link of the first two gets cut (silently, like a cable), and
+ * measured is how long traffic goes nowhere until it takes the other way.
+ */
+
+#include "harness.h"
+#include "liveness.h"
+
+#define PEERS 10000
+#define INTERVAL_US 100000
+#define MULT 3
+#define DEAD 100
+#define STEADY_US 2000000ULL
+#define WORKERS 2
+
+static struct cl_live near, far;
+static int far_dead[PEERS];
+static uint64_t down_at[PEERS], kill_at;
+
+/* probes in flight, delivered on the next tick */
+static int to_far[PEERS * 2], to_near[PEERS * 2];
+static int n_to_far, n_to_near;
+
+static void near_probe (void*arg, void*ctx)
+{
+	if (n_to_far < PEERS * 2) to_far[n_to_far++] = (intptr_t) ctx;
+}
+
+static void far_probe (void*arg, void*ctx)
+{
+	int i = (intptr_t) ctx;
+	if (!far_dead[i] && n_to_near < PEERS * 2) to_near[n_to_near++] = i;
+}
+
+static void near_down (void*arg, void*ctx)
+{
+	down_at[ (intptr_t) ctx] = * (uint64_t*) arg;
+}
+
+static void far_down (void*arg, void*ctx) {}
+
+static void wheel()
+{
+	uint64_t now = 1000000, end, t0, spent = 0, p0 = 0, sum = 0, worst = 0;
+	int i, n;
+
+	if (cl_live_init (&near, INTERVAL_US, MULT, near_probe, near_down, &now) ||
+	        cl_live_init (&far, INTERVAL_US, MULT, far_probe, far_down, &now) )
+		bench_fail ("liveness", "init");
+	for (i = 0;i < PEERS;++i)
+		if (cl_live_add (&near, (void*) (intptr_t) i, now) != i ||
+		        cl_live_add (&far, (void*) (intptr_t) i, now) != i)
+			bench_fail ("liveness", "add");
+
+	for (end = now + 2 * STEADY_US;now < end;now += 1000) {
+		if (now >= 1000000 + STEADY_US && !p0) {
+			/* steady from here on; now some die */
+			p0 = near.probes;
+			kill_at = now;
+			for (i = 0;i < DEAD;++i) far_dead[i * (PEERS / DEAD)] = 1;
+		}
+
+		/* deliver what was sent a tick ago */
+		n = n_to_near;
+		t0 = bench_now_ns();
+		for (i = 0;i < n;++i) cl_live_heard (&near, to_near[i], INTERVAL_US, now);
+		cl_live_run (&near, now);
+		spent += bench_now_ns() - t0;
+
+		for (i = 0;i < n_to_far;++i)
+			if (!far_dead[to_far[i]])
+				cl_live_heard (&far, to_far[i], INTERVAL_US, now);
+		n_to_near = n_to_far = 0;
+		cl_live_run (&far, now);
+	}
+
+	for (i = 0;i < PEERS;++i) {
+		if (!far_dead[i]) {
+			if (!cl_live_is_up (&near, i) )
+				bench_fail ("liveness", "live peer down");
+			continue;
+		}
+		if (cl_live_is_up (&near, i) || down_at[i] < kill_at)
+			bench_fail ("liveness", "dead peer not noticed");
+		sum += down_at[i] - kill_at;
+		if (down_at[i] - kill_at > worst) worst = down_at[i] - kill_at;
+	}
+
+	bench_report ("liveness", "cpu_10k_peers", 1,
+	              100.0 * spent / (2 * STEADY_US * 1000), "% of core");
+	bench_report ("liveness", "per_peer_second", 1,
+	              spent / (2.0 * STEADY_US / 1e6) / PEERS, "ns");
+	bench_report ("liveness", "probes", 1,
+	              (near.probes - p0) / (STEADY_US / 1e6), "probes/s");
+	bench_report ("liveness", "detect_avg", 1, sum / DEAD / 1e3, "ms");
+	bench_report ("liveness", "detect_max", 1, worst / 1e3, "ms");
+
+	cl_live_destroy (&near);
+	cl_live_destroy (&far);
+}
+
+/*
+ * routers
+ */
+
+struct wire {
+	struct part*other, *router;
+	int cut;
+};
+
+static void wire_process (struct part*pt, struct work*w)
+{
+	struct wire*e = pt->data;
+	struct packet*p = w->p;
+	struct work*nw;
+
+	if (w->type != work_packet) {
+		if (w->type == work_command) cloudvpn_packet_free (p);
+		return;
+	}
+	if (cl_atomic_load (&e->cut) || ! (nw = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	p->src_part = e->other;
+	p->next_part = e->router;
+	nw->type = work_packet;
+	nw->priority = w->priority;
+	nw->is_static = 0;
+	nw->p = p;
+	cloudvpn_schedule_work (nw);
+}
+
+static struct plugin wire_plugin = {
+	"bench_wire", {0}, wire_process, 0, 0
+};
+
+static struct wire* connect (struct part*x, int xi, struct part*y, int yi)
+{
+	/* ends are named wX_Y, X is the router that has it as a link */
+	struct part*a, *b;
+	struct wire*wa, *wb;
+	char name[32], cmd[64];
+
+	sprintf (name, "w%d_%d", xi, yi);
+	a = cloudvpn_part_init (&wire_plugin, name);
+	sprintf (name, "w%d_%d", yi, xi);
+	b = cloudvpn_part_init (&wire_plugin, name);
+	wa = calloc (1, sizeof (struct wire) );
+	wb = calloc (1, sizeof (struct wire) );
+	if (!a || !b || !wa || !wb) bench_fail ("liveness", "can't create parts");
+
+	wa->other = b;
+	wa->router = y;
+	wb->other = a;
+	wb->router = x;
+	a->data = wa;
+	b->data = wb;
+
+	sprintf (cmd, "link w%d_%d", xi, yi);
+	bench_command (x, cmd);
+	sprintf (cmd, "link w%d_%d", yi, xi);
+	bench_command (y, cmd);
+	return wa;
+}
+
+static int gets_through (struct part*r)
+{
+	/* a packet to 0b.. from r makes it to the sink */
+	struct packet*p = cloudvpn_packet_alloc_buf (64);
+	struct work*w = cloudvpn_new_work();
+	uint64_t n0 = cl_atomic_load (&bench_sink_packets), t;
+
+	if (!p || !w) bench_fail ("liveness", "no memory");
+	memset (p->data, 0, 64);
+	p->data[0] = 0x0b;
+	p->soff = p->doff = 4;
+	p->src_part = 0;
+	p->next_part = r;
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+
+	for (t = bench_now_ns();
+	        cl_atomic_load (&bench_sink_packets) == n0 &&
+	        bench_now_ns() - t < 1000000;) sched_yield();
+	return cl_atomic_load (&bench_sink_packets) != n0;
+}
+
+static void failover()
+{
+	struct plugin*pl;
+	struct part*r[3];
+	struct wire*direct, *back;
+	uint64_t start;
+	char name[32];
+	int i;
+
+	bench_core_start (WORKERS);
+	if (cloudvpn_plugin_init() ) bench_fail ("liveness", "plugin init");
+	pl = cloudvpn_plugin_get();
+	if (!bench_sink_part ("sink") ) bench_fail ("liveness", "can't create parts");
+
+	for (i = 0;i < 3;++i) {
+		sprintf (name, "r%d", i);
+		r[i] = cloudvpn_part_init (pl, name);
+		if (!r[i]) bench_fail ("liveness", "can't create parts");
+		bench_command (r[i], "liveness 50 3");
+	}
+	direct = connect (r[0], 0, r[1], 1);
+	connect (r[0], 0, r[2], 2);
+	connect (r[2], 2, r[1], 1);
+	bench_command (r[1], "address 0b/8 sink");
+
+	for (start = bench_now_ns();!gets_through (r[0]);usleep (10000) )
+		if (bench_now_ns() - start > 5000000000ULL)
+			bench_fail ("liveness", "routes didn't converge");
+	usleep (500000);
+
+	/* both ways go silent */
+	back = direct->other->data;
+	start = bench_now_ns();
+	cl_atomic_store (&direct->cut, 1);
+	cl_atomic_store (&back->cut, 1);
+	while (!gets_through (r[0]) )
+		if (bench_now_ns() - start > 5000000000ULL)
+			bench_fail ("liveness", "didn't fail over");
+
+	bench_report ("liveness", "lsr_failover_50ms_x3", WORKERS,
+	              (bench_now_ns() - start) / 1e6, "ms");
+}
+
+int main()
+{
+	wheel();
+	failover();
+	return 0;
+}
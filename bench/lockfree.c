@@ -0,0 +1,313 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * throughput of the lock-free toolkit (ring.h, mpsc.h, seqlock.h) across
+ * thread counts, with a mutex-protected queue as the baseline.
+ *
+ * Every run checks what went through (order or sums), so this doubles as a
+ * stress run; it exits with nonzero status if anything got lost.
+ */
+
+#include "bench.h"
+#include "ring.h"
+#include "mpsc.h"
+#include "seqlock.h"
+#include "mutex.h"
+
+#define ITEMS (1<<21)
+#define RING_SIZE 1024
+
+static void wait_a_bit()
+{
+	sched_yield(); /* be nice to single-core machines */
+}
+
+/*
+ * spsc
+ */
+
+static struct cl_spsc spsc;
+
+static void* spsc_producer (void*a)
+{
+	uintptr_t i;
+	for (i = 1;i <= ITEMS;++i)
+		while (cl_spsc_push (&spsc, (void*) i) ) wait_a_bit();
+	return 0;
+}
+
+static void* spsc_consumer (void*a)
+{
+	uintptr_t i, v;
+	for (i = 1;i <= ITEMS;++i) {
+		while (! (v = (uintptr_t) cl_spsc_pop (&spsc) ) ) wait_a_bit();
+		if (v != i) bench_fail ("spsc", "items reordered or lost");
+	}
+	return 0;
+}
+
+static void* spsc_thread (void*a)
+{
+	return a ? spsc_producer (a) : spsc_consumer (a);
+}
+
+static void bench_spsc()
+{
+	void*args[2] = {0, (void*) 1};
+	uint64_t t;
+
+	if (cl_spsc_init (&spsc, RING_SIZE) ) bench_fail ("spsc", "init");
+	t = bench_run_threads (2, spsc_thread, args);
+	bench_report ("lockfree", "spsc", 2, ITEMS * 1000.0 / t, "Mops/s");
+	cl_spsc_destroy (&spsc);
+}
+
+/*
+ * mpmc and the mutex baseline. Producers push disjoint ranges of numbers,
+ * consumers sum what they get; the total must match.
+ */
+
+static struct cl_mpmc mpmc;
+
+struct locked_queue {
+	cl_mutex m;
+	void*slots[RING_SIZE];
+	size_t head, tail;
+} lq;
+
+static int lq_push (void*p)
+{
+	cl_mutex_lock (&lq.m);
+	if (lq.tail - lq.head == RING_SIZE) {
+		cl_mutex_unlock (&lq.m);
+		return 1;
+	}
+	lq.slots[ (lq.tail++) % RING_SIZE] = p;
+	cl_mutex_unlock (&lq.m);
+	return 0;
+}
+
+static void* lq_pop()
+{
+	void*p = 0;
+	cl_mutex_lock (&lq.m);
+	if (lq.tail != lq.head) p = lq.slots[ (lq.head++) % RING_SIZE];
+	cl_mutex_unlock (&lq.m);
+	return p;
+}
+
+struct mp_arg {
+	int producer, locked;
+	uintptr_t from, count;
+	uint64_t sum;
+};
+
+static void* mp_thread (void*a)
+{
+	struct mp_arg*x = a;
+	uintptr_t i, v;
+
+	if (x->producer) {
+		for (i = x->from;i < x->from + x->count;++i)
+			while (x->locked ? lq_push ( (void*) i)
+			        : cl_mpmc_push (&mpmc, (void*) i) ) wait_a_bit();
+	} else {
+		for (i = 0;i < x->count;++i) {
+			while (! (v = (uintptr_t) (x->locked ? lq_pop()
+			                           : cl_mpmc_pop (&mpmc) ) ) )
+				wait_a_bit();
+			x->sum += v;
+		}
+	}
+	return 0;
+}
+
+static void bench_mp (int threads, int locked)
+{
+	struct mp_arg args[2*threads];
+	void*argp[2*threads];
+	uintptr_t per = ITEMS / threads;
+	uint64_t t, sum = 0, expected;
+	int i;
+
+	for (i = 0;i < 2*threads;++i) {
+		args[i].producer = i < threads;
+		args[i].locked = locked;
+		args[i].from = 1 + (i % threads) * per;
+		args[i].count = per;
+		args[i].sum = 0;
+		argp[i] = args + i;
+	}
+
+	t = bench_run_threads (2 * threads, mp_thread, argp);
+
+	for (i = threads;i < 2*threads;++i) sum += args[i].sum;
+	expected = (uint64_t) (per * threads) * (per * threads + 1) / 2;
+	if (sum != expected)
+		bench_fail ("mpmc", "sum of items doesn't match");
+
+	bench_report ("lockfree", locked ? "mutex_queue" : "mpmc",
+	              2 * threads, per * threads * 1000.0 / t, "Mops/s");
+}
+
+/*
+ * mpsc: every producer pushes its own nodes in order, the consumer checks
+ * that the order is kept per producer.
+ */
+
+struct mpsc_item {
+	struct cl_mpsc_node n;
+	int producer;
+	uintptr_t seq;
+};
+
+static struct cl_mpsc mpsc;
+static struct mpsc_item*mpsc_items;
+static int mpsc_producers;
+
+static void* mpsc_thread (void*a)
+{
+	intptr_t id = (intptr_t) a;
+	uintptr_t i, per = ITEMS / mpsc_producers, got = 0;
+	uintptr_t*last;
+	struct mpsc_item*it;
+
+	if (id >= 0) {
+		for (i = 0;i < per;++i) {
+			it = mpsc_items + id * per + i;
+			it->producer = id;
+			it->seq = i + 1;
+			cl_mpsc_push (&mpsc, &it->n);
+		}
+		return 0;
+	}
+
+	last = calloc (mpsc_producers, sizeof (uintptr_t) );
+	while (got < per * mpsc_producers) {
+		it = (struct mpsc_item*) cl_mpsc_pop (&mpsc);
+		if (!it) {
+			wait_a_bit();
+			continue;
+		}
+		if (it->seq != last[it->producer] + 1)
+			bench_fail ("mpsc", "items reordered or lost");
+		last[it->producer] = it->seq;
+		++got;
+	}
+	free (last);
+	return 0;
+}
+
+static void bench_mpsc (int producers)
+{
+	void*argp[producers+1];
+	uint64_t t;
+	int i;
+
+	mpsc_producers = producers;
+	mpsc_items = calloc (ITEMS, sizeof (struct mpsc_item) );
+	if (!mpsc_items) bench_fail ("mpsc", "no memory");
+	cl_mpsc_init (&mpsc);
+
+	argp[0] = (void*) (intptr_t) - 1;
+	for (i = 0;i < producers;++i) argp[i+1] = (void*) (intptr_t) i;
+
+	t = bench_run_threads (producers + 1, mpsc_thread, argp);
+	bench_report ("lockfree", "mpsc", producers + 1,
+	              (ITEMS / producers) * producers * 1000.0 / t, "Mops/s");
+	free (mpsc_items);
+}
+
+/*
+ * seqlock: one writer keeps the pair consistent, readers check it.
+ */
+
+static cl_seqlock sl;
+static struct {
+	uint64_t a, b;
+} sl_data;
+static int sl_stop;
+
+static void* seqlock_thread (void*a)
+{
+	uint64_t x, y, reads = 0;
+	unsigned s;
+
+	if (!a) {
+		for (x = 0;!cl_atomic_load (&sl_stop);++x) {
+			cl_seqlock_write_begin (&sl);
+			cl_atomic_store (&sl_data.a, x);
+			cl_atomic_store (&sl_data.b, ~x);
+			cl_seqlock_write_end (&sl);
+			wait_a_bit();
+		}
+		return 0;
+	}
+
+	while (reads < ITEMS) {
+		do {
+			s = cl_seqlock_read_begin (&sl);
+			x = cl_atomic_load (&sl_data.a);
+			y = cl_atomic_load (&sl_data.b);
+		} while (cl_seqlock_read_retry (&sl, s) );
+		if (x != ~y) bench_fail ("seqlock", "torn read");
+		++reads;
+	}
+	return 0;
+}
+
+static void* seqlock_reader_or_writer (void*a)
+{
+	void*r = seqlock_thread (a);
+	if (a && cl_atomic_sub ( (int*) a, 1) == 0)
+		cl_atomic_store (&sl_stop, 1); /* last reader stops the writer */
+	return r;
+}
+
+static void bench_seqlock (int readers)
+{
+	void*argp[readers+1];
+	int left = readers, i;
+	uint64_t t;
+
+	cl_seqlock_init (&sl);
+	sl_data.a = 0;
+	sl_data.b = ~0ULL;
+	sl_stop = 0;
+
+	argp[0] = 0;
+	for (i = 1;i <= readers;++i) argp[i] = &left;
+
+	t = bench_run_threads (readers + 1, seqlock_reader_or_writer, argp);
+	bench_report ("lockfree", "seqlock_read", readers + 1,
+	              (double) ITEMS * readers * 1000.0 / t, "Mops/s");
+}
+
+int main()
+{
+	const int*t;
+
+	cl_mutex_init (&lq.m, 0);
+	if (cl_mpmc_init (&mpmc, RING_SIZE) ) bench_fail ("mpmc", "init");
+
+	bench_spsc();
+	for (t = bench_thread_counts;*t;++t) {
+		bench_mp (*t, 0);
+		bench_mp (*t, 1);
+	}
+	for (t = bench_thread_counts;*t;++t) bench_mpsc (*t);
+	for (t = bench_thread_counts;*t;++t) bench_seqlock (*t);
+
+	return 0;
+}
+
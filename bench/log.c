@@ -0,0 +1,204 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * what a cl_log call costs the thread that makes it:
+ *	filtered	the level is above what's logged
+ *	logged		it goes into the ring (drained between the rounds)
+ *	rate_limited	the call site is over its limit
+ *	ring_full	nobody drains
+ * and then the log plugin writing to /dev/null: how many records a second
+ * it gets through while a worker logs as fast as it can.
+ */
+
+#include "harness.h"
+#include "log.h"
+
+#define CALLS 1000000
+#define ROUND 1000 /* fits into the ring */
+#define FLOOD_NS 1000000000ULL
+
+static struct part fake = {0, 0, "bench"};
+
+static void nothing (struct cl_log_rec*r, void*arg) {}
+
+static void* filtered (void*arg)
+{
+	int i;
+	for (i = 0;i < CALLS;++i)
+		cl_log (&fake, CL_LOG_DEBUG, "filtered %d %d", i, 42);
+	return 0;
+}
+
+static void* limited (void*arg)
+{
+	int i;
+	for (i = 0;i < CALLS;++i)
+		cl_log_rl (&fake, CL_LOG_INFO, 1, "limited %d %d", i, 42);
+	return 0;
+}
+
+static void* full (void*arg)
+{
+	int i;
+	for (i = 0;i < CALLS;++i)
+		cl_log_rl (&fake, CL_LOG_INFO, 0, "full %d %d", i, 42);
+	return 0;
+}
+
+static int round_done, logged_done;
+static uint64_t logged_ns;
+
+static void* logged (void*arg)
+{
+	uint64_t t;
+	int i, j;
+
+	for (i = 0;i < CALLS / ROUND;++i) {
+		t = bench_now_ns();
+		for (j = 0;j < ROUND;++j)
+			cl_log_rl (&fake, CL_LOG_INFO, 0, "logged %d %s %p", j,
+			           (uintptr_t) "x", (uintptr_t) &fake);
+		logged_ns += bench_now_ns() - t;
+
+		/* the drain in main catches up */
+		cl_atomic_store_rel (&round_done, 1);
+		while (cl_atomic_load_acq (&round_done) ) sched_yield();
+	}
+	cl_atomic_store_rel (&logged_done, 1);
+	return 0;
+}
+
+static void hot_calls()
+{
+	uint64_t ns;
+	pthread_t t;
+	void*args[8] = {0};
+	int n;
+
+	cl_log_attach (CL_LOG_INFO);
+
+	for (n = 1;n <= 2;++n) {
+		ns = bench_run_threads (n, filtered, args);
+		bench_report ("log", "filtered", n, (double) ns / CALLS, "ns/call");
+		ns = bench_run_threads (n, limited, args);
+		bench_report ("log", "rate_limited", n, (double) ns / CALLS, "ns/call");
+		ns = bench_run_threads (n, full, args);
+		bench_report ("log", "ring_full", n, (double) ns / CALLS, "ns/call");
+		cl_log_drain (nothing, 0);
+	}
+
+	if (pthread_create (&t, 0, logged, 0) ) bench_fail ("log", "no thread");
+	while (!cl_atomic_load_acq (&logged_done) ) {
+		if (cl_atomic_load_acq (&round_done) ) {
+			cl_log_drain (nothing, 0);
+			cl_atomic_store_rel (&round_done, 0);
+		}
+		sched_yield();
+	}
+	pthread_join (t, 0);
+	cl_log_drain (nothing, 0);
+	bench_report ("log", "logged", 1, (double) logged_ns / CALLS, "ns/call");
+
+	cl_log_detach();
+}
+
+static void format_rate()
+{
+	struct cl_log_site s = {"packet from %s:%u len %u prio %d flow %llx", 2};
+	struct cl_log_rec r;
+	uint64_t t;
+	char buf[256];
+	int i;
+
+	memset (&r, 0, sizeof (r) );
+	r.site = &s;
+	strcpy (r.part, "udp0");
+	r.nargs = 5;
+	r.arg[0] = (uintptr_t) "10.0.0.1";
+	r.arg[1] = 4433;
+	r.arg[2] = 1400;
+	r.arg[3] = -1;
+	r.arg[4] = 0xdeadbeefULL;
+
+	t = bench_now_ns();
+	for (i = 0;i < CALLS;++i) {
+		r.time_ns = 1700000000000000000ULL + i * 1000ULL;
+		cl_log_format (&r, buf, sizeof (buf) );
+	}
+	bench_report ("log", "format", 1, (bench_now_ns() - t) / (double) CALLS,
+	              "ns/record");
+	if (!strstr (buf, "info udp0: packet from 10.0.0.1:4433 len 1400 prio -1 "
+	             "flow deadbeef\n") ) bench_fail ("log", buf);
+}
+
+/*
+ * the plugin
+ */
+
+static int flood_done;
+
+static void flood_process (struct part*pt, struct work*w)
+{
+	uint64_t t = bench_now_ns();
+	int i;
+
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_packet) return;
+	cloudvpn_packet_free (w->p);
+
+	while (bench_now_ns() - t < FLOOD_NS) {
+		for (i = 0;i < 100;++i)
+			cl_log_rl (pt, CL_LOG_INFO, 0, "flood %d of %s", i,
+			           (uintptr_t) "bench");
+		sched_yield(); /* lets the log thread in, on one core */
+	}
+	cl_atomic_store_rel (&flood_done, 1);
+}
+
+static struct plugin flood_plugin = {
+	"bench_flood", {0}, flood_process, 0, 0
+};
+
+static void plugin()
+{
+	struct part*log, *flood;
+	struct cl_log_site*s;
+	uint64_t logged = 0, dropped = 0;
+
+	bench_core_start (2);
+	if (cloudvpn_plugin_init() ) bench_fail ("log", "plugin init");
+	log = cloudvpn_part_init (cloudvpn_plugin_get(), "log");
+	flood = cloudvpn_part_init (&flood_plugin, "flood");
+	if (!log || !flood || !log->data) bench_fail ("log", "can't create parts");
+	bench_command (log, "file /dev/null");
+	usleep (50000);
+
+	bench_send_packet (flood, 64, 128);
+	while (!cl_atomic_load_acq (&flood_done) ) usleep (10000);
+	usleep (50000);
+
+	for (s = cl_log_sites();s;s = s->next)
+		if (!strncmp (s->fmt, "flood", 5) )
+			cl_log_counts (s, &logged, &dropped);
+	bench_report ("log", "drained", 1, logged / (FLOOD_NS / 1e9), "records/s");
+	bench_report ("log", "dropped", 1,
+	              100.0 * dropped / (logged + dropped + 1), "%");
+}
+
+int main()
+{
+	hot_calls();
+	format_rate();
+	plugin();
+	return 0;
+}
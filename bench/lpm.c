@@ -0,0 +1,230 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * longest prefix match lookup rate for tables of 1k to 1M prefixes of
+ * random lengths (2 to 16 bytes, not byte-aligned). Addresses looked up
+ * are random extensions of the prefixes in the table, so every lookup
+ * walks as deep as it can.
+ *
+ * Every size runs without and with the 16-bit direct table.
+ *
+ * The smallest table is first checked against a linear scan, and there's
+ * also a run with a writer that keeps removing and adding prefixes while
+ * the readers look up.
+ */
+
+#include "bench.h"
+#include "lpm.h"
+#include "alloc.h"
+
+#include <string.h>
+
+#define ADDR_LEN 16
+#define LOOKUPS (1<<21)
+#define CHECKS 100000
+
+static const int table_sizes[] = {1000, 10000, 100000, 1000000, 0};
+
+struct prefix {
+	uint8_t key[ADDR_LEN];
+	unsigned bits;
+};
+
+static struct prefix*prefixes;
+static uint8_t (*addrs) [ADDR_LEN];
+static struct cl_lpm lpm;
+static int nprefixes, naddrs;
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint64_t rnd()
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static void make_prefix (struct prefix*p)
+{
+	int i;
+
+	p->bits = (2 + rnd() % (ADDR_LEN - 1) ) * 8 - rnd() % 8;
+	for (i = 0;i < ADDR_LEN;++i) p->key[i] = rnd();
+}
+
+static void make_addr (uint8_t*a, struct prefix*p)
+{
+	/* prefix bits, then anything */
+	int i, full = p->bits / 8, rest = p->bits % 8;
+
+	for (i = 0;i < ADDR_LEN;++i) a[i] = rnd();
+	memcpy (a, p->key, full);
+	if (rest) a[full] = (p->key[full] & ~ (0xff >> rest) )
+		                    | (a[full] & (0xff >> rest) );
+}
+
+static int prefix_of (struct prefix*p, const uint8_t*a)
+{
+	int full = p->bits / 8, rest = p->bits % 8;
+
+	if (memcmp (p->key, a, full) ) return 0;
+	return !rest || ! ( (p->key[full] ^ a[full]) & ~ (0xff >> rest) );
+}
+
+static void check_linear()
+{
+	/* compare against the dumbest possible implementation */
+	struct prefix*best, *v;
+	unsigned t;
+	int i, j;
+
+	for (i = 0;i < CHECKS;++i) {
+		best = 0;
+		for (j = 0;j < nprefixes;++j)
+			if (prefix_of (prefixes + j, addrs[i % naddrs]) &&
+			        (!best || prefixes[j].bits > best->bits) )
+				best = prefixes + j;
+
+		t = cl_lpm_enter (&lpm);
+		v = cl_lpm_lookup (&lpm, addrs[i % naddrs], ADDR_LEN);
+		cl_lpm_leave (&lpm, t);
+
+		/* same prefix might have been generated twice */
+		if (v != best && (!v || !best || v->bits != best->bits ||
+		                  !prefix_of (v, best->key) ) )
+			bench_fail ("lpm", "lookup differs from linear scan");
+	}
+}
+
+static void* lookup_thread (void*a)
+{
+	uintptr_t from = (uintptr_t) a, i, found = 0;
+	unsigned t;
+
+	for (i = 0;i < LOOKUPS;++i) {
+		t = cl_lpm_enter (&lpm);
+		found += !!cl_lpm_lookup (&lpm, addrs[ (from + i) % naddrs],
+		                          ADDR_LEN);
+		cl_lpm_leave (&lpm, t);
+	}
+
+	if (found != LOOKUPS) bench_fail ("lpm", "lookup missed a prefix");
+	return 0;
+}
+
+static int churn_running;
+
+static void* churn_thread (void*a)
+{
+	struct prefix p;
+	uint64_t*n = a;
+
+	/*
+	 * full-length ones, so they don't replace (and then remove) the short
+	 * prefixes from the table
+	 */
+	while (cl_atomic_load_acq (&churn_running) ) {
+		make_prefix (&p);
+		p.bits = ADDR_LEN * 8;
+		if (cl_lpm_insert (&lpm, p.key, p.bits, &p) )
+			bench_fail ("lpm", "insert failed");
+		cl_lpm_remove (&lpm, p.key, p.bits);
+		++*n;
+		sched_yield();
+	}
+	return 0;
+}
+
+static void* churn_lookup_thread (void*a)
+{
+	lookup_thread (a);
+	cl_atomic_store_rel (&churn_running, 0);
+	return 0;
+}
+
+static void* churn_start (void*a)
+{
+	return a ? churn_thread (a) : churn_lookup_thread (0);
+}
+
+static void bench_size (int size, unsigned direct)
+{
+	const int*th;
+	void*args[16];
+	uint64_t t, churned = 0;
+	char what[64];
+	int i;
+
+	nprefixes = size;
+	naddrs = size < (1 << 20) ? size * 4 : size;
+	prefixes = calloc (nprefixes, sizeof (struct prefix) );
+	addrs = calloc (naddrs, ADDR_LEN);
+	if (!prefixes || !addrs || cl_lpm_init (&lpm, direct) )
+		bench_fail ("lpm", "no memory");
+
+	for (i = 0;i < nprefixes;++i) make_prefix (prefixes + i);
+	for (i = 0;i < naddrs;++i)
+		make_addr (addrs[i], prefixes + rnd() % nprefixes);
+
+	t = bench_now_ns();
+	for (i = 0;i < nprefixes;++i)
+		if (cl_lpm_insert (&lpm, prefixes[i].key, prefixes[i].bits,
+		                   prefixes + i) )
+			bench_fail ("lpm", "insert failed");
+	t = bench_now_ns() - t;
+
+	sprintf (what, "insert_%d%s", size, direct ? "_direct" : "");
+	bench_report ("lpm", what, 1, nprefixes * 1e3 / t, "Mops/s");
+	sprintf (what, "nodes_%d%s", size, direct ? "_direct" : "");
+	bench_report ("lpm", what, 1, (double) lpm.nodes / lpm.count,
+	              "nodes/prefix");
+
+	if (size <= 1000) check_linear();
+
+	for (th = bench_thread_counts;*th;++th) {
+		for (i = 0;i < *th;++i) args[i] = (void*) (uintptr_t) (i * 7919);
+		t = bench_run_threads (*th, lookup_thread, args);
+		sprintf (what, "lookup_%d%s", size, direct ? "_direct" : "");
+		bench_report ("lpm", what, *th,
+		              (double) LOOKUPS * *th * 1e3 / t, "Mops/s");
+	}
+
+	/* one reader and one writer at the same time */
+	churn_running = 1;
+	args[0] = 0;
+	args[1] = &churned;
+	t = bench_run_threads (2, churn_start, args);
+	sprintf (what, "lookup_churn_%d%s", size, direct ? "_direct" : "");
+	bench_report ("lpm", what, 1, LOOKUPS * 1e3 / t, "Mops/s");
+	sprintf (what, "churn_%d%s", size, direct ? "_direct" : "");
+	bench_report ("lpm", what, 1, churned * 1e9 / t, "updates/s");
+
+	/* churn must have left the table as it was */
+	if (size <= 1000) check_linear();
+
+	cl_lpm_destroy (&lpm);
+	free (prefixes);
+	free (addrs);
+}
+
+int main()
+{
+	const int*s;
+
+	for (s = table_sizes;*s;++s) {
+		bench_size (*s, 0);
+		bench_size (*s, 16);
+	}
+	return 0;
+}
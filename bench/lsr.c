@@ -0,0 +1,386 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * link-state routing in a big simulated mesh. One real router has two
+ * neighbors, A and B, that are played by the benchmark: they say hello and
+ * then A feeds the router records of a 50x100 grid of routers, each with
+ * one prefix. A is attached to the left column of the grid, B to the right
+ * one. Measured is how long it takes until all 5000 prefixes work.
+ *
+ * Then single things change, and measured is how long it takes until a
+ * probe packet leaves through the other neighbor:
+ *	- the router's own link to A gets expensive (half of the tree moves)
+ *	- a stub router T hanging on two grid routers loses one of its links
+ *	  (only T moves)
+ *	- A loses all its links to the grid
+ * and back. All of it with incremental SPF, and with full SPF to compare.
+ */
+
+#include "harness.h"
+
+#include "wire.h"
+
+#define WORKERS 2
+#define ROWS 50
+#define COLS 100
+#define NODES (ROWS * COLS)
+#define LSA_MTU 1400
+
+/* as in the plugin */
+#define LSR_HELLO 1
+#define LSR_LSA 2
+
+#define ID_ROUTER 0x100
+#define ID_A 1
+#define ID_B 2
+#define ID_T 3
+#define ID_GRID 0x10000
+#define grid_id(r, c) (ID_GRID + (r) * COLS + (c) )
+
+/* probe targets */
+#define MID_ROW 25
+#define MID_COL 45
+#define T_LEFT 40
+#define T_RIGHT 60
+
+/*
+ * feeders are A and B; they get whatever the router sends to them and
+ * note which of them the data packets came out of.
+ */
+
+static uint64_t delivered, control_msgs;
+static int last_exit;
+
+static void feeder_process (struct part*pt, struct work*w)
+{
+	int*id = pt->data;
+
+	if (w->type != work_packet) {
+		if (w->type == work_command) cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	if (!w->p->soff) cl_atomic_inc (&control_msgs);
+	else {
+		cl_atomic_store (&last_exit, *id);
+		cl_atomic_inc (&delivered);
+	}
+	cloudvpn_packet_free (w->p);
+}
+
+static struct plugin feeder_plugin = {
+	"bench_feeder", {0}, feeder_process, 0, 0
+};
+
+static struct part*router, *fa, *fb;
+
+static void inject (struct part*from, const uint8_t*data, int len)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (len);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("lsr", "no memory");
+	memcpy (p->data, data, len);
+	p->len = len;
+	p->soff = p->doff = 0;
+	p->src_part = from;
+	p->next_part = router;
+
+	w->type = work_packet;
+	w->priority = 0;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+static void put64 (uint8_t*b, uint64_t v)
+{
+	wire_put32 (b, v >> 32);
+	wire_put32 (b + 4, v);
+}
+
+static void hello (struct part*from, uint64_t id)
+{
+	uint8_t b[9];
+
+	b[0] = LSR_HELLO;
+	put64 (b + 1, id);
+	inject (from, b, 9);
+}
+
+/*
+ * records of the simulated routers, batched into packets
+ */
+
+static uint8_t batch[LSA_MTU];
+static int batch_len;
+static uint32_t seqs[NODES + 4];
+
+struct lsa {
+	uint64_t id;
+	int nedges;
+	uint64_t to[ROWS + 4];
+	uint32_t cost[ROWS + 4];
+	int bits;
+	uint8_t key[3];
+};
+
+static void flush_batch (struct part*from)
+{
+	if (batch_len > 1) inject (from, batch, batch_len);
+	batch[0] = LSR_LSA;
+	batch_len = 1;
+}
+
+static void add_lsa (struct part*from, struct lsa*l, uint32_t seq)
+{
+	int size = 16 + 12 * l->nedges + (l->bits ? 2 + (l->bits + 7) / 8 : 0), i;
+	uint8_t*b;
+
+	if (batch_len + size > LSA_MTU) flush_batch (from);
+	b = batch + batch_len;
+	put64 (b, l->id);
+	wire_put32 (b + 8, seq);
+	wire_put16 (b + 12, l->nedges);
+	wire_put16 (b + 14, l->bits ? 1 : 0);
+	for (i = 0, b += 16;i < l->nedges;++i, b += 12) {
+		put64 (b, l->to[i]);
+		wire_put32 (b + 8, l->cost[i]);
+	}
+	if (l->bits) {
+		wire_put16 (b, l->bits);
+		memcpy (b + 2, l->key, (l->bits + 7) / 8);
+	}
+	batch_len += size;
+}
+
+static void edge (struct lsa*l, uint64_t to, uint32_t cost)
+{
+	l->to[l->nedges] = to;
+	l->cost[l->nedges++] = cost;
+}
+
+static void grid_lsa (struct lsa*l, int r, int c)
+{
+	int i = r * COLS + c;
+
+	l->id = grid_id (r, c);
+	l->nedges = 0;
+	if (r > 0) edge (l, grid_id (r - 1, c), 1);
+	if (r + 1 < ROWS) edge (l, grid_id (r + 1, c), 1);
+	if (c > 0) edge (l, grid_id (r, c - 1), 1);
+	if (c + 1 < COLS) edge (l, grid_id (r, c + 1), 1);
+	if (!c) edge (l, ID_A, 1);
+	if (c == COLS - 1) edge (l, ID_B, 1);
+	if (r == MID_ROW && (c == T_LEFT || c == T_RIGHT) ) edge (l, ID_T, 1);
+
+	l->bits = 24;
+	l->key[0] = 0x0e;
+	l->key[1] = i >> 8;
+	l->key[2] = i;
+}
+
+static void feeder_lsa (struct lsa*l, uint64_t id, int col, int grid)
+{
+	/* A or B, with the router and (if grid) the whole column */
+	int r;
+
+	l->id = id;
+	l->nedges = 0;
+	l->bits = 0;
+	edge (l, ID_ROUTER, 1);
+	if (grid) for (r = 0;r < ROWS;++r) edge (l, grid_id (r, col), 1);
+}
+
+static void t_lsa (struct lsa*l, int both)
+{
+	l->id = ID_T;
+	l->nedges = 0;
+	edge (l, grid_id (MID_ROW, T_LEFT), 1);
+	if (both) edge (l, grid_id (MID_ROW, T_RIGHT), 1);
+	l->bits = 8;
+	l->key[0] = 0x0f;
+}
+
+static void send_lsa (struct lsa*l, int slot)
+{
+	add_lsa (fa, l, ++seqs[slot]);
+	flush_batch (fa);
+}
+
+/*
+ * probing
+ */
+
+static void send_probe (const uint8_t*addr)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (64);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("lsr", "no memory");
+	memset (p->data, 0, 64);
+	memcpy (p->data, addr, 3);
+	p->soff = p->doff = 3;
+	p->src_part = 0;
+	p->next_part = router;
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+static int probe (const uint8_t*addr)
+{
+	/* which feeder it comes out of, 0 if none */
+	uint64_t n0 = cl_atomic_load (&delivered), t;
+
+	cl_atomic_store (&last_exit, 0);
+	send_probe (addr);
+	for (t = bench_now_ns();
+	        cl_atomic_load (&delivered) == n0 && bench_now_ns() - t < 10000000;)
+		sched_yield();
+	return cl_atomic_load (&delivered) == n0 ? 0 : cl_atomic_load (&last_exit);
+}
+
+static uint64_t wait_exit (const uint8_t*addr, int exit, uint64_t start)
+{
+	while (probe (addr) != exit)
+		if (bench_now_ns() - start > 10000000000ULL)
+			bench_fail ("lsr", "didn't converge");
+	return bench_now_ns() - start;
+}
+
+static void grid_addr (uint8_t*a, int r, int c)
+{
+	a[0] = 0x0e;
+	a[1] = (r * COLS + c) >> 8;
+	a[2] = r * COLS + c;
+}
+
+static void change (const char*mode, const char*what, void (*f) (int),
+                    const uint8_t*addr, int before, int after)
+{
+	uint64_t start, t1, t2;
+	char s[64];
+
+	if (probe (addr) != before) bench_fail ("lsr", "wrong path before");
+	start = bench_now_ns();
+	f (1);
+	t1 = wait_exit (addr, after, start);
+	start = bench_now_ns();
+	f (0);
+	t2 = wait_exit (addr, before, start);
+
+	sprintf (s, "%s_%s", mode, what);
+	bench_report ("lsr", s, WORKERS, (t1 + t2) / 2e6, "ms");
+}
+
+static void expensive_link (int on)
+{
+	bench_command (router, on ? "link fa 20" : "link fa 1");
+}
+
+static void stub_link_down (int on)
+{
+	struct lsa l;
+	t_lsa (&l, !on);
+	send_lsa (&l, NODES + ID_T);
+}
+
+static void feeder_detach (int on)
+{
+	struct lsa l;
+	feeder_lsa (&l, ID_A, 0, !on);
+	send_lsa (&l, NODES + ID_A);
+}
+
+int main()
+{
+	static int ida = 1, idb = 2;
+	struct plugin*pl;
+	struct lsa l;
+	uint8_t a[3], ta[3] = {0x0f, 0, 0};
+	uint64_t start, n0, t;
+	const char*mode;
+	int r, c, i, pass;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("lsr", "plugin init");
+	pl = cloudvpn_plugin_get();
+
+	fa = cloudvpn_part_init (&feeder_plugin, "fa");
+	fb = cloudvpn_part_init (&feeder_plugin, "fb");
+	router = cloudvpn_part_init (pl, "r");
+	if (!fa || !fb || !router) bench_fail ("lsr", "can't create parts");
+	fa->data = &ida;
+	fb->data = &idb;
+
+	bench_command (router, "refresh 0");
+	bench_command (router, "id 100");
+	bench_command (router, "link fa");
+	bench_command (router, "link fb");
+	usleep (100000);
+	hello (fa, ID_A);
+	hello (fb, ID_B);
+	usleep (100000);
+
+	/* the whole mesh, through A */
+	start = bench_now_ns();
+	flush_batch (fa);
+	for (r = 0;r < ROWS;++r)
+		for (c = 0;c < COLS;++c) {
+			grid_lsa (&l, r, c);
+			add_lsa (fa, &l, ++seqs[r * COLS + c]);
+		}
+	feeder_lsa (&l, ID_A, 0, 1);
+	add_lsa (fa, &l, ++seqs[NODES + ID_A]);
+	feeder_lsa (&l, ID_B, COLS - 1, 1);
+	add_lsa (fa, &l, ++seqs[NODES + ID_B]);
+	t_lsa (&l, 1);
+	add_lsa (fa, &l, ++seqs[NODES + ID_T]);
+	flush_batch (fa);
+
+	/* until all of them get through at once */
+	for (;;) {
+		n0 = cl_atomic_load (&delivered);
+		for (i = 0;i < NODES;++i) {
+			grid_addr (a, i / COLS, i % COLS);
+			send_probe (a);
+		}
+		for (t = bench_now_ns();
+		        cl_atomic_load (&delivered) - n0 < NODES &&
+		        bench_now_ns() - t < 20000000ULL;) usleep (100);
+		if (cl_atomic_load (&delivered) - n0 == NODES) break;
+		if (bench_now_ns() - start > 60000000000ULL)
+			bench_fail ("lsr", "mesh didn't converge");
+	}
+	bench_report ("lsr", "load_5000", WORKERS,
+	              (bench_now_ns() - start) / 1e6, "ms");
+	bench_report ("lsr", "load_flooded", WORKERS,
+	              cl_atomic_load (&control_msgs), "messages");
+
+	grid_addr (a, MID_ROW, MID_COL);
+	for (pass = 0;pass < 2;++pass) {
+		mode = pass ? "full" : "incremental";
+		bench_command (router, pass ? "spf full" : "spf incremental");
+		usleep (10000);
+
+		change (mode, "own_link", expensive_link, a, ID_A, ID_B);
+		change (mode, "remote_link", stub_link_down, ta, ID_B, ID_A);
+		change (mode, "neighbor_detach", feeder_detach, a, ID_A, ID_B);
+	}
+
+	return 0;
+}
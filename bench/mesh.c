@@ -0,0 +1,201 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * a grid of link-state routers in the mesh simulator (sim.h). Links have
+ * 1-5ms of latency, 100Mbit/s and 50ms of queue. Every router has one
+ * prefix. Scenarios:
+ *	join		all the routers come up at once
+ *	partition	the grid is cut in halves, and healed again
+ *	flap		one link in the middle goes down and up 10 times
+ *	forward		the corner router sends to the opposite corner, paced
+ *			at 80Mbit/s, with 0.1% loss on every link
+ * Times are virtual ("real" ones are how long the simulation took),
+ * messages are the control ones on all the links.
+ */
+
+#include "sim.h"
+
+#define ROWS 20
+#define COLS 20
+#define NODES (ROWS * COLS)
+#define FLAPS 10
+#define FLAP_NS 20000000ULL
+#define PACKETS 20000
+#define PACKET_SIZE 1000
+#define PACE_NS 100000ULL
+
+static struct part*node[NODES];
+static int right_link[NODES], down_link[NODES]; /* -1 if none */
+static struct part*sink;
+
+static void node_addr (uint8_t*a, int i)
+{
+	a[0] = 0x0e;
+	a[1] = i >> 8;
+	a[2] = i;
+}
+
+static int reachable (int from, int lo, int hi)
+{
+	/* how many of nodes lo..hi-1 the node gets packets to */
+	uint64_t n0 = bench_sink_packets;
+	uint8_t a[3];
+	int i;
+
+	for (i = lo;i < hi;++i) {
+		node_addr (a, i);
+		sim_send (node[from], a, 3, 64);
+	}
+	sim_run (0);
+	return bench_sink_packets - n0;
+}
+
+struct phase {
+	uint64_t start, real, msgs, bytes;
+};
+
+static void phase_start (struct phase*ph)
+{
+	ph->start = sim_now;
+	ph->real = bench_now_ns();
+	ph->msgs = sim_ctl_msgs;
+	ph->bytes = sim_ctl_bytes;
+}
+
+static void phase_end (struct phase*ph, const char*what)
+{
+	char s[64];
+
+	sim_run (0);
+
+	sprintf (s, "%s_converge", what);
+	bench_report ("mesh", s, 1, sim_last_ctl > ph->start ?
+	              (sim_last_ctl - ph->start) / 1e6 : 0, "ms");
+	sprintf (s, "%s_msgs", what);
+	bench_report ("mesh", s, 1, sim_ctl_msgs - ph->msgs, "messages");
+	sprintf (s, "%s_bytes", what);
+	bench_report ("mesh", s, 1, sim_ctl_bytes - ph->bytes, "bytes");
+	sprintf (s, "%s_real", what);
+	bench_report ("mesh", s, 1, (bench_now_ns() - ph->real) / 1e6, "ms");
+}
+
+static void cut (int up)
+{
+	/* between the two middle columns */
+	int r;
+
+	for (r = 0;r < ROWS;++r)
+		sim_link_set (right_link[r * COLS + COLS / 2 - 1], up);
+}
+
+static void forward()
+{
+	uint64_t start, real, n0 = bench_sink_packets, s0 = sim_data_sent,
+	                       l0 = sim_data_lost;
+	uint8_t a[3];
+	int i, got;
+
+	node_addr (a, NODES - 1);
+	start = sim_now;
+	real = bench_now_ns();
+	for (i = 0;i < PACKETS;++i) {
+		sim_run (start + i * PACE_NS);
+		sim_send (node[0], a, 3, PACKET_SIZE);
+	}
+	sim_run (0);
+	got = bench_sink_packets - n0;
+
+	bench_report ("mesh", "forward_delivered", 1, 100.0 * got / PACKETS, "%");
+	bench_report ("mesh", "forward_goodput", 1,
+	              got * PACKET_SIZE * 8e3 / (sim_now - start), "Mbit/s");
+	bench_report ("mesh", "forward_hop_loss", 1,
+	              100.0 * (sim_data_lost - l0) / (sim_data_sent - s0), "%");
+	bench_report ("mesh", "forward_sim_rate", 1,
+	              (sim_data_sent - s0) * 1e3 / (bench_now_ns() - real),
+	              "Mhops/s");
+}
+
+int main()
+{
+	struct sim_link_params lp;
+	struct plugin*pl;
+	struct phase ph;
+	char name[32], cmd[64];
+	uint8_t a[3];
+	int i, r, c, mid;
+
+	sim_init();
+	if (cloudvpn_plugin_init() ) bench_fail ("mesh", "plugin init");
+	pl = cloudvpn_plugin_get();
+	sink = bench_sink_part ("sink");
+	if (!sink) bench_fail ("mesh", "can't create parts");
+
+	lp.loss_ppm = 0;
+	lp.bandwidth = 100000000ULL;
+	lp.queue_ns = 50000000ULL;
+
+	/* join */
+	phase_start (&ph);
+	for (i = 0;i < NODES;++i) {
+		sprintf (name, "n%d", i);
+		node[i] = sim_node (pl, name);
+		bench_command (node[i], "refresh 0");
+		node_addr (a, i);
+		sprintf (cmd, "address %02x:%02x:%02x sink", a[0], a[1], a[2]);
+		bench_command (node[i], cmd);
+	}
+	for (r = 0;r < ROWS;++r)
+		for (c = 0;c < COLS;++c) {
+			i = r * COLS + c;
+			right_link[i] = down_link[i] = -1;
+			lp.latency_ns = 1000000ULL + sim_rnd() % 4000000;
+			if (c + 1 < COLS) right_link[i] = sim_connect (node[i], node[i + 1], &lp);
+			lp.latency_ns = 1000000ULL + sim_rnd() % 4000000;
+			if (r + 1 < ROWS) down_link[i] = sim_connect (node[i], node[i + COLS], &lp);
+		}
+	phase_end (&ph, "join");
+	if (reachable (0, 0, NODES) != NODES ||
+	        reachable (NODES - 1, 0, NODES) != NODES)
+		bench_fail ("mesh", "join didn't converge");
+
+	/* partition */
+	phase_start (&ph);
+	cut (0);
+	phase_end (&ph, "partition");
+	if (reachable (0, 0, NODES) != NODES / 2)
+		bench_fail ("mesh", "partition didn't converge");
+
+	phase_start (&ph);
+	cut (1);
+	phase_end (&ph, "heal");
+	if (reachable (0, 0, NODES) != NODES)
+		bench_fail ("mesh", "heal didn't converge");
+
+	/* flap */
+	mid = right_link[ (ROWS / 2) * COLS + COLS / 2];
+	phase_start (&ph);
+	for (i = 0;i < 2 * FLAPS;++i) {
+		sim_run (ph.start + i * FLAP_NS);
+		sim_link_set (mid, i & 1);
+	}
+	ph.start = sim_now; /* converges from the last change */
+	phase_end (&ph, "flap");
+	if (reachable (0, 0, NODES) != NODES)
+		bench_fail ("mesh", "flap didn't converge");
+
+	/* forwarding, lossy */
+	for (i = 0;i < sim_nlinks;++i) sim_links[i].lp.loss_ppm = 1000;
+	forward();
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * metrics: what an update costs in the workers, and what it costs to get
+ * them all out.
+ *	counter_inc, gauge_add,	ns per update, all workers at once, each
+ *	histogram_observe	on its copy
+ *	shared_inc		the same on one shared counter, for comparison
+ *	format_us, text_kb	the text of 100 parts with 6 metrics each
+ *	write_us		cl_metric_write of it
+ *	scrape_p50/p99		a HTTP GET of it from the metrics part
+ */
+
+#include "harness.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define WORKERS 4
+#define ITERS 2000000
+#define PARTS 100
+#define SCRAPES 50
+#define PORT 19191
+#define FILE_PATH "/tmp/cloudvpn_bench_metrics.prom"
+
+/*
+ * updates, run in the workers so that every one has its copy
+ */
+
+enum { do_inc, do_add, do_observe, do_shared };
+
+static struct cl_metric*metric;
+static uint64_t shared;
+static int job, done;
+
+static void update_process (struct part*pt, struct work*w)
+{
+	int i;
+
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_command) return;
+
+	for (i = 0;i < ITERS;++i)
+		switch (job) {
+		case do_inc:
+			cl_metric_inc (metric);
+			break;
+		case do_add:
+			cl_metric_add (metric, i & 1 ? 1 : -1);
+			break;
+		case do_observe:
+			cl_metric_observe (metric, i & 0xffff);
+			break;
+		case do_shared:
+			cl_atomic_add_relaxed (&shared, 1);
+			break;
+		}
+	cl_atomic_inc (&done);
+}
+
+static struct plugin update_plugin = {
+	"bench_update", {0}, update_process, 0, 0
+};
+
+static void updates (struct part*pt, const char*what, int j)
+{
+	struct cl_metric_slot v;
+	uint64_t t;
+	int i;
+
+	job = j;
+	done = 0;
+	t = bench_now_ns();
+	for (i = 0;i < WORKERS;++i) bench_command (pt, "go");
+	while (cl_atomic_load (&done) < WORKERS) usleep (1000);
+	t = bench_now_ns() - t;
+
+	bench_report ("metrics", what, WORKERS,
+	              (double) t / ( (double) ITERS * WORKERS), "ns");
+
+	/* nothing got lost on the way */
+	if (j == do_shared) return;
+	cl_metric_read (metric, &v);
+	if (v.value != (j == do_add ? 0 : (int64_t) ITERS * WORKERS) )
+		bench_fail ("metrics", "sum doesn't match");
+}
+
+/*
+ * exposition
+ */
+
+static int format_all (struct cl_metric*m, int family, void*arg)
+{
+	static char buf[CL_METRIC_TEXT];
+	int n = cl_metric_format (m, family, buf, sizeof (buf) );
+
+	if (n < 0) bench_fail ("metrics", "doesn't fit");
+	* (uint64_t*) arg += n;
+	return 0;
+}
+
+static int scrape (char*buf, int size)
+{
+	static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct sockaddr_in sa;
+	int fd, n, len = 0;
+
+	memset (&sa, 0, sizeof (sa) );
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons (PORT);
+	sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if ( (fd = socket (AF_INET, SOCK_STREAM, 0) ) < 0) return -1;
+	if (connect (fd, (struct sockaddr*) &sa, sizeof (sa) )
+	        || send (fd, req, sizeof (req) - 1, 0) != sizeof (req) - 1) {
+		close (fd);
+		return -1;
+	}
+	while (len < size - 1 && (n = read (fd, buf + len, size - 1 - len) ) > 0)
+		len += n;
+	close (fd);
+	buf[len] = 0;
+	return len;
+}
+
+static int count (const char*s, const char*what)
+{
+	int n = 0;
+
+	for (;(s = strstr (s, what) );++s) ++n;
+	return n;
+}
+
+int main()
+{
+	static const uint64_t bounds[] = { 64, 256, 1024, 4096, 16384, 65536 };
+	static const char*names[] = { "bench_rx_packets_total",
+	                              "bench_tx_packets_total",
+	                              "bench_rx_bytes_total",
+	                              "bench_tx_bytes_total",
+	                              "bench_queue_length"
+	                            };
+	static char buf[1 << 20];
+	struct bench_samples s;
+	struct part*pt, *mp;
+	uint64_t t, text = 0;
+	char name[32];
+	int i, j, n;
+
+	bench_core_start (WORKERS);
+
+	pt = cloudvpn_part_init (&update_plugin, "update");
+	if (!pt) bench_fail ("metrics", "no part");
+
+	metric = cl_metric_counter (pt, "bench_counter_total", "");
+	updates (pt, "counter_inc", do_inc);
+	cl_metric_free (metric);
+	metric = cl_metric_gauge (pt, "bench_gauge", "");
+	updates (pt, "gauge_add", do_add);
+	cl_metric_free (metric);
+	metric = cl_metric_histogram (pt, "bench_histogram", "", bounds, 6);
+	updates (pt, "histogram_observe", do_observe);
+	cl_metric_free (metric);
+	updates (pt, "shared_inc", do_shared);
+
+	/* what a router with a hundred parts might have */
+	for (i = 0;i < PARTS;++i) {
+		sprintf (name, "p%d", i);
+		if (! (mp = bench_sink_part (name) ) ) bench_fail ("metrics", "part");
+		for (j = 0;j < 5;++j)
+			if (! (metric = j < 4 ? cl_metric_counter (mp, names[j], "x")
+			                : cl_metric_gauge (mp, names[j], "x") ) )
+				bench_fail ("metrics", "register");
+			else cl_metric_add (metric, i * j);
+		if (! (metric = cl_metric_histogram (mp, "bench_packet_bytes", "x",
+		                                     bounds, 6) ) )
+			bench_fail ("metrics", "register");
+		cl_metric_observe (metric, i * 100);
+	}
+	if (cl_metric_counter (mp, names[0], "x") )
+		bench_fail ("metrics", "registered twice");
+
+	t = bench_now_ns();
+	cl_metric_walk (format_all, &text);
+	bench_report ("metrics", "format_us", 1, (bench_now_ns() - t) / 1e3, "us");
+	bench_report ("metrics", "text_kb", 1, text / 1024.0, "KiB");
+
+	t = bench_now_ns();
+	if (cl_metric_write (FILE_PATH) ) bench_fail ("metrics", "write");
+	bench_report ("metrics", "write_us", 1, (bench_now_ns() - t) / 1e3, "us");
+	unlink (FILE_PATH);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("metrics", "plugin init");
+	mp = cloudvpn_part_init (cloudvpn_plugin_get(), "metrics");
+	if (!mp || !mp->data) bench_fail ("metrics", "no metrics part");
+	sprintf (name, "listen %d", PORT);
+	bench_command (mp, name);
+
+	for (i = 0;i < 100 && scrape (buf, sizeof (buf) ) < 0;++i) usleep (10000);
+	for (s.n = i = 0;i < SCRAPES;++i) {
+		t = bench_now_ns();
+		n = scrape (buf, sizeof (buf) );
+		bench_sample (&s, (bench_now_ns() - t) / 1e3);
+		if (n <= 0 || strncmp (buf, "HTTP/1.0 200", 12) )
+			bench_fail ("metrics", "scrape");
+	}
+	bench_report_samples ("metrics", "scrape", 1, &s, "us");
+
+	/* the 6 families here and the metrics part's 4, whole */
+	if (count (buf, "# TYPE ") != 10 ||
+	        count (buf, "bench_packet_bytes_count{") != PARTS)
+		bench_fail ("metrics", "scrape isn't whole");
+	return 0;
+}
@@ -0,0 +1,260 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * the name plugin. The system resolver is replaced by a fake one that
+ * takes 20ms per query and doesn't know names starting with "no-", so this
+ * needs no network and the resolver calls can be counted. Cases:
+ *	preload		100k names from a file
+ *	hit		lookups of preloaded names, through the scheduler
+ *	coalesce	1000 parts ask for the same unknown name at once
+ *	negative	lookups of a name that isn't there, after the first
+ *	hit_while_slow	a cached lookup while slow queries are outstanding
+ */
+
+#include "harness.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define WORKERS 2
+#define NAMES 100000
+#define HITS 200000
+#define BATCH 1000
+#define WAITERS 1000
+#define SLOW_US 20000
+
+static uint64_t resolver_calls;
+
+int getaddrinfo (const char*node, const char*service,
+                 const struct addrinfo*hints, struct addrinfo**res)
+{
+	struct addrinfo*r;
+	struct sockaddr_in*sa;
+
+	cl_atomic_inc (&resolver_calls);
+	usleep (SLOW_US);
+	if (!strncmp (node, "no-", 3) ) return EAI_NONAME;
+
+	r = calloc (1, sizeof (struct addrinfo) + sizeof (struct sockaddr_in) );
+	if (!r) return EAI_MEMORY;
+	sa = (struct sockaddr_in*) (r + 1);
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl (0x0a000001);
+	r->ai_family = AF_INET;
+	r->ai_addr = (struct sockaddr*) sa;
+	r->ai_addrlen = sizeof (struct sockaddr_in);
+	*res = r;
+	return 0;
+}
+
+void freeaddrinfo (struct addrinfo*r)
+{
+	free (r);
+}
+
+/*
+ * the part that asks
+ */
+
+static uint64_t answers, found;
+
+static void client_process (struct part*pt, struct work*w)
+{
+	if (w->type != work_packet && w->type != work_command) return;
+	if (w->p->len >= 7 && w->p->data[0] == 2) {
+		if (w->p->data[5]) cl_atomic_inc (&found);
+		cl_atomic_inc (&answers);
+	}
+	cloudvpn_packet_free (w->p);
+}
+
+static struct plugin client_plugin = {
+	"bench_client", {0}, client_process, 0, 0
+};
+
+static struct part*name, *client[WAITERS];
+
+static void query (struct part*from, const char*n, uint32_t tag)
+{
+	int len = strlen (n);
+	struct packet*p = cloudvpn_packet_alloc_buf (5 + len);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("name", "no memory");
+	p->data[0] = 1;
+	memcpy (p->data + 1, &tag, 4);
+	memcpy (p->data + 5, n, len);
+	p->soff = p->doff = 0;
+	p->src_part = from;
+	p->next_part = name;
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+static void wait_answers (uint64_t n, const char*what)
+{
+	uint64_t t = bench_now_ns();
+
+	while (cl_atomic_load (&answers) < n) {
+		if (bench_now_ns() - t > 10000000000ULL) bench_fail ("name", what);
+		sched_yield();
+	}
+}
+
+static void preload()
+{
+	char file[] = "/tmp/bench_nameXXXXXX", cmd[64], n[32];
+	uint64_t start, f0, a0;
+	FILE*f;
+	int fd, i;
+
+	if ( (fd = mkstemp (file) ) < 0 || ! (f = fdopen (fd, "w") ) )
+		bench_fail ("name", "can't write the file");
+	fprintf (f, "# bench names\n");
+	for (i = 0;i < NAMES;++i)
+		fprintf (f, "host%d.bench 0a:%02x:%02x:%02x\n",
+		         i, i >> 16 & 0xff, i >> 8 & 0xff, i & 0xff);
+	fclose (f);
+
+	/* until it's loaded, the last name is simply not there */
+	bench_command (name, "system off");
+	start = bench_now_ns();
+	sprintf (cmd, "load %s", file);
+	bench_command (name, cmd);
+	sprintf (n, "host%d.bench", NAMES - 1);
+	for (;;) {
+		f0 = cl_atomic_load (&found);
+		a0 = cl_atomic_load (&answers);
+		query (client[0], n, 0);
+		wait_answers (a0 + 1, "preload");
+		if (cl_atomic_load (&found) != f0) break;
+		if (bench_now_ns() - start > 10000000000ULL)
+			bench_fail ("name", "preload didn't finish");
+		usleep (1000);
+	}
+	bench_report ("name", "preload_100k", WORKERS,
+	              (bench_now_ns() - start) / 1e6, "ms");
+	bench_command (name, "system on");
+	unlink (file);
+}
+
+static void hits()
+{
+	uint64_t start, a0 = cl_atomic_load (&answers),
+	                f0 = cl_atomic_load (&found), c0 = resolver_calls;
+	char n[32];
+	int i;
+
+	start = bench_now_ns();
+	for (i = 0;i < HITS;++i) {
+		if (i >= BATCH) wait_answers (a0 + i - BATCH, "hit");
+		sprintf (n, "host%d.bench", (int) ( (i * 7919ULL) % NAMES) );
+		query (client[i % WAITERS], n, i);
+	}
+	wait_answers (a0 + HITS, "hit");
+	if (cl_atomic_load (&found) - f0 != HITS || resolver_calls != c0)
+		bench_fail ("name", "preloaded names missing");
+	bench_report ("name", "hit", WORKERS,
+	              HITS * 1e3 / (bench_now_ns() - start), "Mlookups/s");
+}
+
+static void coalesce()
+{
+	uint64_t start, a0 = cl_atomic_load (&answers),
+	                f0 = cl_atomic_load (&found), c0 = resolver_calls;
+	int i;
+
+	start = bench_now_ns();
+	for (i = 0;i < WAITERS;++i) query (client[i], "slow.bench", i);
+	wait_answers (a0 + WAITERS, "coalesce");
+	if (cl_atomic_load (&found) - f0 != WAITERS)
+		bench_fail ("name", "coalesced answers wrong");
+	bench_report ("name", "coalesce_1000_queries", WORKERS,
+	              resolver_calls - c0, "resolver calls");
+	bench_report ("name", "coalesce_1000_time", WORKERS,
+	              (bench_now_ns() - start) / 1e6, "ms");
+}
+
+static void negative()
+{
+	uint64_t start, a0 = cl_atomic_load (&answers),
+	                f0 = cl_atomic_load (&found), c0 = resolver_calls;
+	int i;
+
+	query (client[0], "no-such.bench", 0);
+	wait_answers (a0 + 1, "negative");
+	start = bench_now_ns();
+	for (i = 0;i < HITS;++i) {
+		if (i >= BATCH) wait_answers (a0 + 1 + i - BATCH, "negative");
+		query (client[i % WAITERS], "no-such.bench", i);
+	}
+	wait_answers (a0 + 1 + HITS, "negative");
+	if (cl_atomic_load (&found) != f0)
+		bench_fail ("name", "found a name that isn't there");
+	bench_report ("name", "negative", WORKERS,
+	              HITS * 1e3 / (bench_now_ns() - start), "Mlookups/s");
+	bench_report ("name", "negative_resolver_calls", WORKERS,
+	              resolver_calls - c0, "calls");
+}
+
+static void hit_while_slow()
+{
+	/* the resolvers are both busy; a cached name still comes right back */
+	uint64_t a0 = cl_atomic_load (&answers), start, worst = 0, t;
+	char n[32];
+	int i;
+
+	for (i = 0;i < 8;++i) {
+		sprintf (n, "slow%d.bench", i);
+		query (client[i], n, i);
+	}
+	for (i = 0;i < 8;++i) {
+		start = bench_now_ns();
+		query (client[0], "host1.bench", 0);
+		wait_answers (a0 + 1, "hit_while_slow");
+		++a0;
+		t = bench_now_ns() - start;
+		if (t > worst) worst = t;
+	}
+	if (cl_atomic_load (&answers) - a0 > 0)
+		bench_fail ("name", "slow ones came too soon");
+	bench_report ("name", "hit_while_slow_worst", WORKERS, worst / 1e3, "us");
+	wait_answers (a0 + 8, "hit_while_slow");
+}
+
+int main()
+{
+	char n[32];
+	int i;
+
+	bench_core_start (WORKERS);
+	if (cloudvpn_plugin_init() ) bench_fail ("name", "plugin init");
+	name = cloudvpn_part_init (cloudvpn_plugin_get(), "name");
+	if (!name) bench_fail ("name", "can't create parts");
+	for (i = 0;i < WAITERS;++i) {
+		sprintf (n, "c%d", i);
+		if (! (client[i] = cloudvpn_part_init (&client_plugin, n) ) )
+			bench_fail ("name", "can't create parts");
+	}
+
+	preload();
+	hits();
+	coalesce();
+	negative();
+	hit_while_slow();
+	return 0;
+}
@@ -0,0 +1,144 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * pktgen sending to another pktgen part for a second, directly and through
+ * a chain of parts that just pass the packets on. Every case says what
+ * got through (packets/s, Gbit/s), the latency percentiles from making a
+ * packet to counting it, and what was lost or reordered on the way.
+ *	<size>_direct		as fast as it goes, 64, 1500 bytes and imix
+ *	64_chain<n>		through n hops
+ *	64_rate100k[_chain4]	paced at 100k packets/s, in bursts of a 1ms tick
+ */
+
+#include "harness.h"
+#include "pktgen.h"
+
+#include <string.h>
+
+#define RUN_US 1000000
+#define WORKERS 2
+
+/* passes packets on, like a forwarding part that has nothing to decide */
+static void hop_process (struct part*pt, struct work*w)
+{
+	struct work*n;
+
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_packet) return;
+
+	w->p->next_part = pt->data;
+	if (! (n = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (w->p);
+		return;
+	}
+	n->type = work_packet;
+	n->priority = w->priority;
+	n->is_static = 0;
+	n->p = w->p;
+	if (cloudvpn_schedule_work (n) ) {
+		cloudvpn_packet_free (n->p);
+		cl_free (n);
+	}
+}
+
+static struct plugin hop_plugin = {
+	"bench_hop", {0}, hop_process, 0, 0
+};
+
+static struct part*gen, *sink;
+
+static void command (struct part*p, const char*fmt, const char*arg)
+{
+	char buf[128];
+	snprintf (buf, sizeof (buf), fmt, arg);
+	bench_command (p, buf);
+}
+
+static void run (const char*what, const char*size, int hops, const char*rate)
+{
+	struct pktgen_result r;
+	struct part*first = sink, *h;
+	char name[32], buf[64];
+	uint64_t sent, last = 0;
+	int i;
+
+	/* the chain, from the sink backwards */
+	for (i = 0;i < hops;++i) {
+		sprintf (name, "%s_hop%d", what, i);
+		if (! (h = cloudvpn_part_init (&hop_plugin, name) ) )
+			bench_fail ("pktgen", "no hop");
+		h->data = first;
+		first = h;
+	}
+
+	bench_command (sink, "reset");
+	command (gen, "size %s", size);
+	command (gen, "rate %s", rate);
+	command (gen, "next %s", first->name);
+	usleep (10000);
+	pktgen_result (gen, &r);
+	sent = r.sent;
+	bench_command (gen, "start");
+	usleep (RUN_US);
+	bench_command (gen, "stop");
+
+	/* until the queue is empty */
+	for (;;) {
+		usleep (50000);
+		pktgen_result (sink, &r);
+		if (r.received == last) break;
+		last = r.received;
+	}
+	pktgen_result (gen, &r);
+	sent = r.sent - sent;
+	pktgen_result (sink, &r);
+
+	sprintf (buf, "%s_packets", what);
+	bench_report ("pktgen", buf, WORKERS, r.pps, "packets/s");
+	sprintf (buf, "%s_gbit", what);
+	bench_report ("pktgen", buf, WORKERS, r.gbps, "Gbit/s");
+	sprintf (buf, "%s_lat_p50", what);
+	bench_report ("pktgen", buf, WORKERS, r.lat_p50 / 1e3, "us");
+	sprintf (buf, "%s_lat_p99", what);
+	bench_report ("pktgen", buf, WORKERS, r.lat_p99 / 1e3, "us");
+	sprintf (buf, "%s_lat_p999", what);
+	bench_report ("pktgen", buf, WORKERS, r.lat_p999 / 1e3, "us");
+	sprintf (buf, "%s_lost", what);
+	bench_report ("pktgen", buf, WORKERS, r.lost + (sent - r.received),
+	              "packets");
+	sprintf (buf, "%s_reordered", what);
+	bench_report ("pktgen", buf, WORKERS, r.reordered, "packets");
+
+	if (r.foreign || r.duplicate) bench_fail ("pktgen", "packets got mixed up");
+}
+
+int main()
+{
+	bench_core_start (WORKERS);
+	if (cloudvpn_plugin_init() ) bench_fail ("pktgen", "plugin init");
+	gen = cloudvpn_part_init (cloudvpn_plugin_get(), "gen");
+	sink = cloudvpn_part_init (cloudvpn_plugin_get(), "sink");
+	if (!gen || !sink || !gen->data || !sink->data)
+		bench_fail ("pktgen", "no parts");
+	bench_command (gen, "dst 0a000000 256");
+	bench_command (gen, "src 0a010000 16");
+
+	run ("64_direct", "64", 0, "0");
+	run ("1500_direct", "1500", 0, "0");
+	run ("imix_direct", "imix", 0, "0");
+	run ("64_chain1", "64", 1, "0");
+	run ("64_chain4", "64", 4, "0");
+	run ("64_rate100k", "64", 0, "100000");
+	run ("64_rate100k_chain4", "64", 4, "100000");
+	return 0;
+}
@@ -0,0 +1,89 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * shared memory transport: both ends live in this process, but they only
+ * see each other through the memfd rings, same as two instances would.
+ */
+
+#include "harness.h"
+#include "wire.h"
+
+#define WORKERS 3
+#define WINDOW 4096 /* packets in flight */
+#define BYTES_PER_SIZE (256*1024*1024ULL)
+#define MAX_PACKETS 1000000
+
+static const int sizes[] = {64, 256, 1024, 1500, 9000, 32768, 0};
+
+int main()
+{
+	struct plugin*pl;
+	struct part*a, *b, *sink;
+	uint64_t n, sent, start, t, base;
+	char cmd[128], path[64];
+	const int*s;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("shm", "plugin init");
+	pl = cloudvpn_plugin_get();
+
+	sink = bench_sink_part ("sink");
+	a = cloudvpn_part_init (pl, "a");
+	b = cloudvpn_part_init (pl, "b");
+	if (!sink || !a || !b) bench_fail ("shm", "can't create parts");
+
+	sprintf (path, "/tmp/cloudvpn-bench-shm-%d", getpid() );
+	bench_command (a, "queue 8192"); /* more than the window, no drops */
+	bench_command (b, "next sink");
+	sprintf (cmd, "listen %s", path);
+	bench_command (b, cmd);
+	usleep (100000);
+	sprintf (cmd, "connect %s", path);
+	bench_command (a, cmd);
+
+	for (n = 0;!cl_atomic_load (&bench_sink_packets);++n) {
+		if (n > 500) bench_fail ("shm", "peers can't see each other");
+		bench_send_packet (a, 64, 128);
+		usleep (10000);
+	}
+	unlink (path);
+
+	for (s = sizes;*s;++s) {
+		n = BYTES_PER_SIZE / *s;
+		if (n > MAX_PACKETS) n = MAX_PACKETS;
+
+		base = cl_atomic_load (&bench_sink_packets);
+		start = bench_now_ns();
+		for (sent = 0;sent < n;++sent) {
+			while (sent - (cl_atomic_load (&bench_sink_packets) - base)
+			        >= WINDOW) sched_yield();
+			if (bench_send_packet (a, *s, 128) )
+				bench_fail ("shm", "can't send");
+		}
+
+		for (t = bench_now_ns();
+		        cl_atomic_load (&bench_sink_packets) - base < n &&
+		        bench_now_ns() - t < 1000000000ULL;) usleep (1000);
+
+		t = bench_now_ns() - start;
+		n = cl_atomic_load (&bench_sink_packets) - base;
+
+		sprintf (cmd, "local_%d", *s);
+		bench_report ("shm", cmd, WORKERS, n * 1e9 / t, "packets/s");
+		bench_report ("shm", cmd, WORKERS,
+		              n * (*s + WIRE_HDR_LEN) * 8.0 / t, "Gbit/s");
+	}
+
+	return 0;
+}
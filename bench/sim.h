@@ -0,0 +1,336 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_BENCH_SIM_H
+#define _CVPN_BENCH_SIM_H
+
+/*
+ * mesh simulator: lots of nodes (parts of a plugin, usually a router) in one
+ * process, connected by simulated links that have latency, loss, bandwidth
+ * and a queue. Time in the simulation is virtual: it jumps to whenever the
+ * next packet arrives, so a mesh with 10ms links converges in a moment of
+ * real time, and the results don't depend on how fast the machine is.
+ *
+ * The core is one per process (scheduler, pool and event loop are global),
+ * so the nodes share it; they are separate parts, and that's all the
+ * isolation they have anyway. Nobody polls the event loop and no workers
+ * run in background: the simulator runs the scheduler itself, in one
+ * thread, and it does
+ *
+ *	loop:	run all the queued work (processing takes no virtual time)
+ *		move the clock to the next packet arrival, deliver it
+ *
+ * so everything is deterministic. Timers of the nodes don't fire, so the
+ * plugin must not need them (lsr doesn't, dvr's triggered updates do).
+ *
+ *	sim_init();
+ *	a = sim_node (pl, "a"); b = sim_node (pl, "b");
+ *	l = sim_connect (a, b, &params);	(sends "link <end>" to both)
+ *	sim_run (0);			(until nothing moves)
+ *	sim_link_set (l, 0);		(down, and "unlink <end>")
+ */
+
+#include "harness.h"
+
+#define SIM_MAX_LINKS 4096
+
+struct sim_link_params {
+	uint64_t latency_ns;
+	uint32_t loss_ppm; /* per million packets */
+	uint64_t bandwidth; /* bits per second, 0 is infinite */
+	uint64_t queue_ns; /* packets that would wait longer are dropped */
+};
+
+/* one direction of a link */
+struct sim_end {
+	struct part*pt; /* the router sends to this */
+	struct part*router; /* ...which is this one */
+	struct sim_end*other;
+	struct sim_link_params*lp;
+	uint64_t busy_until; /* virtual time when the last packet is sent */
+	int up;
+};
+
+struct sim_link {
+	struct sim_end end[2];
+	struct sim_link_params lp;
+};
+
+struct sim_pending {
+	uint64_t due, order; /* order keeps the same-time arrivals in order */
+	struct packet*p;
+	struct sim_end*to;
+};
+
+static uint64_t sim_now; /* virtual, in nanoseconds */
+static uint64_t sim_rnd_state = 0x2545f4914f6cdd1dULL;
+
+static struct sim_link sim_links[SIM_MAX_LINKS];
+static int sim_nlinks;
+
+static struct sim_pending*sim_heap;
+static unsigned sim_heap_n, sim_heap_cap;
+static uint64_t sim_order;
+
+/* control packets are the ones with empty addresses */
+static uint64_t sim_ctl_msgs, sim_ctl_bytes, sim_last_ctl;
+static uint64_t sim_data_sent, sim_data_lost;
+
+static struct part*sim_clock_part;
+static struct work sim_marker;
+static int sim_running;
+
+static inline uint32_t sim_rnd()
+{
+	sim_rnd_state ^= sim_rnd_state << 13;
+	sim_rnd_state ^= sim_rnd_state >> 7;
+	sim_rnd_state ^= sim_rnd_state << 17;
+	return sim_rnd_state >> 32;
+}
+
+static void sim_heap_push (struct sim_pending*e)
+{
+	unsigned i, p;
+
+	if (sim_heap_n == sim_heap_cap) {
+		sim_heap_cap = sim_heap_cap ? 2 * sim_heap_cap : 1024;
+		sim_heap = realloc (sim_heap,
+		                    sim_heap_cap * sizeof (struct sim_pending) );
+		if (!sim_heap) bench_fail ("sim", "no memory");
+	}
+
+	for (i = sim_heap_n++;i;i = p) {
+		p = (i - 1) / 2;
+		if (sim_heap[p].due < e->due || (sim_heap[p].due == e->due &&
+		                                 sim_heap[p].order < e->order) ) break;
+		sim_heap[i] = sim_heap[p];
+	}
+	sim_heap[i] = *e;
+}
+
+static void sim_heap_pop (struct sim_pending*e)
+{
+	struct sim_pending last;
+	unsigned i, c;
+
+	*e = sim_heap[0];
+	last = sim_heap[--sim_heap_n];
+	for (i = 0; (c = 2 * i + 1) < sim_heap_n;i = c) {
+		if (c + 1 < sim_heap_n && (sim_heap[c + 1].due < sim_heap[c].due ||
+		                           (sim_heap[c + 1].due == sim_heap[c].due &&
+		                            sim_heap[c + 1].order < sim_heap[c].order) ) )
+			++c;
+		if (last.due < sim_heap[c].due || (last.due == sim_heap[c].due &&
+		                                   last.order < sim_heap[c].order) ) break;
+		sim_heap[i] = sim_heap[c];
+	}
+	sim_heap[i] = last;
+}
+
+/*
+ * link ends
+ */
+
+static void sim_end_process (struct part*pt, struct work*w)
+{
+	struct sim_end*e = pt->data;
+	struct sim_pending x;
+	struct packet*p = w->p;
+	uint64_t start;
+
+	if (w->type != work_packet) {
+		if (w->type == work_command) cloudvpn_packet_free (p);
+		return;
+	}
+
+	if (!p->soff) {
+		++sim_ctl_msgs;
+		sim_ctl_bytes += p->len;
+	} else ++sim_data_sent;
+
+	/* down, lost, or doesn't fit the queue */
+	start = e->busy_until > sim_now ? e->busy_until : sim_now;
+	if (!e->up || (e->lp->loss_ppm && sim_rnd() % 1000000 < e->lp->loss_ppm) ||
+	        (e->lp->queue_ns && start - sim_now > e->lp->queue_ns) ) {
+		if (p->soff) ++sim_data_lost;
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	if (e->lp->bandwidth)
+		e->busy_until = start + p->len * 8000000000ULL / e->lp->bandwidth;
+	else e->busy_until = start;
+
+	x.due = e->busy_until + e->lp->latency_ns;
+	x.order = sim_order++;
+	x.p = p;
+	x.to = e->other;
+	sim_heap_push (&x);
+}
+
+static struct plugin sim_end_plugin = {
+	"bench_sim_link", {0}, sim_end_process, 0, 0
+};
+
+static void sim_deliver (struct sim_pending*x)
+{
+	struct work*w = cloudvpn_new_work();
+
+	if (!w) bench_fail ("sim", "no memory");
+	if (!x->p->soff) sim_last_ctl = sim_now;
+
+	x->p->src_part = x->to->pt;
+	x->p->next_part = x->to->router;
+	w->type = work_packet;
+	w->priority = 0;
+	w->is_static = 0;
+	w->p = x->p;
+	cloudvpn_schedule_work (w);
+}
+
+/*
+ * the clock
+ */
+
+static void sim_clock_process (struct part*pt, struct work*w)
+{
+	/* the marker got to the front of the queue, nothing else is there */
+	sim_running = 0;
+}
+
+static struct plugin sim_clock_plugin = {
+	"bench_sim_clock", {0}, sim_clock_process, 0, 0
+};
+
+static void sim_drain()
+{
+	/* runs the queued work, and whatever it schedules, until it's done */
+	sim_running = 1;
+	cloudvpn_schedule_work (&sim_marker);
+	cloudvpn_scheduler_run (&sim_running);
+}
+
+/* runs until virtual time until, or until nothing moves if it's 0 */
+static void sim_run (uint64_t until)
+{
+	struct sim_pending x;
+
+	for (;;) {
+		sim_drain();
+		if (!sim_heap_n || (until && sim_heap[0].due > until) ) break;
+
+		sim_now = sim_heap[0].due;
+		while (sim_heap_n && sim_heap[0].due == sim_now) {
+			sim_heap_pop (&x);
+			sim_deliver (&x);
+		}
+	}
+	if (until > sim_now) sim_now = until;
+}
+
+static void sim_init()
+{
+	if (cloudvpn_core_init() ) bench_fail ("sim", "core init failed");
+
+	sim_clock_part = cloudvpn_part_init (&sim_clock_plugin, "sim_clock");
+	if (!sim_clock_part) bench_fail ("sim", "can't create parts");
+
+	/* goes after everything with higher priority */
+	sim_marker.type = work_event;
+	sim_marker.priority = LOWEST_PRIORITY;
+	sim_marker.is_static = 1;
+	sim_marker.e.type = event_async;
+	sim_marker.e.owner = sim_clock_part;
+	sim_marker.e.priv = 0;
+}
+
+/*
+ * topology
+ */
+
+static struct part* sim_node (struct plugin*pl, const char*name) {
+
+	struct part*pt = cloudvpn_part_init (pl, name);
+
+	if (!pt) bench_fail ("sim", "can't create parts");
+	return pt;
+}
+
+static void sim_link_command (struct sim_end*e, const char*cmd)
+{
+	char s[128];
+
+	snprintf (s, sizeof (s), "%s %s", cmd, e->pt->name);
+	bench_command (e->router, s);
+}
+
+/* connects the two nodes, returns the link number */
+static int sim_connect (struct part*x, struct part*y,
+                        const struct sim_link_params*lp)
+{
+	struct sim_link*l;
+	char name[128];
+	int i;
+
+	if (sim_nlinks == SIM_MAX_LINKS) bench_fail ("sim", "too many links");
+	l = sim_links + sim_nlinks;
+	l->lp = *lp;
+
+	for (i = 0;i < 2;++i) {
+		/* end i belongs to x for 0, y for 1, and is called x>y */
+		snprintf (name, sizeof (name), "%s>%s",
+		          (i ? y : x)->name, (i ? x : y)->name);
+		l->end[i].pt = cloudvpn_part_init (&sim_end_plugin, name);
+		if (!l->end[i].pt) bench_fail ("sim", "can't create parts");
+		l->end[i].pt->data = l->end + i;
+		l->end[i].router = i ? y : x;
+		l->end[i].other = l->end + !i;
+		l->end[i].lp = &l->lp;
+		l->end[i].busy_until = 0;
+		l->end[i].up = 1;
+	}
+
+	sim_link_command (l->end, "link");
+	sim_link_command (l->end + 1, "link");
+	return sim_nlinks++;
+}
+
+static void sim_link_set (int link, int up)
+{
+	struct sim_link*l = sim_links + link;
+
+	if (l->end[0].up == up) return;
+	l->end[0].up = l->end[1].up = up;
+	sim_link_command (l->end, up ? "link" : "unlink");
+	sim_link_command (l->end + 1, up ? "link" : "unlink");
+}
+
+/* data packet to be routed by node, to address addr */
+static void sim_send (struct part*node, const uint8_t*addr, int alen, int size)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (size);
+	struct work*w = cloudvpn_new_work();
+
+	if (!p || !w) bench_fail ("sim", "no memory");
+	memset (p->data, 0, size);
+	memcpy (p->data, addr, alen);
+	p->soff = p->doff = alen;
+	p->src_part = 0;
+	p->next_part = node;
+	w->type = work_packet;
+	w->priority = 128;
+	w->is_static = 0;
+	w->p = p;
+	cloudvpn_schedule_work (w);
+}
+
+#endif
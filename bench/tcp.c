@@ -0,0 +1,261 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tcp transport over loopback: two tcp parts connected to each other,
+ * packets go in through one and are counted by a sink behind the other.
+ * Each size runs over a plain connection and over one sending with
+ * MSG_ZEROCOPY, and the cpu time spent per Gbit is reported for both.
+ *
+ * Then small probe packets are sent while a bulk flow fills the link, once
+ * with the bulk priority (same stream, behind the bulk data) and once with
+ * control priority (own stream), and their latency is measured.
+ */
+
+#include "harness.h"
+#include "wire.h"
+
+#include <sys/resource.h>
+#include <stdlib.h>
+
+#define WORKERS 3
+#define WINDOW 2048 /* packets in flight */
+#define BYTES_PER_SIZE (256*1024*1024ULL)
+#define MAX_PACKETS 500000
+
+#define PROBES 500
+#define PROBE_LEN 64
+#define PROBE_MAGIC 0x70726f62
+#define PROBE_GAP_NS 1000000
+#define BULK_SIZE 32768
+#define BULK_PRIORITY 200
+
+static const int sizes[] = {64, 256, 1024, 1500, 9000, 32768, 65000, 0};
+
+/*
+ * probe sink, takes the latency of probes and counts the rest like the
+ * ordinary sink does
+ */
+
+static uint64_t probe_lat[PROBES];
+static int probe_count;
+
+static void probe_process (struct part*pt, struct work*w)
+{
+	struct packet*p = w->p;
+	uint64_t t;
+	uint32_t magic;
+
+	if (w->type != work_packet && w->type != work_command) return;
+	memcpy (&magic, p->data, sizeof (magic) );
+	if (p->len == PROBE_LEN && magic == PROBE_MAGIC) {
+		memcpy (&t, p->data + 8, sizeof (t) );
+		t = bench_now_ns() - t;
+		if (probe_count < PROBES) probe_lat[probe_count] = t;
+		cl_atomic_inc (&probe_count);
+	} else {
+		cl_atomic_add (&bench_sink_bytes, p->len);
+		cl_atomic_inc (&bench_sink_packets);
+	}
+	cloudvpn_packet_free (p);
+}
+
+static struct plugin probe_plugin = {
+	"bench_probe", {0}, probe_process, 0, 0
+};
+
+static int send_probe (struct part*pt, uint8_t prio)
+{
+	struct packet*p = cloudvpn_packet_alloc_buf (PROBE_LEN);
+	struct work*w;
+	uint32_t magic = PROBE_MAGIC;
+	uint64_t t = bench_now_ns();
+
+	if (!p) return 1;
+	memset (p->data, 0, PROBE_LEN);
+	memcpy (p->data, &magic, sizeof (magic) );
+	memcpy (p->data + 8, &t, sizeof (t) );
+	p->next_part = pt;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		cloudvpn_packet_free (p);
+		return 1;
+	}
+	w->type = work_packet;
+	w->priority = prio;
+	w->is_static = 0;
+	w->p = p;
+	return cloudvpn_schedule_work (w);
+}
+
+static int cmp_u64 (const void*a, const void*b)
+{
+	uint64_t x = * (const uint64_t*) a, y = * (const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t cpu_ns()
+{
+	/* process cpu time, user+system */
+	struct rusage r;
+	getrusage (RUSAGE_SELF, &r);
+	return (r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000000000ULL
+	       + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) * 1000ULL;
+}
+
+static struct part* make_pair (struct plugin*pl, const char*name,
+                               int port, const char*options,
+                               const char*next) {
+
+	struct part*a, *b;
+	char cmd[64];
+	uint64_t n, base = cl_atomic_load (&bench_sink_packets);
+
+	sprintf (cmd, "%s_tx", name);
+	a = cloudvpn_part_init (pl, cmd);
+	sprintf (cmd, "%s_rx", name);
+	b = cloudvpn_part_init (pl, cmd);
+	if (!a || !b) bench_fail ("tcp", "can't create parts");
+
+	if (options) bench_command (a, options);
+	sprintf (cmd, "next %s", next);
+	bench_command (b, cmd);
+	sprintf (cmd, "listen 127.0.0.1 %d", port);
+	bench_command (b, cmd);
+	sprintf (cmd, "connect 127.0.0.1 %d", port);
+	bench_command (a, cmd);
+
+	/* wait for the connection */
+	for (n = 0;cl_atomic_load (&bench_sink_packets) == base;++n) {
+		if (n > 500) bench_fail ("tcp", "can't connect over loopback");
+		bench_send_packet (a, 64, 128);
+		usleep (10000);
+	}
+	usleep (100000);
+	return a;
+}
+
+static void run (struct part*a, const char*mode, int size)
+{
+	uint64_t n, sent, start, t, cpu, base;
+	char what[64];
+
+	n = BYTES_PER_SIZE / size;
+	if (n > MAX_PACKETS) n = MAX_PACKETS;
+
+	base = cl_atomic_load (&bench_sink_packets);
+	start = bench_now_ns();
+	cpu = cpu_ns();
+	for (sent = 0;sent < n;++sent) {
+		while (sent - (cl_atomic_load (&bench_sink_packets) - base)
+		        >= WINDOW) sched_yield();
+		if (bench_send_packet (a, size, 128) )
+			bench_fail ("tcp", "can't send");
+	}
+
+	/* queue overflows are dropped, so don't wait forever */
+	for (t = bench_now_ns();
+	        cl_atomic_load (&bench_sink_packets) - base < n &&
+	        bench_now_ns() - t < 1000000000ULL;) usleep (1000);
+
+	t = bench_now_ns() - start;
+	cpu = cpu_ns() - cpu;
+	n = cl_atomic_load (&bench_sink_packets) - base;
+
+	sprintf (what, "loopback_%s_%d", mode, size);
+	bench_report ("tcp", what, WORKERS, n * 1e9 / t, "packets/s");
+	bench_report ("tcp", what, WORKERS,
+	              n * (size + WIRE_HDR_LEN) * 8.0 / t, "Gbit/s");
+	/* cpu seconds needed to move one gigabit */
+	bench_report ("tcp", what, WORKERS,
+	              n ? cpu / (n * (size + WIRE_HDR_LEN) * 8.0) : 0,
+	              "cpu-s/Gbit");
+}
+
+static void probe_run (struct part*a, const char*mode, uint8_t prio)
+{
+	uint64_t sent, base, next_probe, t;
+	int probes = 0, n;
+	char what[64];
+
+	probe_count = 0;
+	base = cl_atomic_load (&bench_sink_packets);
+	next_probe = bench_now_ns();
+
+	for (sent = 0;probes < PROBES;) {
+		/* keep the bulk flow saturating the link */
+		while (sent - (cl_atomic_load (&bench_sink_packets) - base)
+		        < WINDOW / 4) {
+			if (bench_send_packet (a, BULK_SIZE, BULK_PRIORITY) )
+				bench_fail ("tcp", "can't send");
+			++sent;
+		}
+
+		if (bench_now_ns() >= next_probe) {
+			if (send_probe (a, prio) ) bench_fail ("tcp", "can't send");
+			++probes;
+			next_probe += PROBE_GAP_NS;
+		} else sched_yield();
+	}
+
+	for (t = bench_now_ns();cl_atomic_load (&probe_count) < PROBES &&
+	        bench_now_ns() - t < 1000000000ULL;) usleep (1000);
+
+	n = cl_atomic_load (&probe_count);
+	if (n > PROBES) n = PROBES;
+	if (!n) bench_fail ("tcp", "no probes came through");
+	qsort (probe_lat, n, sizeof (uint64_t), cmp_u64);
+
+	/* let the bulk flow drain before the next run */
+	for (t = bench_now_ns();
+	        cl_atomic_load (&bench_sink_packets) - base < sent &&
+	        bench_now_ns() - t < 1000000000ULL;) usleep (1000);
+
+	sprintf (what, "probe_%s_p50", mode);
+	bench_report ("tcp", what, WORKERS, probe_lat[n / 2] / 1000.0, "us");
+	sprintf (what, "probe_%s_p99", mode);
+	bench_report ("tcp", what, WORKERS,
+	              probe_lat[n * 99 / 100] / 1000.0, "us");
+}
+
+int main()
+{
+	struct plugin*pl;
+	struct part*plain, *zc, *mux;
+	const int*s;
+	int port = 20000 + getpid() % 20000;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("tcp", "plugin init");
+	pl = cloudvpn_plugin_get();
+
+	if (!bench_sink_part ("sink") )
+		bench_fail ("tcp", "can't create parts");
+
+	plain = make_pair (pl, "copy", port, 0, "sink");
+	zc = make_pair (pl, "zc", port + 1, "zerocopy 8192", "sink");
+
+	for (s = sizes;*s;++s) {
+		run (plain, "copy", *s);
+		run (zc, "zerocopy", *s);
+	}
+
+	if (!cloudvpn_part_init (&probe_plugin, "probe") )
+		bench_fail ("tcp", "can't create parts");
+	mux = make_pair (pl, "mux", port + 2, 0, "probe");
+	probe_run (mux, "behind_bulk", BULK_PRIORITY);
+	probe_run (mux, "control", 0);
+
+	return 0;
+}
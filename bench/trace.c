@@ -0,0 +1,163 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * what tracing costs and what it says. pktgen sends 64 byte packets through
+ * a chain of 4 parts to a pktgen sink as fast as it goes, with tracing off
+ * and with every 1000th, 100th and every packet traced.
+ *	<every>_packets		what got through
+ *	<part>_queue_p50/p99	the breakdown from 1/100, in ns; "life" is
+ *	<part>_process_p50/p99	all the queues and making to freeing
+ *	json_events, json_kb	the Chrome trace of the kept traces, left in
+ *				/tmp with BENCH_KEEP_JSON=1
+ */
+
+#include "harness.h"
+#include "pktgen.h"
+#include "trace.h"
+
+#include <string.h>
+
+#define RUN_US 500000
+#define WORKERS 2
+#define HOPS 4
+#define JSON "/tmp/cloudvpn_bench_trace.json"
+
+static void hop_process (struct part*pt, struct work*w)
+{
+	struct work*n;
+
+	if (w->type == work_command) cloudvpn_packet_free (w->p);
+	if (w->type != work_packet) return;
+
+	w->p->next_part = pt->data;
+	if (! (n = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (w->p);
+		return;
+	}
+	n->type = work_packet;
+	n->priority = w->priority;
+	n->is_static = 0;
+	n->p = w->p;
+	if (cloudvpn_schedule_work (n) ) {
+		cloudvpn_packet_free (n->p);
+		cl_free (n);
+	}
+}
+
+static struct plugin hop_plugin = {
+	"bench_hop", {0}, hop_process, 0, 0
+};
+
+static struct part*gen, *sink;
+
+static void run (const char*what, uint32_t every)
+{
+	struct pktgen_result r;
+	uint64_t last = 0;
+	char buf[64];
+
+	cl_trace_set_every (every);
+	cl_trace_reset();
+	bench_command (sink, "reset");
+	bench_command (gen, "start");
+	usleep (RUN_US);
+	bench_command (gen, "stop");
+
+	for (;;) {
+		usleep (50000);
+		pktgen_result (sink, &r);
+		if (r.received == last) break;
+		last = r.received;
+	}
+
+	sprintf (buf, "%s_packets", what);
+	bench_report ("trace", buf, WORKERS, r.pps, "packets/s");
+	cl_trace_set_every (0);
+}
+
+static int hop_report (struct cl_trace_stats*s, void*arg)
+{
+	const char*part = strcmp (s->part, "*") ? s->part : "life";
+	char buf[64];
+
+	if (!s->count) return 0;
+	sprintf (buf, "%s_queue_p50", part);
+	bench_report ("trace", buf, WORKERS, s->queue.p50, "ns");
+	sprintf (buf, "%s_queue_p99", part);
+	bench_report ("trace", buf, WORKERS, s->queue.p99, "ns");
+	sprintf (buf, "%s_process_p50", part);
+	bench_report ("trace", buf, WORKERS, s->process.p50, "ns");
+	sprintf (buf, "%s_process_p99", part);
+	bench_report ("trace", buf, WORKERS, s->process.p99, "ns");
+	return 0;
+}
+
+static void json_check()
+{
+	FILE*f;
+	long size;
+	int events = 0, c, i = 0;
+	const char*ph = "\"ph\"";
+
+	if (cl_trace_write_json (JSON) || ! (f = fopen (JSON, "r") ) )
+		bench_fail ("trace", "json");
+
+	while ( (c = fgetc (f) ) != EOF) {
+		i = c == ph[i] ? i + 1 : (c == ph[0]);
+		if (!ph[i]) {
+			++events;
+			i = 0;
+		}
+	}
+	size = ftell (f);
+	fclose (f);
+	if (!getenv ("BENCH_KEEP_JSON") ) unlink (JSON);
+
+	if (!events) bench_fail ("trace", "empty json");
+	bench_report ("trace", "json_events", WORKERS, events, "events");
+	bench_report ("trace", "json_kb", WORKERS, size / 1024.0, "KiB");
+}
+
+int main()
+{
+	struct part*first, *h;
+	char name[16];
+	int i;
+
+	bench_core_start (WORKERS);
+	if (cloudvpn_plugin_init() ) bench_fail ("trace", "plugin init");
+	gen = cloudvpn_part_init (cloudvpn_plugin_get(), "gen");
+	sink = cloudvpn_part_init (cloudvpn_plugin_get(), "sink");
+	if (!gen || !sink || !gen->data || !sink->data)
+		bench_fail ("trace", "no parts");
+
+	for (first = sink, i = 0;i < HOPS;++i) {
+		sprintf (name, "hop%d", i);
+		if (! (h = cloudvpn_part_init (&hop_plugin, name) ) )
+			bench_fail ("trace", "no hop");
+		h->data = first;
+		first = h;
+	}
+	sprintf (name, "next %s", first->name);
+	bench_command (gen, name);
+	bench_command (gen, "size 64");
+	bench_command (gen, "dst 0a000000 256");
+
+	run ("off", 0);
+	run ("every1000", 1000);
+	run ("every1", 1);
+	run ("every100", 100);
+	cl_trace_walk (hop_report, 0);
+	json_check();
+	return 0;
+}
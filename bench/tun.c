@@ -0,0 +1,134 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tun plugin on socketpairs instead of a real interface (that would need
+ * root). This side plays the kernel: it pushes tap frames into the queues
+ * and counts what the plugin writes back, a frame per syscall like tun.
+ * Different queue counts and batch sizes are compared.
+ */
+
+#include "harness.h"
+
+#include <sys/socket.h>
+
+#define WORKERS 3
+#define FRAME (10 + 1514) /* vnet header + full ethernet frame */
+#define FRAMES 200000
+#define WINDOW 2048
+
+static int kfd[WORKERS];
+static uint64_t drained;
+
+static void* kernel_rx (void*a)
+{
+	/* "kernel" receiving: counts frames the plugin wrote to one queue */
+	int fd = * (int*) a;
+	char buf[FRAME];
+
+	while (read (fd, buf, FRAME) > 0) cl_atomic_inc (&drained);
+	return 0;
+}
+
+static void* kernel_tx (void*a)
+{
+	/* "kernel" sending: pushes its share of frames into one queue */
+	int fd = * (int*) a, left;
+	static char frame[FRAME];
+
+	for (left = FRAMES / WORKERS;left > 0;--left)
+		if (write (fd, frame, FRAME) != FRAME)
+			bench_fail ("tun", "can't write to queue");
+	return 0;
+}
+
+static void run (struct plugin*pl, int queues, int batch)
+{
+	struct part*t;
+	pthread_t th[WORKERS];
+	void*args[WORKERS];
+	uint64_t n, base, start, ns;
+	int i, sp[2];
+	char cmd[64], what[64];
+
+	sprintf (what, "tun_%d_%d", queues, batch);
+	t = cloudvpn_part_init (pl, what);
+	if (!t) bench_fail ("tun", "can't create part");
+	bench_command (t, "next sink");
+	bench_command (t, "queue 4096"); /* more than the window, no drops */
+	sprintf (cmd, "batch %d", batch);
+	bench_command (t, cmd);
+
+	for (i = 0;i < queues;++i) {
+		if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sp) )
+			bench_fail ("tun", "no socketpair");
+		kfd[i] = sp[1];
+		sprintf (cmd, "fd %d", sp[0]);
+		bench_command (t, cmd);
+		args[i] = kfd + i;
+		pthread_create (th + i, 0, kernel_rx, kfd + i);
+	}
+	usleep (100000);
+
+	/* interface -> plugin -> sink */
+	n = FRAMES / WORKERS * queues;
+	base = cl_atomic_load (&bench_sink_packets);
+	start = bench_now_ns();
+	bench_run_threads (queues, kernel_tx, args);
+	while (cl_atomic_load (&bench_sink_packets) - base < n) usleep (100);
+	ns = bench_now_ns() - start;
+
+	sprintf (what, "read_q%d_b%d", queues, batch);
+	bench_report ("tun", what, WORKERS, n * 1e9 / ns, "packets/s");
+
+	/* plugin -> interface */
+	base = cl_atomic_load (&drained);
+	start = bench_now_ns();
+	for (n = 0;n < FRAMES;++n) {
+		while (n - (cl_atomic_load (&drained) - base) >= WINDOW)
+			sched_yield();
+		if (bench_send_packet (t, FRAME, 128) )
+			bench_fail ("tun", "can't send");
+	}
+	while (cl_atomic_load (&drained) - base < FRAMES) usleep (100);
+	ns = bench_now_ns() - start;
+
+	sprintf (what, "write_q%d_b%d", queues, batch);
+	bench_report ("tun", what, WORKERS, FRAMES * 1e9 / ns, "packets/s");
+
+	bench_command (t, "close");
+	usleep (100000);
+	for (i = 0;i < queues;++i) {
+		shutdown (kfd[i], SHUT_RDWR);
+		pthread_join (th[i], 0);
+		close (kfd[i]);
+	}
+	/* the part stays, events of the closed queues may still be around */
+}
+
+int main()
+{
+	struct plugin*pl;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("tun", "plugin init");
+	pl = cloudvpn_plugin_get();
+	if (!bench_sink_part ("sink") ) bench_fail ("tun", "no sink");
+
+	run (pl, 1, 1);
+	run (pl, 1, 32);
+	run (pl, WORKERS, 1);
+	run (pl, WORKERS, 32);
+
+	return 0;
+}
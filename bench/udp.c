@@ -0,0 +1,135 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * udp transport over loopback: two udp parts pointed at each other, packets
+ * go in through one and are counted by a sink behind the other. Runs with
+ * GSO/GRO on and off. UDP loses stuff when the receiver can't keep up, so
+ * the loss is reported too.
+ */
+
+#include "harness.h"
+#include "wire.h"
+
+#define WORKERS 3
+#define WINDOW 2048 /* packets in flight */
+#define BYTES_PER_SIZE (256*1024*1024ULL)
+#define MAX_PACKETS 500000
+#define STALL_NS 20000000ULL /* nothing arrived for this long = lost */
+
+static const int sizes[] = {64, 256, 1024, 1400, 8192, 0};
+
+static uint64_t received()
+{
+	return cl_atomic_load (&bench_sink_packets);
+}
+
+static void run (struct part*a, const char*mode)
+{
+	uint64_t n, sent, start, t, base, lost, last, seen;
+	const int*s;
+	char what[64];
+
+	for (s = sizes;*s;++s) {
+		n = BYTES_PER_SIZE / *s;
+		if (n > MAX_PACKETS) n = MAX_PACKETS;
+
+		base = received();
+		lost = 0;
+		seen = base;
+		last = start = bench_now_ns();
+		for (sent = 0;sent < n;++sent) {
+			while (sent - lost - (received() - base) >= WINDOW) {
+				if (received() != seen) {
+					seen = received();
+					last = bench_now_ns();
+				} else if (bench_now_ns() - last > STALL_NS) {
+					/* whatever is missing now is not coming */
+					lost = sent - (received() - base);
+					last = bench_now_ns();
+				}
+				sched_yield();
+			}
+			if (bench_send_packet (a, *s, 128) )
+				bench_fail ("udp", "can't send");
+		}
+
+		for (t = bench_now_ns();
+		        received() - base < n && bench_now_ns() - t < 100000000ULL;)
+			usleep (1000);
+
+		t = bench_now_ns() - start;
+		n = received() - base;
+
+		sprintf (what, "%s_%d", mode, *s);
+		bench_report ("udp", what, WORKERS, n * 1e9 / t, "packets/s");
+		bench_report ("udp", what, WORKERS,
+		              n * (*s + WIRE_HDR_LEN) * 8.0 / t, "Gbit/s");
+		bench_report ("udp", what, WORKERS,
+		              100.0 * (sent - n) / sent, "%lost");
+	}
+}
+
+static void offloads (struct part*a, struct part*b, const char*on)
+{
+	char cmd[16];
+
+	sprintf (cmd, "gso %s", on);
+	bench_command (a, cmd);
+	bench_command (b, cmd);
+	sprintf (cmd, "gro %s", on);
+	bench_command (a, cmd);
+	bench_command (b, cmd);
+	usleep (100000);
+}
+
+int main()
+{
+	struct plugin*pl;
+	struct part*a, *b, *sink;
+	uint64_t n;
+	char cmd[64];
+	int port = 20000 + getpid() % 20000;
+
+	bench_core_start (WORKERS);
+
+	if (cloudvpn_plugin_init() ) bench_fail ("udp", "plugin init");
+	pl = cloudvpn_plugin_get();
+
+	sink = bench_sink_part ("sink");
+	a = cloudvpn_part_init (pl, "a");
+	b = cloudvpn_part_init (pl, "b");
+	if (!sink || !a || !b) bench_fail ("udp", "can't create parts");
+
+	bench_command (a, "mtu 9000");
+	bench_command (b, "mtu 9000");
+	bench_command (b, "next sink");
+	sprintf (cmd, "bind 127.0.0.1 %d", port);
+	bench_command (b, cmd);
+	sprintf (cmd, "peer 127.0.0.1 %d", port);
+	bench_command (a, cmd);
+
+	/* wait until it goes through */
+	for (n = 0;!received();++n) {
+		if (n > 500) bench_fail ("udp", "nothing comes over loopback");
+		bench_send_packet (a, 64, 128);
+		usleep (10000);
+	}
+	usleep (100000);
+
+	offloads (a, b, "on");
+	run (a, "offload");
+	offloads (a, b, "off");
+	run (a, "plain");
+
+	return 0;
+}
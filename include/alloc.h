@@ -16,16 +16,64 @@
 /*
  * Simple wrapper around the memory allocating functions. If you want to
  * replace them, do it here.
+ *
+ * Small objects come from per-thread slabs of a few size classes, bigger
+ * ones from libc. Which one is used for small objects can be switched in
+ * runtime (the blocks remember where they came from, so anything can be
+ * freed anytime).
+ *
+ * Every allocation is charged to the "owner" account that's current in the
+ * allocating thread. Scheduler sets it to the part whose process_work is
+ * running, so memory gets accounted (and limited) per part.
  */
 
 #include <stdlib.h>
 #include <string.h>
 
-#define cl_malloc malloc
-#define cl_calloc calloc
-#define cl_free free
-#define cl_realloc realloc
+void* cl_malloc (size_t);
+void* cl_calloc (size_t, size_t);
+void* cl_realloc (void*, size_t);
+void cl_free (void*);
+
 #define cl_memcpy memcpy
 
+/* "slab" (default) or "libc", returns nonzero if there's no such thing */
+int cl_alloc_select (const char*);
+const char* cl_alloc_selected();
+
+/*
+ * accounting
+ */
+
+struct cl_mem_account {
+	const char*name;
+	size_t held; /* bytes in use, +1 while the account is alive */
+	size_t peak;
+	size_t limit; /* 0 = unlimited */
+};
+
+struct cl_mem_account* cl_mem_account_new (const char*name);
+
+/* account gets freed when its owner releases it and all memory is freed */
+void cl_mem_account_release (struct cl_mem_account*);
+
+size_t cl_mem_used (struct cl_mem_account*);
+
+/* sets owner for allocations from this thread, returns the previous one */
+struct cl_mem_account* cl_alloc_set_owner (struct cl_mem_account*);
+struct cl_mem_account* cl_alloc_owner();
+
+/*
+ * arenas, for stuff that is allocated piece by piece and thrown away all at
+ * once. Arena is charged to whoever was the owner when it was created.
+ */
+
+struct cl_arena;
+
+struct cl_arena* cl_arena_new (size_t chunk_size /* 0 = default */);
+void* cl_arena_alloc (struct cl_arena*, size_t);
+void cl_arena_release (struct cl_arena*); /* frees everything allocated */
+void cl_arena_free (struct cl_arena*); /* same, plus the arena itself */
+
 #endif
 
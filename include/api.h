@@ -23,6 +23,8 @@ extern "C"
 #endif
 
 #include "plugin.h"
+#include "log.h"
+#include "metrics.h"
 
 	int cloudvpn_plugin_init();
 	void cloudvpn_plugin_fini();
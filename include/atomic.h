@@ -0,0 +1,69 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_ATOMIC_H
+#define _CVPN_ATOMIC_H
+
+/*
+ * thin wrappers around compiler atomics, so the memory ordering is always
+ * visible in the name. Plain names are relaxed, _acq loads and _rel stores
+ * do what you expect, everything that modifies is acq_rel unless said
+ * otherwise. If your compiler doesn't have __atomic builtins, fix it here.
+ */
+
+#define cl_atomic_load(p) __atomic_load_n ( (p), __ATOMIC_RELAXED)
+#define cl_atomic_load_acq(p) __atomic_load_n ( (p), __ATOMIC_ACQUIRE)
+#define cl_atomic_store(p, v) __atomic_store_n ( (p), (v), __ATOMIC_RELAXED)
+#define cl_atomic_store_rel(p, v) __atomic_store_n ( (p), (v), __ATOMIC_RELEASE)
+
+/* these return the new value */
+#define cl_atomic_add(p, v) __atomic_add_fetch ( (p), (v), __ATOMIC_ACQ_REL)
+#define cl_atomic_sub(p, v) __atomic_sub_fetch ( (p), (v), __ATOMIC_ACQ_REL)
+#define cl_atomic_inc(p) cl_atomic_add ( (p), 1)
+#define cl_atomic_dec(p) cl_atomic_sub ( (p), 1)
+
+/* counters that nobody synchronizes on */
+#define cl_atomic_add_relaxed(p, v) \
+	__atomic_add_fetch ( (p), (v), __ATOMIC_RELAXED)
+
+/* returns the old value */
+#define cl_atomic_xchg(p, v) __atomic_exchange_n ( (p), (v), __ATOMIC_ACQ_REL)
+
+/* returns nonzero on success; *expected gets the current value on failure */
+#define cl_atomic_cas(p, expected, v) \
+	__atomic_compare_exchange_n ( (p), (expected), (v), 0, \
+	                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define cl_atomic_cas_weak(p, expected, v) \
+	__atomic_compare_exchange_n ( (p), (expected), (v), 1, \
+	                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#define cl_fence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#define cl_fence_acq() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define cl_fence_rel() __atomic_thread_fence (__ATOMIC_RELEASE)
+#define cl_compiler_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+#if defined(__i386__) || defined(__x86_64__)
+#	define cl_cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#	define cl_cpu_relax() cl_compiler_barrier()
+#endif
+
+/*
+ * keep the stuff written by different threads on different cache lines,
+ * otherwise they keep stealing it from each other.
+ */
+
+#define CL_CACHELINE 64
+#define cl_cacheline_aligned __attribute__ ( (aligned (CL_CACHELINE) ) )
+
+#endif
+
@@ -10,14 +10,45 @@
  * if not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _CVPN_BOOT_H
+#define _CVPN_BOOT_H
+
 /*
  * to boot, we read the config and then startup everything.
  *
  * If anyone wants to reconfigure stuff later, he also wants to load proper
  * plugin to do so.
+ *
+ * The config (the only argument) has a statement on every line, # starts
+ * a comment:
+ *
+ *	workers <n>		worker threads (the CPU count by default,
+ *				at least 2)
+ *	plugin <name> <file>	plugin to load
+ *	part <name> <plugin> [lazy] [control]
+ *	command <part> <text>	configuration command, parts get them in
+ *				the order they're written
+ *
+ * Boot goes in phases: all plugins are loaded at once on the workers, then
+ * all the parts are made at once, each one with its commands. Parts that
+ * refer to other parts by name just get them made first (whoever looks
+ * for a part that isn't there yet makes it). Lazy parts are made only when
+ * someone looks for them like that. Control parts are made in the
+ * background after cloudvpn_boot returns, at a priority below anything
+ * else, so forwarding doesn't wait for them. Every phase says on stderr
+ * how long it took.
  */
 
+#include <stdint.h>
+
+struct cloudvpn_boot_times {
+	uint64_t parse_us, plugins_us, parts_us, control_us; /* 0 until done */
+	int workers, plugins, parts, lazy_left, failed;
+};
+
 int cloudvpn_boot (int argc, char**argv);
 int cloudvpn_run ();
 
+struct cloudvpn_boot_times* cloudvpn_boot_times();
 
+#endif
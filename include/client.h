@@ -0,0 +1,187 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_CLIENT_H
+#define _CVPN_CLIENT_H
+
+/*
+ * clients of the parts that serve a socket from event works (the init and
+ * metrics plugins).
+ *
+ * The part keeps a fixed array of clients, each starting with a struct
+ * cl_client, and finds them back by the tags of the events: the slot in
+ * the array, the kind of the event and the generation of the slot, so
+ * works of events of a closed client, that were already out, can be told
+ * apart and ignored. Replies go out through the buffer of the client,
+ * which the part fills again as the client reads it.
+ *
+ * None of it locks, the part calls it with its own lock held.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "api.h"
+
+#define CL_CLIENT_OUT 16384
+/* buffers a work may write before it lets others run */
+#define CL_CLIENT_FILLS 8
+
+enum { cl_ev_accept, cl_ev_rx, cl_ev_tx, cl_ev_tick };
+
+#define cl_ev_tag(gen, slot, kind) \
+	( (void*) (uintptr_t) ( ( (gen) << 8) | ( (slot) << 2) | (kind) ) )
+#define cl_ev_tag_kind(tag) ( (uintptr_t) (tag) & 3)
+#define cl_ev_tag_slot(tag) ( ( (uintptr_t) (tag) >> 2) & 63)
+#define cl_ev_tag_gen(tag) ( (uintptr_t) (tag) >> 8)
+
+struct cl_client {
+	int fd;
+	uintptr_t gen;
+	struct event*rx, *tx, *tick;
+	int armed; /* 1 << kind of the events that are registered */
+
+	char out[CL_CLIENT_OUT];
+	int outlen, outoff;
+	uint64_t sent; /* bytes since it was opened */
+};
+
+static inline int cl_set_nonblock (int fd)
+{
+	int f = fcntl (fd, F_GETFL);
+	if (f < 0) return 1;
+	return fcntl (fd, F_SETFL, f | O_NONBLOCK) < 0;
+}
+
+static inline struct event* cl_client_event (struct part*owner,
+        uint8_t priority, int type, int fd, uintptr_t gen, int slot, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = priority;
+	e->is_static = 1;
+	e->data.type = type;
+	e->data.fd = fd;
+	e->data.owner = owner;
+	e->data.priv = cl_ev_tag (gen, slot, kind);
+	return e;
+}
+
+static inline int cl_client_arm (struct cl_client*c, struct event*e, int kind)
+{
+	/* registering one that already is would break the loop */
+	if (c->armed & (1 << kind) ) return 0;
+	if (cloudvpn_register_event (e) ) return 1;
+	c->armed |= 1 << kind;
+	return 0;
+}
+
+static inline void cl_client_close (struct cl_client*c)
+{
+	if (c->fd < 0) return;
+	close (c->fd);
+	c->fd = -1;
+
+	/* works of these that are already out get ignored by the gen */
+	if (c->rx) cloudvpn_dispose_event (c->rx);
+	if (c->tx) cloudvpn_dispose_event (c->tx);
+	if (c->tick) cloudvpn_dispose_event (c->tick);
+	c->rx = c->tx = c->tick = 0;
+	c->armed = 0;
+	++c->gen;
+}
+
+/* the tick event is made only if asked for, nonzero if it's closed again */
+static inline int cl_client_open (struct cl_client*c, struct part*owner,
+                                  uint8_t priority, int fd, int slot, int tick)
+{
+	c->fd = fd;
+	c->outlen = c->outoff = 0;
+	c->sent = 0;
+	c->rx = cl_client_event (owner, priority, event_fd_readable, fd,
+	                         c->gen, slot, cl_ev_rx);
+	c->tx = cl_client_event (owner, priority, event_fd_writeable, fd,
+	                         c->gen, slot, cl_ev_tx);
+	c->tick = tick ? cl_client_event (owner, priority, event_time, 0,
+	                                  c->gen, slot, cl_ev_tick) : 0;
+	if (!c->rx || !c->tx || (tick && !c->tick) ||
+	        cl_client_arm (c, c->rx, cl_ev_rx) ) {
+		cl_client_close (c);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * sends the buffer, and what more (c, arg) puts into it after that, until
+ * more returns nonzero. Returns 0 then; nonzero if the client was closed
+ * or it waits for tx, because the client reads slowly or it has already
+ * written CL_CLIENT_FILLS buffers in this work.
+ */
+static inline int cl_client_pump (struct cl_client*c,
+                                  int (*more) (struct cl_client*, void*),
+                                  void*arg)
+{
+	int fills = 0;
+	ssize_t n;
+
+	while (c->fd >= 0) {
+		while (c->outoff < c->outlen) {
+			n = send (c->fd, c->out + c->outoff, c->outlen - c->outoff,
+			          MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && errno == EAGAIN) {
+				if (cl_client_arm (c, c->tx, cl_ev_tx) ) cl_client_close (c);
+				return 1;
+			}
+			if (n <= 0) {
+				cl_client_close (c);
+				return 1;
+			}
+			c->outoff += n;
+			c->sent += n;
+		}
+		c->outoff = c->outlen = 0;
+
+		if (++fills > CL_CLIENT_FILLS) {
+			/* there may be more, but forwarding goes first */
+			if (cl_client_arm (c, c->tx, cl_ev_tx) ) cl_client_close (c);
+			return 1;
+		}
+		if (more (c, arg) ) return c->fd < 0;
+	}
+	return 1;
+}
+
+/* a nonblocking fd of a new client or -1, and the listener waits again */
+static inline int cl_client_accept (int*lfd, struct event*e)
+{
+	int fd = accept (*lfd, 0, 0);
+
+	if (fd >= 0 && cl_set_nonblock (fd) ) {
+		close (fd);
+		fd = -1;
+	}
+	if (cloudvpn_register_event (e) ) {
+		close (*lfd);
+		*lfd = -1;
+	}
+	return fd;
+}
+
+#endif
+
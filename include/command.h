@@ -0,0 +1,69 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_COMMAND_H
+#define _CVPN_COMMAND_H
+
+/*
+ * configuration commands travel as work_command, the text of the command is
+ * in the payload of the packet (from doff to len). This splits it into
+ * whitespace-separated words.
+ */
+
+#include "packet.h"
+
+#define COMMAND_MAXARGS 16
+#define COMMAND_MAXLEN 512
+
+struct command {
+	int argc;
+	char*argv[COMMAND_MAXARGS];
+	char buf[COMMAND_MAXLEN];
+};
+
+/* returns the number of words, 0 for empty or too long commands */
+static inline int cloudvpn_command_parse (struct packet*p, struct command*c)
+{
+	int len = p->len - p->doff, i;
+	char*s;
+
+	c->argc = 0;
+	if (!p->data || len <= 0 || len >= COMMAND_MAXLEN) return 0;
+
+	for (i = 0;i < len;++i) c->buf[i] = p->data[p->doff + i];
+	c->buf[len] = 0;
+
+	for (s = c->buf;*s && c->argc < COMMAND_MAXARGS;) {
+		while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+			*s++ = 0;
+		if (!*s) break;
+		c->argv[c->argc++] = s;
+		while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r')
+			++s;
+	}
+
+	return c->argc;
+}
+
+/* is this command named like that? */
+static inline int cloudvpn_command_is (struct command*c, const char*name,
+                                       int min_args)
+{
+	const char*a;
+
+	if (c->argc < 1 || c->argc - 1 < min_args) return 0;
+	for (a = c->argv[0];*a && *a == *name;++a, ++name);
+	return !*a && !*name;
+}
+
+#endif
+
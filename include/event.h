@@ -52,6 +52,13 @@ int cloudvpn_register_event (struct event*);
 int cloudvpn_unregister_event (struct event*);
 int cloudvpn_event_send_async (struct event*);
 
+/*
+ * unregisters the event and frees it once the event core doesn't need it.
+ * Use this to get rid of static events, work that the event has already
+ * created may still arrive.
+ */
+int cloudvpn_dispose_event (struct event*);
+
 void cloudvpn_wait_for_event();
 
 int cloudvpn_event_init();
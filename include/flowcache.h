@@ -0,0 +1,91 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_FLOWCACHE_H
+#define _CVPN_FLOWCACHE_H
+
+/*
+ * exact-match cache of (destination address, incoming part) -> whatever
+ * the slow lookup resolved it to, that sits in front of a route table.
+ *
+ * Every worker has its own 2-way set-associative table, so nothing is
+ * locked or even atomic on the fast path; one entry is one cache line.
+ * The whole cache is invalidated at once by bumping the generation, which
+ * the route table owner does on every change. Entries of older generations
+ * just don't match anymore.
+ *
+ *	v = cl_flow_cache_get (c, worker, addr, len, in, &gen);
+ *	if (!v) {
+ *		v = ...slow lookup...;
+ *		if (v) cl_flow_cache_put (c, worker, addr, len, in, v, gen);
+ *	}
+ *
+ * gen is taken before the slow lookup, so if the table changes meanwhile,
+ * the stored entry is already stale. worker is cloudvpn_worker_id();
+ * threads that aren't workers (negative) and addresses longer than
+ * CL_FLOW_KEY just aren't cached.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "atomic.h"
+
+#define CL_FLOW_KEY 38
+#define CL_FLOW_WORKERS 64
+
+struct cl_flow_entry {
+	uint32_t gen;
+	uint32_t hash;
+	const void*in;
+	void*value;
+	uint16_t len;
+	uint8_t key[CL_FLOW_KEY];
+}; /* 64 bytes */
+
+struct cl_flow_worker {
+	uint64_t hits, misses, evictions;
+	struct cl_flow_entry*e; /* cacheline-aligned, after the header */
+};
+
+struct cl_flow_cache {
+	uint32_t gen;
+	unsigned size; /* entries per worker, power of 2 */
+	struct cl_flow_worker*w[CL_FLOW_WORKERS]; /* allocated on first use */
+};
+
+struct cl_flow_stats {
+	uint64_t hits, misses, evictions;
+};
+
+int cl_flow_cache_init (struct cl_flow_cache*, unsigned size);
+void cl_flow_cache_destroy (struct cl_flow_cache*);
+
+/* drops all the entries */
+static inline void cl_flow_cache_invalidate (struct cl_flow_cache*c)
+{
+	cl_atomic_inc (&c->gen);
+}
+
+/* cached value or 0; *gen is what to put the missed one with */
+void* cl_flow_cache_get (struct cl_flow_cache*, int worker,
+                         const uint8_t*addr, size_t len, const void*in,
+                         uint32_t*gen);
+
+void cl_flow_cache_put (struct cl_flow_cache*, int worker,
+                        const uint8_t*addr, size_t len, const void*in,
+                        void*value, uint32_t gen);
+
+/* sums of all the workers, slightly racy */
+void cl_flow_cache_stats (struct cl_flow_cache*, struct cl_flow_stats*);
+
+#endif
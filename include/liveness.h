@@ -0,0 +1,94 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_LIVENESS_H
+#define _CVPN_LIVENESS_H
+
+/*
+ * BFD-style liveness of many peers. Every peer gets a probe every interval
+ * (minus up to 1/4 of jitter, so thousands of them don't go out at once),
+ * and is declared down when nothing was heard from it for mult intervals.
+ * Intervals adapt: a peer that says it probes slower than we do is only
+ * expected (and probed) that slowly, and down peers are probed only once
+ * a second, until they're heard from again.
+ *
+ * All peers are in one timer wheel, so the owner needs just one event_time
+ * timer, however many peers there are:
+ *
+ *	cl_live_init (l, interval_us, mult, probe, down, arg);
+ *	id = cl_live_add (l, ctx, now);
+ *	...got anything from the peer:
+ *		cl_live_heard (l, id, interval it advertised or 0, now);
+ *	...on the timer:
+ *		delay = cl_live_run (l, now);	(probe() and down() get called)
+ *		if (delay) arm the timer for delay
+ *
+ * Hearing from a peer is just a store, the wheel is only touched by the
+ * timer. Nothing is locked inside, that's the owner's job; the callbacks
+ * run inside cl_live_run and must not add or remove peers.
+ */
+
+#include <stdint.h>
+
+#define CL_LIVE_SLOTS 512
+#define CL_LIVE_SLOW_US 1000000 /* probing of peers that are down */
+
+struct cl_live_peer {
+	uint32_t next, prev; /* in a wheel slot, or in the free list */
+	uint32_t peer_us; /* what the peer probes at, 0 if we don't know */
+	uint64_t tx_at, dead_at; /* next probe; when it's down if not heard */
+	uint64_t at; /* when it's due in the wheel, the earlier one of these */
+	void*ctx;
+	uint8_t used, up;
+};
+
+struct cl_live {
+	struct cl_live_peer*p;
+	uint32_t n, cap, free;
+	uint32_t slot[CL_LIVE_SLOTS]; /* list heads */
+	uint64_t tick_us, done; /* ticks up to this one were run */
+
+	uint32_t interval_us;
+	unsigned mult;
+	uint64_t rnd;
+
+	void (*probe) (void*arg, void*ctx);
+	void (*down) (void*arg, void*ctx);
+	void*arg;
+
+	uint64_t probes, downs, ups;
+};
+
+int cl_live_init (struct cl_live*, uint32_t interval_us, unsigned mult,
+                  void (*probe) (void*, void*), void (*down) (void*, void*),
+                  void*arg);
+void cl_live_destroy (struct cl_live*);
+
+/* changes the interval for all the peers */
+void cl_live_set (struct cl_live*, uint32_t interval_us, unsigned mult);
+
+/* peers start as down and get probed on the next run; id or -1 */
+int cl_live_add (struct cl_live*, void*ctx, uint64_t now);
+void cl_live_remove (struct cl_live*, int id);
+
+/* returns 1 if the peer just came up */
+int cl_live_heard (struct cl_live*, int id, uint32_t peer_us, uint64_t now);
+
+/* microseconds until the next run is needed, 0 if there are no peers */
+uint64_t cl_live_run (struct cl_live*, uint64_t now);
+
+static inline int cl_live_is_up (struct cl_live*l, int id)
+{
+	return l->p[id].up;
+}
+
+#endif
@@ -0,0 +1,116 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_LOG_H
+#define _CVPN_LOG_H
+
+/*
+ * logging that is cheap enough for the packet path.
+ *
+ *	cl_log (part, CL_LOG_DEBUG, "got %u bytes from %d", len, fd);
+ *
+ * doesn't format anything: it puts the time, the part name, the call site
+ * and the arguments into a ring of the calling thread, and that's it. The
+ * log plugin takes the records from all the rings in the background,
+ * formats them and writes them out in batches.
+ *
+ * Arguments are stored as 64-bit integers, so the format may only have
+ * integer conversions (%d %u %x %lu %llx %c and such), %p, and %s of
+ * strings that live forever (cast them to uintptr_t). At most
+ * CL_LOG_ARGS of them.
+ *
+ * Every call site may log at most cl_log_rate records a second from each
+ * thread (cl_log_rl sets its own limit, 0 is unlimited); the rest, and
+ * whatever doesn't fit into the ring, is counted as dropped at the site.
+ * Until some log part is running, nothing is logged at all, and levels
+ * above cl_log_level cost just the comparison.
+ */
+
+#include <stdint.h>
+
+enum {
+	CL_LOG_ERROR,
+	CL_LOG_WARN,
+	CL_LOG_INFO,
+	CL_LOG_DEBUG
+};
+
+#define CL_LOG_ARGS 6
+#define CL_LOG_NAME 16 /* of the part, gets cut */
+#define CL_LOG_RING 2048 /* records per thread */
+
+struct cl_log_site {
+	const char*fmt;
+	int level;
+	uint32_t rate; /* a second, 0 is unlimited, ~0 is cl_log_rate */
+
+	/* the thread that logs first registers it */
+	struct cl_log_site*next;
+	int registered;
+
+	/* threads keep their own, these are for the ones that can't */
+	uint64_t window, in_window; /* the current second and what it used */
+	uint64_t logged, dropped; /* see cl_log_counts */
+};
+
+struct cl_log_rec {
+	uint64_t time_ns; /* CLOCK_REALTIME */
+	struct cl_log_site*site;
+	char part[CL_LOG_NAME];
+	uint32_t nargs;
+	uint64_t arg[CL_LOG_ARGS];
+};
+
+extern int cl_log_level; /* -1 while nobody drains */
+extern uint32_t cl_log_rate;
+
+struct part;
+
+void cl_log_write (struct cl_log_site*, struct part*,
+                   const uint64_t*args, int nargs);
+
+#define cl_log_rl(part, lvl, per_sec, fmt, ...) do { \
+		static struct cl_log_site cl_log_site_ = {fmt, lvl, per_sec}; \
+		if ( (lvl) <= cl_log_level) { \
+			const uint64_t cl_log_args_[] = {0, ##__VA_ARGS__}; \
+			cl_log_write (&cl_log_site_, (part), cl_log_args_ + 1, \
+			              sizeof (cl_log_args_) / sizeof (uint64_t) - 1); \
+		} \
+	} while (0)
+
+#define cl_log(part, lvl, fmt, ...) \
+	cl_log_rl (part, lvl, ~0U, fmt, ##__VA_ARGS__)
+
+/*
+ * for the drain. Only one may be attached at a time, attaching returns
+ * nonzero if there already is one. cl_log_drain calls fn for the records
+ * in every thread's ring (oldest first in each), and returns how many
+ * there were; only the attached one may call it.
+ */
+
+int cl_log_attach (int level);
+void cl_log_detach();
+int cl_log_drain (void (*fn) (struct cl_log_rec*, void*), void*arg);
+
+/* formats the record as one line, returns its length like snprintf */
+int cl_log_format (struct cl_log_rec*, char*buf, int size);
+
+/* all the sites that have logged anything, newest first */
+struct cl_log_site* cl_log_sites();
+
+/* what the site logged and dropped so far, from all the threads */
+void cl_log_counts (struct cl_log_site*, uint64_t*logged, uint64_t*dropped);
+
+/* records that were dropped everywhere so far */
+uint64_t cl_log_dropped();
+
+#endif
@@ -0,0 +1,101 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_LPM_H
+#define _CVPN_LPM_H
+
+/*
+ * longest prefix match table for addresses of any length. Prefixes are
+ * bit strings (bit 0 is the top bit of the first byte), each one carries
+ * a value pointer.
+ *
+ * It's a path-compressed binary trie; every node keeps its whole prefix
+ * inline, right after the header, so one node is usually one cache line
+ * and a lookup only compares the bits that the node skips. Big tables can
+ * have a direct table indexed by the first 8, 16 or 24 bits of the address
+ * that jumps over the dense top of the trie (costs a pointer per entry); it
+ * can be changed while the table is in use.
+ *
+ * Lookups don't lock. They must be done between cl_lpm_enter() and
+ * cl_lpm_leave(), and the values found are safe to use until leaving:
+ *
+ *	t = cl_lpm_enter (lpm);
+ *	v = cl_lpm_lookup (lpm, addr, len);
+ *	...use v...
+ *	cl_lpm_leave (lpm, t);
+ *
+ * Updates are serialized by a mutex inside. Removing a prefix waits until
+ * all readers that could have seen it leave, so when cl_lpm_remove returns,
+ * the removed value isn't referenced by the table or by any reader. When
+ * many prefixes go at once, cl_lpm_unlink them and wait only once:
+ *
+ *	cl_lpm_unlink (lpm, a, abits);
+ *	cl_lpm_unlink (lpm, b, bbits);
+ *	cl_lpm_synchronize (lpm);
+ *	...free the values of a and b...
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mutex.h"
+
+#define CL_LPM_SLOTS 64 /* reader counters, threads share them mod this */
+
+struct cl_lpm_node;
+struct cl_lpm_direct;
+
+struct cl_lpm {
+	struct cl_lpm_node*root; /* empty prefix, always there */
+	struct cl_lpm_direct*direct; /* 0 or the anchors */
+	cl_mutex lock;
+	int epoch;
+	size_t count; /* prefixes */
+	size_t nodes;
+	struct cl_lpm_node**dead; /* unlinked, to free after the readers */
+	size_t ndead, dead_size;
+
+	struct {
+		int n[2];
+	} cl_cacheline_aligned readers[CL_LPM_SLOTS];
+};
+
+/* direct_bits is 0, 8, 16 or 24 */
+int cl_lpm_init (struct cl_lpm*, unsigned direct_bits);
+void cl_lpm_destroy (struct cl_lpm*);
+
+/* builds a new direct table (0 for none) and swaps it in */
+int cl_lpm_set_direct (struct cl_lpm*, unsigned direct_bits);
+
+/* sets the value of the prefix (value must not be 0) */
+int cl_lpm_insert (struct cl_lpm*, const uint8_t*prefix, unsigned bits,
+                   void*value);
+
+/* returns nonzero if there's no such prefix */
+int cl_lpm_remove (struct cl_lpm*, const uint8_t*prefix, unsigned bits);
+
+/* same, but readers may still see the value until cl_lpm_synchronize */
+int cl_lpm_unlink (struct cl_lpm*, const uint8_t*prefix, unsigned bits);
+
+unsigned cl_lpm_enter (struct cl_lpm*);
+void cl_lpm_leave (struct cl_lpm*, unsigned token);
+
+/*
+ * waits until all the readers that are inside now leave; values that were
+ * unpublished elsewhere or unlinked before this call can be freed after it
+ */
+void cl_lpm_synchronize (struct cl_lpm*);
+
+/* value of the longest prefix of the len-byte address, or 0 */
+void* cl_lpm_lookup (struct cl_lpm*, const uint8_t*addr, size_t len);
+
+#endif
@@ -0,0 +1,156 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_METRICS_H
+#define _CVPN_METRICS_H
+
+/*
+ * named metrics that parts keep about themselves, for whoever watches.
+ *
+ *	d->rx = cl_metric_counter (p, "cloudvpn_udp_rx_packets_total",
+ *	                           "packets received");
+ *	...
+ *	cl_metric_inc (d->rx);
+ *	...
+ *	cl_metric_free (d->rx); // in fini
+ *
+ * Every metric is labelled with the part that registered it (part="name",
+ * none for 0). Values are kept in a copy per worker thread, each on its
+ * own cache lines, so updating one is an uncontended add; reading sums
+ * the copies. Threads that aren't workers share one copy.
+ *
+ * Counters only go up. Gauges go up and down with cl_metric_add, or are
+ * cl_metric_set by one thread that doesn't add (the two are summed). A
+ * counter can also be read from a function, for counts that something else
+ * keeps anyway.
+ * Histograms count observed values into up to CL_METRIC_BUCKETS buckets
+ * by their upper bounds, plus one for what's above them.
+ *
+ * The text is the Prometheus exposition format (version 0.0.4); the
+ * metrics plugin serves it over HTTP or writes it to a file.
+ */
+
+#include <stdint.h>
+
+#include "sched.h"
+#include "atomic.h"
+
+struct part;
+
+enum {
+	CL_METRIC_COUNTER,
+	CL_METRIC_GAUGE,
+	CL_METRIC_HISTOGRAM
+};
+
+#define CL_METRIC_SLOTS 16 /* copies; worker n uses 1 + n % 15 */
+#define CL_METRIC_BUCKETS 16
+#define CL_METRIC_NAME 64 /* longest name */
+#define CL_METRIC_LABEL 64 /* of the part name, gets cut; escaped, twice that */
+#define CL_METRIC_TEXT 8192 /* most text a metric makes */
+
+struct cl_metric_slot {
+	int64_t value; /* counters and gauges */
+	uint64_t sum; /* histograms */
+	uint64_t bucket[CL_METRIC_BUCKETS + 1];
+};
+
+struct cl_metric {
+	int type;
+	char*name, *help, *label; /* label is the escaped part name or 0 */
+	int64_t set; /* gauges */
+	uint64_t (*read) (void*); /* added to the value, with arg */
+	void*arg;
+
+	int nbounds;
+	uint64_t bound[CL_METRIC_BUCKETS];
+
+	char*slots; /* CL_METRIC_SLOTS of them, stride bytes apart */
+	int stride;
+	void*mem;
+
+	struct cl_metric*next;
+};
+
+/* 0 if the name isn't a Prometheus one, it's there already, or if
+ * there's no memory. Bounds go up. */
+struct cl_metric* cl_metric_counter (struct part*, const char*name,
+                                     const char*help);
+struct cl_metric* cl_metric_gauge (struct part*, const char*name,
+                                   const char*help);
+/* read (arg) is called whenever the metric is read, so the metric must be
+ * freed before what it looks at */
+struct cl_metric* cl_metric_counter_fn (struct part*, const char*name,
+                                        const char*help,
+                                        uint64_t (*read) (void*), void*arg);
+struct cl_metric* cl_metric_histogram (struct part*, const char*name,
+                                       const char*help,
+                                       const uint64_t*bounds, int nbounds);
+void cl_metric_free (struct cl_metric*);
+
+static inline struct cl_metric_slot* cl_metric_slot (struct cl_metric*m) {
+
+	int w = cloudvpn_worker_id();
+
+	w = w < 0 ? 0 : 1 + w % (CL_METRIC_SLOTS - 1);
+	return (struct cl_metric_slot*) (m->slots + w * m->stride);
+}
+
+static inline void cl_metric_add (struct cl_metric*m, int64_t v)
+{
+	cl_atomic_add_relaxed (&cl_metric_slot (m)->value, v);
+}
+
+#define cl_metric_inc(m) cl_metric_add ( (m), 1)
+#define cl_metric_dec(m) cl_metric_add ( (m), -1)
+
+static inline void cl_metric_set (struct cl_metric*m, int64_t v)
+{
+	cl_atomic_store (&m->set, v);
+}
+
+static inline void cl_metric_observe (struct cl_metric*m, uint64_t v)
+{
+	struct cl_metric_slot*s = cl_metric_slot (m);
+	int b = 0;
+
+	while (b < m->nbounds && v > m->bound[b]) ++b;
+	cl_atomic_add_relaxed (&s->bucket[b], 1);
+	cl_atomic_add_relaxed (&s->sum, v);
+}
+
+/* the copies summed; for histograms, value is the count */
+void cl_metric_read (struct cl_metric*, struct cl_metric_slot*);
+
+/*
+ * exposition
+ */
+
+/* calls the callback for every metric, sorted by name and then by label
+ * (the unlabelled first); family is set for the first one of a name. Stops
+ * if it returns nonzero. Metrics can't be registered or freed from the
+ * callback. */
+int cl_metric_walk (int (*) (struct cl_metric*, int family, void*), void*);
+
+/* less than, equal to or more than 0 as the metric comes before, is, or
+ * comes after the one with the name and (escaped) label in the walk */
+int cl_metric_cmp (struct cl_metric*, const char*name, const char*label);
+
+/* text of the metric (with HELP and TYPE if family), the length, or -1 if
+ * it doesn't fit into size */
+int cl_metric_format (struct cl_metric*, int family, char*buf, int size);
+
+/* all of them into the file, replaced at once (for textfile collectors),
+ * 0 on success */
+int cl_metric_write (const char*path);
+
+#endif
@@ -0,0 +1,86 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_MPSC_H
+#define _CVPN_MPSC_H
+
+/*
+ * unbounded intrusive queue with many producers and one consumer. Put
+ * struct cl_mpsc_node into whatever you want to queue. Push is wait-free
+ * (one atomic exchange), so it's fine for hot paths.
+ *
+ * Pop may return 0 even if the queue isn't empty, when some producer is
+ * just in the middle of a push. The item will be there on the next try, so
+ * whoever consumes should be woken up again by the producer anyway.
+ */
+
+#include "atomic.h"
+
+struct cl_mpsc_node {
+	struct cl_mpsc_node*next;
+};
+
+struct cl_mpsc {
+	struct cl_mpsc_node*head cl_cacheline_aligned; /* producers */
+	struct cl_mpsc_node*tail cl_cacheline_aligned; /* consumer */
+	struct cl_mpsc_node stub;
+};
+
+static inline void cl_mpsc_init (struct cl_mpsc*q)
+{
+	q->stub.next = 0;
+	q->head = q->tail = &q->stub;
+}
+
+static inline void cl_mpsc_push (struct cl_mpsc*q, struct cl_mpsc_node*n)
+{
+	struct cl_mpsc_node*prev;
+
+	cl_atomic_store (&n->next, (struct cl_mpsc_node*) 0);
+	prev = cl_atomic_xchg (&q->head, n);
+	cl_atomic_store_rel (&prev->next, n);
+}
+
+static inline struct cl_mpsc_node* cl_mpsc_pop (struct cl_mpsc*q) {
+
+	struct cl_mpsc_node*tail, *next, *head;
+
+	tail = q->tail;
+	next = cl_atomic_load_acq (&tail->next);
+
+	if (tail == &q->stub) {
+		if (!next) return 0;
+		q->tail = tail = next;
+		next = cl_atomic_load_acq (&next->next);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	head = cl_atomic_load_acq (&q->head);
+	if (tail != head) return 0; /* push in progress */
+
+	/* tail is the last one, put the stub behind it so we can take it */
+	cl_mpsc_push (q, &q->stub);
+
+	next = cl_atomic_load_acq (&tail->next);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return 0;
+}
+
+#endif
+
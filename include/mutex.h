@@ -16,30 +16,138 @@
 /*
  * wrapper around mutual exclusion stuff. If you want to supply any other (more
  * native) implementations, please feed them to mutex.c or so.
+ *
+ * All the types are small and meant to be embedded by value into whatever
+ * they protect, so there's no extra pointer to chase on every lock. Mutex
+ * is a futex word (0 = free, 1 = locked, 2 = locked with waiters) that spins
+ * shortly before going to sleep in the kernel.
+ */
+
+#include <stdint.h>
+
+#include "atomic.h"
+
+/*
+ * lock statistics. They are collected only for named mutexes, and only if
+ * cl_mutex_stats_enable() was called before the mutex got initialized. All
+ * the counters are written by the current lock holder, so they need no
+ * additional synchronization; readers may see slightly stale values.
  */
 
-typedef void* cl_mutex;
-typedef void* cl_cond;
-typedef void* cl_sem;
+struct cl_mutex_stats {
+	const char*name;
+	uint64_t acquired; /* total lock acquisitions */
+	uint64_t contended; /* acquisitions that had to wait */
+	uint64_t wait_ns; /* total time spent waiting for the lock */
+	uint64_t max_hold_ns; /* longest time the lock was held */
+	uint64_t failed; /* trylocks that found it held (atomic, not the holder) */
+
+	struct cl_mutex_stats*next;
+};
+
+typedef struct {
+	int state;
+	struct cl_mutex_stats*stats;
+	uint64_t locked_at; /* only used with stats */
+} cl_mutex;
+
+typedef struct {
+	int seq;
+	int waiters;
+} cl_cond;
+
+typedef struct {
+	int value;
+} cl_sem;
+
+int cl_mutex_init (cl_mutex*, const char*name /* may be 0 */);
+int cl_mutex_destroy (cl_mutex*);
+int cl_mutex_lock_slow (cl_mutex*);
+int cl_mutex_unlock_slow (cl_mutex*);
+void cl_mutex_wake (cl_mutex*);
+void cl_mutex_locked (cl_mutex*); /* counts an acquisition, for stats */
+
+static inline int cl_mutex_trylock (cl_mutex*m)
+{
+	int s = 0;
+	if (!cl_atomic_cas (&m->state, &s, 1) ) {
+		/* some locks are only ever tried, this is their contention */
+		if (m->stats) cl_atomic_add_relaxed (&m->stats->failed, 1);
+		return 1;
+	}
+	if (m->stats) cl_mutex_locked (m);
+	return 0;
+}
 
-int cl_mutex_init (cl_mutex*);
-int cl_mutex_destroy (cl_mutex);
-int cl_mutex_lock (cl_mutex);
-int cl_mutex_trylock (cl_mutex);
-int cl_mutex_unlock (cl_mutex);
+static inline int cl_mutex_lock (cl_mutex*m)
+{
+	int s = 0;
+	if (!m->stats && cl_atomic_cas (&m->state, &s, 1) ) return 0;
+	return cl_mutex_lock_slow (m);
+}
+
+static inline int cl_mutex_unlock (cl_mutex*m)
+{
+	if (m->stats) return cl_mutex_unlock_slow (m);
+	if (cl_atomic_xchg (&m->state, 0) == 2)
+		cl_mutex_wake (m); /* someone's sleeping */
+	return 0;
+}
 
 int cl_cond_init (cl_cond*);
-int cl_cond_destroy (cl_cond);
-int cl_cond_wait (cl_cond, cl_mutex);
-int cl_cond_signal (cl_cond);
-int cl_cond_broadcast (cl_cond);
+int cl_cond_destroy (cl_cond*);
+int cl_cond_wait (cl_cond*, cl_mutex*);
+int cl_cond_signal (cl_cond*);
+int cl_cond_broadcast (cl_cond*);
+
+/*
+ * semaphores are only used as reference counters, so they're just atomic
+ * integers. cl_sem_get doesn't block, it fails (returns nonzero) if the
+ * value is already zero.
+ */
 
 int cl_sem_init (cl_sem*, unsigned int value);
-int cl_sem_destroy (cl_sem);
-int cl_sem_post (cl_sem);
-int cl_sem_get (cl_sem);
-int cl_sem_value (cl_sem);
+int cl_sem_destroy (cl_sem*);
+
+static inline int cl_sem_post (cl_sem*s)
+{
+	cl_atomic_inc (&s->value);
+	return 0;
+}
+
+static inline int cl_sem_get (cl_sem*s)
+{
+	int v = cl_atomic_load (&s->value);
+	do {
+		if (v <= 0) return 1;
+	} while (!cl_atomic_cas_weak (&s->value, &v, v - 1) );
+	return 0;
+}
+
+/* like get, but returns what's left (-1 if it was already zero), so that
+ * exactly one of those who drop the references sees the 0 */
+static inline int cl_sem_drop (cl_sem*s)
+{
+	int v = cl_atomic_load (&s->value);
+	do {
+		if (v <= 0) return -1;
+	} while (!cl_atomic_cas_weak (&s->value, &v, v - 1) );
+	return v - 1;
+}
+
+static inline int cl_sem_value (cl_sem*s)
+{
+	return cl_atomic_load_acq (&s->value);
+}
+
+/*
+ * lock profiling
+ */
+
+void cl_mutex_stats_enable (int);
 
+/* calls the callback for all profiled mutexes, stops if it returns nonzero */
+int cl_mutex_stats_walk (int (*) (struct cl_mutex_stats*, void*), void*);
 
 #endif
 
@@ -14,6 +14,7 @@
 #define _CVPN_PACKET_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
  * packet allocation functions.
@@ -25,6 +26,14 @@
  * -packet payload (offset doff)
  *
  * -mark is a voluntarily filled-in integer that everyone can fiddle with
+ *
+ * -hash is the flow hash of both addresses, computed (once) on demand by
+ *  cloudvpn_packet_flow_hash(); whoever rewrites the addresses zeroes it
+ *
+ * Packets that travel a lot (transports receiving into them) should come
+ * from cloudvpn_packet_alloc_buf(), which keeps the packet and its data
+ * buffer in one block and recycles them per thread. Pooled memory belongs
+ * to the core, not to the part that happened to allocate it.
  */
 
 struct packet {
@@ -34,15 +43,36 @@ struct packet {
 	uint16_t doff;
 
 	uint32_t mark;
+	uint32_t hash; /* 0 if not computed yet */
+
+	uint32_t cap; /* allocated size of data */
+	uint8_t pool; /* pool class + 1 if it's from the pool */
 
 	struct part *src_part, *next_part, *dst_part;
+
+	struct cl_trace*trace; /* only on sampled packets, see trace.h */
 };
 
 struct packet* cloudvpn_packet_alloc();
 void cloudvpn_packet_free (struct packet*);
 
+/* makes data at least len bytes long, keeping the contents */
 int cloudvpn_alloc_data (struct packet*);
 
+/* pooled packet with room for size bytes, len is set to size */
+struct packet* cloudvpn_packet_alloc_buf (size_t size);
+
+/* buffers of the pool class c (0, 1, ...) that were allocated and freed
+ * so far, the difference is in use or kept by the threads. Nonzero past
+ * the last class. */
+int cloudvpn_packet_pool_stats (int c, uint32_t*size,
+                                uint64_t*mallocs, uint64_t*frees);
+
+/* hash of data from 0 to doff, same for all packets of a flow, never 0 */
+uint32_t cloudvpn_packet_flow_hash (struct packet*);
+
+#define PACKET_MAX_LEN 65535
+
 
 #endif
 
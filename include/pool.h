@@ -14,9 +14,11 @@
 #define _CVPN_POOL_H
 
 struct part;
+struct work;
 
 #include "plugin.h"
 #include "mutex.h"
+#include "alloc.h"
 
 /*
  * part is an instance of plugin
@@ -28,11 +30,16 @@ struct part {
 	void*data;
 	char*name;
 	cl_sem refcount;
+	struct cl_mem_account*mem; /* everything allocated on part's behalf */
 };
 
 /* human usage in the config files */
 struct part* cloudvpn_find_part_by_name (const char*);
 
+/* makes the parts that are looked for by name but don't exist yet (boot
+ * does that for the lazy ones); returns 0 if it can't */
+void cloudvpn_set_part_maker (struct part* (*) (const char*) );
+
 /* instantiating from plugins */
 struct part* cloudvpn_part_init (struct plugin*, const char*name);
 
@@ -42,6 +49,15 @@ struct part* cloudvpn_part_acquire (struct part*);
 /* stopping part usage ("undo" any of above 3 functions) */
 void cloudvpn_part_close (struct part*);
 
+/* run part's process_work, with allocations charged to the part */
+void cloudvpn_part_process (struct part*, struct work*);
+
+/* 0 = unlimited. Allocations over the limit fail. */
+void cloudvpn_part_mem_limit (struct part*, size_t bytes);
+
+/* calls the callback for every part, stops if it returns nonzero */
+int cloudvpn_walk_parts (int (*) (struct part*, void*), void*);
+
 int cloudvpn_init_pool();
 void cloudvpn_finish_pool();
 
@@ -0,0 +1,210 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_RING_H
+#define _CVPN_RING_H
+
+/*
+ * bounded lock-free rings of pointers, for handing stuff over between
+ * threads without locking.
+ *
+ * cl_spsc is for exactly one producer and one consumer thread; cl_mpmc
+ * allows any number of both. Sizes get rounded up to a power of two. Null
+ * pointers can't be stored, because pop returns 0 when the ring is empty.
+ * Push returns nonzero if the ring is full, as usual.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+#include "atomic.h"
+
+static inline size_t cl_ring_roundup (size_t size)
+{
+	size_t s = 2;
+	while (s < size) s <<= 1;
+	return s;
+}
+
+/*
+ * single producer, single consumer. Both sides cache the other side's
+ * index, so they only touch the shared cache line when the cached value
+ * says the ring is full/empty.
+ */
+
+struct cl_spsc {
+	/* consumer's stuff */
+	size_t head cl_cacheline_aligned;
+	size_t tail_cache;
+
+	/* producer's stuff */
+	size_t tail cl_cacheline_aligned;
+	size_t head_cache;
+
+	size_t mask cl_cacheline_aligned;
+	void**slots;
+};
+
+static inline int cl_spsc_init (struct cl_spsc*r, size_t size)
+{
+	size = cl_ring_roundup (size);
+	r->slots = cl_calloc (size, sizeof (void*) );
+	if (!r->slots) return 1;
+	r->mask = size - 1;
+	r->head = r->tail = r->head_cache = r->tail_cache = 0;
+	return 0;
+}
+
+static inline void cl_spsc_destroy (struct cl_spsc*r)
+{
+	cl_free (r->slots);
+	r->slots = 0;
+}
+
+static inline int cl_spsc_push (struct cl_spsc*r, void*p)
+{
+	size_t t = r->tail;
+
+	if (t - r->head_cache > r->mask) {
+		r->head_cache = cl_atomic_load_acq (&r->head);
+		if (t - r->head_cache > r->mask) return 1;
+	}
+
+	r->slots[t & r->mask] = p;
+	cl_atomic_store_rel (&r->tail, t + 1);
+	return 0;
+}
+
+static inline void* cl_spsc_pop (struct cl_spsc*r)
+{
+	size_t h = r->head;
+	void*p;
+
+	if (h == r->tail_cache) {
+		r->tail_cache = cl_atomic_load_acq (&r->tail);
+		if (h == r->tail_cache) return 0;
+	}
+
+	p = r->slots[h & r->mask];
+	cl_atomic_store_rel (&r->head, h + 1);
+	return p;
+}
+
+/* takes up to n items at once, returns how many it got */
+static inline size_t cl_spsc_pop_many (struct cl_spsc*r, void**out, size_t n)
+{
+	size_t h = r->head, i;
+
+	if (r->tail_cache - h < n)
+		r->tail_cache = cl_atomic_load_acq (&r->tail);
+	if (r->tail_cache - h < n) n = r->tail_cache - h;
+
+	for (i = 0;i < n;++i) out[i] = r->slots[ (h+i) & r->mask];
+	if (n) cl_atomic_store_rel (&r->head, h + n);
+	return n;
+}
+
+/* approximate, exact only when called by one of the sides */
+static inline size_t cl_spsc_count (struct cl_spsc*r)
+{
+	return cl_atomic_load_acq (&r->tail) - cl_atomic_load_acq (&r->head);
+}
+
+/*
+ * multiple producers, multiple consumers. Every cell has a sequence number
+ * that tells whether it's ready to be written or read in the current lap
+ * (this is Dmitry Vyukov's bounded queue).
+ */
+
+struct cl_mpmc_cell {
+	size_t seq;
+	void*data;
+};
+
+struct cl_mpmc {
+	size_t enq cl_cacheline_aligned;
+	size_t deq cl_cacheline_aligned;
+
+	size_t mask cl_cacheline_aligned;
+	struct cl_mpmc_cell*cells;
+};
+
+static inline int cl_mpmc_init (struct cl_mpmc*r, size_t size)
+{
+	size_t i;
+
+	size = cl_ring_roundup (size);
+	r->cells = cl_malloc (size * sizeof (struct cl_mpmc_cell) );
+	if (!r->cells) return 1;
+	for (i = 0;i < size;++i) {
+		r->cells[i].seq = i;
+		r->cells[i].data = 0;
+	}
+	r->mask = size - 1;
+	r->enq = r->deq = 0;
+	return 0;
+}
+
+static inline void cl_mpmc_destroy (struct cl_mpmc*r)
+{
+	cl_free (r->cells);
+	r->cells = 0;
+}
+
+static inline int cl_mpmc_push (struct cl_mpmc*r, void*p)
+{
+	struct cl_mpmc_cell*c;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = cl_atomic_load (&r->enq);
+	for (;;) {
+		c = r->cells + (pos & r->mask);
+		seq = cl_atomic_load_acq (&c->seq);
+		dif = (intptr_t) seq - (intptr_t) pos;
+		if (!dif) {
+			if (cl_atomic_cas_weak (&r->enq, &pos, pos + 1) ) break;
+		} else if (dif < 0) return 1; /* full */
+		else pos = cl_atomic_load (&r->enq);
+	}
+
+	c->data = p;
+	cl_atomic_store_rel (&c->seq, pos + 1);
+	return 0;
+}
+
+static inline void* cl_mpmc_pop (struct cl_mpmc*r)
+{
+	struct cl_mpmc_cell*c;
+	size_t pos, seq;
+	intptr_t dif;
+	void*p;
+
+	pos = cl_atomic_load (&r->deq);
+	for (;;) {
+		c = r->cells + (pos & r->mask);
+		seq = cl_atomic_load_acq (&c->seq);
+		dif = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (!dif) {
+			if (cl_atomic_cas_weak (&r->deq, &pos, pos + 1) ) break;
+		} else if (dif < 0) return 0; /* empty */
+		else pos = cl_atomic_load (&r->deq);
+	}
+
+	p = c->data;
+	cl_atomic_store_rel (&c->seq, pos + r->mask + 1);
+	return p;
+}
+
+#endif
+
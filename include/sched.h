@@ -18,14 +18,30 @@
  * It can also handle multicore tasks, etc.
  */
 
+#include <stdint.h>
+
 int cloudvpn_scheduler_init();
 int cloudvpn_scheduler_destroy();
 
 int cloudvpn_scheduler_run (int*);
 
+/* index of the calling worker thread (-1 if it isn't one), and how many */
+int cloudvpn_worker_id();
+int cloudvpn_worker_count();
+
+/* works waiting in the queue now, and how many went through it so far */
+struct cloudvpn_sched_stats {
+	uint64_t queued, scheduled, done;
+};
+
+void cloudvpn_scheduler_stats (struct cloudvpn_sched_stats*);
+
 struct work* cloudvpn_new_work();
 int cloudvpn_schedule_work (struct work*);
 
+/* schedules all or (on failure) none of them */
+int cloudvpn_schedule_works (struct work**, int n);
+
 void cloudvpn_schedule_event_poll();
 
 enum {
@@ -49,7 +65,7 @@ struct work {
 	short is_static; /* struct work is owned and freed by someone else */
 
 	union {
-		struct packet* p; /* packet to process */
+		struct packet* p; /* packet to process, next_part takes it */
 		struct event_data e;
 		struct part* pt; /* part to cleanup */
 		struct plugin* pl; /* plugin to cleanup */
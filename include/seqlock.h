@@ -0,0 +1,67 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_SEQLOCK_H
+#define _CVPN_SEQLOCK_H
+
+/*
+ * sequence lock for small, often read and rarely written data (stats,
+ * configuration snapshots). Readers never write anything shared, they just
+ * copy the data out and retry if a writer came in between:
+ *
+ *	do {
+ *		s = cl_seqlock_read_begin (&lock);
+ *		copy = data;
+ *	} while (cl_seqlock_read_retry (&lock, s) );
+ *
+ * Don't follow pointers from the data before the retry check passes.
+ * Writers must be serialized by something else (one writer thread, or a
+ * cl_mutex).
+ */
+
+#include "atomic.h"
+
+typedef struct {
+	unsigned seq;
+} cl_seqlock;
+
+static inline void cl_seqlock_init (cl_seqlock*l)
+{
+	l->seq = 0;
+}
+
+static inline void cl_seqlock_write_begin (cl_seqlock*l)
+{
+	cl_atomic_store (&l->seq, l->seq + 1);
+	cl_fence_rel();
+}
+
+static inline void cl_seqlock_write_end (cl_seqlock*l)
+{
+	cl_atomic_store_rel (&l->seq, l->seq + 1);
+}
+
+static inline unsigned cl_seqlock_read_begin (cl_seqlock*l)
+{
+	unsigned s;
+	while ( (s = cl_atomic_load_acq (&l->seq) ) & 1) cl_cpu_relax();
+	return s;
+}
+
+static inline int cl_seqlock_read_retry (cl_seqlock*l, unsigned s)
+{
+	cl_fence_acq();
+	return cl_atomic_load (&l->seq) != s;
+}
+
+#endif
+
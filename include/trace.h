@@ -0,0 +1,94 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_TRACE_H
+#define _CVPN_TRACE_H
+
+/*
+ * sampled packet tracing. Every cl_trace_every-th packet allocated by a
+ * thread gets a trace, which goes with it in struct packet. Scheduler
+ * stamps it when the packet is queued for a part and when it's taken out
+ * of the queue, dispatch when the part starts and stops processing it.
+ * When the packet is freed, the trace goes to the per-part latency
+ * breakdown, and into a buffer of recent ones that can be written out as
+ * Chrome trace JSON (chrome://tracing, Perfetto), a row per packet.
+ *
+ * Untraced packets cost a test of a zero pointer; with sampling off, the
+ * allocation costs a test of cl_trace_every. Set it with the
+ * CLOUDVPN_TRACE environment variable or cl_trace_set_every().
+ */
+
+#include <stdint.h>
+
+struct part;
+struct packet;
+
+#define CL_TRACE_HOPS 16
+#define CL_TRACE_NAME 16
+#define CL_TRACE_KEEP 4096 /* recent traces kept for the JSON */
+
+struct cl_trace_hop {
+	char part[CL_TRACE_NAME]; /* cut, not necessarily terminated */
+	int worker;
+	uint64_t enqueue_ns, dequeue_ns, start_ns, end_ns; /* 0 = not yet */
+};
+
+struct cl_trace {
+	uint64_t id, born_ns, freed_ns;
+	int refs; /* the packet, and the dispatch while it's processed */
+	int hops, full;
+	struct cl_trace_hop hop[CL_TRACE_HOPS];
+};
+
+extern uint32_t cl_trace_every; /* 0 = off */
+
+void cl_trace_set_every (uint32_t);
+
+/* for the core only */
+void cl_trace_sample (struct packet*);
+void cl_trace_enqueue (struct cl_trace*, struct part*);
+void cl_trace_dequeue (struct cl_trace*);
+int cl_trace_begin (struct cl_trace*);
+void cl_trace_end (struct cl_trace*, int hop);
+void cl_trace_free (struct cl_trace*);
+
+/*
+ * per-part breakdown, in ns: waiting in the queue, from the queue to the
+ * part, and in the part. Percentiles are a power of two split in 4
+ * (so within 25%).
+ */
+
+struct cl_trace_lat {
+	uint64_t p50, p99, max, sum;
+};
+
+struct cl_trace_stats {
+	const char*part;
+	uint64_t count;
+	struct cl_trace_lat queue, dispatch, process;
+};
+
+/* calls the callback for every part that has seen traced packets, and
+ * the first time with part "*" for the whole lives of the packets; stops
+ * if it returns nonzero */
+int cl_trace_walk (int (*) (struct cl_trace_stats*, void*), void*);
+
+/* sampled, finished, and dropped (out of memory or hops) traces */
+void cl_trace_counts (uint64_t*sampled, uint64_t*finished, uint64_t*dropped);
+
+/* forgets the breakdown */
+void cl_trace_reset();
+
+/* writes the kept traces to the file and forgets them, 0 on success */
+int cl_trace_write_json (const char*path);
+
+#endif
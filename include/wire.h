@@ -0,0 +1,104 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_WIRE_H
+#define _CVPN_WIRE_H
+
+/*
+ * how packets look on the wire between two transports. Each one gets
+ * a fixed header, followed by the packet data:
+ *
+ *	u16 len		length of data that follows the header
+ *	u16 soff	offsets from struct packet
+ *	u16 doff
+ *	u8 priority	of the work that carried the packet
+ *	u8 flags	transport specific
+ *	u32 mark
+ *
+ * everything in network byte order.
+ */
+
+#include <stdint.h>
+
+#include "packet.h"
+
+#define WIRE_HDR_LEN 12
+
+struct wire_hdr {
+	uint16_t len, soff, doff;
+	uint8_t priority, flags;
+	uint32_t mark;
+};
+
+static inline void wire_put16 (uint8_t*b, uint16_t v)
+{
+	b[0] = v >> 8;
+	b[1] = v;
+}
+
+static inline void wire_put32 (uint8_t*b, uint32_t v)
+{
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+static inline uint16_t wire_get16 (const uint8_t*b)
+{
+	return (b[0] << 8) | b[1];
+}
+
+static inline uint32_t wire_get32 (const uint8_t*b)
+{
+	return ( (uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static inline void wire_hdr_put (uint8_t*b, const struct wire_hdr*h)
+{
+	wire_put16 (b, h->len);
+	wire_put16 (b + 2, h->soff);
+	wire_put16 (b + 4, h->doff);
+	b[6] = h->priority;
+	b[7] = h->flags;
+	wire_put32 (b + 8, h->mark);
+}
+
+/* returns nonzero if the header doesn't make sense */
+static inline int wire_hdr_get (const uint8_t*b, struct wire_hdr*h)
+{
+	h->len = wire_get16 (b);
+	h->soff = wire_get16 (b + 2);
+	h->doff = wire_get16 (b + 4);
+	h->priority = b[6];
+	h->flags = b[7];
+	h->mark = wire_get32 (b + 8);
+	return (h->soff > h->doff) || (h->doff > h->len);
+}
+
+/* header for a packet that is about to be sent */
+static inline void wire_hdr_from_packet (uint8_t*b, struct packet*p,
+        uint8_t priority, uint8_t flags)
+{
+	struct wire_hdr h;
+
+	h.len = p->len;
+	h.soff = p->soff;
+	h.doff = p->doff;
+	h.priority = priority;
+	h.flags = flags;
+	h.mark = p->mark;
+	wire_hdr_put (b, &h);
+}
+
+#endif
+
@@ -10,9 +10,1213 @@
  * if not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * distance-vector routing plugin.
+ *
+ * One part is one router. Links are other parts (usually transports) that
+ * lead to neighbor routers; packets that come from them and packets from
+ * local parts are forwarded by the destination address, which is the data
+ * of the packet from offset 0 to soff. Addresses are just byte strings of
+ * any length, routes are for their prefixes (of any number of bits) and
+ * the longest matching one wins. Forwarding looks into a lock-free trie
+ * (lpm.h), so it doesn't wait for the route exchange, and resolved flows
+ * are remembered by every worker (flowcache.h) until some route changes.
+ *
+ * All neighbors that offer the best metric are used (up to "paths" of
+ * them). Packets are spread by the flow hash of their addresses over a
+ * table of buckets, each bucket belongs to one next hop. So packets of a
+ * flow always go the same way and stay in order, and when the set of next
+ * hops changes, buckets of the hops that stay don't move: only flows of a
+ * failed hop go elsewhere (and a new hop only takes its share).
+ *
+ * Packets with empty destination address are for the router itself, those
+ * carry the route exchange between neighbors:
+ *
+ *	u8 type		DVR_UPDATE or DVR_REQUEST
+ *	then for updates, entries of
+ *	u16 bits	prefix length
+ *	u16 metric	infinity-or-more means unreachable
+ *	(bits+7)/8 bytes of the prefix
+ *
+ * A router only sends what changed. Offers that neighbors change are only
+ * noted, and after a short window all the routes they touch are recomputed
+ * at once, the ones that changed are sent to all neighbors in one update,
+ * and forwarding gets all the new hops with one cache flush. So a storm of
+ * updates costs one round of work per window, not per update. Split
+ * horizon with poisoned reverse: the neighbors that the route goes through
+ * get it as unreachable. Whole table is only sent when a link is added,
+ * when a neighbor asks for it, and on (rare) periodic refresh. When nothing
+ * changes, nothing is sent.
+ *
+ * Flapping routes are damped, per prefix: every time a route learned from
+ * the neighbors becomes unreachable it gets a penalty, which decays to half
+ * every half-life. A route with penalty over the suppress limit is treated
+ * as unreachable (so it's not used or announced further) until the penalty
+ * decays under the reuse limit. Penalty has a ceiling, so no route is held
+ * down for longer than 4 half-lives.
+ *
+ * What the router does is counted in metrics (metrics.h), named
+ * cloudvpn_dvr_*; the flow cache ones are summed from the workers.
+ *
+ * Commands:
+ *	link <part> [cost]	neighbor behind the part (cost default 1)
+ *	unlink <part>
+ *	address <prefix> <part>	prefix that is delivered to a local part
+ *	forget <prefix>
+ *	infinity <metric>	unreachable metric (default 64)
+ *	trigger <ms>		window to collect changes in (default 50)
+ *	refresh <s>		full table refresh, 0 is off (default 300)
+ *	mtu <bytes>		max size of update packets (default 1400)
+ *	priority <n>		priority of the route exchange (default 0)
+ *	paths <n>		max equal-cost next hops, 1 is off (default 8)
+ *	damping <half-life s> [suppress reuse]
+ *				flap damping, half-life 0 is off (default
+ *				15 s, 3000, 750; one flap is 1000)
+ *	direct <bits>		direct table size of the trie, 0, 8 (default),
+ *				16 or 24
+ *
+ * Prefixes are written in hex, ':' and '.' can separate the bytes, and
+ * "/bits" can follow (default is all the bytes).
+ */
+
 #include "api.h"
+#include "alloc.h"
+#include "command.h"
+#include "lpm.h"
+#include "flowcache.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define DVR_UPDATE 1
+#define DVR_REQUEST 2
+
+#define MAX_LINKS 64
+#define MAX_KEY 255 /* bytes */
+#define ENTRY_HDR 4
+
+#define FLOW_CACHE 4096 /* per worker */
+
+#define HOP_BUCKETS 64
+
+#define FLAP_PENALTY 1000
+#define PENALTY_CEILING(reuse) ( (reuse) * 16)
+
+#define key_bytes(bits) ( ( (bits) + 7) / 8)
+
+enum { ev_trigger, ev_refresh, ev_damping };
+
+enum {
+	m_forwarded, m_dropped, m_updates_sent, m_update_bytes,
+	m_updates_received, m_recomputes, m_flaps, m_suppressions,
+	m_flow_hits, m_flow_misses, m_flow_evictions, m_count
+};
+
+static const char*metric_names[m_count][2] = {
+	{"cloudvpn_dvr_forwarded_packets_total", "packets sent to a next hop"},
+	{"cloudvpn_dvr_dropped_packets_total", "packets with no route"},
+	{"cloudvpn_dvr_updates_sent_total", "update packets to neighbors"},
+	{"cloudvpn_dvr_update_bytes_total", "bytes of the updates sent"},
+	{"cloudvpn_dvr_updates_received_total", "updates from neighbors"},
+	{"cloudvpn_dvr_recomputes_total", "routes recomputed after a change"},
+	{"cloudvpn_dvr_flaps_total", "routes that became unreachable"},
+	{"cloudvpn_dvr_suppressions_total", "routes suppressed by damping"},
+	{"cloudvpn_dvr_flow_cache_hits_total", "lookups found in the cache"},
+	{"cloudvpn_dvr_flow_cache_misses_total", "lookups done in the trie"},
+	{"cloudvpn_dvr_flow_cache_evictions_total", "live flows pushed out"}
+};
+
+/* metric that a neighbor advertised for a route */
+struct offer {
+	struct offer*next;
+	uint16_t metric;
+	uint8_t link;
+};
+
+/* next hops of a route, what forwarding sees */
+struct hops {
+	struct hops*next; /* when waiting to be freed */
+	int n;
+	uint8_t bucket[HOP_BUCKETS]; /* flow hash -> index of pt */
+	struct part*pt[];
+};
+
+struct route {
+	struct route*next; /* hash chain */
+	struct route*dnext; /* dirty list */
+	struct route*snext; /* stale list, offers changed */
+	struct offer*offers;
+	struct part*local; /* delivered here */
+	struct hops*hops; /* 0 if unreachable */
+	uint64_t vias; /* links that give the best metric */
+	uint16_t metric; /* best one, infinity if unreachable */
+	uint8_t dirty, stale, suppressed;
+	uint8_t up; /* reachable, even if suppressed */
+	uint32_t penalty; /* as of penalty_us */
+	uint64_t penalty_us;
+	uint16_t bits;
+	uint8_t key[];
+};
+
+struct link {
+	struct part*pt; /* 0 if the slot is free */
+	unsigned cost;
+};
+
+struct dvr {
+	cl_mutex lock;
+	struct part*self;
+
+	/* route table, hashed by prefix; reachable ones are also in lpm */
+	struct route**tab;
+	unsigned tsize, count;
+	struct cl_lpm lpm;
+	struct cl_flow_cache flows; /* bumped with every change of a hop */
+
+	struct route*dirty, *stale;
+	struct hops*old_hops; /* replaced, to free after readers leave */
+	struct route*old_routes; /* same, routes taken out of the trie */
+	struct link links[MAX_LINKS];
+
+	uint16_t infinity;
+	unsigned mtu;
+	int paths;
+	uint8_t priority;
+	uint64_t trigger_us, refresh_us;
+	struct event*trigger, *refresh, *damping;
+	int trigger_armed, refresh_armed, damping_armed;
+
+	uint64_t half_life_us;
+	unsigned suppress, reuse;
+	unsigned penalized; /* routes with penalty */
+
+	struct cl_metric*m[m_count];
+};
+
+/*
+ * route table
+ */
+
+static uint32_t key_hash (const uint8_t*k, int bits)
+{
+	uint32_t h = 2166136261U ^ bits;
+	int len = key_bytes (bits);
+
+	while (len--) h = (h ^ *k++) * 16777619U;
+	return h;
+}
+
+static struct route** find_slot (struct dvr*d, const uint8_t*k, int bits)
+{
+	struct route**r = d->tab + (key_hash (k, bits) & (d->tsize - 1) );
+
+	for (;*r;r = & (*r)->next)
+		if ( (*r)->bits == bits &&
+		        !memcmp ( (*r)->key, k, key_bytes (bits) ) ) break;
+	return r;
+}
+
+static struct route* find_route (struct dvr*d, const uint8_t*k, int bits) {
+
+	return *find_slot (d, k, bits);
+}
+
+static void grow_table (struct dvr*d)
+{
+	struct route**t, *r, *n;
+	unsigned i, size = d->tsize * 2;
+
+	t = cl_calloc (size, sizeof (struct route*) );
+	if (!t) return; /* chains just get longer */
+
+	for (i = 0;i < d->tsize;++i)
+		for (r = d->tab[i];r;r = n) {
+			n = r->next;
+			r->next = t[key_hash (r->key, r->bits) & (size - 1)];
+			t[key_hash (r->key, r->bits) & (size - 1)] = r;
+		}
+
+	cl_free (d->tab);
+	d->tab = t;
+	d->tsize = size;
+}
+
+static struct route* get_route (struct dvr*d, const uint8_t*k, int bits) {
+
+	/* k must have the bits after the prefix zeroed */
+	struct route**s = find_slot (d, k, bits), *r;
+
+	if (*s) return *s;
+
+	r = cl_malloc (sizeof (struct route) + key_bytes (bits) );
+	if (!r) return 0;
+	memset (r, 0, sizeof (struct route) );
+	memcpy (r->key, k, key_bytes (bits) );
+	r->bits = bits;
+	r->metric = d->infinity;
+
+	r->next = *s;
+	*s = r;
+	if (++d->count > d->tsize) grow_table (d);
+	return r;
+}
+
+/*
+ * flap damping
+ */
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* 2^(-i/16), times 65536 */
+static const uint32_t decay_table[16] = {
+	65536, 62757, 60097, 57549, 55109, 52773, 50535, 48393,
+	46341, 44376, 42495, 40693, 38968, 37316, 35734, 34219
+};
+
+static void decay (struct dvr*d, struct route*r, uint64_t now)
+{
+	/* in 16ths of the half-life, the rest waits for next time */
+	uint64_t steps;
+
+	if (!d->half_life_us) {
+		r->penalty = 1; /* damping got switched off, forget it soon */
+		return;
+	}
+
+	steps = (now - r->penalty_us) * 16 / d->half_life_us;
+	r->penalty_us += steps * d->half_life_us / 16;
+	if (steps >= 16 * 32) r->penalty = 1;
+	else r->penalty = ( (uint64_t) (r->penalty >> (steps / 16) )
+		                    * decay_table[steps % 16]) >> 16;
+
+	/* nonzero is what says that it's penalized */
+	if (!r->penalty) r->penalty = 1;
+}
+
+static void arm_damping (struct dvr*d)
+{
+	uint64_t t = d->half_life_us / 8;
+
+	if (d->damping_armed || !d->penalized) return;
+	d->damping->data.time = t < 10000 ? 10000 : t;
+	if (!cloudvpn_register_event (d->damping) ) d->damping_armed = 1;
+}
+
+static void flap (struct dvr*d, struct route*r)
+{
+	uint64_t now;
+
+	if (!d->half_life_us) return;
+	cl_metric_inc (d->m[m_flaps]);
+
+	now = now_us();
+	if (!r->penalty) {
+		r->penalty_us = now;
+		++d->penalized;
+		arm_damping (d);
+	} else decay (d, r, now);
+
+	r->penalty += FLAP_PENALTY;
+	if (r->penalty > PENALTY_CEILING (d->reuse) )
+		r->penalty = PENALTY_CEILING (d->reuse);
+
+	if (!r->suppressed && r->penalty > d->suppress) {
+		r->suppressed = 1;
+		cl_metric_inc (d->m[m_suppressions]);
+	}
+}
+
+/*
+ * route computation
+ */
+
+static void arm_trigger (struct dvr*d)
+{
+	if (d->trigger_armed) return;
+	d->trigger->data.time = d->trigger_us;
+	if (!cloudvpn_register_event (d->trigger) ) d->trigger_armed = 1;
+}
+
+static void mark_dirty (struct dvr*d, struct route*r)
+{
+	if (r->dirty) return;
+	r->dirty = 1;
+	r->dnext = d->dirty;
+	d->dirty = r;
+	arm_trigger (d);
+}
+
+static void mark_stale (struct dvr*d, struct route*r)
+{
+	/* gets recomputed when the window closes */
+	if (r->stale) return;
+	r->stale = 1;
+	r->snext = d->stale;
+	d->stale = r;
+	arm_trigger (d);
+}
+
+static int same_hops (struct hops*h, struct part**pt, int n)
+{
+	return h->n == n && !memcmp (h->pt, pt, n * sizeof (struct part*) );
+}
+
+static struct hops* new_hops (struct part**pt, int n, struct hops*old) {
+
+	/*
+	 * buckets keep their hop if it's still there (and doesn't have more
+	 * than its share), the rest goes to the hops that have the fewest
+	 */
+	struct hops*h = cl_malloc (sizeof (struct hops) + n * sizeof (struct part*) );
+	int count[MAX_LINKS], share = (HOP_BUCKETS + n - 1) / n, b, i, j;
+
+	if (!h) return 0;
+	h->n = n;
+	memcpy (h->pt, pt, n * sizeof (struct part*) );
+	memset (count, 0, sizeof (count) );
+
+	for (b = 0;b < HOP_BUCKETS;++b) {
+		h->bucket[b] = 0xff;
+		if (!old) continue;
+		for (i = 0;i < n && pt[i] != old->pt[old->bucket[b]];++i);
+		if (i < n && count[i] < share) {
+			h->bucket[b] = i;
+			++count[i];
+		}
+	}
+
+	for (b = 0;b < HOP_BUCKETS;++b) {
+		if (h->bucket[b] != 0xff) continue;
+		for (j = 0, i = 1;i < n;++i) if (count[i] < count[j]) j = i;
+		h->bucket[b] = j;
+		++count[j];
+	}
+
+	return h;
+}
+
+static void update_hops (struct dvr*d, struct route*r)
+{
+	/*
+	 * publishes what forwarding sees. Forwarding threads might have the
+	 * old hops from the trie or from their flow caches, so those are only
+	 * freed after the cache generation changes and the readers leave; that
+	 * is done once for many routes by flush_hops. Routes that leave the
+	 * trie are unlinked without waiting, the same wait covers them.
+	 */
+	struct part*pt[MAX_LINKS];
+	struct hops*old = r->hops, *h = 0;
+	int i, n = 0;
+
+	if (r->metric < d->infinity) {
+		if (r->local) pt[n++] = r->local;
+		else for (i = 0;i < MAX_LINKS;++i)
+				if ( (r->vias >> i) & 1) pt[n++] = d->links[i].pt;
+	}
+
+	if (old ? same_hops (old, pt, n) : !n) return;
+	if (n && ! (h = new_hops (pt, n, old) ) ) return;
+
+	if (!old) {
+		cl_atomic_store_rel (&r->hops, h);
+		if (cl_lpm_insert (&d->lpm, r->key, r->bits, r) ) {
+			r->hops = 0;
+			cl_free (h);
+			return;
+		}
+		/* longer prefix now catches flows cached for a shorter one */
+		cl_flow_cache_invalidate (&d->flows);
+		return;
+	}
+
+	if (!h) {
+		cl_lpm_unlink (&d->lpm, r->key, r->bits);
+		r->hops = 0;
+	} else cl_atomic_store_rel (&r->hops, h);
+
+	/* freed in flush_hops, together with all from this round */
+	old->next = d->old_hops;
+	d->old_hops = old;
+}
+
+static void flush_hops (struct dvr*d)
+{
+	struct hops*h;
+	struct route*r;
+
+	if (!d->old_hops && !d->old_routes) return;
+
+	cl_flow_cache_invalidate (&d->flows);
+	cl_lpm_synchronize (&d->lpm);
+	while ( (h = d->old_hops) ) {
+		d->old_hops = h->next;
+		cl_free (h);
+	}
+	while ( (r = d->old_routes) ) {
+		d->old_routes = r->next;
+		cl_free (r);
+	}
+}
+
+static uint64_t trim_vias (struct dvr*d, uint64_t vias, uint64_t current)
+{
+	/* at most d->paths of them, the current ones go first */
+	uint64_t res = 0, m;
+	int i, n = 0, pass;
+
+	for (pass = 0;pass < 2;++pass)
+		for (i = 0;i < MAX_LINKS && n < d->paths;++i) {
+			m = 1ULL << i;
+			if ( (vias & m) && ! (res & m) && (pass || (current & m) ) ) {
+				res |= m;
+				++n;
+			}
+		}
+	return res;
+}
+
+static void recompute (struct dvr*d, struct route*r)
+{
+	struct offer*o;
+	unsigned m, best = d->infinity;
+	uint64_t vias = 0;
+
+	if (r->local) best = 0;
+	else for (o = r->offers;o;o = o->next) {
+			m = o->metric + d->links[o->link].cost;
+			if (m < best) {
+				best = m;
+				vias = 0;
+			}
+			if (m == best && m < d->infinity) vias |= 1ULL << o->link;
+		}
+
+	if (best >= d->infinity) {
+		best = d->infinity;
+		vias = 0;
+	}
+
+	/* learned route went away */
+	if (r->up && best >= d->infinity && !r->local) flap (d, r);
+	r->up = best < d->infinity;
+
+	if (r->suppressed && !r->local) {
+		best = d->infinity;
+		vias = 0;
+	}
+	vias = trim_vias (d, vias, r->vias);
+	if (best == r->metric && vias == r->vias) return;
+
+	r->metric = best;
+	r->vias = vias;
+	update_hops (d, r);
+	mark_dirty (d, r);
+}
+
+static void free_route (struct dvr*d, struct route*r)
+{
+	struct route**s = find_slot (d, r->key, r->bits);
+	struct offer*o;
+	int seen = !!r->hops;
+
+	if (r->hops) {
+		r->metric = d->infinity;
+		update_hops (d, r);
+	}
+	if (r->penalty) --d->penalized;
+
+	*s = r->next;
+	--d->count;
+	while ( (o = r->offers) ) {
+		r->offers = o->next;
+		cl_free (o);
+	}
+
+	/* forwarding might have found it in the trie, flush_hops frees it */
+	if (seen) {
+		r->next = d->old_routes;
+		d->old_routes = r;
+	} else cl_free (r);
+}
+
+static void set_offer (struct dvr*d, struct route*r, int link, unsigned metric)
+{
+	struct offer**o, *n;
+
+	for (o = &r->offers;*o && (*o)->link != link;o = & (*o)->next);
+
+	if (metric >= d->infinity) {
+		if (! *o) return;
+		n = *o;
+		*o = n->next;
+		cl_free (n);
+	} else if (*o) {
+		if ( (*o)->metric == metric) return;
+		(*o)->metric = metric;
+	} else {
+		n = cl_malloc (sizeof (struct offer) );
+		if (!n) return;
+		n->metric = metric;
+		n->link = link;
+		n->next = r->offers;
+		r->offers = n;
+	}
+
+	mark_stale (d, r);
+}
+
+static int find_link (struct dvr*d, struct part*pt)
+{
+	int i;
+	for (i = 0;i < MAX_LINKS;++i) if (d->links[i].pt == pt) return i;
+	return -1;
+}
+
+static int is_dead (struct route*r)
+{
+	/* penalized ones are kept, so flapping doesn't reset their history */
+	return !r->local && !r->offers && !r->penalty;
+}
+
+/*
+ * sending updates
+ */
+
+struct msg {
+	struct packet*p;
+	unsigned used;
+};
+
+static void msg_send (struct dvr*d, int link, struct msg*m)
+{
+	struct work*w;
+
+	if (!m->p) return;
+	m->p->len = m->used;
+	m->p->next_part = d->links[link].pt;
+	m->p->src_part = d->self;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		cloudvpn_packet_free (m->p);
+		m->p = 0;
+		return;
+	}
+	w->type = work_packet;
+	w->priority = d->priority;
+	w->is_static = 0;
+	w->p = m->p;
+
+	if (cloudvpn_schedule_work (w) ) {
+		cloudvpn_packet_free (m->p);
+		cl_free (w);
+	} else {
+		cl_metric_inc (d->m[m_updates_sent]);
+		cl_metric_add (d->m[m_update_bytes], m->used);
+	}
+	m->p = 0;
+}
+
+static int msg_start (struct dvr*d, struct msg*m, uint8_t type)
+{
+	m->p = cloudvpn_packet_alloc_buf (d->mtu);
+	if (!m->p) return 1;
+	m->p->soff = m->p->doff = 0;
+	m->p->mark = 0;
+	m->p->data[0] = type;
+	m->used = 1;
+	return 0;
+}
+
+static void msg_add (struct dvr*d, int link, struct msg*m, struct route*r)
+{
+	/* poisoned reverse: tell the next hop that we can't reach it */
+	uint16_t metric = (r->vias >> link) & 1 ? d->infinity : r->metric;
+	int len = key_bytes (r->bits);
+	uint8_t*b;
+
+	if (m->p && m->used + ENTRY_HDR + len > d->mtu) msg_send (d, link, m);
+	if (!m->p && msg_start (d, m, DVR_UPDATE) ) return;
+
+	b = (uint8_t*) m->p->data + m->used;
+	b[0] = r->bits >> 8;
+	b[1] = r->bits;
+	b[2] = metric >> 8;
+	b[3] = metric;
+	memcpy (b + ENTRY_HDR, r->key, len);
+	m->used += ENTRY_HDR + len;
+}
+
+static void send_full (struct dvr*d, int link)
+{
+	struct msg m;
+	struct route*r;
+	unsigned i;
+
+	m.p = 0;
+	for (i = 0;i < d->tsize;++i)
+		for (r = d->tab[i];r;r = r->next)
+			if (r->metric < d->infinity) msg_add (d, link, &m, r);
+	msg_send (d, link, &m);
+}
+
+static void send_request (struct dvr*d, int link)
+{
+	struct msg m;
+
+	if (msg_start (d, &m, DVR_REQUEST) ) return;
+	msg_send (d, link, &m);
+}
+
+static void send_dirty (struct dvr*d)
+{
+	/* deltas to all neighbors, then forget the routes that went away */
+	struct msg m;
+	struct route*r, *n;
+	int i;
+
+	for (i = 0;i < MAX_LINKS;++i) {
+		if (!d->links[i].pt) continue;
+		m.p = 0;
+		for (r = d->dirty;r;r = r->dnext) msg_add (d, i, &m, r);
+		msg_send (d, i, &m);
+	}
+
+	for (r = d->dirty;r;r = n) {
+		n = r->dnext;
+		r->dirty = 0;
+		if (is_dead (r) ) free_route (d, r);
+	}
+	d->dirty = 0;
+}
+
+static void settle (struct dvr*d)
+{
+	/* recomputes everything that changed in the window, and sends it */
+	struct route*r, *n;
+
+	for (r = d->stale, d->stale = 0;r;r = n) {
+		n = r->snext;
+		r->stale = 0;
+		recompute (d, r);
+		cl_metric_inc (d->m[m_recomputes]);
+		if (is_dead (r) && !r->dirty) free_route (d, r);
+	}
+
+	if (d->dirty) send_dirty (d);
+	flush_hops (d);
+}
+
+static void check_damping (struct dvr*d)
+{
+	/* penalties decay, suppressed routes come back */
+	uint64_t now = now_us();
+	struct route*r, *n;
+	unsigned i;
+
+	for (i = 0;i < d->tsize;++i)
+		for (r = d->tab[i];r;r = n) {
+			n = r->next;
+			if (!r->penalty) continue;
+
+			decay (d, r, now);
+			if (r->suppressed && r->penalty < d->reuse) {
+				r->suppressed = 0;
+				mark_stale (d, r);
+			}
+			if (r->penalty < d->reuse / 2) {
+				r->penalty = 0;
+				--d->penalized;
+				if (is_dead (r) && !r->dirty && !r->stale)
+					free_route (d, r);
+			}
+		}
+
+	arm_damping (d);
+}
+
+/*
+ * receiving updates
+ */
+
+static void receive_update (struct dvr*d, int link, const uint8_t*b, int len)
+{
+	uint8_t k[MAX_KEY];
+	struct route*r;
+	unsigned metric, bits;
+	int klen;
+
+	while (len >= ENTRY_HDR) {
+		bits = (b[0] << 8) | b[1];
+		metric = (b[2] << 8) | b[3];
+		klen = key_bytes (bits);
+		if (len < ENTRY_HDR + klen) break;
+
+		/* don't trust the peer to zero the bits after the prefix */
+		r = 0;
+		if (bits && klen <= MAX_KEY) {
+			memcpy (k, b + ENTRY_HDR, klen);
+			if (bits & 7) k[klen - 1] &= ~ (0xff >> (bits & 7) );
+			r = metric < d->infinity ? get_route (d, k, bits)
+			    : find_route (d, k, bits);
+		}
+		if (r) {
+			set_offer (d, r, link, metric);
+			/* unknown and still unreachable, don't keep it */
+			if (is_dead (r) && !r->dirty && !r->stale) free_route (d, r);
+		}
+
+		b += ENTRY_HDR + klen;
+		len -= ENTRY_HDR + klen;
+	}
+}
+
+static void receive_control (struct dvr*d, struct packet*p)
+{
+	int link = find_link (d, p->src_part);
+
+	/* only neighbors we know about may talk to us */
+	if (link < 0 || p->len < 1) return;
+
+	switch (p->data[0]) {
+	case DVR_UPDATE:
+		cl_metric_inc (d->m[m_updates_received]);
+		receive_update (d, link, (uint8_t*) p->data + 1, p->len - 1);
+		break;
+	case DVR_REQUEST:
+		send_full (d, link);
+		break;
+	}
+}
+
+/*
+ * forwarding
+ */
+
+static void forward (struct dvr*d, struct work*w)
+{
+	struct packet*p = w->p;
+	struct part*next = 0;
+	struct hops*h;
+	struct route*r;
+	struct work*nw;
+	int worker = cloudvpn_worker_id();
+	uint32_t gen;
+	unsigned t;
+
+	/* hops stay valid until leaving */
+	t = cl_lpm_enter (&d->lpm);
+
+	h = cl_flow_cache_get (&d->flows, worker, (uint8_t*) p->data,
+	                       p->soff, p->src_part, &gen);
+	if (!h) {
+		r = cl_lpm_lookup (&d->lpm, (uint8_t*) p->data, p->soff);
+		h = r ? cl_atomic_load_acq (&r->hops) : 0;
+		if (h) cl_flow_cache_put (&d->flows, worker, (uint8_t*) p->data,
+			                          p->soff, p->src_part, h, gen);
+	}
+
+	if (h) next = h->n == 1 ? h->pt[0] : h->pt[h->bucket
+		              [cloudvpn_packet_flow_hash (p) % HOP_BUCKETS]];
+
+	cl_lpm_leave (&d->lpm, t);
+
+	cl_metric_inc (d->m[next ? m_forwarded : m_dropped]);
+
+	if (!next || ! (nw = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	p->src_part = d->self;
+	p->next_part = next;
+	nw->type = work_packet;
+	nw->priority = w->priority;
+	nw->is_static = 0;
+	nw->p = p;
+	if (cloudvpn_schedule_work (nw) ) {
+		cl_free (nw);
+		cloudvpn_packet_free (p);
+	}
+}
+
+/*
+ * commands
+ */
+
+static int parse_key (const char*s, uint8_t*k)
+{
+	/* hex bytes, optionally separated, "/bits"; returns bits or -1 */
+	int len = 0, hi = -1, v, bits;
+
+	for (;*s && *s != '/';++s) {
+		if (*s == ':' || *s == '.') {
+			if (hi >= 0) return -1;
+			continue;
+		}
+		if (*s >= '0' && *s <= '9') v = *s - '0';
+		else if (*s >= 'a' && *s <= 'f') v = *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'F') v = *s - 'A' + 10;
+		else return -1;
+
+		if (hi < 0) hi = v;
+		else {
+			if (len == MAX_KEY) return -1;
+			k[len++] = (hi << 4) | v;
+			hi = -1;
+		}
+	}
+	if (hi >= 0) return -1;
+
+	bits = *s ? atoi (s + 1) : len * 8;
+	if (bits <= 0 || bits > len * 8) return -1;
+	if (bits & 7) k[key_bytes (bits) - 1] &= ~ (0xff >> (bits & 7) );
+	return bits;
+}
+
+static void dvr_link (struct dvr*d, struct part*pt, unsigned cost)
+{
+	struct route*r;
+	unsigned i;
+	int l = find_link (d, pt);
+
+	if (!pt || !cost) return;
+
+	if (l >= 0) {
+		/* cost change, everything through it may change */
+		d->links[l].cost = cost;
+		for (i = 0;i < d->tsize;++i)
+			for (r = d->tab[i];r;r = r->next) mark_stale (d, r);
+		return;
+	}
+
+	if ( (l = find_link (d, 0) ) < 0) return;
+	d->links[l].pt = pt;
+	d->links[l].cost = cost;
+
+	/* exchange whole tables with the new neighbor */
+	send_full (d, l);
+	send_request (d, l);
+}
+
+static void dvr_unlink (struct dvr*d, struct part*pt)
+{
+	struct route*r, *n;
+	unsigned i;
+	int l = find_link (d, pt);
+
+	if (!pt || l < 0) return;
+
+	for (i = 0;i < d->tsize;++i)
+		for (r = d->tab[i];r;r = n) {
+			n = r->next;
+			set_offer (d, r, l, d->infinity);
+		}
+
+	/* before the slot is reused, the changes are sent and hops updated */
+	d->links[l].pt = 0;
+	settle (d);
+}
+
+static void dvr_address (struct dvr*d, const char*addr, struct part*local)
+{
+	uint8_t k[MAX_KEY];
+	struct route*r;
+	int bits = parse_key (addr, k);
+
+	if (bits <= 0) return;
+	r = local ? get_route (d, k, bits) : find_route (d, k, bits);
+	if (!r) return;
+
+	r->local = local;
+	recompute (d, r);
+	update_hops (d, r); /* local part could change with the same metric */
+	if (is_dead (r) && !r->dirty && !r->stale) free_route (d, r);
+}
+
+static void arm_refresh (struct dvr*d)
+{
+	if (d->refresh_armed || !d->refresh_us) return;
+	d->refresh->data.time = d->refresh_us;
+	if (!cloudvpn_register_event (d->refresh) ) d->refresh_armed = 1;
+}
+
+static void dvr_command (struct dvr*d, struct packet*p)
+{
+	struct command c;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "link", 1) )
+		dvr_link (d, cloudvpn_find_part_by_name (c.argv[1]),
+		          c.argc > 2 ? atoi (c.argv[2]) : 1);
+
+	else if (cloudvpn_command_is (&c, "unlink", 1) )
+		dvr_unlink (d, cloudvpn_find_part_by_name (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "address", 2) )
+		dvr_address (d, c.argv[1], cloudvpn_find_part_by_name (c.argv[2]) );
+
+	else if (cloudvpn_command_is (&c, "forget", 1) )
+		dvr_address (d, c.argv[1], 0);
+
+	else if (cloudvpn_command_is (&c, "infinity", 1) ) {
+		/* only before there are any routes, metrics would be off */
+		if (!d->count && atoi (c.argv[1]) > 1 && atoi (c.argv[1]) < 65535)
+			d->infinity = atoi (c.argv[1]);
+
+	} else if (cloudvpn_command_is (&c, "trigger", 1) )
+		d->trigger_us = 1000ULL * atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "refresh", 1) ) {
+		d->refresh_us = 1000000ULL * atoi (c.argv[1]);
+		arm_refresh (d);
+
+	} else if (cloudvpn_command_is (&c, "mtu", 1) ) {
+		if (atoi (c.argv[1]) >= 1 + ENTRY_HDR + MAX_KEY)
+			d->mtu = atoi (c.argv[1]);
+
+	} else if (cloudvpn_command_is (&c, "priority", 1) )
+		d->priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "paths", 1) ) {
+		/* takes effect as the routes change */
+		if (atoi (c.argv[1]) > 0) d->paths = atoi (c.argv[1]);
+
+	} else if (cloudvpn_command_is (&c, "damping", 1) ) {
+		d->half_life_us = 1000000ULL * atoi (c.argv[1]);
+		if (c.argc > 3 && atoi (c.argv[3]) > 0 &&
+		        atoi (c.argv[2]) > atoi (c.argv[3]) ) {
+			d->suppress = atoi (c.argv[2]);
+			d->reuse = atoi (c.argv[3]);
+		}
+	}
+
+	else if (cloudvpn_command_is (&c, "direct", 1) )
+		/* forwarding goes on with the old one meanwhile */
+		cl_lpm_set_direct (&d->lpm, atoi (c.argv[1]) );
+
+	/* local changes were done right away */
+	flush_hops (d);
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void dvr_event (struct dvr*d, struct event_data*e)
+{
+	int i;
+
+	cl_mutex_lock (&d->lock);
+
+	switch ( (uintptr_t) e->priv) {
+	case ev_trigger:
+		d->trigger_armed = 0;
+		settle (d);
+		break;
+
+	case ev_damping:
+		d->damping_armed = 0;
+		check_damping (d);
+		flush_hops (d);
+		break;
+
+	case ev_refresh:
+		d->refresh_armed = 0;
+		for (i = 0;i < MAX_LINKS;++i)
+			if (d->links[i].pt) send_full (d, i);
+		arm_refresh (d);
+		break;
+	}
+
+	cl_mutex_unlock (&d->lock);
+}
+
+static void dvr_process_work (struct part*p, struct work*w)
+{
+	struct dvr*d = p->data;
+
+	if (!d) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		if (w->p->soff) {
+			forward (d, w);
+			break;
+		}
+		cl_mutex_lock (&d->lock);
+		receive_control (d, w->p);
+		flush_hops (d);
+		cl_mutex_unlock (&d->lock);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		dvr_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		dvr_event (d, &w->e);
+		break;
+	}
+}
+
+static struct event* new_timer (struct dvr*d, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = d->priority;
+	e->is_static = 1;
+	e->data.type = event_time;
+	e->data.owner = d->self;
+	e->data.priv = (void*) (uintptr_t) kind;
+	return e;
+}
+
+static uint64_t flow_hits (void*arg)
+{
+	struct cl_flow_stats s;
+
+	cl_flow_cache_stats (& ( (struct dvr*) arg)->flows, &s);
+	return s.hits;
+}
+
+static uint64_t flow_misses (void*arg)
+{
+	struct cl_flow_stats s;
+
+	cl_flow_cache_stats (& ( (struct dvr*) arg)->flows, &s);
+	return s.misses;
+}
+
+static uint64_t flow_evictions (void*arg)
+{
+	struct cl_flow_stats s;
+
+	cl_flow_cache_stats (& ( (struct dvr*) arg)->flows, &s);
+	return s.evictions;
+}
+
+static int new_metrics (struct dvr*d)
+{
+	static uint64_t (*const flow[3]) (void*) = {
+		flow_hits, flow_misses, flow_evictions
+	};
+	int i, fail = 0;
+
+	for (i = 0;i < m_count;++i) {
+		d->m[i] = i < m_flow_hits ?
+		          cl_metric_counter (d->self, metric_names[i][0],
+		                             metric_names[i][1]) :
+		          cl_metric_counter_fn (d->self, metric_names[i][0],
+		                                metric_names[i][1],
+		                                flow[i - m_flow_hits], d);
+		fail |= !d->m[i];
+	}
+	return fail;
+}
+
+static void free_metrics (struct dvr*d)
+{
+	int i;
+
+	for (i = 0;i < m_count;++i) cl_metric_free (d->m[i]);
+}
+
+static void dvr_init (struct part*p)
+{
+	struct dvr*d = cl_calloc (1, sizeof (struct dvr) );
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	d->self = p;
+	d->infinity = 64;
+	d->mtu = 1400;
+	d->paths = 8;
+	d->half_life_us = 15000000ULL;
+	d->suppress = 3000;
+	d->reuse = 750;
+	d->trigger_us = 50000;
+	d->refresh_us = 300000000ULL;
+	d->tsize = 64;
+
+	d->tab = cl_calloc (d->tsize, sizeof (struct route*) );
+	d->trigger = new_timer (d, ev_trigger);
+	d->refresh = new_timer (d, ev_refresh);
+	d->damping = new_timer (d, ev_damping);
+	if (!d->tab || !d->trigger || !d->refresh || !d->damping ||
+	        cl_lpm_init (&d->lpm, 8) ||
+	        cl_flow_cache_init (&d->flows, FLOW_CACHE) || new_metrics (d) ) {
+		free_metrics (d);
+		if (d->tab) cl_free (d->tab);
+		if (d->trigger) cloudvpn_delete_event (d->trigger);
+		if (d->refresh) cloudvpn_delete_event (d->refresh);
+		if (d->damping) cloudvpn_delete_event (d->damping);
+		cl_mutex_destroy (&d->lock);
+		cl_free (d);
+		p->data = 0;
+		return;
+	}
+
+	arm_refresh (d);
+}
+
+static void dvr_fini (struct part*p)
+{
+	struct dvr*d = p->data;
+	struct route*r;
+	unsigned i;
+
+	if (!d) return;
+
+	cloudvpn_dispose_event (d->trigger);
+	cloudvpn_dispose_event (d->refresh);
+	cloudvpn_dispose_event (d->damping);
+
+	for (i = 0;i < d->tsize;++i)
+		while ( (r = d->tab[i]) ) free_route (d, r);
+	cl_free (d->tab);
+	flush_hops (d);
+	free_metrics (d); /* the flow cache ones read it */
+	cl_lpm_destroy (&d->lpm);
+	cl_flow_cache_destroy (&d->flows);
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "dvr";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = dvr_process_work;
+	thisplugin.init = dvr_init;
+	thisplugin.fini = dvr_fini;
 
-struct plugin* cloudvpn_plugin_get () {
 	return 0;
 }
 
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
@@ -14,15 +14,645 @@
 /*
  * init plugin for cloudvpn.
  *
- * This is intended to be autoloaded on cloudvpn startup, then read some config
- * files and/or receive instructions from something else; then configure
- * cloudvpn parts to act well together.
+ * Boot reads the config; this is what talks to cloudvpn afterwards. The
+ * part listens on a local unix socket, where anyone with the permission
+ * to it can configure the running parts and look at how it goes. Requests
+ * are lines of text, every reply ends with a line with just a dot:
  *
- * Should come with debug mode, so you can enter debug commands on cmdline.
- * Also may setup PID files etc.
+ *	send <part> <command...>	the command goes to the part as a
+ *				work_command (at the control priority)
+ *	stats [sched|pools|locks|boot|log|parts|trace]
+ *				snapshot of the counters, all of them or
+ *				just one kind
+ *	watch <ms>		a "sched" and "pools" line every ms, until
+ *				anything else is sent
+ *	trace <n>		trace every n-th packet, 0 stops it
+ *	trace json <path>	writes the recent traces for chrome://tracing
+ *	trace reset		forgets the per-part latencies
+ *	shutdown [restart]
+ *	quit
+ *
+ * Everything the socket does runs in event works at the control priority,
+ * below any forwarding. Replies go out through a small buffer per client;
+ * long ones (the parts, the locks) are made a piece at a time as the
+ * client reads them, so they're never held in memory whole and no lock is
+ * held for long.
+ *
+ * Commands:
+ *	control <path>	where to listen (the socket is only for the owner)
+ *	priority <n>	of the control works (250 by default)
+ *	close		stops listening and drops the clients
  */
 
 #include "api.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "client.h"
+#include "command.h"
+#include "boot.h"
+#include "shutdown.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS 16
+#define IN_SIZE 1024 /* longest request */
+#define MAX_LINE 512
+
+/* what a reply is made of, in this order */
+enum { s_none, s_sched, s_pools, s_locks, s_boot, s_log, s_parts, s_trace,
+       s_end
+     };
+
+static const char*sections[] =
+{ 0, "sched", "pools", "locks", "boot", "log", "parts", "trace", 0 };
+
+struct client {
+	struct cl_client io; /* first, pump hands it back */
+
+	char in[IN_SIZE];
+	int inlen;
+
+	int section, only; /* the reply that's being made */
+	int cursor; /* how far in the section it got */
+	uint32_t watch_ms;
+};
+
+struct init {
+	cl_mutex lock;
+	struct part*self;
+	uint8_t priority;
+
+	int lfd;
+	char*path;
+	struct event*accept;
+	uintptr_t gen;
+
+	struct client c[MAX_CLIENTS];
+
+	uint64_t requests, sent;
+};
+
+/*
+ * helpers
+ */
+
+static int unix_addr (const char*path, struct sockaddr_un*sa)
+{
+	if (strlen (path) >= sizeof (sa->sun_path) ) return 1;
+	memset (sa, 0, sizeof (*sa) );
+	sa->sun_family = AF_UNIX;
+	strcpy (sa->sun_path, path);
+	return 0;
+}
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * clients, everything is called with the lock held
+ */
+
+static void client_close (struct client*c)
+{
+	cl_client_close (&c->io);
+}
+
+static int client_open (struct init*d, struct client*c, int fd)
+{
+	c->inlen = 0;
+	c->section = s_none;
+	c->watch_ms = 0;
+	return cl_client_open (&c->io, d->self, d->priority, fd, c - d->c, 1);
+}
+
+/* appends a line if it fits whole, nonzero if it doesn't */
+static int out (struct client*c, const char*fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (c->io.outlen + MAX_LINE > CL_CLIENT_OUT) return 1;
+	va_start (ap, fmt);
+	n = vsnprintf (c->io.out + c->io.outlen, MAX_LINE, fmt, ap);
+	va_end (ap);
+	if (n >= MAX_LINE) {
+		n = MAX_LINE - 1;
+		c->io.out[c->io.outlen + n - 1] = '\n';
+	}
+	c->io.outlen += n;
+	return 0;
+}
+
+/*
+ * the sections of stats, each returns 1 when it's done and 0 when the
+ * buffer is full, having remembered where it stopped
+ */
+
+static int out_sched (struct client*c)
+{
+	struct cloudvpn_sched_stats s;
+
+	cloudvpn_scheduler_stats (&s);
+	return !out (c, "sched workers %d queued %llu scheduled %llu done %llu\n",
+	             cloudvpn_worker_count(), (unsigned long long) s.queued,
+	             (unsigned long long) s.scheduled,
+	             (unsigned long long) s.done);
+}
+
+static int out_pools (struct client*c)
+{
+	uint64_t mallocs, frees;
+	uint32_t size;
+
+	for (;!cloudvpn_packet_pool_stats (c->cursor, &size, &mallocs, &frees);
+	        ++c->cursor)
+		if (out (c, "pool %u mallocs %llu frees %llu\n", size,
+		         (unsigned long long) mallocs, (unsigned long long) frees) )
+			return 0;
+	return 1;
+}
+
+static int out_boot (struct client*c)
+{
+	struct cloudvpn_boot_times*t = cloudvpn_boot_times();
+
+	return !out (c, "boot parse_us %llu plugins_us %llu parts_us %llu "
+	             "control_us %llu plugins %d parts %d lazy_left %d "
+	             "failed %d\n", (unsigned long long) t->parse_us,
+	             (unsigned long long) t->plugins_us,
+	             (unsigned long long) t->parts_us,
+	             (unsigned long long) cl_atomic_load (&t->control_us),
+	             t->plugins, t->parts, cl_atomic_load (&t->lazy_left),
+	             t->failed);
+}
+
+static int out_log (struct client*c)
+{
+	struct cl_log_site*s;
+	uint64_t logged = 0, l, dropped;
+	int n = 0;
+
+	for (s = cl_log_sites();s;s = s->next, ++n) {
+		cl_log_counts (s, &l, &dropped);
+		logged += l;
+	}
+	return !out (c, "log sites %d logged %llu dropped %llu\n", n,
+	             (unsigned long long) logged,
+	             (unsigned long long) cl_log_dropped() );
+}
+
+/* the long ones: skip what was written before, stop when it's full */
+
+struct walk {
+	struct client*c;
+	int i;
+};
+
+static int lock_line (struct cl_mutex_stats*s, void*arg)
+{
+	struct walk*w = arg;
+
+	if (w->i++ < w->c->cursor) return 0;
+	if (out (w->c, "lock %s acquired %llu contended %llu wait_ns %llu "
+	         "max_hold_ns %llu failed %llu\n", s->name ? s->name : "-",
+	         (unsigned long long) cl_atomic_load (&s->acquired),
+	         (unsigned long long) cl_atomic_load (&s->contended),
+	         (unsigned long long) cl_atomic_load (&s->wait_ns),
+	         (unsigned long long) cl_atomic_load (&s->max_hold_ns),
+	         (unsigned long long) cl_atomic_load (&s->failed) ) )
+		return 1;
+	++w->c->cursor;
+	return 0;
+}
+
+static int part_line (struct part*p, void*arg)
+{
+	struct walk*w = arg;
+
+	if (w->i++ < w->c->cursor) return 0;
+	if (out (w->c, "part %s plugin %s refs %d mem %llu peak %llu "
+	         "limit %llu\n", p->name ? p->name : "-",
+	         p->p && p->p->name ? p->p->name : "-",
+	         cl_sem_value (&p->refcount),
+	         (unsigned long long) (p->mem ? cl_mem_used (p->mem) : 0),
+	         (unsigned long long) (p->mem ? cl_atomic_load (&p->mem->peak) : 0),
+	         (unsigned long long) (p->mem ? p->mem->limit : 0) ) )
+		return 1;
+	++w->c->cursor;
+	return 0;
+}
+
+static int trace_line (struct cl_trace_stats*s, void*arg)
+{
+	struct walk*w = arg;
+
+	if (w->i++ < w->c->cursor) return 0;
+	if (out (w->c, "trace %s count %llu queue_p50 %llu queue_p99 %llu "
+	         "dispatch_p50 %llu dispatch_p99 %llu process_p50 %llu "
+	         "process_p99 %llu process_max %llu\n", s->part,
+	         (unsigned long long) s->count,
+	         (unsigned long long) s->queue.p50,
+	         (unsigned long long) s->queue.p99,
+	         (unsigned long long) s->dispatch.p50,
+	         (unsigned long long) s->dispatch.p99,
+	         (unsigned long long) s->process.p50,
+	         (unsigned long long) s->process.p99,
+	         (unsigned long long) s->process.max) )
+		return 1;
+	++w->c->cursor;
+	return 0;
+}
+
+static int out_locks (struct client*c)
+{
+	struct walk w = {c, 0};
+	return !cl_mutex_stats_walk (lock_line, &w);
+}
+
+static int out_parts (struct client*c)
+{
+	struct walk w = {c, 0};
+	return !cloudvpn_walk_parts (part_line, &w);
+}
+
+static int out_trace (struct client*c)
+{
+	struct walk w = {c, 1};
+	uint64_t sampled, finished, dropped;
+
+	if (!c->cursor) {
+		cl_trace_counts (&sampled, &finished, &dropped);
+		if (out (c, "trace every %u sampled %llu finished %llu "
+		         "dropped %llu\n", cl_atomic_load (&cl_trace_every),
+		         (unsigned long long) sampled,
+		         (unsigned long long) finished,
+		         (unsigned long long) dropped) )
+			return 0;
+		c->cursor = 1;
+	}
+	return !cl_trace_walk (trace_line, &w);
+}
+
+static int (*section_out[]) (struct client*) = {
+	0, out_sched, out_pools, out_locks, out_boot, out_log, out_parts,
+	out_trace, 0
+};
+
+static void fill (struct client*c)
+{
+	while (c->section != s_none) {
+		if (c->section == s_end) {
+			if (out (c, ".\n") ) return;
+			c->section = s_none;
+			return;
+		}
+		if (!section_out[c->section] (c) ) return;
+		c->section = c->only ? s_end : c->section + 1;
+		c->cursor = 0;
+	}
+}
+
+/*
+ * requests
+ */
+
+static void reply (struct client*c, const char*fmt, ...)
+{
+	/* short ones, they always fit into an empty buffer */
+	va_list ap;
+	int n;
+
+	va_start (ap, fmt);
+	n = vsnprintf (c->io.out + c->io.outlen, MAX_LINE, fmt, ap);
+	va_end (ap);
+	if (n >= MAX_LINE) n = MAX_LINE - 1;
+	c->io.outlen += n;
+	c->section = s_end;
+}
+
+static int send_command (struct init*d, const char*name, const char*text)
+{
+	struct part*p = cloudvpn_find_part_by_name (name);
+	int len = strlen (text);
+	struct packet*pk;
+	struct work*w;
+
+	if (!p) return 1;
+	if (! (pk = cloudvpn_packet_alloc_buf (len) ) ) return 2;
+	memcpy (pk->data, text, len);
+	pk->soff = pk->doff = 0;
+	pk->src_part = d->self;
+	pk->next_part = p;
+
+	if (! (w = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (pk);
+		return 2;
+	}
+	w->type = work_command;
+	w->priority = d->priority;
+	w->is_static = 0;
+	w->p = pk;
+	if (cloudvpn_schedule_work (w) ) {
+		cl_free (w);
+		cloudvpn_packet_free (pk);
+		return 2;
+	}
+	++d->sent;
+	return 0;
+}
+
+static void request (struct init*d, struct client*c, char*line)
+{
+	char*name, *text;
+	int i;
+
+	++d->requests;
+	c->watch_ms = 0; /* anything stops the watch */
+	c->cursor = 0;
+
+	while (*line == ' ' || *line == '\t') ++line;
+	if (!*line) return;
+
+	if (!strncmp (line, "send ", 5) ) {
+		for (name = line + 5;*name == ' ';++name);
+		for (text = name;*text && *text != ' ';++text);
+		if (*text) *text++ = 0;
+		switch (send_command (d, name, text) ) {
+		case 0:
+			reply (c, "ok\n");
+			break;
+		case 1:
+			reply (c, "error: no part %.64s\n", name);
+			break;
+		default:
+			reply (c, "error: out of memory\n");
+		}
+
+	} else if (!strcmp (line, "stats") ) {
+		c->section = s_sched;
+		c->only = 0;
+
+	} else if (!strncmp (line, "stats ", 6) ) {
+		for (i = s_sched;i < s_end;++i)
+			if (!strcmp (line + 6, sections[i]) ) break;
+		if (i == s_end) reply (c, "error: no stats %.64s\n", line + 6);
+		else {
+			c->section = i;
+			c->only = 1;
+		}
+
+	} else if (!strncmp (line, "watch ", 6) ) {
+		c->watch_ms = atoi (line + 6);
+		if (!c->watch_ms) reply (c, "error: watch every how many ms?\n");
+		else {
+			c->io.tick->data.time = 0;
+			cl_client_arm (&c->io, c->io.tick, cl_ev_tick);
+		}
+
+	} else if (!strncmp (line, "trace json ", 11) ) {
+		if (cl_trace_write_json (line + 11) )
+			reply (c, "error: can't write %.64s\n", line + 11);
+		else reply (c, "ok\n");
+
+	} else if (!strcmp (line, "trace reset") ) {
+		cl_trace_reset();
+		reply (c, "ok\n");
+
+	} else if (!strncmp (line, "trace ", 6) ) {
+		cl_trace_set_every (atoi (line + 6) );
+		reply (c, "ok\n");
+
+	} else if (!strcmp (line, "shutdown") ) {
+		reply (c, "ok\n");
+		cloudvpn_shutdown (0);
+
+	} else if (!strcmp (line, "shutdown restart") ) {
+		reply (c, "ok\n");
+		cloudvpn_shutdown (1);
+
+	} else if (!strcmp (line, "quit") )
+		client_close (c);
+
+	else reply (c, "error: what's %.64s?\n", line);
+}
+
+/* runs the requests that came in, one at a time, returns 0 if it waits */
+static int next_request (struct init*d, struct client*c)
+{
+	char*e;
+	int n;
+
+	if (c->io.fd < 0 || c->section != s_none || c->io.outlen) return 0;
+	e = memchr (c->in, '\n', c->inlen);
+	if (!e) {
+		if (c->inlen < IN_SIZE) return 0;
+		c->inlen = 0; /* nobody sends lines like that */
+		reply (c, "error: too long\n");
+		return 1;
+	}
+
+	*e = 0;
+	if (e > c->in && e[-1] == '\r') e[-1] = 0;
+	request (d, c, c->in);
+	if (c->io.fd < 0) return 0;
+
+	n = e + 1 - c->in;
+	memmove (c->in, e + 1, c->inlen - n);
+	c->inlen -= n;
+	return 1;
+}
+
+static int more (struct cl_client*io, void*arg)
+{
+	struct client*c = (struct client*) io;
+
+	if (c->section == s_none && !next_request (arg, c) ) return 1;
+	fill (c);
+	return 0;
+}
+
+static void pump (struct init*d, struct client*c)
+{
+	if (cl_client_pump (&c->io, more, d) ) return;
+	if (cl_client_arm (&c->io, c->io.rx, cl_ev_rx) ) client_close (c);
+}
+
+/*
+ * events
+ */
+
+static void accept_client (struct init*d)
+{
+	int fd = cl_client_accept (&d->lfd, d->accept), i;
+
+	if (fd < 0) return;
+	for (i = 0;i < MAX_CLIENTS;++i) if (d->c[i].io.fd < 0) break;
+	if (i == MAX_CLIENTS) close (fd);
+	else client_open (d, d->c + i, fd);
+}
+
+static void client_readable (struct init*d, struct client*c)
+{
+	ssize_t n;
+
+	n = read (c->io.fd, c->in + c->inlen, IN_SIZE - c->inlen);
+	if (!n || (n < 0 && errno != EAGAIN && errno != EINTR) ) {
+		client_close (c);
+		return;
+	}
+	if (n > 0) c->inlen += n;
+	if (c->watch_ms && memchr (c->in, '\n', c->inlen) ) c->watch_ms = 0;
+	pump (d, c);
+}
+
+static void client_tick (struct init*d, struct client*c)
+{
+	if (!c->watch_ms) return;
+
+	/* a line only if the last one is gone, slow readers get fewer */
+	if (c->section == s_none && !c->io.outlen) {
+		out (c, "time_us %llu\n", (unsigned long long) now_us() );
+		out_sched (c);
+		c->cursor = 0;
+		out_pools (c);
+		pump (d, c);
+		if (c->io.fd < 0) return;
+	}
+
+	c->io.tick->data.time = 1000ULL * c->watch_ms;
+	if (cl_client_arm (&c->io, c->io.tick, cl_ev_tick) ) client_close (c);
+}
+
+static void init_event (struct init*d, struct event_data*e)
+{
+	struct client*c;
+	int kind = cl_ev_tag_kind (e->priv);
+
+	cl_mutex_lock (&d->lock);
+
+	if (kind == cl_ev_accept) {
+		if (d->lfd >= 0 && cl_ev_tag_gen (e->priv) == d->gen)
+			accept_client (d);
+		cl_mutex_unlock (&d->lock);
+		return;
+	}
+
+	c = d->c + cl_ev_tag_slot (e->priv) % MAX_CLIENTS;
+	if (c->io.fd < 0 || cl_ev_tag_gen (e->priv) != c->io.gen) {
+		cl_mutex_unlock (&d->lock);
+		return;
+	}
+	c->io.armed &= ~ (1 << kind);
+
+	switch (kind) {
+	case cl_ev_rx:
+		client_readable (d, c);
+		break;
+	case cl_ev_tx:
+		pump (d, c);
+		break;
+	case cl_ev_tick:
+		client_tick (d, c);
+		break;
+	}
+
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * commands
+ */
+
+static void stop_listening (struct init*d)
+{
+	int i;
+
+	for (i = 0;i < MAX_CLIENTS;++i) client_close (d->c + i);
+	if (d->lfd < 0) return;
+
+	close (d->lfd);
+	d->lfd = -1;
+	cloudvpn_dispose_event (d->accept);
+	d->accept = 0;
+	++d->gen;
+	if (d->path) {
+		unlink (d->path);
+		cl_free (d->path);
+		d->path = 0;
+	}
+}
+
+static int control_listen (struct init*d, const char*path)
+{
+	struct sockaddr_un sa;
+	mode_t mask;
+	int fd, r;
+
+	stop_listening (d);
+	if (unix_addr (path, &sa) ) return 1;
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+	unlink (path);
+	mask = umask (0077);
+	r = bind (fd, (struct sockaddr*) &sa, sizeof (sa) );
+	umask (mask);
+	if (r || listen (fd, MAX_CLIENTS) || cl_set_nonblock (fd) ) goto fail;
+
+	d->accept = cl_client_event (d->self, d->priority, event_fd_readable, fd,
+	                             d->gen, 0, cl_ev_accept);
+	d->path = cl_malloc (strlen (path) + 1);
+	if (!d->accept || !d->path) goto fail;
+	strcpy (d->path, path);
+	d->lfd = fd;
+	if (cloudvpn_register_event (d->accept) ) goto fail;
+	return 0;
+
+fail:
+	if (d->accept) cloudvpn_delete_event (d->accept);
+	if (d->path) cl_free (d->path);
+	d->accept = 0;
+	d->path = 0;
+	d->lfd = -1;
+	close (fd);
+	unlink (path);
+	return 1;
+}
+
+static void init_command (struct init*d, struct packet*p)
+{
+	struct command c;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "control", 1) )
+		control_listen (d, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "priority", 1) )
+		d->priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "close", 0) )
+		stop_listening (d);
+
+	cl_mutex_unlock (&d->lock);
+}
 
 /*
  * plugin functions
@@ -30,14 +660,49 @@
 
 static void initplugin_process_work (struct part*p, struct work*w)
 {
+	struct init*d = p->data;
+
+	switch (w->type) {
+	case work_packet:
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		if (d) init_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		if (d) init_event (d, &w->e);
+		break;
+	}
 }
 
 static void initplugin_init (struct part*p)
 {
+	struct init*d = cl_calloc (1, sizeof (struct init) );
+	int i;
+
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	d->self = p;
+	d->priority = LOWEST_PRIORITY - 5;
+	d->lfd = -1;
+	for (i = 0;i < MAX_CLIENTS;++i) d->c[i].io.fd = -1;
 }
 
 static void initplugin_fini (struct part*p)
 {
+	struct init*d = p->data;
+	if (!d) return;
+
+	cl_mutex_lock (&d->lock);
+	stop_listening (d);
+	cl_mutex_unlock (&d->lock);
+
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
 }
 
 /*
@@ -60,4 +725,3 @@ int cloudvpn_plugin_init()
 struct plugin* cloudvpn_plugin_get () {
 	return &thisplugin;
 }
-
@@ -10,9 +10,314 @@
  * if not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * log plugin. Whatever is logged with cl_log (see log.h) sits in the rings
+ * of the threads that logged it; this part's own thread takes it from
+ * there, formats it and writes it out in big batches, so that no worker
+ * ever waits for a disk or a terminal. Once a second it also tells how
+ * many records were dropped by rate limits or full rings, if any.
+ *
+ * There is only one log; a second log part doesn't do anything.
+ *
+ * Commands:
+ *	level error|warn|info|debug	(info by default)
+ *	rate <n>	records a second a call site may log (1000 by default,
+ *			0 is unlimited)
+ *	file <path>	where it goes, "-" is stderr (the default); the file
+ *			is appended to
+ *	sites		writes out what every call site logged and dropped
+ */
+
 #include "api.h"
+#include "alloc.h"
+#include "command.h"
+#include "log.h"
 
-struct plugin* cloudvpn_plugin_get () {
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BUF_SIZE 65536
+#define MAX_LINE 1024 /* longer lines get cut */
+#define IDLE_US 10000 /* longest sleep when the rings are empty */
+
+struct log {
+	cl_mutex lock; /* requests from commands */
+	char*file; /* to be opened by the thread */
+	int sites;
+
+	int fd;
+	pthread_t thread;
+	int quit;
+
+	char buf[BUF_SIZE];
+	int len;
+	uint64_t last_report, reported_drops;
+
+	uint64_t written, batches;
+};
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * output, all of it is done by the log thread
+ */
+
+static void flush (struct log*d)
+{
+	int n, done = 0;
+
+	while (done < d->len) {
+		n = write (d->fd, d->buf + done, d->len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break; /* nowhere to put it, it's gone */
+		done += n;
+	}
+	if (d->len) ++d->batches;
+	d->len = 0;
+}
+
+static void emit (struct cl_log_rec*r, void*arg)
+{
+	struct log*d = arg;
+	int n;
+
+	if (d->len + MAX_LINE > BUF_SIZE) flush (d);
+	n = cl_log_format (r, d->buf + d->len, MAX_LINE);
+	if (n >= MAX_LINE) {
+		n = MAX_LINE - 1;
+		d->buf[d->len + n - 1] = '\n';
+	}
+	d->len += n;
+	++d->written;
+}
+
+static void line (struct log*d, const char*fmt, ...)
+{
+	/* our own messages, they don't go through the rings */
+	va_list ap;
+	int n;
+
+	if (d->len + MAX_LINE > BUF_SIZE) flush (d);
+	va_start (ap, fmt);
+	n = vsnprintf (d->buf + d->len, MAX_LINE, fmt, ap);
+	va_end (ap);
+	if (n >= MAX_LINE) n = MAX_LINE - 1;
+	d->len += n;
+}
+
+static void reopen (struct log*d, const char*file)
+{
+	int fd = 2;
+
+	if (strcmp (file, "-") ) {
+		fd = open (file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd < 0) {
+			line (d, "log: can't open %s, keeping the old one\n", file);
+			return;
+		}
+	}
+	flush (d);
+	if (d->fd != 2) close (d->fd);
+	d->fd = fd;
+}
+
+static void write_sites (struct log*d)
+{
+	struct cl_log_site*s;
+	uint64_t logged, dropped;
+
+	for (s = cl_log_sites();s;s = s->next) {
+		cl_log_counts (s, &logged, &dropped);
+		line (d, "log: %llu logged, %llu dropped: %s\n",
+		      (unsigned long long) logged, (unsigned long long) dropped,
+		      s->fmt);
+	}
+}
+
+static void requests (struct log*d)
+{
+	char*file;
+	int sites;
+
+	cl_mutex_lock (&d->lock);
+	file = d->file;
+	d->file = 0;
+	sites = d->sites;
+	d->sites = 0;
+	cl_mutex_unlock (&d->lock);
+
+	if (file) {
+		reopen (d, file);
+		cl_free (file);
+	}
+	if (sites) write_sites (d);
+}
+
+static void report_drops (struct log*d)
+{
+	uint64_t now = now_us(), n;
+
+	if (now - d->last_report < 1000000) return;
+	d->last_report = now;
+	n = cl_log_dropped();
+	if (n == d->reported_drops) return;
+	line (d, "log: %llu records dropped\n",
+	      (unsigned long long) (n - d->reported_drops) );
+	d->reported_drops = n;
+}
+
+static void* log_thread (void*arg)
+{
+	struct log*d = arg;
+	int idle = 0;
+
+	d->last_report = now_us();
+	while (!cl_atomic_load_acq (&d->quit) ) {
+		requests (d);
+		if (cl_log_drain (emit, d) ) idle = 0;
+		report_drops (d);
+		flush (d);
+
+		/* sleeps longer the longer there's nothing */
+		if (idle) usleep (idle);
+		idle = idle ? 2 * idle : 100;
+		if (idle > IDLE_US) idle = IDLE_US;
+	}
+
+	/* whatever was logged until the detach */
+	requests (d);
+	cl_log_drain (emit, d);
+	d->last_report = 0;
+	report_drops (d);
+	flush (d);
 	return 0;
 }
 
+/*
+ * commands
+ */
+
+static const char*levels[] = {"error", "warn", "info", "debug", 0};
+
+static void log_command (struct log*d, struct packet*p)
+{
+	struct command c;
+	int i;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	if (cloudvpn_command_is (&c, "level", 1) ) {
+		for (i = 0;levels[i];++i)
+			if (!strcmp (c.argv[1], levels[i]) )
+				cl_atomic_store (&cl_log_level, i);
+
+	} else if (cloudvpn_command_is (&c, "rate", 1) )
+		cl_atomic_store (&cl_log_rate, atoi (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "file", 1) ) {
+		cl_mutex_lock (&d->lock);
+		if (d->file) cl_free (d->file);
+		d->file = cl_malloc (strlen (c.argv[1]) + 1);
+		if (d->file) strcpy (d->file, c.argv[1]);
+		cl_mutex_unlock (&d->lock);
+
+	} else if (cloudvpn_command_is (&c, "sites", 0) ) {
+		cl_mutex_lock (&d->lock);
+		d->sites = 1;
+		cl_mutex_unlock (&d->lock);
+	}
+}
+
+/*
+ * plugin functions
+ */
+
+static void log_process_work (struct part*p, struct work*w)
+{
+	struct log*d = p->data;
+
+	switch (w->type) {
+	case work_packet:
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		if (d) log_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	}
+}
+
+static void log_init (struct part*p)
+{
+	struct log*d;
+
+	p->data = 0;
+	if (cl_log_attach (CL_LOG_INFO) ) return; /* there already is a log */
+
+	d = cl_calloc (1, sizeof (struct log) );
+	if (!d) {
+		cl_log_detach();
+		return;
+	}
+	cl_mutex_init (&d->lock, 0);
+	d->fd = 2;
+
+	if (pthread_create (&d->thread, 0, log_thread, d) ) {
+		cl_mutex_destroy (&d->lock);
+		cl_free (d);
+		cl_log_detach();
+		return;
+	}
+	p->data = d;
+}
+
+static void log_fini (struct part*p)
+{
+	struct log*d = p->data;
+
+	if (!d) return;
+
+	/* nothing new comes in, the thread writes out the rest */
+	cl_log_detach();
+	cl_atomic_store_rel (&d->quit, 1);
+	pthread_join (d->thread, 0);
+
+	if (d->fd != 2) close (d->fd);
+	if (d->file) cl_free (d->file);
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "log";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = log_process_work;
+	thisplugin.init = log_init;
+	thisplugin.fini = log_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
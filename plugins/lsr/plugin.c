@@ -0,0 +1,1517 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * link-state routing plugin, an alternative to dvr.
+ *
+ * One part is one router, with a 64-bit router id. Links are other parts
+ * that lead to neighbor routers, same as in dvr, and packets are forwarded
+ * by the longest prefix of their destination address (lpm.h, lock-free).
+ *
+ * Every router describes itself in one link-state record (LSA): its
+ * neighbors with costs, and the prefixes it delivers. Records are flooded
+ * to everyone; each carries a sequence number, and a router only takes
+ * (and floods further) a record newer than what it has. Older copies get
+ * answered by the newer one, so a restarted router that starts counting
+ * again from 1 catches up with its own old records.
+ *
+ * The database is compact: nodes are in one array, found by id through a
+ * hash, and a record is kept parsed (edges are node indexes and costs,
+ * prefixes are pointers to the shared prefix table), not as the raw bytes.
+ * A link between two routers is only used if both of them list it.
+ *
+ * Paths are computed by incremental SPF. When a record changes, only the
+ * edges that it changed are looked at: nodes below an edge that got worse
+ * (in the shortest path tree) are cut off and get reattached from their
+ * neighbors, and edges that got better are relaxed from; then Dijkstra runs
+ * only from those nodes. Usually that's a tiny part of the graph.
+ *
+ * Packets with empty destination address carry the protocol:
+ *
+ *	u8 type		LSR_HELLO, LSR_LSA
+ *	hello:	u64 id		of the router that sends it
+ *		u32 interval	of its liveness probes in us, 0 if off
+ *	lsa:	records of
+ *		u64 id, u32 seq, u16 edges, u16 prefixes
+ *		edges of u64 id, u32 cost
+ *		prefixes of u16 bits, (bits+7)/8 bytes
+ *
+ * Commands:
+ *	id <hex>		router id (default is made of the part name)
+ *	link <part> [cost]	neighbor behind the part (cost default 1)
+ *	unlink <part>
+ *	address <prefix> <part>	prefix that is delivered to a local part
+ *	forget <prefix>
+ *	refresh <s>		records are renewed this often, and dropped
+ *				when not renewed for 3 times that (default
+ *				1800, 0 is off)
+ *	spf full|incremental	full is only for comparison
+ *	mtu <bytes>		max size of packets with records (default 1400)
+ *	priority <n>		priority of the protocol packets (default 0)
+ *	direct <bits>		direct table size of the trie (as in dvr)
+ *	liveness <ms> [mult]	hellos are sent this often on every link,
+ *				and a neighbor that wasn't heard from for
+ *				mult (default 3) times that is taken down at
+ *				once (0 is off, the default); both ends need
+ *				it on
+ *
+ * Prefixes are written in hex, ':' and '.' can separate the bytes, and
+ * "/bits" can follow (default is all the bytes).
+ */
+
+#include "api.h"
+#include "alloc.h"
+#include "command.h"
+#include "liveness.h"
+#include "lpm.h"
+#include "wire.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define LSR_HELLO 1
+#define LSR_LSA 2
+
+#define MAX_LINKS 64
+#define MAX_KEY 255 /* bytes */
+#define MAX_COST 65535
+
+#define LSA_HDR 16
+#define EDGE_LEN 12
+
+#define INF 0xffffffffU
+#define NONE 0xffffffffU
+#define SELF 0 /* node index of this router */
+
+#define key_bytes(bits) ( ( (bits) + 7) / 8)
+
+enum { ev_refresh, ev_live };
+
+/* node flags */
+#define N_INVALID 1 /* cut off from the tree, waits for reattaching */
+#define N_CHANGED 2 /* its prefixes need a look */
+#define N_SEEN 4
+
+struct edge {
+	uint32_t to; /* node index */
+	uint32_t cost;
+};
+
+struct prefix {
+	struct prefix*next; /* hash chain */
+	struct part*local; /* delivered here, if it's ours */
+	struct part*hop; /* what forwarding sees, 0 if unreachable */
+	uint32_t*origins; /* nodes that announce it */
+	unsigned norigins;
+	uint8_t mark;
+	uint16_t bits;
+	uint8_t key[];
+};
+
+struct node {
+	uint64_t id;
+	uint32_t seq; /* 0 if no record was heard yet */
+	uint32_t nedges, nprefixes;
+	struct edge*edges;
+	struct prefix**prefixes;
+	uint64_t heard_us;
+	uint32_t hnext; /* id hash chain */
+
+	/* shortest path tree */
+	uint32_t dist; /* INF if unreachable */
+	uint32_t parent;
+	int16_t link; /* first hop, -1 if none */
+	uint8_t flags;
+};
+
+struct link {
+	struct part*pt; /* 0 if the slot is free */
+	unsigned cost;
+	uint32_t nbr; /* node behind it, NONE until it says hello */
+	int live; /* liveness peer, -1 if none */
+};
+
+struct vec {
+	uint32_t*v;
+	unsigned n, cap;
+};
+
+struct heap_ent {
+	uint32_t dist, node;
+};
+
+struct lsr {
+	cl_mutex lock;
+	struct part*self;
+
+	/* topology; node 0 is us */
+	struct node*nodes;
+	unsigned nnodes, cap;
+	uint32_t*htab;
+	unsigned hsize;
+
+	struct link links[MAX_LINKS];
+
+	/* prefixes, hashed; reachable ones are also in lpm */
+	struct prefix**ptab;
+	unsigned psize, pcount;
+	struct cl_lpm lpm;
+	struct prefix*old_prefixes; /* gone, to free after readers leave */
+
+	/* spf scratch */
+	struct heap_ent*heap;
+	unsigned hn, hcap;
+	struct vec changed, invalid, stack, seen;
+
+	int full_spf;
+	unsigned mtu;
+	uint8_t priority;
+	uint64_t refresh_us;
+	struct event*refresh;
+	int refresh_armed;
+
+	struct cl_live live;
+	int live_on, live_armed;
+	struct event*live_timer;
+
+	uint64_t forwarded, dropped;
+	uint64_t lsa_sent, lsa_received, spf_runs, spf_nodes;
+};
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int vec_push (struct vec*v, uint32_t x)
+{
+	uint32_t*n;
+
+	if (v->n == v->cap) {
+		n = cl_realloc (v->v, (v->cap ? v->cap * 2 : 64) * sizeof (uint32_t) );
+		if (!n) return 1;
+		v->v = n;
+		v->cap = v->cap ? v->cap * 2 : 64;
+	}
+	v->v[v->n++] = x;
+	return 0;
+}
+
+static inline int seq_newer (uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b) > 0;
+}
+
+static inline void put64 (uint8_t*b, uint64_t v)
+{
+	wire_put32 (b, v >> 32);
+	wire_put32 (b + 4, v);
+}
+
+static inline uint64_t get64 (const uint8_t*b)
+{
+	return ( (uint64_t) wire_get32 (b) << 32) | wire_get32 (b + 4);
+}
+
+/*
+ * nodes
+ */
+
+static uint32_t id_hash (uint64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	return id;
+}
+
+static uint32_t find_node (struct lsr*d, uint64_t id)
+{
+	uint32_t i = d->htab[id_hash (id) & (d->hsize - 1)];
+
+	while (i != NONE && d->nodes[i].id != id) i = d->nodes[i].hnext;
+	return i;
+}
+
+static int grow_nodes (struct lsr*d)
+{
+	struct node*n;
+	uint32_t*h, i, s;
+
+	n = cl_realloc (d->nodes, 2 * d->cap * sizeof (struct node) );
+	if (!n) return 1;
+	d->nodes = n;
+	d->cap *= 2;
+
+	/* hash is kept as big as the array */
+	h = cl_malloc (d->cap * sizeof (uint32_t) );
+	if (!h) return 0; /* old one works, only with longer chains */
+	for (i = 0;i < d->cap;++i) h[i] = NONE;
+	for (i = 0;i < d->nnodes;++i) {
+		s = id_hash (d->nodes[i].id) & (d->cap - 1);
+		d->nodes[i].hnext = h[s];
+		h[s] = i;
+	}
+	cl_free (d->htab);
+	d->htab = h;
+	d->hsize = d->cap;
+	return 0;
+}
+
+static uint32_t get_node (struct lsr*d, uint64_t id)
+{
+	/* creates an empty one; note that d->nodes can move */
+	uint32_t i = find_node (d, id), s;
+	struct node*n;
+
+	if (i != NONE) return i;
+	if (d->nnodes == d->cap && grow_nodes (d) ) return NONE;
+
+	i = d->nnodes++;
+	n = d->nodes + i;
+	memset (n, 0, sizeof (struct node) );
+	n->id = id;
+	n->dist = INF;
+	n->parent = NONE;
+	n->link = -1;
+
+	s = id_hash (id) & (d->hsize - 1);
+	n->hnext = d->htab[s];
+	d->htab[s] = i;
+	return i;
+}
+
+static void rehash_self (struct lsr*d, uint64_t id)
+{
+	/* router id changed, before anything else happened */
+	uint32_t*s = d->htab + (id_hash (d->nodes[SELF].id) & (d->hsize - 1) );
+
+	*s = d->nodes[SELF].hnext;
+	d->nodes[SELF].id = id;
+	s = d->htab + (id_hash (id) & (d->hsize - 1) );
+	d->nodes[SELF].hnext = *s;
+	*s = SELF;
+}
+
+static uint32_t edge_cost (struct lsr*d, uint32_t a, uint32_t b)
+{
+	/* a->b as a says, INF if it doesn't */
+	struct node*n = d->nodes + a;
+	unsigned i;
+
+	for (i = 0;i < n->nedges;++i)
+		if (n->edges[i].to == b) return n->edges[i].cost;
+	return INF;
+}
+
+static uint32_t two_way_cost (struct lsr*d, uint32_t a, uint32_t b)
+{
+	uint32_t c = edge_cost (d, a, b);
+
+	if (c == INF || edge_cost (d, b, a) == INF) return INF;
+	return c;
+}
+
+static int link_to (struct lsr*d, uint32_t nbr)
+{
+	/* the cheapest link to a neighbor */
+	int i, best = -1;
+
+	for (i = 0;i < MAX_LINKS;++i)
+		if (d->links[i].pt && d->links[i].nbr == nbr &&
+		        (best < 0 || d->links[i].cost < d->links[best].cost) )
+			best = i;
+	return best;
+}
+
+/*
+ * prefixes
+ */
+
+static uint32_t key_hash (const uint8_t*k, int bits)
+{
+	uint32_t h = 2166136261U ^ bits;
+	int len = key_bytes (bits);
+
+	while (len--) h = (h ^ *k++) * 16777619U;
+	return h;
+}
+
+static struct prefix** find_pslot (struct lsr*d, const uint8_t*k, int bits)
+{
+	struct prefix**x = d->ptab + (key_hash (k, bits) & (d->psize - 1) );
+
+	for (;*x;x = & (*x)->next)
+		if ( (*x)->bits == bits &&
+		        !memcmp ( (*x)->key, k, key_bytes (bits) ) ) break;
+	return x;
+}
+
+static void grow_ptab (struct lsr*d)
+{
+	unsigned size = d->psize * 2, i;
+	struct prefix**t = cl_calloc (size, sizeof (struct prefix*) ), *x, *n;
+
+	if (!t) return;
+	for (i = 0;i < d->psize;++i)
+		for (x = d->ptab[i];x;x = n) {
+			n = x->next;
+			x->next = t[key_hash (x->key, x->bits) & (size - 1)];
+			t[key_hash (x->key, x->bits) & (size - 1)] = x;
+		}
+	cl_free (d->ptab);
+	d->ptab = t;
+	d->psize = size;
+}
+
+static struct prefix* get_prefix (struct lsr*d, const uint8_t*k, int bits) {
+
+	/* k must have the bits after the prefix zeroed */
+	struct prefix**s = find_pslot (d, k, bits), *x;
+
+	if (*s) return *s;
+
+	x = cl_malloc (sizeof (struct prefix) + key_bytes (bits) );
+	if (!x) return 0;
+	memset (x, 0, sizeof (struct prefix) );
+	memcpy (x->key, k, key_bytes (bits) );
+	x->bits = bits;
+
+	x->next = *s;
+	*s = x;
+	if (++d->pcount > d->psize) grow_ptab (d);
+	return x;
+}
+
+static int add_origin (struct prefix*x, uint32_t node)
+{
+	uint32_t*o = cl_realloc (x->origins, (x->norigins + 1) * sizeof (uint32_t) );
+
+	if (!o) return 1;
+	x->origins = o;
+	x->origins[x->norigins++] = node;
+	return 0;
+}
+
+static void del_origin (struct prefix*x, uint32_t node)
+{
+	unsigned i;
+
+	for (i = 0;i < x->norigins;++i)
+		if (x->origins[i] == node) {
+			x->origins[i] = x->origins[--x->norigins];
+			return;
+		}
+}
+
+static void update_prefix (struct lsr*d, struct prefix*x)
+{
+	/* nearest origin wins; frees the prefix if nobody has it */
+	struct part*hop = 0;
+	struct prefix**s;
+	struct node*n;
+	uint32_t best = INF;
+	unsigned i;
+
+	for (i = 0;i < x->norigins;++i) {
+		n = d->nodes + x->origins[i];
+		if (n->dist >= best) continue;
+		if (x->origins[i] == SELF) {
+			if (!x->local) continue;
+			hop = x->local;
+		} else if (n->link < 0) continue;
+		else hop = d->links[n->link].pt;
+		best = n->dist;
+	}
+
+	if (hop != x->hop) {
+		if (!x->hop) {
+			cl_atomic_store_rel (&x->hop, hop);
+			if (cl_lpm_insert (&d->lpm, x->key, x->bits, x) ) x->hop = 0;
+		} else if (!hop) {
+			/* forwarding may still see it until flush_prefixes */
+			cl_lpm_unlink (&d->lpm, x->key, x->bits);
+			x->hop = 0;
+		} else cl_atomic_store_rel (&x->hop, hop);
+	}
+
+	if (x->norigins || x->hop) return;
+
+	s = find_pslot (d, x->key, x->bits);
+	*s = x->next;
+	--d->pcount;
+	if (x->origins) cl_free (x->origins);
+	x->next = d->old_prefixes;
+	d->old_prefixes = x;
+}
+
+static void flush_prefixes (struct lsr*d)
+{
+	/* one wait for all the prefixes that went away */
+	struct prefix*x;
+
+	if (!d->old_prefixes) return;
+
+	cl_lpm_synchronize (&d->lpm);
+	while ( (x = d->old_prefixes) ) {
+		d->old_prefixes = x->next;
+		cl_free (x);
+	}
+}
+
+static void set_prefixes (struct lsr*d, uint32_t u, struct prefix**np,
+                          unsigned nnp)
+{
+	/* new list of what u announces; takes np */
+	struct node*n = d->nodes + u;
+	struct prefix**op = n->prefixes;
+	unsigned nop = n->nprefixes, i;
+
+	/* 1 = only in old, 2 = in both, 3 = only in new */
+	for (i = 0;i < nop;++i) op[i]->mark = 1;
+	for (i = 0;i < nnp;++i) {
+		if (np[i]->mark == 1) np[i]->mark = 2;
+		else if (!np[i]->mark) {
+			np[i]->mark = 3;
+			if (add_origin (np[i], u) ) np[i]->mark = 4;
+		}
+	}
+
+	n->prefixes = np;
+	n->nprefixes = nnp;
+
+	for (i = 0;i < nop;++i)
+		if (op[i]->mark == 1) {
+			op[i]->mark = 0;
+			del_origin (op[i], u);
+			update_prefix (d, op[i]);
+		}
+	for (i = 0;i < nnp;++i) {
+		if (np[i]->mark == 3) update_prefix (d, np[i]);
+		np[i]->mark = 0;
+	}
+	if (op) cl_free (op);
+}
+
+/*
+ * spf
+ */
+
+static int heap_push (struct lsr*d, uint32_t dist, uint32_t node)
+{
+	struct heap_ent*h, e = {dist, node};
+	unsigned i, p;
+
+	if (d->hn == d->hcap) {
+		h = cl_realloc (d->heap, (d->hcap ? d->hcap * 2 : 256)
+		                * sizeof (struct heap_ent) );
+		if (!h) return 1;
+		d->heap = h;
+		d->hcap = d->hcap ? d->hcap * 2 : 256;
+	}
+
+	for (i = d->hn++;i;i = p) {
+		p = (i - 1) / 2;
+		if (d->heap[p].dist <= dist) break;
+		d->heap[i] = d->heap[p];
+	}
+	d->heap[i] = e;
+	return 0;
+}
+
+static int heap_pop (struct lsr*d, struct heap_ent*e)
+{
+	struct heap_ent last;
+	unsigned i, c;
+
+	if (!d->hn) return 0;
+	*e = d->heap[0];
+	last = d->heap[--d->hn];
+
+	for (i = 0; (c = 2 * i + 1) < d->hn;i = c) {
+		if (c + 1 < d->hn && d->heap[c + 1].dist < d->heap[c].dist) ++c;
+		if (last.dist <= d->heap[c].dist) break;
+		d->heap[i] = d->heap[c];
+	}
+	d->heap[i] = last;
+	return 1;
+}
+
+static void mark_changed (struct lsr*d, uint32_t i)
+{
+	if (d->nodes[i].flags & N_CHANGED) return;
+	if (vec_push (&d->changed, i) ) return;
+	d->nodes[i].flags |= N_CHANGED;
+}
+
+static void set_dist (struct lsr*d, uint32_t i, uint32_t dist, uint32_t parent)
+{
+	struct node*n = d->nodes + i;
+
+	n->dist = dist;
+	n->parent = parent;
+	n->link = parent == SELF ? link_to (d, i) : d->nodes[parent].link;
+	mark_changed (d, i);
+	heap_push (d, dist, i);
+}
+
+static void run_spf (struct lsr*d)
+{
+	/* plain dijkstra, from whatever is in the heap */
+	struct heap_ent e;
+	struct node*x;
+	uint32_t nd, y;
+	unsigned i;
+
+	while (heap_pop (d, &e) ) {
+		x = d->nodes + e.node;
+		if (e.dist != x->dist) continue;
+		++d->spf_nodes;
+
+		for (i = 0;i < x->nedges;++i) {
+			y = x->edges[i].to;
+			nd = x->dist + x->edges[i].cost;
+			if (nd >= d->nodes[y].dist) continue;
+			if (edge_cost (d, y, e.node) == INF) continue;
+			set_dist (d, y, nd, e.node);
+		}
+	}
+}
+
+static void full_spf (struct lsr*d)
+{
+	unsigned i;
+
+	for (i = 0;i < d->nnodes;++i) {
+		d->nodes[i].dist = INF;
+		d->nodes[i].parent = NONE;
+		d->nodes[i].link = -1;
+		mark_changed (d, i);
+	}
+	d->nodes[SELF].dist = 0;
+	d->hn = 0;
+	heap_push (d, 0, SELF);
+	run_spf (d);
+}
+
+static void invalidate (struct lsr*d, uint32_t v)
+{
+	/* cuts off the subtree of v */
+	struct node*x;
+	uint32_t i;
+	unsigned j;
+
+	d->stack.n = 0;
+	vec_push (&d->stack, v);
+
+	while (d->stack.n) {
+		i = d->stack.v[--d->stack.n];
+		x = d->nodes + i;
+		if (x->flags & N_INVALID) continue;
+		if (vec_push (&d->invalid, i) ) continue;
+
+		x->flags |= N_INVALID;
+		x->dist = INF;
+		x->parent = NONE;
+		x->link = -1;
+		mark_changed (d, i);
+
+		for (j = 0;j < x->nedges;++j)
+			if (d->nodes[x->edges[j].to].parent == i)
+				vec_push (&d->stack, x->edges[j].to);
+	}
+}
+
+static void reattach (struct lsr*d)
+{
+	/* cut-off nodes get the best offer from the rest of the tree */
+	struct node*x, *y;
+	uint32_t i, c, best, parent;
+	unsigned j, k;
+
+	for (k = 0;k < d->invalid.n;++k) {
+		i = d->invalid.v[k];
+		x = d->nodes + i;
+		best = INF;
+		parent = NONE;
+
+		for (j = 0;j < x->nedges;++j) {
+			y = d->nodes + x->edges[j].to;
+			if (y->dist == INF || (y->flags & N_INVALID) ) continue;
+			c = edge_cost (d, x->edges[j].to, i);
+			if (c == INF || y->dist + c >= best) continue;
+			best = y->dist + c;
+			parent = x->edges[j].to;
+		}
+		if (parent != NONE) set_dist (d, i, best, parent);
+	}
+
+	for (k = 0;k < d->invalid.n;++k)
+		d->nodes[d->invalid.v[k]].flags &= ~N_INVALID;
+	d->invalid.n = 0;
+}
+
+struct edge_change {
+	uint32_t v, uv, vu; /* costs u->v and v->u, both directions checked */
+};
+
+static void set_edges (struct lsr*d, uint32_t u, struct edge*ne, unsigned nne)
+{
+	/* new edges of u (takes ne), and the shortest paths that follow */
+	struct edge_change*ch;
+	struct edge*oe = d->nodes[u].edges;
+	unsigned noe = d->nodes[u].nedges, nch = 0, i;
+	uint32_t v, c;
+
+	++d->spf_runs;
+
+	/* everyone on the either list is affected */
+	d->seen.n = 0;
+	for (i = 0;i < noe + nne;++i) {
+		v = i < noe ? oe[i].to : ne[i - noe].to;
+		if (v == u || (d->nodes[v].flags & N_SEEN) ) continue;
+		if (vec_push (&d->seen, v) ) continue;
+		d->nodes[v].flags |= N_SEEN;
+	}
+
+	ch = cl_malloc ( (d->seen.n + 1) * sizeof (struct edge_change) );
+	for (i = 0;i < d->seen.n;++i) {
+		v = d->seen.v[i];
+		d->nodes[v].flags &= ~N_SEEN;
+		if (!ch) continue;
+		ch[nch].v = v;
+		ch[nch].uv = two_way_cost (d, u, v);
+		ch[nch].vu = two_way_cost (d, v, u);
+		++nch;
+	}
+
+	d->nodes[u].edges = ne;
+	d->nodes[u].nedges = nne;
+	if (oe) cl_free (oe);
+
+	if (d->full_spf || !ch) {
+		if (ch) cl_free (ch);
+		full_spf (d);
+		return;
+	}
+
+	/* what got worse: cut off what hangs on it */
+	for (i = 0;i < nch;++i) {
+		v = ch[i].v;
+		if (two_way_cost (d, u, v) > ch[i].uv && d->nodes[v].parent == u)
+			invalidate (d, v);
+		if (two_way_cost (d, v, u) > ch[i].vu && d->nodes[u].parent == v)
+			invalidate (d, u);
+
+		/* our neighbor might be behind another link now */
+		if (u == SELF && d->nodes[v].parent == SELF &&
+		        d->nodes[v].link != link_to (d, v) )
+			invalidate (d, v);
+	}
+	reattach (d);
+
+	/* what got better: relax it */
+	for (i = 0;i < nch;++i) {
+		v = ch[i].v;
+		c = two_way_cost (d, u, v);
+		if (c < ch[i].uv && d->nodes[u].dist != INF &&
+		        d->nodes[u].dist + c < d->nodes[v].dist)
+			set_dist (d, v, d->nodes[u].dist + c, u);
+		c = two_way_cost (d, v, u);
+		if (c < ch[i].vu && d->nodes[v].dist != INF &&
+		        d->nodes[v].dist + c < d->nodes[u].dist)
+			set_dist (d, u, d->nodes[v].dist + c, v);
+	}
+
+	cl_free (ch);
+	run_spf (d);
+}
+
+static void settle (struct lsr*d)
+{
+	/* prefixes of the nodes whose paths changed */
+	struct node*n;
+	unsigned i, j;
+
+	for (i = 0;i < d->changed.n;++i) {
+		n = d->nodes + d->changed.v[i];
+		n->flags &= ~N_CHANGED;
+		for (j = 0;j < n->nprefixes;++j) update_prefix (d, n->prefixes[j]);
+	}
+	d->changed.n = 0;
+	flush_prefixes (d);
+}
+
+/*
+ * sending
+ */
+
+struct msg {
+	struct packet*p;
+	unsigned used;
+};
+
+static void msg_send (struct lsr*d, int link, struct msg*m)
+{
+	struct work*w;
+
+	if (!m->p) return;
+
+	m->p->len = m->used;
+	m->p->next_part = d->links[link].pt;
+	m->p->src_part = d->self;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		cloudvpn_packet_free (m->p);
+		m->p = 0;
+		return;
+	}
+	w->type = work_packet;
+	w->priority = d->priority;
+	w->is_static = 0;
+	w->p = m->p;
+
+	if (cloudvpn_schedule_work (w) ) {
+		cloudvpn_packet_free (m->p);
+		cl_free (w);
+	}
+	m->p = 0;
+}
+
+static int msg_start (struct lsr*d, struct msg*m, uint8_t type, unsigned size)
+{
+	m->p = cloudvpn_packet_alloc_buf (size);
+	if (!m->p) return 1;
+	m->p->soff = m->p->doff = 0;
+	m->p->mark = 0;
+	m->p->data[0] = type;
+	m->used = 1;
+	return 0;
+}
+
+static unsigned lsa_size (struct node*n)
+{
+	unsigned s = LSA_HDR + n->nedges * EDGE_LEN, i;
+
+	for (i = 0;i < n->nprefixes;++i)
+		s += 2 + key_bytes (n->prefixes[i]->bits);
+	return s;
+}
+
+static void msg_add (struct lsr*d, int link, struct msg*m, uint32_t u)
+{
+	/* record of node u */
+	struct node*n = d->nodes + u;
+	unsigned size = lsa_size (n), i;
+	uint8_t*b;
+
+	if (size + 1 > PACKET_MAX_LEN) return; /* that many neighbors won't go */
+
+	if (m->p && m->used + size > m->p->cap) msg_send (d, link, m);
+	if (!m->p && msg_start (d, m, LSR_LSA, size + 1 > d->mtu ? size + 1 : d->mtu) )
+		return;
+
+	b = (uint8_t*) m->p->data + m->used;
+	put64 (b, n->id);
+	wire_put32 (b + 8, n->seq);
+	wire_put16 (b + 12, n->nedges);
+	wire_put16 (b + 14, n->nprefixes);
+	b += LSA_HDR;
+
+	for (i = 0;i < n->nedges;++i, b += EDGE_LEN) {
+		put64 (b, d->nodes[n->edges[i].to].id);
+		wire_put32 (b + 8, n->edges[i].cost);
+	}
+	for (i = 0;i < n->nprefixes;++i) {
+		wire_put16 (b, n->prefixes[i]->bits);
+		memcpy (b + 2, n->prefixes[i]->key, key_bytes (n->prefixes[i]->bits) );
+		b += 2 + key_bytes (n->prefixes[i]->bits);
+	}
+
+	m->used += size;
+	++d->lsa_sent;
+}
+
+static void send_hello (struct lsr*d, int link)
+{
+	struct msg m;
+
+	if (msg_start (d, &m, LSR_HELLO, 13) ) return;
+	put64 ( (uint8_t*) m.p->data + 1, d->nodes[SELF].id);
+	wire_put32 ( (uint8_t*) m.p->data + 9,
+	             d->live_on ? d->live.interval_us : 0);
+	m.used = 13;
+	msg_send (d, link, &m);
+}
+
+static void send_database (struct lsr*d, int link)
+{
+	struct msg m;
+	uint32_t i;
+
+	m.p = 0;
+	for (i = 0;i < d->nnodes;++i)
+		if (d->nodes[i].seq) msg_add (d, link, &m, i);
+	msg_send (d, link, &m);
+}
+
+static void flood (struct lsr*d, struct msg*out, int except, uint32_t u)
+{
+	int i;
+
+	for (i = 0;i < MAX_LINKS;++i)
+		if (i != except && d->links[i].pt && d->links[i].nbr != NONE)
+			msg_add (d, i, out + i, u);
+}
+
+static void send_all (struct lsr*d, struct msg*out)
+{
+	int i;
+
+	for (i = 0;i < MAX_LINKS;++i)
+		if (out[i].p) msg_send (d, i, out + i);
+}
+
+static void originate (struct lsr*d)
+{
+	/* our record, from the links that said hello */
+	struct msg out[MAX_LINKS];
+	struct edge*e;
+	unsigned n = 0, j;
+	int i;
+
+	e = cl_malloc (MAX_LINKS * sizeof (struct edge) );
+	if (!e) return;
+
+	for (i = 0;i < MAX_LINKS;++i) {
+		if (!d->links[i].pt || d->links[i].nbr == NONE) continue;
+		for (j = 0;j < n && e[j].to != d->links[i].nbr;++j);
+		if (j == n) {
+			e[n].to = d->links[i].nbr;
+			e[n++].cost = d->links[i].cost;
+		} else if (d->links[i].cost < e[j].cost) e[j].cost = d->links[i].cost;
+	}
+
+	++d->nodes[SELF].seq;
+	d->nodes[SELF].heard_us = now_us();
+	set_edges (d, SELF, e, n);
+	settle (d);
+
+	memset (out, 0, sizeof (out) );
+	flood (d, out, -1, SELF);
+	send_all (d, out);
+}
+
+/*
+ * receiving
+ */
+
+static int parse_lsa (struct lsr*d, const uint8_t*b, int len, uint32_t u)
+{
+	/* installs the record into node u; returns nonzero if it's broken */
+	unsigned ne = wire_get16 (b + 12), np = wire_get16 (b + 14), i, bits, n = 0;
+	struct edge*e = 0;
+	struct prefix**p = 0, *x;
+	uint8_t k[MAX_KEY];
+	uint32_t to;
+	int off = LSA_HDR + ne * EDGE_LEN;
+
+	if (off > len) return 1;
+	if ( (ne && ! (e = cl_malloc (ne * sizeof (struct edge) ) ) ) ||
+	        (np && ! (p = cl_malloc (np * sizeof (struct prefix*) ) ) ) )
+		goto fail;
+
+	for (i = 0;i < ne;++i) {
+		to = get_node (d, get64 (b + LSA_HDR + i * EDGE_LEN) );
+		if (to == NONE) goto fail;
+		e[i].to = to;
+		e[i].cost = wire_get32 (b + LSA_HDR + i * EDGE_LEN + 8);
+		if (!e[i].cost || e[i].cost > MAX_COST) e[i].cost = MAX_COST;
+	}
+
+	for (i = 0;i < np;++i) {
+		if (off + 2 > len) goto fail;
+		bits = wire_get16 (b + off);
+		if (!bits || key_bytes (bits) > MAX_KEY ||
+		        off + 2 + key_bytes (bits) > len) goto fail;
+		memcpy (k, b + off + 2, key_bytes (bits) );
+		if (bits & 7) k[key_bytes (bits) - 1] &= ~ (0xff >> (bits & 7) );
+		if (! (x = get_prefix (d, k, bits) ) ) goto fail;
+		off += 2 + key_bytes (bits);
+
+		if (x->mark) continue; /* listed twice */
+		x->mark = 5;
+		p[n++] = x;
+	}
+	for (i = 0;i < n;++i) p[i]->mark = 0;
+
+	d->nodes[u].seq = wire_get32 (b + 8);
+	d->nodes[u].heard_us = now_us();
+	set_edges (d, u, e, ne);
+	set_prefixes (d, u, p, n);
+	return 0;
+
+fail:
+	/* this frees the prefixes that got created for nothing */
+	for (i = 0;i < n;++i) {
+		p[i]->mark = 0;
+		update_prefix (d, p[i]);
+	}
+	if (e) cl_free (e);
+	if (p) cl_free (p);
+	return 1;
+}
+
+static int lsa_len (const uint8_t*b, int len)
+{
+	/* length of the record at b, -1 if it doesn't fit */
+	int l, np, i;
+
+	if (len < LSA_HDR) return -1;
+	l = LSA_HDR + wire_get16 (b + 12) * EDGE_LEN;
+	np = wire_get16 (b + 14);
+	for (i = 0;i < np;++i) {
+		if (l + 2 > len) return -1;
+		l += 2 + key_bytes (wire_get16 (b + l) );
+	}
+	return l > len ? -1 : l;
+}
+
+static void receive_lsas (struct lsr*d, int link, const uint8_t*b, int len)
+{
+	struct msg out[MAX_LINKS];
+	uint32_t u, seq;
+	int l;
+
+	memset (out, 0, sizeof (out) );
+
+	for (; (l = lsa_len (b, len) ) > 0;b += l, len -= l) {
+		++d->lsa_received;
+		u = get_node (d, get64 (b) );
+		seq = wire_get32 (b + 8);
+		if (u == NONE) break;
+
+		if (u == SELF) {
+			/*
+			 * our own one comes back from the flood; a newer one is
+			 * our old record from before a restart, outdo it
+			 */
+			if (seq_newer (seq, d->nodes[SELF].seq) ) {
+				d->nodes[SELF].seq = seq;
+				originate (d);
+			}
+		} else if (!d->nodes[u].seq || seq_newer (seq, d->nodes[u].seq) ) {
+			if (!parse_lsa (d, b, l, u) ) flood (d, out, link, u);
+		} else if (seq_newer (d->nodes[u].seq, seq) )
+			msg_add (d, link, out + link, u);
+	}
+
+	settle (d);
+	send_all (d, out);
+}
+
+static void receive_hello (struct lsr*d, int link, const uint8_t*b, int len)
+{
+	uint32_t u;
+
+	if (len < 8) return;
+	u = get_node (d, get64 (b) );
+	if (u == NONE || u == SELF || d->links[link].nbr == u) return;
+
+	/* new neighbor: answer, give it everything, and tell everyone */
+	d->links[link].nbr = u;
+	send_hello (d, link);
+	originate (d);
+	send_database (d, link);
+}
+
+static void receive_control (struct lsr*d, struct packet*p)
+{
+	int i;
+
+	/* only neighbors we know about may talk to us */
+	for (i = 0;i < MAX_LINKS && d->links[i].pt != p->src_part;++i);
+	if (i == MAX_LINKS || !p->src_part || p->len < 1) return;
+
+	/* anything counts as alive, hellos also say how often they come */
+	if (d->live_on && d->links[i].live >= 0)
+		cl_live_heard (&d->live, d->links[i].live,
+		               p->data[0] == LSR_HELLO && p->len >= 13 ?
+		               wire_get32 ( (uint8_t*) p->data + 9) : 0, now_us() );
+
+	switch (p->data[0]) {
+	case LSR_HELLO:
+		receive_hello (d, i, (uint8_t*) p->data + 1, p->len - 1);
+		break;
+	case LSR_LSA:
+		receive_lsas (d, i, (uint8_t*) p->data + 1, p->len - 1);
+		break;
+	}
+}
+
+static void expire (struct lsr*d)
+{
+	/* records nobody renewed for long are gone */
+	uint64_t old;
+	uint32_t i;
+
+	/* nothing can be that old yet */
+	if (now_us() < 3 * d->refresh_us) return;
+	old = now_us() - 3 * d->refresh_us;
+
+	for (i = 1;i < d->nnodes;++i) {
+		if (!d->nodes[i].seq || d->nodes[i].heard_us > old) continue;
+		if (!d->nodes[i].nedges && !d->nodes[i].nprefixes) continue;
+		set_edges (d, i, 0, 0);
+		set_prefixes (d, i, 0, 0);
+	}
+	settle (d);
+}
+
+/*
+ * liveness
+ */
+
+static void live_probe (void*arg, void*ctx)
+{
+	send_hello (arg, (intptr_t) ctx);
+}
+
+static void live_down (void*arg, void*ctx)
+{
+	/* routing knows right away, not after the refresh */
+	struct lsr*d = arg;
+	int l = (intptr_t) ctx;
+
+	if (d->links[l].nbr == NONE) return;
+	d->links[l].nbr = NONE;
+	originate (d);
+}
+
+static void arm_live (struct lsr*d, uint64_t delay)
+{
+	/* at least every tick, then new peers don't wait for long */
+	if (d->live_armed || !delay) return;
+	if (delay > d->live.tick_us) delay = d->live.tick_us;
+	d->live_timer->data.time = delay;
+	if (!cloudvpn_register_event (d->live_timer) ) d->live_armed = 1;
+}
+
+static void live_add (struct lsr*d, int l)
+{
+	d->links[l].live = cl_live_add (&d->live, (void*) (intptr_t) l, now_us() );
+	arm_live (d, d->live.tick_us);
+}
+
+static void live_config (struct lsr*d, unsigned ms, unsigned mult)
+{
+	int i;
+
+	if (!ms || !mult) {
+		if (!d->live_on) return;
+		for (i = 0;i < MAX_LINKS;++i) d->links[i].live = -1;
+		cl_live_destroy (&d->live);
+		d->live_on = 0;
+		return;
+	}
+
+	if (d->live_on) {
+		cl_live_set (&d->live, 1000 * ms, mult);
+		return;
+	}
+
+	if (cl_live_init (&d->live, 1000 * ms, mult, live_probe, live_down, d) )
+		return;
+	d->live_on = 1;
+	for (i = 0;i < MAX_LINKS;++i) if (d->links[i].pt) live_add (d, i);
+}
+
+/*
+ * forwarding
+ */
+
+static void forward (struct lsr*d, struct work*w)
+{
+	struct packet*p = w->p;
+	struct part*next = 0;
+	struct prefix*x;
+	struct work*nw;
+	unsigned t;
+
+	t = cl_lpm_enter (&d->lpm);
+	x = cl_lpm_lookup (&d->lpm, (uint8_t*) p->data, p->soff);
+	if (x) next = cl_atomic_load_acq (&x->hop);
+	cl_lpm_leave (&d->lpm, t);
+
+	if (next) cl_atomic_add_relaxed (&d->forwarded, 1);
+	else cl_atomic_add_relaxed (&d->dropped, 1);
+
+	if (!next || ! (nw = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	p->src_part = d->self;
+	p->next_part = next;
+	nw->type = work_packet;
+	nw->priority = w->priority;
+	nw->is_static = 0;
+	nw->p = p;
+	if (cloudvpn_schedule_work (nw) ) {
+		cl_free (nw);
+		cloudvpn_packet_free (p);
+	}
+}
+
+/*
+ * commands
+ */
+
+static int parse_key (const char*s, uint8_t*k)
+{
+	/* hex bytes, optionally separated, "/bits"; returns bits or -1 */
+	int len = 0, hi = -1, v, bits;
+
+	for (;*s && *s != '/';++s) {
+		if (*s == ':' || *s == '.') {
+			if (hi >= 0) return -1;
+			continue;
+		}
+		if (*s >= '0' && *s <= '9') v = *s - '0';
+		else if (*s >= 'a' && *s <= 'f') v = *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'F') v = *s - 'A' + 10;
+		else return -1;
+
+		if (hi < 0) hi = v;
+		else {
+			if (len == MAX_KEY) return -1;
+			k[len++] = (hi << 4) | v;
+			hi = -1;
+		}
+	}
+	if (hi >= 0) return -1;
+
+	bits = *s ? atoi (s + 1) : len * 8;
+	if (bits <= 0 || bits > len * 8) return -1;
+	if (bits & 7) k[key_bytes (bits) - 1] &= ~ (0xff >> (bits & 7) );
+	return bits;
+}
+
+static int find_link (struct lsr*d, struct part*pt)
+{
+	int i;
+	for (i = 0;i < MAX_LINKS;++i) if (d->links[i].pt == pt) return i;
+	return -1;
+}
+
+static void lsr_link (struct lsr*d, struct part*pt, unsigned cost)
+{
+	int l = find_link (d, pt);
+
+	if (!pt || !cost || cost > MAX_COST) return;
+
+	if (l >= 0) {
+		d->links[l].cost = cost;
+		if (d->links[l].nbr != NONE) originate (d);
+		return;
+	}
+
+	if ( (l = find_link (d, 0) ) < 0) return;
+	d->links[l].pt = pt;
+	d->links[l].cost = cost;
+	d->links[l].nbr = NONE;
+	d->links[l].live = -1;
+	if (d->live_on) live_add (d, l);
+	send_hello (d, l);
+}
+
+static void lsr_unlink (struct lsr*d, struct part*pt)
+{
+	int l = find_link (d, pt);
+
+	if (!pt || l < 0) return;
+
+	d->links[l].pt = 0;
+	if (d->links[l].live >= 0) cl_live_remove (&d->live, d->links[l].live);
+	d->links[l].live = -1;
+	if (d->links[l].nbr == NONE) return;
+	d->links[l].nbr = NONE;
+	originate (d);
+}
+
+static void lsr_address (struct lsr*d, const char*addr, struct part*local)
+{
+	/* our own record gets edited */
+	struct node*n = d->nodes + SELF;
+	struct prefix**np, *x;
+	uint8_t k[MAX_KEY];
+	unsigned i, j;
+	int bits = parse_key (addr, k);
+
+	if (bits <= 0) return;
+	x = local ? get_prefix (d, k, bits) : *find_pslot (d, k, bits);
+	if (!x) return;
+
+	for (i = 0;i < n->nprefixes && n->prefixes[i] != x;++i);
+
+	x->local = local;
+	if (local && i < n->nprefixes) {
+		/* only delivered elsewhere now */
+		update_prefix (d, x);
+		return;
+	}
+	if (!local && i == n->nprefixes) return;
+
+	np = cl_malloc ( (n->nprefixes + 1) * sizeof (struct prefix*) );
+	if (!np) return;
+	for (j = 0;j < n->nprefixes;++j) np[j] = n->prefixes[j];
+	if (local) np[j++] = x;
+	else np[i] = np[--j];
+
+	/* this can free x */
+	set_prefixes (d, SELF, np, j);
+	originate (d);
+}
+
+static void arm_refresh (struct lsr*d)
+{
+	if (d->refresh_armed || !d->refresh_us) return;
+	d->refresh->data.time = d->refresh_us;
+	if (!cloudvpn_register_event (d->refresh) ) d->refresh_armed = 1;
+}
+
+static void lsr_command (struct lsr*d, struct packet*p)
+{
+	struct command c;
+	uint64_t id;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "link", 1) )
+		lsr_link (d, cloudvpn_find_part_by_name (c.argv[1]),
+		          c.argc > 2 ? atoi (c.argv[2]) : 1);
+
+	else if (cloudvpn_command_is (&c, "unlink", 1) )
+		lsr_unlink (d, cloudvpn_find_part_by_name (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "address", 2) )
+		lsr_address (d, c.argv[1], cloudvpn_find_part_by_name (c.argv[2]) );
+
+	else if (cloudvpn_command_is (&c, "forget", 1) )
+		lsr_address (d, c.argv[1], 0);
+
+	else if (cloudvpn_command_is (&c, "id", 1) ) {
+		/* only before we told anyone */
+		id = strtoull (c.argv[1], 0, 16);
+		if (d->nnodes == 1 && !d->nodes[SELF].seq && find_node (d, id) == NONE)
+			rehash_self (d, id);
+
+	} else if (cloudvpn_command_is (&c, "refresh", 1) ) {
+		d->refresh_us = 1000000ULL * atoi (c.argv[1]);
+		arm_refresh (d);
+
+	} else if (cloudvpn_command_is (&c, "spf", 1) ) {
+		d->full_spf = !strcmp (c.argv[1], "full");
+
+	} else if (cloudvpn_command_is (&c, "mtu", 1) ) {
+		if (atoi (c.argv[1]) >= 64 && atoi (c.argv[1]) < PACKET_MAX_LEN)
+			d->mtu = atoi (c.argv[1]);
+
+	} else if (cloudvpn_command_is (&c, "liveness", 1) ) {
+		live_config (d, atoi (c.argv[1]), c.argc > 2 ? atoi (c.argv[2]) : 3);
+
+	} else if (cloudvpn_command_is (&c, "priority", 1) )
+		d->priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "direct", 1) )
+		cl_lpm_set_direct (&d->lpm, atoi (c.argv[1]) );
+
+	flush_prefixes (d);
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void lsr_event (struct lsr*d, struct event_data*e)
+{
+	cl_mutex_lock (&d->lock);
+
+	if ( (uintptr_t) e->priv == ev_refresh) {
+		d->refresh_armed = 0;
+		expire (d);
+		originate (d);
+		arm_refresh (d);
+
+	} else if ( (uintptr_t) e->priv == ev_live) {
+		d->live_armed = 0;
+		if (d->live_on) arm_live (d, cl_live_run (&d->live, now_us() ) );
+	}
+
+	cl_mutex_unlock (&d->lock);
+}
+
+static void lsr_process_work (struct part*p, struct work*w)
+{
+	struct lsr*d = p->data;
+
+	if (!d) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		if (w->p->soff) {
+			forward (d, w);
+			break;
+		}
+		cl_mutex_lock (&d->lock);
+		receive_control (d, w->p);
+		cl_mutex_unlock (&d->lock);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		lsr_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		lsr_event (d, &w->e);
+		break;
+	}
+}
+
+static uint64_t name_id (const char*s)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (s && *s) h = (h ^ (uint8_t) *s++) * 1099511628211ULL;
+	return h;
+}
+
+static struct event* new_timer (struct lsr*d, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = 0;
+	e->is_static = 1;
+	e->data.type = event_time;
+	e->data.owner = d->self;
+	e->data.priv = (void*) (uintptr_t) kind;
+	return e;
+}
+
+static void lsr_init (struct part*p)
+{
+	struct lsr*d = cl_calloc (1, sizeof (struct lsr) );
+	unsigned i;
+
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	d->self = p;
+	d->mtu = 1400;
+	d->refresh_us = 1800000000ULL;
+	d->cap = d->hsize = 64;
+	d->psize = 64;
+
+	d->nodes = cl_malloc (d->cap * sizeof (struct node) );
+	d->htab = cl_malloc (d->hsize * sizeof (uint32_t) );
+	d->ptab = cl_calloc (d->psize, sizeof (struct prefix*) );
+	d->refresh = new_timer (d, ev_refresh);
+	d->live_timer = new_timer (d, ev_live);
+	if (!d->nodes || !d->htab || !d->ptab || !d->refresh || !d->live_timer ||
+	        cl_lpm_init (&d->lpm, 8) ) {
+		if (d->nodes) cl_free (d->nodes);
+		if (d->htab) cl_free (d->htab);
+		if (d->ptab) cl_free (d->ptab);
+		if (d->refresh) cloudvpn_delete_event (d->refresh);
+		if (d->live_timer) cloudvpn_delete_event (d->live_timer);
+		cl_mutex_destroy (&d->lock);
+		cl_free (d);
+		p->data = 0;
+		return;
+	}
+
+	for (i = 0;i < d->hsize;++i) d->htab[i] = NONE;
+	get_node (d, name_id (p->name) );
+	d->nodes[SELF].dist = 0;
+	arm_refresh (d);
+}
+
+static void lsr_fini (struct part*p)
+{
+	struct lsr*d = p->data;
+	struct prefix*x;
+	uint32_t i;
+
+	if (!d) return;
+
+	cloudvpn_dispose_event (d->refresh);
+	cloudvpn_dispose_event (d->live_timer);
+	if (d->live_on) cl_live_destroy (&d->live);
+
+	for (i = 0;i < d->nnodes;++i) {
+		if (d->nodes[i].edges) cl_free (d->nodes[i].edges);
+		if (d->nodes[i].prefixes) cl_free (d->nodes[i].prefixes);
+	}
+	for (i = 0;i < d->psize;++i)
+		while ( (x = d->ptab[i]) ) {
+			d->ptab[i] = x->next;
+			if (x->origins) cl_free (x->origins);
+			cl_free (x);
+		}
+	flush_prefixes (d);
+
+	cl_free (d->nodes);
+	cl_free (d->htab);
+	cl_free (d->ptab);
+	if (d->heap) cl_free (d->heap);
+	if (d->changed.v) cl_free (d->changed.v);
+	if (d->invalid.v) cl_free (d->invalid.v);
+	if (d->stack.v) cl_free (d->stack.v);
+	if (d->seen.v) cl_free (d->seen.v);
+	cl_lpm_destroy (&d->lpm);
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "lsr";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = lsr_process_work;
+	thisplugin.init = lsr_init;
+	thisplugin.fini = lsr_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
@@ -0,0 +1,496 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * metrics plugin for cloudvpn.
+ *
+ * Shows what the parts have registered with cl_metric_* (see metrics.h)
+ * in the Prometheus text format: over HTTP for a scraper, and in a file
+ * when asked or every while, for the node exporter's textfile collector or
+ * anyone else. GET of / or /metrics gets the whole text and the connection
+ * is closed after it; the text is made a metric at a time as the client
+ * reads it, so it's never held whole and the metrics lock is held only
+ * shortly.
+ *
+ * Everything runs in event works at the control priority, below any
+ * forwarding.
+ *
+ * Commands:
+ *	listen <port> [addr]	serve it there (127.0.0.1 by default)
+ *	dump <path>		write it to the file now
+ *	every <ms> [path]	and then every ms (0 stops it)
+ *	priority <n>		of the works (250 by default)
+ *	close			stops serving
+ */
+
+#include "api.h"
+#include "alloc.h"
+#include "client.h"
+#include "command.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS 16
+#define IN_SIZE 2048 /* of the request head, the rest is ignored */
+
+#if CL_CLIENT_OUT <= CL_METRIC_TEXT
+#error "a metric wouldn't fit into the client buffer"
+#endif
+
+enum { st_request, st_body, st_done };
+
+struct client {
+	struct cl_client io; /* first, pump hands it back */
+
+	char in[IN_SIZE];
+	int inlen;
+
+	int state;
+	/* the last metric sent, a metric that comes or goes meanwhile doesn't
+	 * make the text skip or repeat the others */
+	char name[CL_METRIC_NAME + 1];
+	char label[2 * CL_METRIC_LABEL + 1];
+	int labelled;
+};
+
+struct metrics {
+	cl_mutex lock;
+	struct part*self;
+	uint8_t priority;
+
+	int lfd;
+	struct event*accept;
+	uintptr_t gen;
+
+	struct event*tick;
+	int tick_armed;
+	uint32_t every_ms;
+	char*path;
+
+	struct client c[MAX_CLIENTS];
+
+	/* its own */
+	struct cl_metric*scrapes, *dumps, *failed, *bytes;
+};
+
+/*
+ * clients, everything is called with the lock held
+ */
+
+static void client_close (struct metrics*d, struct client*c)
+{
+	if (c->io.fd >= 0 && c->io.sent)
+		cl_metric_observe (d->bytes, c->io.sent);
+	cl_client_close (&c->io);
+}
+
+static int client_open (struct metrics*d, struct client*c, int fd)
+{
+	c->inlen = 0;
+	c->state = st_request;
+	c->name[0] = 0;
+	return cl_client_open (&c->io, d->self, d->priority, fd, c - d->c, 0);
+}
+
+static int metric_out (struct cl_metric*m, int family, void*arg)
+{
+	struct client*c = arg;
+	int n;
+
+	if (c->name[0] &&
+	        cl_metric_cmp (m, c->name, c->labelled ? c->label : 0) <= 0)
+		return 0;
+
+	/* the walk's family doesn't know what the last piece sent */
+	family = strcmp (m->name, c->name) != 0;
+	n = cl_metric_format (m, family, c->io.out + c->io.outlen,
+	                      CL_CLIENT_OUT - c->io.outlen);
+	if (n < 0) {
+		/* it comes next time, unless it wouldn't fit ever */
+		if (c->io.outlen) return 1;
+		n = 0;
+	}
+	c->io.outlen += n;
+	strcpy (c->name, m->name);
+	c->labelled = m->label != 0;
+	if (m->label) strcpy (c->label, m->label);
+	return 0;
+}
+
+/* makes another piece of the text */
+static void fill (struct client*c)
+{
+	if (c->state == st_body && !cl_metric_walk (metric_out, c) )
+		c->state = st_done;
+}
+
+static void reply (struct client*c, const char*status, const char*body)
+{
+	c->io.outlen = snprintf (c->io.out, CL_CLIENT_OUT, "HTTP/1.0 %s\r\n"
+	                      "Content-Type: text/plain; version=0.0.4; "
+	                      "charset=utf-8\r\nConnection: close\r\n\r\n%s",
+	                      status, body);
+	c->state = body[0] ? st_done : st_body;
+}
+
+/* nonzero once there's the whole head of the request */
+static int request (struct metrics*d, struct client*c)
+{
+	char*path;
+	size_t n;
+
+	c->in[c->inlen] = 0;
+	if (!strstr (c->in, "\r\n\r\n") && !strstr (c->in, "\n\n") ) {
+		if (c->inlen < IN_SIZE - 1) return 0;
+		reply (c, "431 Request Header Fields Too Large", "too long\n");
+		return 1;
+	}
+
+	if (strncmp (c->in, "GET ", 4) ) {
+		reply (c, "405 Method Not Allowed", "only GET\n");
+		return 1;
+	}
+	path = c->in + 4;
+	n = strcspn (path, " ?\r\n");
+	if ( (n == 1 && *path == '/') ||
+	        (n == 8 && !strncmp (path, "/metrics", 8) ) ) {
+		reply (c, "200 OK", "");
+		cl_metric_inc (d->scrapes);
+	} else reply (c, "404 Not Found", "try /metrics\n");
+	return 1;
+}
+
+static int more (struct cl_client*io, void*arg)
+{
+	struct client*c = (struct client*) io;
+
+	if (c->state == st_done) {
+		client_close (arg, c);
+		return 1;
+	}
+	fill (c);
+	return 0;
+}
+
+static void pump (struct metrics*d, struct client*c)
+{
+	if (c->state != st_request) cl_client_pump (&c->io, more, d);
+}
+
+/*
+ * events
+ */
+
+static void accept_client (struct metrics*d)
+{
+	int fd = cl_client_accept (&d->lfd, d->accept), i;
+
+	if (fd < 0) return;
+	for (i = 0;i < MAX_CLIENTS;++i) if (d->c[i].io.fd < 0) break;
+	if (i == MAX_CLIENTS) close (fd);
+	else client_open (d, d->c + i, fd);
+}
+
+static void client_readable (struct metrics*d, struct client*c)
+{
+	ssize_t n;
+
+	/* one request a connection, whatever comes after it isn't read */
+	if (c->state != st_request) return;
+
+	n = read (c->io.fd, c->in + c->inlen, IN_SIZE - 1 - c->inlen);
+	if (!n || (n < 0 && errno != EAGAIN && errno != EINTR) ) {
+		client_close (d, c);
+		return;
+	}
+	if (n > 0) c->inlen += n;
+
+	if (request (d, c) ) pump (d, c);
+	else if (cl_client_arm (&c->io, c->io.rx, cl_ev_rx) ) client_close (d, c);
+}
+
+static void dump (struct metrics*d, const char*path)
+{
+	if (cl_metric_write (path) ) cl_metric_inc (d->failed);
+	else cl_metric_inc (d->dumps);
+}
+
+static void tick (struct metrics*d)
+{
+	d->tick_armed = 0;
+	if (!d->every_ms || !d->path) return;
+
+	dump (d, d->path);
+	d->tick->data.time = 1000ULL * d->every_ms;
+	if (!cloudvpn_register_event (d->tick) ) d->tick_armed = 1;
+}
+
+static void metrics_event (struct metrics*d, struct event_data*e)
+{
+	struct client*c;
+	int kind = cl_ev_tag_kind (e->priv);
+
+	cl_mutex_lock (&d->lock);
+
+	if (kind == cl_ev_accept) {
+		if (d->lfd >= 0 && cl_ev_tag_gen (e->priv) == d->gen)
+			accept_client (d);
+		cl_mutex_unlock (&d->lock);
+		return;
+	}
+
+	if (kind == cl_ev_tick) {
+		tick (d);
+		cl_mutex_unlock (&d->lock);
+		return;
+	}
+
+	c = d->c + cl_ev_tag_slot (e->priv) % MAX_CLIENTS;
+	if (c->io.fd < 0 || cl_ev_tag_gen (e->priv) != c->io.gen) {
+		cl_mutex_unlock (&d->lock);
+		return;
+	}
+	c->io.armed &= ~ (1 << kind);
+
+	if (kind == cl_ev_rx) client_readable (d, c);
+	else pump (d, c);
+
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * commands
+ */
+
+static void stop_listening (struct metrics*d)
+{
+	int i;
+
+	for (i = 0;i < MAX_CLIENTS;++i) client_close (d, d->c + i);
+	if (d->lfd < 0) return;
+
+	close (d->lfd);
+	d->lfd = -1;
+	cloudvpn_dispose_event (d->accept);
+	d->accept = 0;
+	++d->gen;
+}
+
+static int metrics_listen (struct metrics*d, const char*port,
+                           const char*addr)
+{
+	struct sockaddr_in6 sa6;
+	struct sockaddr_in sa;
+	struct sockaddr*s;
+	socklen_t len;
+	int fd, one = 1;
+
+	stop_listening (d);
+
+	memset (&sa, 0, sizeof (sa) );
+	memset (&sa6, 0, sizeof (sa6) );
+	if (strchr (addr, ':') ) {
+		sa6.sin6_family = AF_INET6;
+		sa6.sin6_port = htons (atoi (port) );
+		if (inet_pton (AF_INET6, addr, &sa6.sin6_addr) != 1) return 1;
+		s = (struct sockaddr*) &sa6;
+		len = sizeof (sa6);
+	} else {
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons (atoi (port) );
+		if (inet_pton (AF_INET, addr, &sa.sin_addr) != 1) return 1;
+		s = (struct sockaddr*) &sa;
+		len = sizeof (sa);
+	}
+
+	fd = socket (s->sa_family, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one) );
+	if (bind (fd, s, len) || listen (fd, MAX_CLIENTS) || cl_set_nonblock (fd) )
+		goto fail;
+
+	d->accept = cl_client_event (d->self, d->priority, event_fd_readable, fd,
+	                             d->gen, 0, cl_ev_accept);
+	if (!d->accept) goto fail;
+	d->lfd = fd;
+	if (cloudvpn_register_event (d->accept) ) goto fail;
+	return 0;
+
+fail:
+	if (d->accept) cloudvpn_delete_event (d->accept);
+	d->accept = 0;
+	d->lfd = -1;
+	close (fd);
+	return 1;
+}
+
+static void every (struct metrics*d, uint32_t ms, const char*path)
+{
+	char*p;
+
+	if (path && (p = cl_malloc (strlen (path) + 1) ) ) {
+		strcpy (p, path);
+		if (d->path) cl_free (d->path);
+		d->path = p;
+	}
+	d->every_ms = ms;
+
+	/* the running timer picks up the change, or stops */
+	if (!ms || !d->path || d->tick_armed || !d->tick) return;
+	d->tick->data.time = 1000ULL * ms;
+	if (!cloudvpn_register_event (d->tick) ) d->tick_armed = 1;
+}
+
+static void metrics_command (struct metrics*d, struct packet*p)
+{
+	struct command c;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "listen", 1) )
+		metrics_listen (d, c.argv[1], "127.0.0.1");
+
+	else if (cloudvpn_command_is (&c, "listen", 2) )
+		metrics_listen (d, c.argv[1], c.argv[2]);
+
+	else if (cloudvpn_command_is (&c, "dump", 1) )
+		dump (d, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "every", 1) )
+		every (d, atoi (c.argv[1]), 0);
+
+	else if (cloudvpn_command_is (&c, "every", 2) )
+		every (d, atoi (c.argv[1]), c.argv[2]);
+
+	else if (cloudvpn_command_is (&c, "priority", 1) )
+		d->priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "close", 0) )
+		stop_listening (d);
+
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void metricsplugin_process_work (struct part*p, struct work*w)
+{
+	struct metrics*d = p->data;
+
+	switch (w->type) {
+	case work_packet:
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		if (d) metrics_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		if (d) metrics_event (d, &w->e);
+		break;
+	}
+}
+
+static void metricsplugin_init (struct part*p)
+{
+	static const uint64_t sizes[] = { 1024, 4096, 16384, 65536, 262144,
+	                                  1048576
+	                                };
+	struct metrics*d = cl_calloc (1, sizeof (struct metrics) );
+	int i;
+
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	d->self = p;
+	d->priority = LOWEST_PRIORITY - 5;
+	d->lfd = -1;
+	for (i = 0;i < MAX_CLIENTS;++i) d->c[i].io.fd = -1;
+	d->tick = cl_client_event (p, d->priority, event_time, 0, 0, 0,
+	                           cl_ev_tick);
+
+	d->scrapes = cl_metric_counter (p, "cloudvpn_metrics_scrapes_total",
+	                                "requests for the metrics over HTTP");
+	d->dumps = cl_metric_counter (p, "cloudvpn_metrics_dumps_total",
+	                              "metrics written to a file");
+	d->failed = cl_metric_counter (p, "cloudvpn_metrics_dump_errors_total",
+	                               "metrics that couldn't be written");
+	d->bytes = cl_metric_histogram (p, "cloudvpn_metrics_response_bytes",
+	                                "sent to a HTTP client", sizes,
+	                                sizeof (sizes) / sizeof (*sizes) );
+	if (!d->tick || !d->scrapes || !d->dumps || !d->failed || !d->bytes) {
+		/* two parts of it can't have the same name anyway */
+		cl_metric_free (d->scrapes);
+		cl_metric_free (d->dumps);
+		cl_metric_free (d->failed);
+		cl_metric_free (d->bytes);
+		if (d->tick) cloudvpn_delete_event (d->tick);
+		cl_mutex_destroy (&d->lock);
+		cl_free (d);
+		p->data = 0;
+	}
+}
+
+static void metricsplugin_fini (struct part*p)
+{
+	struct metrics*d = p->data;
+	if (!d) return;
+
+	cl_mutex_lock (&d->lock);
+	stop_listening (d);
+	cloudvpn_dispose_event (d->tick);
+	if (d->path) cl_free (d->path);
+	cl_mutex_unlock (&d->lock);
+
+	cl_metric_free (d->scrapes);
+	cl_metric_free (d->dumps);
+	cl_metric_free (d->failed);
+	cl_metric_free (d->bytes);
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "metrics";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = metricsplugin_process_work;
+	thisplugin.init = metricsplugin_init;
+	thisplugin.fini = metricsplugin_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
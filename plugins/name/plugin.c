@@ -10,9 +10,690 @@
  * if not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * name resolution plugin. Other parts send it names, it sends back the
+ * addresses.
+ *
+ * Answers are cached for a while, and so are the names that weren't found
+ * (negative cache), so that a typo doesn't ask the resolver every time.
+ * When many parts ask for the same name that is not known yet, only one
+ * query goes out, and its answer goes to all of them.
+ *
+ * Resolving and file reading are done by a couple of resolver threads of
+ * the plugin, never by the workers; when they have something, they wake
+ * the part with cloudvpn_event_send_async and it answers whoever waited.
+ * Names that aren't in the cache go to the system resolver (getaddrinfo),
+ * addresses are then 4 or 16 bytes long.
+ *
+ * Packets with empty addresses:
+ *	query:	u8 NAME_QUERY, u32 tag, name (the rest of the packet)
+ *	answer:	u8 NAME_ANSWER, u32 tag, u8 found, u8 address length,
+ *		address, name
+ * Answers go to the part that asked, with the tag it chose.
+ *
+ * Commands:
+ *	set <name> <addr> [ttl]	entry that expires in ttl seconds (never by
+ *				default); addresses are in hex, as in dvr
+ *	forget <name>
+ *	load <file>		lines of "name addr [ttl]", # comments
+ *	ttl <s>			of the resolved names (default 300)
+ *	negative <s>		of the names that weren't found (default 30)
+ *	system on|off		without the system resolver, whatever isn't
+ *				set or loaded doesn't exist
+ */
+
 #include "api.h"
+#include "alloc.h"
+#include "command.h"
+#include "wire.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define NAME_QUERY 1
+#define NAME_ANSWER 2
+
+#define MAX_NAME 255
+#define MAX_ADDR 32
+#define RESOLVERS 2
+
+enum { e_pending, e_found, e_missing };
+
+struct waiter {
+	struct waiter*next;
+	struct part*pt;
+	uint32_t tag;
+};
+
+struct entry {
+	struct entry*next; /* hash chain */
+	uint64_t expires_us; /* 0 is never */
+	struct waiter*waiters; /* while it's pending */
+	uint8_t state;
+	uint8_t len;
+	uint8_t addr[MAX_ADDR];
+	char name[];
+};
+
+/* work for the resolvers, and what they did */
+struct job {
+	struct job*next;
+	char*file; /* load this, instead of resolving */
+	int found, loaded;
+	uint8_t len;
+	uint8_t addr[MAX_ADDR];
+	uint64_t ttl_us; /* of the loaded ones, 0 is never */
+	char name[];
+};
+
+struct name {
+	cl_mutex lock; /* the cache */
+	struct part*self;
+	struct entry**tab;
+	unsigned size, count;
+	uint64_t ttl_us, negative_us;
+	int system;
+
+	/* resolvers */
+	cl_mutex qlock;
+	cl_cond qcond;
+	struct job*todo, **todo_tail, *done;
+	int quit, nthreads;
+	pthread_t threads[RESOLVERS];
+	struct event*wake;
+
+	uint64_t queries, hits, negative_hits, coalesced, resolved, loaded;
+};
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int parse_addr (const char*s, uint8_t*a)
+{
+	/* hex bytes, optionally separated; returns the length or -1 */
+	int len = 0, hi = -1, v;
+
+	for (;*s;++s) {
+		if (*s == ':' || *s == '.') {
+			if (hi >= 0) return -1;
+			continue;
+		}
+		if (*s >= '0' && *s <= '9') v = *s - '0';
+		else if (*s >= 'a' && *s <= 'f') v = *s - 'a' + 10;
+		else if (*s >= 'A' && *s <= 'F') v = *s - 'A' + 10;
+		else return -1;
+
+		if (hi < 0) hi = v;
+		else {
+			if (len == MAX_ADDR) return -1;
+			a[len++] = (hi << 4) | v;
+			hi = -1;
+		}
+	}
+	return hi >= 0 || !len ? -1 : len;
+}
+
+/*
+ * cache
+ */
+
+static uint32_t name_hash (const char*s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s) h = (h ^ (uint8_t) *s++) * 16777619U;
+	return h;
+}
+
+static struct entry** find_slot (struct name*d, const char*name)
+{
+	struct entry**e = d->tab + (name_hash (name) & (d->size - 1) );
+
+	while (*e && strcmp ( (*e)->name, name) ) e = & (*e)->next;
+	return e;
+}
+
+static int expired (struct entry*e, uint64_t now)
+{
+	return e->state != e_pending && e->expires_us && e->expires_us <= now;
+}
+
+static void grow_table (struct name*d)
+{
+	/* old stuff that nobody asked for since it expired goes away now */
+	unsigned size = d->size * 2, i;
+	struct entry**t = cl_calloc (size, sizeof (struct entry*) ), *e, *n;
+	uint64_t now = now_us();
+
+	if (!t) return;
+	for (i = 0;i < d->size;++i)
+		for (e = d->tab[i];e;e = n) {
+			n = e->next;
+			if (expired (e, now) ) {
+				cl_free (e);
+				--d->count;
+				continue;
+			}
+			e->next = t[name_hash (e->name) & (size - 1)];
+			t[name_hash (e->name) & (size - 1)] = e;
+		}
+	cl_free (d->tab);
+	d->tab = t;
+	d->size = size;
+}
+
+static struct entry* get_entry (struct name*d, const char*name) {
+
+	struct entry**s = find_slot (d, name), *e;
+
+	if (*s) return *s;
+	if (d->count >= d->size) {
+		grow_table (d);
+		s = find_slot (d, name);
+	}
+
+	e = cl_malloc (sizeof (struct entry) + strlen (name) + 1);
+	if (!e) return 0;
+	memset (e, 0, sizeof (struct entry) );
+	strcpy (e->name, name);
+	e->state = e_missing;
+	e->expires_us = 1; /* long ago, so that it gets looked up */
+	e->next = *s;
+	*s = e;
+	++d->count;
+	return e;
+}
+
+/*
+ * answering
+ */
+
+static void answer (struct name*d, struct part*pt, uint32_t tag,
+                    struct entry*e)
+{
+	int nlen = strlen (e->name), found = e->state == e_found;
+	struct packet*p = cloudvpn_packet_alloc_buf (7 + MAX_ADDR + nlen);
+	struct work*w;
+	uint8_t*b;
+
+	if (!p) return;
+	b = (uint8_t*) p->data;
+	b[0] = NAME_ANSWER;
+	wire_put32 (b + 1, tag);
+	b[5] = found;
+	b[6] = found ? e->len : 0;
+	if (found) memcpy (b + 7, e->addr, e->len);
+	memcpy (b + 7 + b[6], e->name, nlen);
+
+	p->len = 7 + b[6] + nlen;
+	p->soff = p->doff = 0;
+	p->src_part = d->self;
+	p->next_part = pt;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+	w->type = work_packet;
+	w->priority = 0;
+	w->is_static = 0;
+	w->p = p;
+	if (cloudvpn_schedule_work (w) ) {
+		cloudvpn_packet_free (p);
+		cl_free (w);
+	}
+}
+
+static void settle (struct name*d, struct entry*e)
+{
+	/* e got its answer, everyone who waited gets it too */
+	struct waiter*w;
+
+	while ( (w = e->waiters) ) {
+		e->waiters = w->next;
+		answer (d, w->pt, w->tag, e);
+		cl_free (w);
+	}
+}
+
+/*
+ * resolvers
+ */
+
+static void submit (struct name*d, struct job*j)
+{
+	j->next = 0;
+	cl_mutex_lock (&d->qlock);
+	*d->todo_tail = j;
+	d->todo_tail = &j->next;
+	cl_mutex_unlock (&d->qlock);
+	cl_cond_signal (&d->qcond);
+}
+
+static void finished (struct name*d, struct job*j)
+{
+	/* the part only needs waking if it isn't already going to look */
+	int kick;
+
+	cl_mutex_lock (&d->qlock);
+	kick = !d->done;
+	j->next = d->done;
+	d->done = j;
+	cl_mutex_unlock (&d->qlock);
+
+	if (kick) cloudvpn_event_send_async (d->wake);
+}
+
+static void resolve (struct job*j)
+{
+	struct addrinfo hints, *res, *r;
+
+	memset (&hints, 0, sizeof (hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo (j->name, 0, &hints, &res) ) return;
+
+	for (r = res;r && !j->found;r = r->ai_next)
+		if (r->ai_family == AF_INET) {
+			memcpy (j->addr, & ( (struct sockaddr_in*) r->ai_addr)->sin_addr, 4);
+			j->len = 4;
+			j->found = 1;
+		} else if (r->ai_family == AF_INET6) {
+			memcpy (j->addr,
+			        & ( (struct sockaddr_in6*) r->ai_addr)->sin6_addr, 16);
+			j->len = 16;
+			j->found = 1;
+		}
+	freeaddrinfo (res);
+}
+
+static void load_file (struct name*d, const char*file)
+{
+	/* every line becomes a finished job */
+	char line[512], name[MAX_NAME + 1], addr[128];
+	uint8_t a[MAX_ADDR];
+	struct job*j;
+	unsigned ttl;
+	int len, n;
+	FILE*f = fopen (file, "r");
+
+	if (!f) return;
+	while (fgets (line, sizeof (line), f) ) {
+		if (line[0] == '#') continue;
+		ttl = 0;
+		n = sscanf (line, "%255s %127s %u", name, addr, &ttl);
+		if (n < 2 || (len = parse_addr (addr, a) ) < 0) continue;
+
+		j = cl_malloc (sizeof (struct job) + strlen (name) + 1);
+		if (!j) break;
+		memset (j, 0, sizeof (struct job) );
+		strcpy (j->name, name);
+		j->found = j->loaded = 1;
+		j->len = len;
+		memcpy (j->addr, a, len);
+		j->ttl_us = 1000000ULL * ttl;
+		finished (d, j);
+	}
+	fclose (f);
+}
+
+static void* resolver (void*arg)
+{
+	struct name*d = arg;
+	struct job*j;
+
+	for (;;) {
+		cl_mutex_lock (&d->qlock);
+		while (!d->todo && !d->quit) cl_cond_wait (&d->qcond, &d->qlock);
+		if (d->quit) {
+			cl_mutex_unlock (&d->qlock);
+			return 0;
+		}
+		j = d->todo;
+		d->todo = j->next;
+		if (!d->todo) d->todo_tail = &d->todo;
+		cl_mutex_unlock (&d->qlock);
+
+		if (j->file) {
+			load_file (d, j->file);
+			cl_free (j->file);
+			cl_free (j);
+		} else {
+			resolve (j);
+			finished (d, j);
+		}
+	}
+}
+
+static void complete (struct name*d, struct job*j, uint64_t now)
+{
+	/* what a resolver found out goes to the cache */
+	struct entry*e;
+
+	if (j->loaded) {
+		if (! (e = get_entry (d, j->name) ) ) return;
+		e->state = e_found;
+		e->expires_us = j->ttl_us ? now + j->ttl_us : 0;
+		++d->loaded;
+	} else {
+		/* unless it was set meanwhile */
+		e = *find_slot (d, j->name);
+		if (!e || e->state != e_pending) return;
+		e->state = j->found ? e_found : e_missing;
+		e->expires_us = now + (j->found ? d->ttl_us : d->negative_us);
+		++d->resolved;
+	}
+	e->len = j->len;
+	memcpy (e->addr, j->addr, j->len);
+	settle (d, e);
+}
+
+/*
+ * queries
+ */
+
+static void lookup (struct name*d, const char*name, struct part*pt,
+                    uint32_t tag)
+{
+	struct entry*e = get_entry (d, name);
+	struct waiter*w;
+	struct job*j;
+	uint64_t now = now_us();
+
+	++d->queries;
+	if (!e) return;
+
+	if (e->state != e_pending && !expired (e, now) ) {
+		if (e->state == e_found) ++d->hits;
+		else ++d->negative_hits;
+		answer (d, pt, tag, e);
+		return;
+	}
+
+	w = cl_malloc (sizeof (struct waiter) );
+	if (!w) return;
+	w->pt = pt;
+	w->tag = tag;
+	w->next = e->waiters;
+	e->waiters = w;
+
+	if (e->state == e_pending) {
+		++d->coalesced;
+		return;
+	}
+
+	/* nobody is asking for it yet */
+	e->state = e_pending;
+	if (!d->system ||
+	        ! (j = cl_malloc (sizeof (struct job) + strlen (name) + 1) ) ) {
+		e->state = e_missing;
+		e->expires_us = now + d->negative_us;
+		settle (d, e);
+		return;
+	}
+	memset (j, 0, sizeof (struct job) );
+	strcpy (j->name, name);
+	submit (d, j);
+}
+
+static void receive_query (struct name*d, struct packet*p)
+{
+	char name[MAX_NAME + 1];
+	int len = p->len - 5;
+
+	if (p->len < 6 || p->data[0] != NAME_QUERY || len > MAX_NAME ||
+	        !p->src_part) return;
+	memcpy (name, p->data + 5, len);
+	name[len] = 0;
+	if ( (int) strlen (name) != len) return; /* zeros inside */
+
+	lookup (d, name, p->src_part, wire_get32 ( (uint8_t*) p->data + 1) );
+}
+
+static void receive_done (struct name*d)
+{
+	struct job*j, *n;
+	uint64_t now = now_us();
+
+	cl_mutex_lock (&d->qlock);
+	j = d->done;
+	d->done = 0;
+	cl_mutex_unlock (&d->qlock);
+
+	for (;j;j = n) {
+		n = j->next;
+		complete (d, j, now);
+		cl_free (j);
+	}
+}
+
+/*
+ * commands
+ */
+
+static void name_set (struct name*d, const char*name, const char*addr,
+                      unsigned ttl)
+{
+	uint8_t a[MAX_ADDR];
+	struct entry*e;
+	int len = parse_addr (addr, a);
+
+	if (len < 0 || strlen (name) > MAX_NAME) return;
+	if (! (e = get_entry (d, name) ) ) return;
+
+	e->state = e_found;
+	e->len = len;
+	memcpy (e->addr, a, len);
+	e->expires_us = ttl ? now_us() + 1000000ULL * ttl : 0;
+	settle (d, e);
+}
+
+static void name_forget (struct name*d, const char*name)
+{
+	struct entry**s = find_slot (d, name), *e = *s;
+
+	/* pending ones stay, their answer is coming */
+	if (!e || e->state == e_pending) return;
+	*s = e->next;
+	--d->count;
+	cl_free (e);
+}
+
+static void name_load (struct name*d, const char*file)
+{
+	struct job*j = cl_malloc (sizeof (struct job) + 1);
+
+	if (!j) return;
+	memset (j, 0, sizeof (struct job) + 1);
+	j->file = cl_malloc (strlen (file) + 1);
+	if (!j->file) {
+		cl_free (j);
+		return;
+	}
+	strcpy (j->file, file);
+	submit (d, j);
+}
+
+static void name_command (struct name*d, struct packet*p)
+{
+	struct command c;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "set", 2) )
+		name_set (d, c.argv[1], c.argv[2], c.argc > 3 ? atoi (c.argv[3]) : 0);
+
+	else if (cloudvpn_command_is (&c, "forget", 1) )
+		name_forget (d, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "load", 1) )
+		name_load (d, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "ttl", 1) )
+		d->ttl_us = 1000000ULL * atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "negative", 1) )
+		d->negative_us = 1000000ULL * atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "system", 1) )
+		d->system = !strcmp (c.argv[1], "on");
+
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void name_process_work (struct part*p, struct work*w)
+{
+	struct name*d = p->data;
+
+	if (!d) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		if (!w->p->soff) {
+			cl_mutex_lock (&d->lock);
+			receive_query (d, w->p);
+			cl_mutex_unlock (&d->lock);
+		}
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		name_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		cl_mutex_lock (&d->lock);
+		receive_done (d);
+		cl_mutex_unlock (&d->lock);
+		break;
+	}
+}
+
+static void stop_resolvers (struct name*d)
+{
+	struct job*j;
+	int i;
+
+	cl_mutex_lock (&d->qlock);
+	d->quit = 1;
+	cl_mutex_unlock (&d->qlock);
+	cl_cond_broadcast (&d->qcond);
+	for (i = 0;i < d->nthreads;++i) pthread_join (d->threads[i], 0);
+
+	while ( (j = d->todo) ) {
+		d->todo = j->next;
+		if (j->file) cl_free (j->file);
+		cl_free (j);
+	}
+	while ( (j = d->done) ) {
+		d->done = j->next;
+		cl_free (j);
+	}
+}
+
+static void name_fini (struct part*p);
+
+static void name_init (struct part*p)
+{
+	struct name*d = cl_calloc (1, sizeof (struct name) );
+
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	cl_mutex_init (&d->qlock, 0);
+	cl_cond_init (&d->qcond);
+	d->self = p;
+	d->size = 64;
+	d->ttl_us = 300000000ULL;
+	d->negative_us = 30000000ULL;
+	d->system = 1;
+	d->todo_tail = &d->todo;
+
+	d->tab = cl_calloc (d->size, sizeof (struct entry*) );
+	d->wake = cloudvpn_new_event();
+	if (!d->tab || !d->wake) {
+		name_fini (p);
+		return;
+	}
+	d->wake->priority = 0;
+	d->wake->is_static = 1;
+	d->wake->data.type = event_async;
+	d->wake->data.owner = p;
+	d->wake->data.priv = 0;
+
+	for (d->nthreads = 0;d->nthreads < RESOLVERS;++d->nthreads)
+		if (pthread_create (d->threads + d->nthreads, 0, resolver, d) ) break;
+	if (!d->nthreads) name_fini (p);
+}
+
+static void name_fini (struct part*p)
+{
+	struct name*d = p->data;
+	struct entry*e;
+	struct waiter*w;
+	unsigned i;
+
+	if (!d) return;
+
+	stop_resolvers (d);
+	if (d->wake) cloudvpn_dispose_event (d->wake);
+
+	for (i = 0;d->tab && i < d->size;++i)
+		while ( (e = d->tab[i]) ) {
+			d->tab[i] = e->next;
+			while ( (w = e->waiters) ) {
+				e->waiters = w->next;
+				cl_free (w);
+			}
+			cl_free (e);
+		}
+	if (d->tab) cl_free (d->tab);
+
+	cl_cond_destroy (&d->qcond);
+	cl_mutex_destroy (&d->qlock);
+	cl_mutex_destroy (&d->lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "name";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = name_process_work;
+	thisplugin.init = name_init;
+	thisplugin.fini = name_fini;
 
-struct plugin* cloudvpn_plugin_get () {
 	return 0;
 }
 
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
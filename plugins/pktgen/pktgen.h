@@ -0,0 +1,44 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_PKTGEN_H
+#define _CVPN_PKTGEN_H
+
+/*
+ * what's in the payload of generated packets, and what a pktgen part has
+ * measured, for those that run it in-process (benchmarks).
+ */
+
+#include <stdint.h>
+
+/* magic, stream, seq (64 bits), time it was made (64 bits, ns of
+ * CLOCK_MONOTONIC), all big endian */
+#define PKTGEN_MAGIC 0x70676e31
+#define PKTGEN_HDR 24
+
+struct part;
+
+struct pktgen_result {
+	/* generator side */
+	uint64_t sent, sent_bytes, failed;
+
+	/* sink side; lost are the gaps in sequences that didn't fill later */
+	uint64_t received, received_bytes, foreign;
+	uint64_t lost, reordered, duplicate;
+	double seconds, pps, gbps; /* from the first to the last packet */
+	uint64_t lat_p50, lat_p99, lat_p999, lat_max; /* ns */
+};
+
+/* nonzero if the part isn't a pktgen one */
+int pktgen_result (struct part*, struct pktgen_result*);
+
+#endif
@@ -0,0 +1,660 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * pktgen plugin: test traffic that needs nobody outside. A part makes
+ * packets and sends them to the next part at a given rate; whatever
+ * packets a part gets, it counts as the sink. So a chain is measured by
+ * putting it between two pktgen parts (or by looping one back to itself).
+ *
+ * Every generated packet carries a stream id, a sequence number and the
+ * time it was made (see pktgen.h). The sink checks the sequences of every
+ * stream for gaps (lost) and numbers that come late (reordered), and
+ * keeps a histogram of how long the packets took, one per worker so
+ * that the workers don't share anything. Packets that aren't from pktgen
+ * are just counted as foreign.
+ *
+ * The generator runs as one work that makes a batch of packets and then
+ * comes again: right away behind its packets (in the same priority) when
+ * there's no rate, or on a timer tick with as many packets as the rate
+ * allows since the last one.
+ *
+ * Commands:
+ *	next <part>		where the packets go
+ *	rate <pps>		0 is as fast as it goes (default)
+ *	size <n> | size <min> <max> | size imix
+ *				whole packet lengths, fixed, uniformly random
+ *				or 7:4:1 of 64, 576 and 1500 (default 64)
+ *	dst <hex> [n] | src <hex> [n]
+ *				addresses, n of them counting up from that
+ *				in the last bytes (default 4 zero bytes, 1)
+ *	priority <n>		of the packets (default 0)
+ *	batch <n>		packets per round (default 32)
+ *	tick <us>		timer for the rate (default 1000)
+ *	start [count]		stops by itself after count packets
+ *	stop
+ *	reset			forgets what the sink has seen
+ *	report			logs the results (info)
+ */
+
+#include "api.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "command.h"
+#include "wire.h"
+#include "pktgen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ADDR 16
+#define MAX_BATCH 256
+#define MAX_STREAMS 16
+#define SLOTS 16 /* sink counters, by worker */
+#define BUCKETS 256 /* 4 per power of two */
+
+enum { size_fixed, size_uniform, size_imix };
+
+struct slot {
+	uint64_t received, bytes, foreign;
+	uint64_t first_ns, last_ns;
+	uint64_t hist[BUCKETS];
+} cl_cacheline_aligned;
+
+struct stream {
+	uint32_t id;
+	uint64_t expect; /* seq that comes next if nothing is lost */
+	uint64_t lost, reordered, duplicate;
+};
+
+static struct plugin thisplugin;
+
+struct pktgen {
+	cl_mutex lock;
+	struct part*self, *next;
+
+	/* generator */
+	uint64_t rate;
+	int size_mode;
+	uint32_t size_min, size_max;
+	uint8_t dst[MAX_ADDR], src[MAX_ADDR];
+	int dlen, slen;
+	uint32_t dcount, scount;
+	uint8_t priority;
+	int batch;
+	uint32_t tick_us;
+
+	int running;
+	uintptr_t gen; /* of the generator loop, stale rounds are ignored */
+	struct event*timer;
+	int timer_armed;
+	uint32_t stream;
+	uint64_t seq, limit, seed;
+	double tokens;
+	uint64_t last_ns;
+	uint64_t sent, sent_bytes, failed;
+
+	/* sink */
+	cl_mutex streams_lock;
+	struct stream streams[MAX_STREAMS];
+	int nstreams;
+	struct slot slot[SLOTS];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift (uint64_t*s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/*
+ * latency histogram: values under 4 have their own buckets, above that
+ * every power of two is split in 4
+ */
+
+static int bucket (uint64_t v)
+{
+	int k;
+
+	if (v < 4) return v;
+	k = 63 - __builtin_clzll (v);
+	return 4 * (k - 1) + ( (v >> (k - 2) ) & 3);
+}
+
+static uint64_t bucket_top (int b)
+{
+	/* the highest value that falls into the bucket */
+	int k = b / 4 + 1;
+
+	if (b < 4) return b;
+	return ( (uint64_t) (4 + b % 4 + 1) << (k - 2) ) - 1;
+}
+
+static uint64_t percentile (uint64_t*hist, uint64_t count, int per_mille)
+{
+	uint64_t want = (count * per_mille + 999) / 1000, n = 0;
+	int b;
+
+	if (!count) return 0;
+	for (b = 0;b < BUCKETS;++b)
+		if ( (n += hist[b]) >= want) return bucket_top (b);
+	return bucket_top (BUCKETS - 1);
+}
+
+/*
+ * generator
+ */
+
+static uint32_t next_size (struct pktgen*d)
+{
+	static const uint32_t imix[] = {64, 64, 576, 64, 64, 576, 64, 1500,
+	                                64, 576, 64, 576
+	                               };
+
+	switch (d->size_mode) {
+	case size_uniform:
+		return d->size_min +
+		       xorshift (&d->seed) % (d->size_max - d->size_min + 1);
+	case size_imix:
+		return imix[d->seq % 12];
+	}
+	return d->size_min;
+}
+
+static void put_addr (uint8_t*b, const uint8_t*base, int len, uint32_t add)
+{
+	/* base + add in the last (up to 4) bytes, big endian */
+	int i;
+
+	memcpy (b, base, len);
+	for (i = len - 1;i >= 0 && add;--i) {
+		add += b[i];
+		b[i] = add & 0xff;
+		add >>= 8;
+	}
+}
+
+static struct work* make_packet (struct pktgen*d, uint64_t t) {
+
+	uint32_t size = next_size (d), min = d->dlen + d->slen + PKTGEN_HDR;
+	struct packet*p;
+	struct work*w;
+	uint8_t*b;
+
+	if (size < min) size = min;
+	if (size > PACKET_MAX_LEN) size = PACKET_MAX_LEN;
+	if (! (p = cloudvpn_packet_alloc_buf (size) ) ) return 0;
+	if (! (w = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return 0;
+	}
+
+	b = (uint8_t*) p->data;
+	put_addr (b, d->dst, d->dlen, d->seq % d->dcount);
+	put_addr (b + d->dlen, d->src, d->slen, d->seq / d->dcount % d->scount);
+	p->soff = d->dlen;
+	p->doff = d->dlen + d->slen;
+	p->src_part = d->self;
+	p->next_part = d->next;
+
+	b += p->doff;
+	wire_put32 (b, PKTGEN_MAGIC);
+	wire_put32 (b + 4, d->stream);
+	wire_put32 (b + 8, d->seq >> 32);
+	wire_put32 (b + 12, d->seq);
+	wire_put32 (b + 16, t >> 32);
+	wire_put32 (b + 20, t);
+	memset (b + PKTGEN_HDR, 0, size - p->doff - PKTGEN_HDR);
+
+	w->type = work_packet;
+	w->priority = d->priority;
+	w->is_static = 0;
+	w->p = p;
+	return w;
+}
+
+static void send_packets (struct pktgen*d, int n)
+{
+	struct work*w[MAX_BATCH];
+	uint64_t t = now_ns(), bytes = 0;
+	int i, k;
+
+	while (n > 0 && d->running) {
+		k = n < d->batch ? n : d->batch;
+		if (d->limit && d->seq + k > d->limit) k = d->limit - d->seq;
+		if (k <= 0) break;
+
+		for (i = 0;i < k;++i) {
+			if (! (w[i] = make_packet (d, t) ) ) break;
+			bytes += w[i]->p->len;
+			++d->seq;
+		}
+		if (i && cloudvpn_schedule_works (w, i) ) {
+			d->seq -= i; /* or the sink would count them lost */
+			while (i--) {
+				cloudvpn_packet_free (w[i]->p);
+				cl_free (w[i]);
+			}
+			d->failed += k;
+			return; /* nothing to send them with, wait a round */
+		}
+
+		d->sent += i;
+		d->sent_bytes += bytes;
+		bytes = 0;
+		if (i < k) {
+			d->failed += k - i;
+			return;
+		}
+		n -= k;
+		if (d->limit && d->seq >= d->limit) d->running = 0;
+	}
+}
+
+static int again (struct pktgen*d)
+{
+	/* a round right behind the packets of this one */
+	struct work*w = cloudvpn_new_work();
+
+	if (!w) return 1;
+	w->type = work_event;
+	w->priority = d->priority;
+	w->is_static = 0;
+	w->e.type = event_async;
+	w->e.owner = d->self;
+	w->e.priv = (void*) d->gen;
+	if (cloudvpn_schedule_work (w) ) {
+		cl_free (w);
+		return 1;
+	}
+	return 0;
+}
+
+static void generate (struct pktgen*d)
+{
+	uint64_t t = now_ns();
+	double cap;
+
+	if (!d->running || !d->next) return;
+
+	if (!d->rate) {
+		send_packets (d, d->batch);
+		if (d->running && again (d) ) d->running = 0;
+		return;
+	}
+
+	/* what the rate allows since the last round, bursts stay small */
+	d->tokens += (t - d->last_ns) * (double) d->rate / 1e9;
+	d->last_ns = t;
+	cap = d->rate * (double) d->tick_us / 1e6 * 4 + d->batch;
+	if (d->tokens > cap) d->tokens = cap;
+	send_packets (d, (int) d->tokens);
+	d->tokens -= (int) d->tokens;
+
+	/* if the timer is still registered, its tick carries on */
+	if (!d->running || d->timer_armed) return;
+	d->timer->priority = d->priority;
+	d->timer->data.time = d->tick_us;
+	d->timer->data.priv = (void*) d->gen;
+	if (cloudvpn_register_event (d->timer) ) d->running = 0;
+	else d->timer_armed = 1;
+}
+
+static void start (struct pktgen*d, uint64_t count)
+{
+	if (d->running || !d->next) return;
+	d->running = 1;
+	++d->gen;
+	d->limit = count ? d->seq + count : 0;
+	d->tokens = d->batch; /* something goes out right away */
+	d->last_ns = now_ns();
+	if (again (d) ) d->running = 0;
+}
+
+/*
+ * sink
+ */
+
+static struct stream* find_stream (struct pktgen*d, uint32_t id, uint64_t seq) {
+
+	struct stream*s;
+	int i;
+
+	for (i = 0;i < d->nstreams;++i)
+		if (d->streams[i].id == id) return d->streams + i;
+	if (d->nstreams == MAX_STREAMS) return 0;
+
+	/* what was before the first one isn't known */
+	s = d->streams + d->nstreams++;
+	memset (s, 0, sizeof (*s) );
+	s->id = id;
+	s->expect = seq;
+	return s;
+}
+
+static void check_seq (struct pktgen*d, uint32_t id, uint64_t seq)
+{
+	struct stream*s;
+
+	cl_mutex_lock (&d->streams_lock);
+	if ( (s = find_stream (d, id, seq) ) ) {
+		if (seq >= s->expect) {
+			s->lost += seq - s->expect;
+			s->expect = seq + 1;
+		} else if (s->lost) {
+			/* it's just late */
+			--s->lost;
+			++s->reordered;
+		} else ++s->duplicate;
+	}
+	cl_mutex_unlock (&d->streams_lock);
+}
+
+static void receive (struct pktgen*d, struct packet*p)
+{
+	int id = cloudvpn_worker_id();
+	struct slot*s = d->slot + (id < 0 ? SLOTS - 1 : id % SLOTS);
+	uint64_t t = now_ns(), sent;
+	const uint8_t*b;
+
+	cl_atomic_add_relaxed (&s->received, 1);
+	cl_atomic_add_relaxed (&s->bytes, p->len);
+	if (!s->first_ns) cl_atomic_store (&s->first_ns, t);
+	cl_atomic_store (&s->last_ns, t);
+
+	b = (const uint8_t*) p->data + p->doff;
+	if (p->len < p->doff + PKTGEN_HDR || wire_get32 (b) != PKTGEN_MAGIC) {
+		cl_atomic_add_relaxed (&s->foreign, 1);
+		return;
+	}
+
+	sent = (uint64_t) wire_get32 (b + 16) << 32 | wire_get32 (b + 20);
+	cl_atomic_add_relaxed (&s->hist[bucket (t > sent ? t - sent : 0)], 1);
+	check_seq (d, wire_get32 (b + 4),
+	           (uint64_t) wire_get32 (b + 8) << 32 | wire_get32 (b + 12) );
+}
+
+static void reset (struct pktgen*d)
+{
+	/* packets that come meanwhile may be half counted, that's fine */
+	cl_mutex_lock (&d->streams_lock);
+	d->nstreams = 0;
+	memset (d->slot, 0, sizeof (d->slot) );
+	cl_mutex_unlock (&d->streams_lock);
+}
+
+int pktgen_result (struct part*p, struct pktgen_result*r)
+{
+	struct pktgen*d = p->data;
+	uint64_t hist[BUCKETS] = {0}, first = 0, last = 0, count = 0;
+	int i, b;
+
+	if (!d || p->p != &thisplugin) return 1;
+	memset (r, 0, sizeof (*r) );
+
+	cl_mutex_lock (&d->lock);
+	r->sent = d->sent;
+	r->sent_bytes = d->sent_bytes;
+	r->failed = d->failed;
+	cl_mutex_unlock (&d->lock);
+
+	for (i = 0;i < SLOTS;++i) {
+		struct slot*s = d->slot + i;
+		r->received += cl_atomic_load (&s->received);
+		r->received_bytes += cl_atomic_load (&s->bytes);
+		r->foreign += cl_atomic_load (&s->foreign);
+		if (s->first_ns && (!first || s->first_ns < first)) first = s->first_ns;
+		if (s->last_ns > last) last = s->last_ns;
+		for (b = 0;b < BUCKETS;++b) {
+			hist[b] += cl_atomic_load (&s->hist[b]);
+			count += cl_atomic_load (&s->hist[b]);
+		}
+	}
+
+	cl_mutex_lock (&d->streams_lock);
+	for (i = 0;i < d->nstreams;++i) {
+		r->lost += d->streams[i].lost;
+		r->reordered += d->streams[i].reordered;
+		r->duplicate += d->streams[i].duplicate;
+	}
+	cl_mutex_unlock (&d->streams_lock);
+
+	if (last > first) {
+		r->seconds = (last - first) / 1e9;
+		r->pps = r->received / r->seconds;
+		r->gbps = r->received_bytes * 8 / r->seconds / 1e9;
+	}
+	r->lat_p50 = percentile (hist, count, 500);
+	r->lat_p99 = percentile (hist, count, 990);
+	r->lat_p999 = percentile (hist, count, 999);
+	for (b = BUCKETS - 1;b > 0 && !hist[b];--b);
+	r->lat_max = count ? bucket_top (b) : 0;
+	return 0;
+}
+
+static void report (struct pktgen*d)
+{
+	struct pktgen_result r;
+
+	if (pktgen_result (d->self, &r) ) return;
+	cl_log (d->self, CL_LOG_INFO, "sent %llu packets, %llu bytes, %llu failed",
+	        r.sent, r.sent_bytes, r.failed);
+	cl_log (d->self, CL_LOG_INFO, "received %llu packets, %llu bytes, "
+	        "%llu foreign, %llu lost, %llu reordered, %llu duplicate",
+	        r.received, r.received_bytes, r.foreign, r.lost, r.reordered,
+	        r.duplicate);
+	cl_log (d->self, CL_LOG_INFO, "%llu packets/s, %llu Mbit/s, latency "
+	        "p50 %llu ns p99 %llu ns p99.9 %llu ns max %llu ns",
+	        (uint64_t) r.pps, (uint64_t) (r.gbps * 1000), r.lat_p50,
+	        r.lat_p99, r.lat_p999, r.lat_max);
+}
+
+/*
+ * commands
+ */
+
+static int parse_addr (const char*hex, uint8_t*b)
+{
+	int n = 0, v;
+
+	if (strlen (hex) % 2 || strlen (hex) > 2 * MAX_ADDR) return -1;
+	for (;hex[0];hex += 2) {
+		if (sscanf (hex, "%2x", &v) != 1) return -1;
+		b[n++] = v;
+	}
+	return n;
+}
+
+static void set_addr (struct command*c, uint8_t*b, int*len, uint32_t*count)
+{
+	uint8_t t[MAX_ADDR];
+	int n = parse_addr (c->argv[1], t);
+
+	if (n < 0) return;
+	memcpy (b, t, n);
+	*len = n;
+	*count = c->argc > 2 && atoi (c->argv[2]) > 0 ? atoi (c->argv[2]) : 1;
+}
+
+static void pktgen_command (struct pktgen*d, struct packet*p)
+{
+	struct command c;
+	int n;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	if (cloudvpn_command_is (&c, "report", 0) ) {
+		report (d);
+		return;
+	}
+	if (cloudvpn_command_is (&c, "reset", 0) ) {
+		reset (d);
+		return;
+	}
+
+	cl_mutex_lock (&d->lock);
+
+	if (cloudvpn_command_is (&c, "next", 1) )
+		d->next = cloudvpn_find_part_by_name (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "rate", 1) )
+		d->rate = strtoull (c.argv[1], 0, 10);
+
+	else if (cloudvpn_command_is (&c, "size", 1) ) {
+		if (!strcmp (c.argv[1], "imix") ) d->size_mode = size_imix;
+		else if (c.argc > 2 && atoi (c.argv[2]) > atoi (c.argv[1]) ) {
+			d->size_mode = size_uniform;
+			d->size_min = atoi (c.argv[1]);
+			d->size_max = atoi (c.argv[2]);
+		} else if (atoi (c.argv[1]) > 0) {
+			d->size_mode = size_fixed;
+			d->size_min = d->size_max = atoi (c.argv[1]);
+		}
+
+	} else if (cloudvpn_command_is (&c, "dst", 1) )
+		set_addr (&c, d->dst, &d->dlen, &d->dcount);
+
+	else if (cloudvpn_command_is (&c, "src", 1) )
+		set_addr (&c, d->src, &d->slen, &d->scount);
+
+	else if (cloudvpn_command_is (&c, "priority", 1) )
+		d->priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "batch", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > 0) d->batch = n < MAX_BATCH ? n : MAX_BATCH;
+
+	} else if (cloudvpn_command_is (&c, "tick", 1) ) {
+		if (atoi (c.argv[1]) > 0) d->tick_us = atoi (c.argv[1]);
+
+	} else if (cloudvpn_command_is (&c, "start", 0) )
+		start (d, c.argc > 1 ? strtoull (c.argv[1], 0, 10) : 0);
+
+	else if (cloudvpn_command_is (&c, "stop", 0) )
+		d->running = 0;
+
+	cl_mutex_unlock (&d->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void pktgen_process_work (struct part*p, struct work*w)
+{
+	struct pktgen*d = p->data;
+
+	switch (w->type) {
+	case work_packet:
+		if (d) receive (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_command:
+		if (d) pktgen_command (d, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		if (!d) break;
+		cl_mutex_lock (&d->lock);
+		if (w->e.type == event_time) {
+			/* there's one timer, a tick of any round goes on */
+			d->timer_armed = 0;
+			if (d->rate) generate (d);
+		} else if ( (uintptr_t) w->e.priv == d->gen) generate (d);
+		cl_mutex_unlock (&d->lock);
+		break;
+	}
+}
+
+static void pktgen_init (struct part*p)
+{
+	static uint32_t streams = 0;
+	struct pktgen*d = cl_calloc (1, sizeof (struct pktgen) );
+
+	p->data = d;
+	if (!d) return;
+
+	cl_mutex_init (&d->lock, 0);
+	cl_mutex_init (&d->streams_lock, 0);
+	d->self = p;
+	d->size_mode = size_fixed;
+	d->size_min = d->size_max = 64;
+	d->dlen = d->slen = 4;
+	d->dcount = d->scount = 1;
+	d->batch = 32;
+	d->tick_us = 1000;
+	d->stream = (uint32_t) getpid() << 12 ^ cl_atomic_inc (&streams);
+	d->seed = 0x9e3779b97f4a7c15ULL ^ d->stream;
+
+	d->timer = cloudvpn_new_event();
+	if (!d->timer) {
+		cl_mutex_destroy (&d->lock);
+		cl_mutex_destroy (&d->streams_lock);
+		cl_free (d);
+		p->data = 0;
+		return;
+	}
+	d->timer->priority = d->priority;
+	d->timer->is_static = 1;
+	d->timer->data.type = event_time;
+	d->timer->data.owner = p;
+}
+
+static void pktgen_fini (struct part*p)
+{
+	struct pktgen*d = p->data;
+	if (!d) return;
+
+	cl_mutex_lock (&d->lock);
+	d->running = 0;
+	++d->gen;
+	cl_mutex_unlock (&d->lock);
+
+	cloudvpn_dispose_event (d->timer);
+	cl_mutex_destroy (&d->lock);
+	cl_mutex_destroy (&d->streams_lock);
+	cl_free (d);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "pktgen";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = pktgen_process_work;
+	thisplugin.init = pktgen_init;
+	thisplugin.fini = pktgen_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
@@ -0,0 +1,828 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * shared memory transport between cloudvpn instances on the same host.
+ *
+ * The connecting side creates a memfd with two rings in it (one for each
+ * direction) and two eventfds (doorbells, one for each side), and passes
+ * them over a unix socket. The socket then stays open only so that we
+ * notice when the other side dies.
+ *
+ * Sending a packet is a memcpy into the ring. Doorbell is rung only when
+ * the consumer said it's going to sleep, so as long as it's busy draining
+ * the ring, the producer doesn't do any syscalls at all. The same goes the
+ * other way round when the producer waits for space in a full ring.
+ *
+ * Records in the ring are 8-byte aligned: u32 record length, wire.h header,
+ * packet data. Record that doesn't fit before the end of the ring is
+ * preceded by a padding record that skips to the start.
+ *
+ * Commands:
+ *	listen <path>		unix socket to wait for the peer on
+ *	connect <path>
+ *	next <part>		where the received packets go
+ *	ring <bytes>		ring size, connecting side decides (default 4M)
+ *	queue <packets>		packets waiting for ring space (default 1024)
+ *	priority <n>		priority of events (default 64)
+ *	close
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
+#include "api.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "wire.h"
+#include "command.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#define SHM_MAGIC 0x63767073 /* "cvps" */
+#define HDR_SIZE 4096 /* ring controls, rings follow */
+#define REC_ALIGN 8
+#define REC_PAD 0x80000000
+#define rec_len(len) ( (4 + WIRE_HDR_LEN + (len) + REC_ALIGN - 1) \
+                       & ~ (REC_ALIGN - 1) )
+#define DRAIN_MAX 1024 /* records per doorbell, then ring it again */
+#define RX_WORKS 64
+
+/* lives in the shared memory */
+struct shm_ring {
+	uint32_t head cl_cacheline_aligned; /* written by producer */
+	uint32_t tail cl_cacheline_aligned; /* written by consumer */
+	int sleeping cl_cacheline_aligned; /* consumer wants the doorbell */
+	int waiting; /* producer wants the doorbell when there's space */
+};
+
+/* ring[i] is filled by side i, connecting side is 0 */
+struct shm_hdr {
+	uint32_t magic, size;
+	struct shm_ring ring[2] cl_cacheline_aligned;
+};
+
+struct hello {
+	uint32_t magic, size;
+};
+
+enum { link_none, link_up, link_closing };
+enum { ev_accept, ev_ctl, ev_bell };
+
+#define ev_tag(gen, kind) ( (void*) (uintptr_t) ( ( (gen) << 2) | (kind) ) )
+#define ev_tag_kind(tag) ( (uintptr_t) (tag) & 3)
+#define ev_tag_gen(tag) ( (uintptr_t) (tag) >> 2)
+
+struct pending {
+	struct packet*p;
+	uint8_t priority;
+};
+
+struct shm {
+	cl_mutex lock;
+	struct part*self, *next;
+
+	int state, side;
+	uintptr_t gen;
+	int io; /* threads that use the mapping without the lock */
+	cl_cond idle; /* io went down to 0 */
+
+	int lfd, cfd, efd[2];
+	void*map;
+	size_t maplen;
+	struct shm_hdr*hdr;
+	uint8_t*data[2];
+	uint32_t size;
+
+	struct event*accept, *ctl, *bell;
+	uint32_t ring_bytes;
+	uint8_t ev_priority;
+
+	/* packets that didn't fit in the ring */
+	struct pending*q;
+	unsigned qsize, qhead, qtail;
+
+	uint64_t tx_packets, rx_packets, drops, bells;
+};
+
+#define tx_ring(s) (& (s)->hdr->ring[ (s)->side])
+#define rx_ring(s) (& (s)->hdr->ring[1 - (s)->side])
+
+/*
+ * helpers
+ */
+
+static int set_nonblock (int fd)
+{
+	int f = fcntl (fd, F_GETFL);
+	if (f < 0) return 1;
+	return fcntl (fd, F_SETFL, f | O_NONBLOCK) < 0;
+}
+
+static int unix_addr (const char*path, struct sockaddr_un*sa)
+{
+	if (strlen (path) >= sizeof (sa->sun_path) ) return 1;
+	memset (sa, 0, sizeof (*sa) );
+	sa->sun_family = AF_UNIX;
+	strcpy (sa->sun_path, path);
+	return 0;
+}
+
+static struct event* new_event (struct shm*s, int fd, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = s->ev_priority;
+	e->is_static = 1;
+	e->data.type = event_fd_readable;
+	e->data.fd = fd;
+	e->data.owner = s->self;
+	e->data.priv = ev_tag (s->gen, kind);
+	return e;
+}
+
+static void ring_bell (struct shm*s, int side)
+{
+	uint64_t one = 1;
+
+	/* fails only if it's rung already */
+	if (write (s->efd[side], &one, sizeof (one) ) < 0) return;
+	++s->bells;
+}
+
+/*
+ * link lifetime, called with the lock held
+ */
+
+static void link_cleanup (struct shm*s)
+{
+	if (s->map) munmap (s->map, s->maplen);
+	s->map = 0;
+	s->hdr = 0;
+	if (s->cfd >= 0) close (s->cfd);
+	if (s->efd[0] >= 0) close (s->efd[0]);
+	if (s->efd[1] >= 0) close (s->efd[1]);
+	s->cfd = s->efd[0] = s->efd[1] = -1;
+
+	if (s->ctl) cloudvpn_dispose_event (s->ctl);
+	if (s->bell) cloudvpn_dispose_event (s->bell);
+	s->ctl = s->bell = 0;
+
+	while (s->qhead != s->qtail)
+		cloudvpn_packet_free (s->q[s->qhead++ & (s->qsize - 1)].p);
+
+	s->state = link_none;
+}
+
+static void link_close (struct shm*s)
+{
+	if (s->state == link_none || s->state == link_closing) return;
+	s->state = link_closing;
+	if (!s->io) link_cleanup (s);
+}
+
+static void io_leave (struct shm*s)
+{
+	if (--s->io) return;
+	if (s->state == link_closing) link_cleanup (s);
+	cl_cond_signal (&s->idle);
+}
+
+static int link_map (struct shm*s, int memfd, uint32_t size)
+{
+	s->maplen = HDR_SIZE + 2 * (size_t) size;
+	s->map = mmap (0, s->maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+	               memfd, 0);
+	if (s->map == MAP_FAILED) {
+		s->map = 0;
+		return 1;
+	}
+
+	s->hdr = s->map;
+	s->size = size;
+	s->data[0] = (uint8_t*) s->map + HDR_SIZE;
+	s->data[1] = s->data[0] + size;
+	return 0;
+}
+
+static int link_start (struct shm*s)
+{
+	/* mapping and fds are there, start listening to the doorbell */
+	s->ctl = new_event (s, s->cfd, ev_ctl);
+	s->bell = new_event (s, s->efd[s->side], ev_bell);
+	if (!s->ctl || !s->bell || cloudvpn_register_event (s->ctl)
+	        || cloudvpn_register_event (s->bell) ) {
+		link_close (s);
+		return 1;
+	}
+	s->state = link_up;
+	return 0;
+}
+
+/*
+ * producer side, called with the lock held
+ */
+
+static int ring_put (struct shm*s, struct packet*p, uint8_t priority)
+{
+	struct shm_ring*r = tx_ring (s);
+	uint8_t*d = s->data[s->side];
+	uint32_t head = r->head, tail = cl_atomic_load_acq (&r->tail);
+	uint32_t need = rec_len (p->len), off, to_end, space;
+
+	off = head & (s->size - 1);
+	to_end = s->size - off;
+	space = s->size - (head - tail);
+
+	if (need > to_end) {
+		if (to_end + need > space) return 1;
+		* (uint32_t*) (d + off) = REC_PAD | to_end;
+		head += to_end;
+		off = 0;
+	} else if (need > space) return 1;
+
+	* (uint32_t*) (d + off) = need;
+	wire_hdr_from_packet (d + off + 4, p, priority, 0);
+	memcpy (d + off + 4 + WIRE_HDR_LEN, p->data, p->len);
+
+	cl_atomic_store_rel (&r->head, head + need);
+	return 0;
+}
+
+static void wake_consumer (struct shm*s)
+{
+	struct shm_ring*r = tx_ring (s);
+
+	/* pairs with the fence in the consumer going to sleep */
+	cl_fence();
+	if (cl_atomic_load (&r->sleeping) && cl_atomic_xchg (&r->sleeping, 0) )
+		ring_bell (s, 1 - s->side);
+}
+
+static int flush_pending (struct shm*s)
+{
+	/* returns nonzero if something got into the ring */
+	struct pending*e;
+	int n = 0;
+
+	while (s->qhead != s->qtail) {
+		e = s->q + (s->qhead & (s->qsize - 1) );
+		if (ring_put (s, e->p, e->priority) ) {
+			/* ask for the doorbell, then check again, it may be free now */
+			cl_atomic_store (&tx_ring (s)->waiting, 1);
+			cl_fence();
+			if (ring_put (s, e->p, e->priority) ) break;
+		}
+		cloudvpn_packet_free (e->p);
+		++s->qhead;
+		++s->tx_packets;
+		++n;
+	}
+	return n;
+}
+
+static void shm_send (struct shm*s, struct work*w)
+{
+	struct packet*p = w->p;
+
+	cl_mutex_lock (&s->lock);
+
+	if (s->state != link_up || rec_len (p->len) > s->size / 2) {
+		++s->drops;
+		goto drop;
+	}
+
+	/* keep the order, nothing overtakes the waiting ones */
+	if (s->qhead == s->qtail && !ring_put (s, p, w->priority) ) {
+		++s->tx_packets;
+		wake_consumer (s);
+		cl_mutex_unlock (&s->lock);
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	if (s->qtail - s->qhead >= s->qsize) {
+		++s->drops;
+		goto drop;
+	}
+	s->q[s->qtail & (s->qsize - 1)].p = p;
+	s->q[s->qtail & (s->qsize - 1)].priority = w->priority;
+	++s->qtail;
+	if (flush_pending (s) ) wake_consumer (s);
+
+	cl_mutex_unlock (&s->lock);
+	return;
+
+drop:
+	cl_mutex_unlock (&s->lock);
+	cloudvpn_packet_free (p);
+}
+
+/*
+ * consumer side, runs without the lock (bell event is one-shot)
+ */
+
+static void push_works (struct work**w, int n)
+{
+	int i;
+
+	if (n && cloudvpn_schedule_works (w, n) )
+		for (i = 0;i < n;++i) {
+			cloudvpn_packet_free (w[i]->p);
+			cl_free (w[i]);
+		}
+}
+
+static int deliver (struct shm*s, uint8_t*rec, struct wire_hdr*h,
+                    struct work**w)
+{
+	/* returns nonzero if the work was made */
+	struct packet*p;
+
+	++s->rx_packets;
+	if (!s->next) return 0;
+
+	p = cloudvpn_packet_alloc_buf (h->len);
+	if (!p) return 0;
+	if (! (*w = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return 0;
+	}
+
+	memcpy (p->data, rec + 4 + WIRE_HDR_LEN, h->len);
+	p->soff = h->soff;
+	p->doff = h->doff;
+	p->mark = h->mark;
+	p->src_part = s->self;
+	p->next_part = s->next;
+
+	(*w)->type = work_packet;
+	(*w)->priority = h->priority;
+	(*w)->is_static = 0;
+	(*w)->p = p;
+	return 1;
+}
+
+static int drain (struct shm*s)
+{
+	/* returns 1 if there's more left, -1 if the peer writes garbage */
+
+	struct shm_ring*r = rx_ring (s);
+	uint8_t*d = s->data[1 - s->side];
+	struct work*works[RX_WORKS];
+	struct wire_hdr h;
+	uint32_t head, tail = r->tail, len, off;
+	int n, done = 0;
+
+	for (;;) {
+		head = cl_atomic_load_acq (&r->head);
+		if (head == tail) {
+			/* going to sleep, then look once more */
+			cl_atomic_store (&r->sleeping, 1);
+			cl_fence();
+			if (cl_atomic_load_acq (&r->head) == tail) return 0;
+			cl_atomic_store (&r->sleeping, 0);
+			continue;
+		}
+
+		for (n = 0;head != tail && n < RX_WORKS;tail += len) {
+			off = tail & (s->size - 1);
+			len = * (uint32_t*) (d + off);
+			if (len & REC_PAD) {
+				len &= ~REC_PAD;
+				if (len != s->size - off) goto garbage;
+				continue;
+			}
+
+			/* the peer isn't trusted to stay inside the ring */
+			if (len < rec_len (0) || (len & (REC_ALIGN - 1) ) ||
+			        len > s->size - off || head - tail < len ||
+			        wire_hdr_get (d + off + 4, &h) ||
+			        rec_len (h.len) != len) goto garbage;
+
+			if (deliver (s, d + off, &h, works + n) ) ++n;
+			++done;
+		}
+
+		/* data is copied out, the space can be reused */
+		cl_atomic_store_rel (&r->tail, tail);
+		cl_fence();
+		if (cl_atomic_load (&r->waiting) && cl_atomic_xchg (&r->waiting, 0) )
+			ring_bell (s, 1 - s->side);
+
+		push_works (works, n);
+		if (done >= DRAIN_MAX) return 1;
+	}
+
+garbage:
+	push_works (works, n);
+	return -1;
+}
+
+static void doorbell (struct shm*s)
+{
+	uint64_t v;
+	int more;
+
+	/* just reset it, it doesn't matter if it was empty */
+	if (read (s->efd[s->side], &v, sizeof (v) ) < 0) v = 0;
+
+	++s->io;
+	cl_mutex_unlock (&s->lock);
+	more = drain (s);
+	cl_mutex_lock (&s->lock);
+	io_leave (s);
+
+	if (s->state != link_up) return;
+	if (more < 0) {
+		link_close (s);
+		return;
+	}
+
+	/* peer may have made space for us */
+	if (flush_pending (s) ) wake_consumer (s);
+
+	/* don't hog the worker, come back through the queue */
+	if (more) ring_bell (s, s->side);
+
+	if (cloudvpn_register_event (s->bell) ) link_close (s);
+}
+
+/*
+ * handshake
+ */
+
+static int send_fds (int sock, int*fds, int n, void*buf, size_t len)
+{
+	struct msghdr m;
+	struct iovec iov;
+	struct cmsghdr*c;
+	char ctl[CMSG_SPACE (3 * sizeof (int) )];
+
+	memset (&m, 0, sizeof (m) );
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl;
+	m.msg_controllen = CMSG_SPACE (n * sizeof (int) );
+
+	c = CMSG_FIRSTHDR (&m);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN (n * sizeof (int) );
+	memcpy (CMSG_DATA (c), fds, n * sizeof (int) );
+
+	return sendmsg (sock, &m, 0) != len;
+}
+
+static int recv_fds (int sock, int*fds, int n, void*buf, size_t len)
+{
+	/* returns number of fds received, -1 on error */
+	struct msghdr m;
+	struct iovec iov;
+	struct cmsghdr*c;
+	char ctl[CMSG_SPACE (3 * sizeof (int) )];
+	int k = 0;
+
+	memset (&m, 0, sizeof (m) );
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = ctl;
+	m.msg_controllen = sizeof (ctl);
+
+	if (recvmsg (sock, &m, 0) != len) return -1;
+
+	for (c = CMSG_FIRSTHDR (&m);c;c = CMSG_NXTHDR (&m, c) )
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			k = (c->cmsg_len - CMSG_LEN (0) ) / sizeof (int);
+			if (k > n) k = n; /* can't happen with our peer */
+			memcpy (fds, CMSG_DATA (c), k * sizeof (int) );
+		}
+	return k;
+}
+
+static int shm_connect (struct shm*s, const char*path)
+{
+	struct sockaddr_un sa;
+	struct hello h;
+	int fds[3], memfd = -1;
+
+	if (s->state != link_none || unix_addr (path, &sa) ) return 1;
+
+	s->cfd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (s->cfd < 0) return 1;
+	if (connect (s->cfd, (struct sockaddr*) &sa, sizeof (sa) ) )
+		goto fail;
+
+	memfd = memfd_create ("cloudvpn-shm", MFD_CLOEXEC);
+	s->efd[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s->efd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (memfd < 0 || s->efd[0] < 0 || s->efd[1] < 0 ||
+	        ftruncate (memfd, HDR_SIZE + 2 * (size_t) s->ring_bytes)
+	        || link_map (s, memfd, s->ring_bytes) ) goto fail;
+
+	memset (s->hdr, 0, sizeof (struct shm_hdr) );
+	s->hdr->magic = SHM_MAGIC;
+	s->hdr->size = s->ring_bytes;
+	s->hdr->ring[0].sleeping = s->hdr->ring[1].sleeping = 1; /* idle */
+	s->side = 0;
+
+	h.magic = SHM_MAGIC;
+	h.size = s->ring_bytes;
+	fds[0] = memfd;
+	fds[1] = s->efd[0];
+	fds[2] = s->efd[1];
+	if (send_fds (s->cfd, fds, 3, &h, sizeof (h) ) || set_nonblock (s->cfd) )
+		goto fail;
+	close (memfd);
+
+	++s->gen;
+	return link_start (s);
+
+fail:
+	if (memfd >= 0) close (memfd);
+	link_cleanup (s);
+	return 1;
+}
+
+static void accept_peer (struct shm*s)
+{
+	struct hello h;
+	struct stat st;
+	struct timeval tmo = { 1, 0 };
+	int fd, fds[3] = { -1, -1, -1}, n, i;
+
+	fd = accept (s->lfd, 0, 0);
+	if (fd >= 0 && s->state != link_none) {
+		close (fd); /* one peer per part */
+		fd = -1;
+	}
+
+	if (fd >= 0) {
+		/*
+		 * peer sends the fds right after connecting, local socket has it
+		 * in no time, so it's fine to wait for it here (not forever).
+		 */
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof (tmo) );
+		n = recv_fds (fd, fds, 3, &h, sizeof (h) );
+		if (n != 3 || h.magic != SHM_MAGIC || !h.size ||
+		        (h.size & (h.size - 1) ) || fstat (fds[0], &st) ||
+		        st.st_size < HDR_SIZE + 2 * (off_t) h.size ||
+		        link_map (s, fds[0], h.size) || set_nonblock (fd) ) {
+			for (i = 0;i < 3;++i) if (fds[i] >= 0) close (fds[i]);
+			if (s->map) munmap (s->map, s->maplen);
+			s->map = 0;
+			close (fd);
+		} else {
+			close (fds[0]);
+			s->cfd = fd;
+			s->efd[0] = fds[1];
+			s->efd[1] = fds[2];
+			s->side = 1;
+			++s->gen;
+			link_start (s);
+		}
+	}
+
+	if (cloudvpn_register_event (s->accept) ) {
+		close (s->lfd);
+		s->lfd = -1;
+	}
+}
+
+static int shm_listen (struct shm*s, const char*path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if (s->lfd >= 0 || unix_addr (path, &sa) ) return 1;
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+	unlink (path);
+	if (bind (fd, (struct sockaddr*) &sa, sizeof (sa) ) || listen (fd, 4)
+	        || set_nonblock (fd) ) {
+		close (fd);
+		return 1;
+	}
+
+	s->lfd = fd;
+	s->accept->data.fd = fd;
+	if (cloudvpn_register_event (s->accept) ) {
+		close (fd);
+		s->lfd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * events
+ */
+
+static void ctl_readable (struct shm*s)
+{
+	char buf[64];
+	ssize_t r = read (s->cfd, buf, sizeof (buf) );
+
+	/* nothing is ever sent there, so it's the peer going away */
+	if (!r || (r < 0 && errno != EAGAIN && errno != EINTR) ) link_close (s);
+	else if (cloudvpn_register_event (s->ctl) ) link_close (s);
+}
+
+static void shm_event (struct shm*s, struct event_data*e)
+{
+	cl_mutex_lock (&s->lock);
+
+	switch (ev_tag_kind (e->priv) ) {
+	case ev_accept:
+		if (s->lfd >= 0 && e->fd == s->lfd) accept_peer (s);
+		break;
+
+	case ev_ctl:
+		if (ev_tag_gen (e->priv) == s->gen && s->state == link_up)
+			ctl_readable (s);
+		break;
+
+	case ev_bell:
+		if (ev_tag_gen (e->priv) == s->gen && s->state == link_up)
+			doorbell (s);
+		break;
+	}
+
+	cl_mutex_unlock (&s->lock);
+}
+
+/*
+ * commands
+ */
+
+static int shm_set_queue (struct shm*s, int n)
+{
+	struct pending*q;
+	unsigned size;
+
+	if (n <= 0 || s->qhead != s->qtail) return 1;
+	for (size = 1;size < (unsigned) n;size <<= 1);
+
+	q = cl_calloc (size, sizeof (struct pending) );
+	if (!q) return 1;
+	cl_free (s->q);
+	s->q = q;
+	s->qsize = size;
+	s->qhead = s->qtail = 0;
+	return 0;
+}
+
+static void shm_command (struct shm*s, struct packet*p)
+{
+	struct command c;
+	unsigned n;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&s->lock);
+
+	if (cloudvpn_command_is (&c, "listen", 1) )
+		shm_listen (s, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "connect", 1) )
+		shm_connect (s, c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "next", 1) )
+		s->next = cloudvpn_find_part_by_name (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "ring", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n >= 4096) {
+			for (s->ring_bytes = 4096;s->ring_bytes < n;)
+				s->ring_bytes <<= 1;
+		}
+
+	} else if (cloudvpn_command_is (&c, "queue", 1) )
+		shm_set_queue (s, atoi (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "priority", 1) )
+		s->ev_priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "close", 0) )
+		link_close (s);
+
+	cl_mutex_unlock (&s->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void shm_process_work (struct part*p, struct work*w)
+{
+	struct shm*s = p->data;
+
+	if (!s) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		shm_send (s, w);
+		break;
+	case work_command:
+		shm_command (s, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		shm_event (s, &w->e);
+		break;
+	}
+}
+
+static void shm_init (struct part*p)
+{
+	struct shm*s = cl_calloc (1, sizeof (struct shm) );
+	p->data = s;
+	if (!s) return;
+
+	cl_mutex_init (&s->lock, 0);
+	cl_cond_init (&s->idle);
+	s->self = p;
+	s->lfd = s->cfd = s->efd[0] = s->efd[1] = -1;
+	s->state = link_none;
+	s->ring_bytes = 4 * 1024 * 1024;
+	s->ev_priority = 64;
+
+	s->accept = new_event (s, -1, ev_accept);
+	if (!s->accept || shm_set_queue (s, 1024) ) {
+		if (s->accept) cloudvpn_delete_event (s->accept);
+		cl_free (s);
+		p->data = 0;
+	}
+}
+
+static void shm_fini (struct part*p)
+{
+	struct shm*s = p->data;
+	if (!s) return;
+
+	cl_mutex_lock (&s->lock);
+	link_close (s);
+
+	/* the mapping is still read by the ring drain */
+	while (s->io) cl_cond_wait (&s->idle, &s->lock);
+	if (s->lfd >= 0) close (s->lfd);
+	cl_mutex_unlock (&s->lock);
+
+	cloudvpn_dispose_event (s->accept);
+	cl_free (s->q);
+	cl_cond_destroy (&s->idle);
+	cl_mutex_destroy (&s->lock);
+	cl_free (s);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "shm";
+
+int cloudvpn_plugin_init ()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = shm_process_work;
+	thisplugin.init = shm_init;
+	thisplugin.fini = shm_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
@@ -10,9 +10,1292 @@
  * if not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * tcp transport plugin.
+ *
+ * One part is one link to one peer. It either connects to the peer, or
+ * listens and takes the first one that connects. Packets are framed with
+ * the wire.h header.
+ *
+ * Sending only puts the packet into the send queue; whoever finds the queue
+ * idle flushes it with writev, and all packets that arrive meanwhile go out
+ * in the next writev. When the queue is deep, the socket is corked so the
+ * kernel doesn't push out small segments. Receiving reads big chunks and
+ * cuts as many frames from them as there are.
+ *
+ * Big packets can be sent with MSG_ZEROCOPY, so the kernel takes the pages
+ * instead of copying the data. Such packets, and copies of their frame
+ * headers, have to stay around until the kernel says (through the socket
+ * error queue) that it's done with them.
+ * It only pays off for big payloads; a writev call goes zerocopy if its
+ * first packet is at least the configured size. Note that loopback and some
+ * devices copy the data anyway, which is then reported as "copied".
+ *
+ * The connection carries several streams, so that routing updates and
+ * commands don't wait behind a long queue of bulk data. Each packet goes
+ * to a stream by its mark (if the mark is mapped) or by the priority of its
+ * work, lower streams are always sent first. Packets bigger than MUX_CHUNK
+ * are cut into chunks so others can get between them. Each stream also has
+ * a credit window: the peer gives the credit back as it reads the frames,
+ * so a stream can't have more than its window inside the socket buffers,
+ * and there's never a lot of bulk data in front of the control frames.
+ *
+ * Wire flags of the frames:
+ *	bits 0-2	stream
+ *	MUX_CREDIT	no data, mark is the credit in bytes given back
+ *	MUX_FRAG	header of the whole packet, only MUX_CHUNK bytes follow
+ *	MUX_CONT	next chunk of the packet, only len is valid
+ *
+ * Commands:
+ *	listen <address> <port>
+ *	connect <address> <port>
+ *	next <part>		where the received packets go
+ *	queue <packets>		send queue length of each stream (default 4096)
+ *	cork <packets>		queue depth to cork the socket at (default 16)
+ *	priority <n>		priority of socket events (default 64)
+ *	retry <ms>		reconnect interval (default 1000)
+ *	zerocopy <bytes>|off	use MSG_ZEROCOPY from this payload size (off)
+ *	stream <n> <prio> [window]
+ *				stream n takes works with priority up to prio,
+ *				window is in bytes (default 1M)
+ *	mark <mark> <n>		packets with this mark go to stream n
+ *	close
+ */
+
 #include "api.h"
+#include "alloc.h"
+#include "wire.h"
+#include "command.h"
 
-struct plugin* cloudvpn_plugin_get () {
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#ifdef __linux__
+#	include <linux/errqueue.h>
+#	ifndef SO_ZEROCOPY
+#		define SO_ZEROCOPY 60
+#	endif
+#	ifndef MSG_ZEROCOPY
+#		define MSG_ZEROCOPY 0x4000000
+#	endif
+#	ifndef SO_EE_ORIGIN_ZEROCOPY
+#		define SO_EE_ORIGIN_ZEROCOPY 5
+#	endif
+#	ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#		define SO_EE_CODE_ZEROCOPY_COPIED 1
+#	endif
+#	define HAVE_ZEROCOPY
+#endif
+
+#define RBUF_SIZE (256*1024)
+#define MAX_IOV 512
+#define READS_PER_EVENT 8
+#define ZC_WINDOW 1024 /* zerocopy calls that can wait for completion */
+
+#define MUX_STREAMS 4
+#define MUX_MARKS 16
+#define MUX_CHUNK 4096
+#define MUX_BURST (64*1024) /* unsent bytes in the wire queue to stop at */
+#define MUX_WINDOW (1024*1024)
+
+#define MUX_STREAM_MASK 7
+#define MUX_CREDIT 0x20
+#define MUX_FRAG 0x40
+#define MUX_CONT 0x80
+
+enum {
+	conn_none,
+	conn_connecting,
+	conn_connected,
+	conn_closing /* waiting for readers/writers to leave */
+};
+
+/*
+ * events are tagged with the connection generation, so that events of a
+ * dead connection can be recognized and ignored.
+ */
+
+enum { ev_rx, ev_tx, ev_accept, ev_retry };
+
+#define ev_tag(gen, kind) ( (void*) (uintptr_t) ( ( (gen) << 2) | (kind) ) )
+#define ev_tag_kind(tag) ( (uintptr_t) (tag) & 3)
+#define ev_tag_gen(tag) ( (uintptr_t) (tag) >> 2)
+
+/* one frame in the wire queue, a packet or its chunk */
+struct sendq_slot {
+	struct packet*p; /* 0 for credit frames */
+	uint32_t off, len; /* part of the packet data in the frame */
+	uint8_t hdr[WIRE_HDR_LEN];
+	uint8_t stream;
+	uint8_t last; /* last frame of the packet, the slot owns it */
+	uint8_t zc; /* some of it went out zerocopy, in call seq */
+	uint32_t seq;
+};
+
+struct mux_entry {
+	struct packet*p;
+	uint8_t priority;
+};
+
+struct stream {
+	/* sending, packets waiting to be framed */
+	struct mux_entry*q; /* same size as the wire queue */
+	unsigned qhead, qtail;
+	uint32_t off; /* how much of the head packet is framed already */
+	uint8_t max_priority;
+	uint32_t window;
+	int64_t credit; /* bytes that can be sent */
+	uint32_t credit_out; /* bytes received, to give back to the peer */
+	int zc_held; /* packet in progress waits for zerocopy call zc_seq */
+	uint32_t zc_seq;
+
+	/* receiving, only the reader touches it */
+	struct packet*rp; /* 0 if there's nowhere to deliver */
+	uint32_t rtotal, rgot;
+	uint8_t rpriority;
+};
+
+/* sent packets that the kernel may still read */
+struct zc_slot {
+	struct packet*p;
+	uint32_t seq;
+};
+
+/* frame headers of zerocopy calls, the wire queue slots get reused */
+struct zc_hdr {
+	uint8_t hdr[WIRE_HDR_LEN];
+	uint32_t seq;
+};
+
+struct tcp {
+	cl_mutex lock;
+	struct part*self, *next;
+
+	int lfd, fd, state;
+	uintptr_t gen;
+	int io; /* threads that currently use fd */
+	cl_cond idle; /* io went down to 0 */
+
+	/* where to connect again */
+	int connect_mode;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint64_t retry_us;
+
+	uint8_t ev_priority;
+	struct event*rx, *tx; /* per connection */
+	struct event*accept, *retry;
+	int tx_armed, retry_armed;
+
+	/* wire queue, frames in the order they are sent */
+	struct sendq_slot*q;
+	unsigned qsize, qhead, qtail; /* free-running indexes */
+	size_t qoff; /* how much of the head frame is already sent */
+	size_t qbytes; /* not sent yet */
+	int flushing, corked;
+	unsigned cork_at;
+
+	/* receive buffer, only the reader touches it */
+	uint8_t*rbuf;
+	size_t rlen;
+
+	/* zerocopy */
+	unsigned zc_min; /* 0 = off */
+	int zc_on; /* connection has SO_ZEROCOPY */
+	uint32_t zc_seq; /* id of the next zerocopy call */
+	uint32_t zc_acked; /* calls before this one are complete */
+	uint8_t zc_done[ZC_WINDOW]; /* completions that came out of order */
+	struct zc_slot*zq; /* same size as q */
+	unsigned zqhead, zqtail;
+	struct zc_hdr*zh; /* same size as q */
+	unsigned zhhead, zhtail;
+
+	struct stream s[MUX_STREAMS];
+	struct {
+		uint32_t mark;
+		uint8_t stream;
+	} marks[MUX_MARKS];
+	int nmarks;
+
+	uint64_t tx_packets, rx_packets, drops;
+	uint64_t zc_calls, zc_copied;
+};
+
+#define slot(t, i) ( (t)->q + ( (i) & ( (t)->qsize - 1) ) )
+
+/*
+ * helpers
+ */
+
+static int set_nonblock (int fd)
+{
+	int f = fcntl (fd, F_GETFL);
+	if (f < 0) return 1;
+	return fcntl (fd, F_SETFL, f | O_NONBLOCK) < 0;
+}
+
+static int parse_addr (const char*host, const char*port,
+                       struct sockaddr_storage*sa, socklen_t*len)
+{
+	struct addrinfo hints, *res;
+
+	/* numeric only, resolving names would block the worker */
+	memset (&hints, 0, sizeof (hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+	if (getaddrinfo (host, port, &hints, &res) ) return 1;
+	memcpy (sa, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo (res);
+	return 0;
+}
+
+static struct event* new_event (struct tcp*t, int type, int fd, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = t->ev_priority;
+	e->is_static = 1;
+	e->data.type = type;
+	e->data.fd = fd;
+	e->data.owner = t->self;
+	e->data.priv = ev_tag (t->gen, kind);
+	return e;
+}
+
+static void set_cork (struct tcp*t, int on)
+{
+#ifdef TCP_CORK
+	if (on == t->corked) return;
+	setsockopt (t->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on) );
+	t->corked = on;
+#endif
+}
+
+static void drop_queue (struct tcp*t)
+{
+	struct stream*st;
+	int i;
+
+	while (t->qhead != t->qtail) {
+		if (slot (t, t->qhead)->last)
+			cloudvpn_packet_free (slot (t, t->qhead)->p);
+		++t->qhead;
+	}
+	t->qoff = 0;
+	t->qbytes = 0;
+
+	/* packets that are partly framed are still owned by the stream */
+	for (i = 0;i < MUX_STREAMS;++i) {
+		st = t->s + i;
+		while (st->qhead != st->qtail) {
+			cloudvpn_packet_free (st->q[st->qhead & (t->qsize - 1)].p);
+			++st->qhead;
+		}
+		st->off = 0;
+		st->credit_out = 0;
+		st->zc_held = 0;
+
+		if (st->rp) cloudvpn_packet_free (st->rp);
+		st->rp = 0;
+		st->rtotal = st->rgot = 0;
+	}
+
+	/*
+	 * the kernel may still read these. conn_cleanup resets the connection
+	 * when any are left, which throws away the socket send queue, so
+	 * nothing can go out of them anymore.
+	 */
+	while (t->zqhead != t->zqtail) {
+		cloudvpn_packet_free (t->zq[t->zqhead & (t->qsize - 1)].p);
+		++t->zqhead;
+	}
+	t->zhhead = t->zhtail;
+	memset (t->zc_done, 0, sizeof (t->zc_done) );
+	t->zc_seq = t->zc_acked = 0;
+	t->zc_on = 0;
+}
+
+/*
+ * connection lifetime. All these are called with t->lock held.
+ */
+
+static void arm_retry (struct tcp*t)
+{
+	if (!t->connect_mode || t->retry_armed) return;
+
+	t->retry->data.time = t->retry_us;
+	if (!cloudvpn_register_event (t->retry) ) t->retry_armed = 1;
+}
+
+static void conn_cleanup (struct tcp*t)
+{
+	/* nobody uses the connection anymore, throw it away */
+	struct linger l = {1, 0};
+
+	if (t->zc_acked != t->zc_seq)
+		setsockopt (t->fd, SOL_SOCKET, SO_LINGER, &l, sizeof (l) );
+	close (t->fd);
+	t->fd = -1;
+	if (t->rx) cloudvpn_dispose_event (t->rx);
+	if (t->tx) cloudvpn_dispose_event (t->tx);
+	t->rx = t->tx = 0;
+	t->tx_armed = 0;
+	t->corked = 0;
+	drop_queue (t);
+	t->rlen = 0;
+	t->state = conn_none;
+
+	arm_retry (t);
+}
+
+static void conn_close (struct tcp*t)
+{
+	if (t->state == conn_none || t->state == conn_closing) return;
+
+	/* wake up whoever is inside read/write; the last one cleans up */
+	shutdown (t->fd, SHUT_RDWR);
+	t->state = conn_closing;
+	if (!t->io) conn_cleanup (t);
+}
+
+static void io_enter (struct tcp*t)
+{
+	++t->io;
+}
+
+static void io_leave (struct tcp*t)
+{
+	if (--t->io) return;
+	if (t->state == conn_closing) conn_cleanup (t);
+	cl_cond_signal (&t->idle); /* fini may wait for it */
+}
+
+static int conn_established (struct tcp*t, int fd)
+{
+	int i, one = 1;
+
+	t->fd = fd;
+	t->state = conn_connected;
+	t->rlen = 0;
+	t->qoff = 0;
+	for (i = 0;i < MUX_STREAMS;++i) t->s[i].credit = t->s[i].window;
+
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one) );
+#ifdef HAVE_ZEROCOPY
+	if (t->zc_min) t->zc_on = !setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY,
+		                                       &one, sizeof (one) );
+#endif
+
+	t->rx = new_event (t, event_fd_readable, fd, ev_rx);
+	t->tx = new_event (t, event_fd_writeable, fd, ev_tx);
+	if (!t->rx || !t->tx || cloudvpn_register_event (t->rx) ) {
+		conn_close (t);
+		return 1;
+	}
+	return 0;
+}
+
+static int conn_start (struct tcp*t)
+{
+	int fd;
+
+	if (t->state != conn_none) return 0;
+
+	fd = socket (t->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) goto retry;
+	if (set_nonblock (fd) ) goto close_retry;
+
+	++t->gen;
+	if (!connect (fd, (struct sockaddr*) &t->addr, t->addrlen) )
+		return conn_established (t, fd);
+
+	if (errno != EINPROGRESS) goto close_retry;
+
+	/* wait for writability to see how it ended */
+	t->fd = fd;
+	t->state = conn_connecting;
+	t->tx = new_event (t, event_fd_writeable, fd, ev_tx);
+	if (!t->tx || cloudvpn_register_event (t->tx) ) {
+		conn_close (t);
+		return 1;
+	}
+	return 0;
+
+close_retry:
+	close (fd);
+retry:
+	arm_retry (t);
+	return 1;
+}
+
+/*
+ * sending
+ */
+
+static int build_iov (struct tcp*t, struct iovec*iov,
+                      unsigned head, unsigned tail, size_t off, int zc)
+{
+	struct sendq_slot*s;
+	struct zc_hdr*z;
+	uint8_t*hdr;
+	int n = 0;
+
+	for (;head != tail && n + 2 <= MAX_IOV;++head, off = 0) {
+		s = slot (t, head);
+		if (off < WIRE_HDR_LEN) {
+			hdr = s->hdr;
+			if (zc) {
+				/* kept until the call completes, like the packets */
+				z = t->zh + (t->zhtail++ & (t->qsize - 1) );
+				memcpy (z->hdr, s->hdr, WIRE_HDR_LEN);
+				z->seq = t->zc_seq;
+				hdr = z->hdr;
+			}
+			iov[n].iov_base = hdr + off;
+			iov[n].iov_len = WIRE_HDR_LEN - off;
+			++n;
+			off = 0;
+		} else off -= WIRE_HDR_LEN;
+
+		if (s->len > off) {
+			iov[n].iov_base = s->p->data + s->off + off;
+			iov[n].iov_len = s->len - off;
+			++n;
+		}
+	}
+
+	return n;
+}
+
+static void consume (struct tcp*t, size_t done, int zc)
+{
+	/* zc: it was a zerocopy call, number t->zc_seq - 1 */
+	struct sendq_slot*s;
+	struct stream*st;
+	struct zc_slot*z;
+	size_t left;
+
+	while (done) {
+		s = slot (t, t->qhead);
+		if (zc && s->p) {
+			s->zc = 1;
+			s->seq = t->zc_seq - 1;
+		}
+
+		left = WIRE_HDR_LEN + s->len - t->qoff;
+		if (done < left) {
+			t->qoff += done;
+			t->qbytes -= done;
+			return;
+		}
+		done -= left;
+		t->qbytes -= left;
+
+		/* chunks of one packet go in order, the stream remembers them */
+		st = t->s + s->stream;
+		if (s->zc) {
+			st->zc_held = 1;
+			st->zc_seq = s->seq;
+			s->zc = 0;
+		}
+
+		if (s->last) {
+			if (st->zc_held) {
+				/* kernel still has it, keep it until the completion */
+				z = t->zq + (t->zqtail++ & (t->qsize - 1) );
+				z->p = s->p;
+				z->seq = st->zc_seq;
+				st->zc_held = 0;
+			} else cloudvpn_packet_free (s->p);
+			++t->tx_packets;
+		}
+
+		++t->qhead;
+		t->qoff = 0;
+	}
+}
+
+#ifdef HAVE_ZEROCOPY
+
+static void zc_complete (struct tcp*t, uint32_t lo, uint32_t hi, int copied)
+{
+	uint32_t id;
+
+	for (id = lo;id != hi + 1;++id)
+		if (id - t->zc_acked < ZC_WINDOW) t->zc_done[id % ZC_WINDOW] = 1;
+	if (copied) t->zc_copied += hi - lo + 1;
+
+	while (t->zc_acked != t->zc_seq && t->zc_done[t->zc_acked % ZC_WINDOW]) {
+		t->zc_done[t->zc_acked % ZC_WINDOW] = 0;
+		++t->zc_acked;
+	}
+
+	/* release what all finished calls were holding */
+	while (t->zqhead != t->zqtail &&
+	        (int32_t) (t->zq[t->zqhead & (t->qsize - 1)].seq
+	                   - t->zc_acked) < 0) {
+		cloudvpn_packet_free (t->zq[t->zqhead & (t->qsize - 1)].p);
+		++t->zqhead;
+	}
+	while (t->zhhead != t->zhtail &&
+	        (int32_t) (t->zh[t->zhhead & (t->qsize - 1)].seq
+	                   - t->zc_acked) < 0) ++t->zhhead;
+}
+
+static void zc_reap (struct tcp*t)
+{
+	/* collect zerocopy completions from the error queue */
+	char ctl[CMSG_SPACE (sizeof (struct sock_extended_err) ) + 64];
+	struct sock_extended_err*ee;
+	struct cmsghdr*c;
+	struct msghdr m;
+
+	while (t->zc_acked != t->zc_seq) {
+		memset (&m, 0, sizeof (m) );
+		m.msg_control = ctl;
+		m.msg_controllen = sizeof (ctl);
+		if (recvmsg (t->fd, &m, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+		for (c = CMSG_FIRSTHDR (&m);c;c = CMSG_NXTHDR (&m, c) ) {
+			if (! (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+			        && ! (c->cmsg_level == SOL_IPV6 &&
+			              c->cmsg_type == IPV6_RECVERR) ) continue;
+			ee = (struct sock_extended_err*) CMSG_DATA (c);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			zc_complete (t, ee->ee_info, ee->ee_data,
+			             ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+}
+
+static int zc_usable (struct tcp*t, unsigned slots)
+{
+	/* is it worth it and is there room to keep the packets? */
+	struct packet*p = slot (t, t->qhead)->p;
+
+	if (!t->zc_on || !p || p->len < t->zc_min) return 0;
+	if (t->zc_seq - t->zc_acked >= ZC_WINDOW - 1) zc_reap (t);
+	/* headers of calls that failed or fell back to copying */
+	if (t->zc_seq == t->zc_acked) t->zhhead = t->zhtail;
+	return t->zc_seq - t->zc_acked < ZC_WINDOW - 1 &&
+	       t->qsize - (t->zqtail - t->zqhead) > slots &&
+	       t->qsize - (t->zhtail - t->zhhead) > slots;
+}
+
+#else
+
+static void zc_reap (struct tcp*t)
+{
+}
+
+static int zc_usable (struct tcp*t, unsigned slots)
+{
+	return 0;
+}
+
+#endif
+
+static struct sendq_slot* wire_add (struct tcp*t, struct packet*p,
+                                    uint32_t off, uint32_t len, int stream) {
+
+	struct sendq_slot*s = slot (t, t->qtail++);
+
+	s->p = p;
+	s->off = off;
+	s->len = len;
+	s->stream = stream;
+	s->last = 0;
+	s->zc = 0;
+	t->qbytes += WIRE_HDR_LEN + len;
+	return s;
+}
+
+static void fill (struct tcp*t)
+{
+	/*
+	 * move frames from the streams to the wire queue. Credit for the peer
+	 * goes first, then the streams in order, each while it has credit.
+	 * Only a bit is moved at a time, so whatever comes to a better stream
+	 * meanwhile doesn't wait behind much.
+	 */
+
+	struct stream*st;
+	struct mux_entry*e;
+	struct sendq_slot*s;
+	struct wire_hdr h;
+	uint32_t len;
+	int i;
+
+	for (i = 0;i < MUX_STREAMS;++i) {
+		st = t->s + i;
+		if (!st->credit_out) continue;
+		if (t->qtail - t->qhead >= t->qsize) return;
+
+		s = wire_add (t, 0, 0, 0, i);
+		memset (&h, 0, sizeof (h) );
+		h.flags = MUX_CREDIT | i;
+		h.mark = st->credit_out;
+		wire_hdr_put (s->hdr, &h);
+		st->credit_out = 0;
+	}
+
+	for (i = 0;i < MUX_STREAMS;++i) {
+		st = t->s + i;
+		while (st->qhead != st->qtail && st->credit > 0) {
+			if (t->qbytes >= MUX_BURST ||
+			        t->qtail - t->qhead >= t->qsize) return;
+
+			e = st->q + (st->qhead & (t->qsize - 1) );
+			len = e->p->len - st->off;
+			if (len > MUX_CHUNK) len = MUX_CHUNK;
+
+			s = wire_add (t, e->p, st->off, len, i);
+			if (!st->off) wire_hdr_from_packet (s->hdr, e->p, e->priority,
+				                                    len < e->p->len ?
+				                                    MUX_FRAG | i : i);
+			else {
+				memset (&h, 0, sizeof (h) );
+				h.len = len;
+				h.priority = e->priority;
+				h.flags = MUX_CONT | i;
+				wire_hdr_put (s->hdr, &h);
+			}
+
+			st->credit -= WIRE_HDR_LEN + len;
+			st->off += len;
+			if (st->off == e->p->len) {
+				s->last = 1;
+				st->off = 0;
+				++st->qhead;
+			}
+		}
+	}
+}
+
+static void flush (struct tcp*t)
+{
+	/*
+	 * only one thread gets here at a time (t->flushing is set). The lock
+	 * is held except while writing, so others can keep queueing.
+	 */
+
+	struct iovec iov[MAX_IOV];
+	struct msghdr m;
+	unsigned head, tail;
+	ssize_t r;
+	int n, zc;
+
+	for (;;) {
+		if (t->state != conn_connected) break;
+		fill (t);
+		head = t->qhead;
+		tail = t->qtail;
+		if (head == tail) break;
+
+		if (tail - head >= t->cork_at) set_cork (t, 1);
+
+		zc = zc_usable (t, tail - head < MAX_IOV / 2 ?
+		                tail - head : MAX_IOV / 2);
+		n = build_iov (t, iov, head, tail, t->qoff, zc);
+		io_enter (t);
+		cl_mutex_unlock (&t->lock);
+
+		if (zc) {
+			memset (&m, 0, sizeof (m) );
+			m.msg_iov = iov;
+			m.msg_iovlen = n;
+			r = sendmsg (t->fd, &m, MSG_ZEROCOPY);
+			if (r < 0 && errno == ENOBUFS) {
+				/* too many completions pending, copy it this time */
+				zc = 0;
+				r = writev (t->fd, iov, n);
+			}
+		} else r = writev (t->fd, iov, n);
+
+		cl_mutex_lock (&t->lock);
+		io_leave (t);
+
+		/* closed meanwhile, the queue is (or will be) dropped */
+		if (t->state != conn_connected) break;
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (t->state == conn_connected &&
+				        !cloudvpn_register_event (t->tx) )
+					t->tx_armed = 1;
+			} else conn_close (t);
+			break;
+		}
+
+		if (zc && r > 0) {
+			++t->zc_seq;
+			++t->zc_calls;
+		}
+		consume (t, r, zc && r > 0);
+	}
+
+	/* nothing more to send right now, push out what's corked */
+	if (t->state == conn_connected && t->qhead == t->qtail)
+		set_cork (t, 0);
+
+	t->flushing = 0;
+}
+
+static void kick (struct tcp*t)
+{
+	/* if someone's already sending, he will take it too */
+	if (!t->flushing && !t->tx_armed) {
+		t->flushing = 1;
+		flush (t);
+	}
+}
+
+static int classify (struct tcp*t, struct work*w)
+{
+	int i;
+
+	for (i = 0;i < t->nmarks;++i)
+		if (t->marks[i].mark == w->p->mark) return t->marks[i].stream;
+
+	for (i = 0;i < MUX_STREAMS - 1;++i)
+		if (w->priority <= t->s[i].max_priority) break;
+	return i;
+}
+
+static void tcp_send (struct tcp*t, struct work*w)
+{
+	struct packet*p = w->p;
+	struct mux_entry*e;
+	struct stream*st;
+
+	cl_mutex_lock (&t->lock);
+
+	st = t->s + classify (t, w);
+	if (t->state != conn_connected || st->qtail - st->qhead >= t->qsize) {
+		++t->drops;
+		cl_mutex_unlock (&t->lock);
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	e = st->q + (st->qtail++ & (t->qsize - 1) );
+	e->p = p;
+	e->priority = w->priority;
+
+	kick (t);
+	cl_mutex_unlock (&t->lock);
+}
+
+/*
+ * receiving
+ */
+
+static struct packet* rx_packet (struct tcp*t, struct wire_hdr*h) {
+
+	struct packet*p = cloudvpn_packet_alloc_buf (h->len);
+	if (!p) return 0;
+
+	p->soff = h->soff;
+	p->doff = h->doff;
+	p->mark = h->mark;
+	p->src_part = t->self;
+	p->next_part = t->next;
+	return p;
+}
+
+static void deliver (struct tcp*t, struct packet*p, uint8_t priority)
+{
+	struct work*w;
+
+	w = cloudvpn_new_work();
+	if (!w) goto free_packet;
+	w->type = work_packet;
+	w->priority = priority;
+	w->is_static = 0;
+	w->p = p;
+
+	if (cloudvpn_schedule_work (w) ) {
+		cl_free (w);
+		goto free_packet;
+	}
+	return;
+
+free_packet:
+	cloudvpn_packet_free (p);
+}
+
+static int rx_frame (struct tcp*t, struct stream*st, struct wire_hdr*h,
+                     uint8_t*data, uint32_t len)
+{
+	/* returns nonzero if the chunks don't fit together */
+	if (h->flags & MUX_CONT) {
+		if (len > st->rtotal - st->rgot) return 1;
+		if (st->rp) memcpy (st->rp->data + st->rgot, data, len);
+		st->rgot += len;
+	} else {
+		if (st->rtotal) return 1; /* previous one isn't complete */
+		if ( (h->flags & MUX_FRAG) && h->len <= MUX_CHUNK) return 1;
+
+		st->rp = t->next ? rx_packet (t, h) : 0;
+		if (st->rp) memcpy (st->rp->data, data, len);
+		st->rtotal = h->len;
+		st->rgot = len;
+		st->rpriority = h->priority;
+	}
+
+	if (st->rgot < st->rtotal) return 0;
+
+	if (st->rp) deliver (t, st->rp, st->rpriority);
+	++t->rx_packets;
+	st->rp = 0;
+	st->rtotal = st->rgot = 0;
+	return 0;
+}
+
+static int parse_frames (struct tcp*t, int64_t*credit_in, uint32_t*used)
+{
+	struct wire_hdr h;
+	size_t pos = 0;
+	uint32_t len;
+	int i;
+
+	while (t->rlen - pos >= WIRE_HDR_LEN) {
+		if (wire_hdr_get (t->rbuf + pos, &h) ) return 1;
+		i = h.flags & MUX_STREAM_MASK;
+		if (i >= MUX_STREAMS) return 1;
+
+		if (h.flags & MUX_CREDIT) {
+			if (h.len) return 1;
+			credit_in[i] += h.mark;
+			pos += WIRE_HDR_LEN;
+			continue;
+		}
+
+		len = (h.flags & MUX_FRAG) ? MUX_CHUNK : h.len;
+		if (t->rlen - pos < WIRE_HDR_LEN + len) break;
+
+		if (rx_frame (t, t->s + i, &h, t->rbuf + pos + WIRE_HDR_LEN, len) )
+			return 1;
+		used[i] += WIRE_HDR_LEN + len;
+		pos += WIRE_HDR_LEN + len;
+	}
+
+	if (pos) {
+		memmove (t->rbuf, t->rbuf + pos, t->rlen - pos);
+		t->rlen -= pos;
+	}
 	return 0;
 }
 
+static void mux_update (struct tcp*t, int64_t*credit_in, uint32_t*used)
+{
+	/* account what the reader found, and send if it unblocked something */
+	int i, more = 0;
+
+	for (i = 0;i < MUX_STREAMS;++i) {
+		t->s[i].credit += credit_in[i];
+		t->s[i].credit_out += used[i];
+		more |= credit_in[i] || used[i];
+	}
+	if (more) kick (t);
+}
+
+static void tcp_read (struct tcp*t)
+{
+	int64_t credit_in[MUX_STREAMS];
+	uint32_t used[MUX_STREAMS];
+	ssize_t r;
+	size_t space;
+	int i, fail = 0;
+
+	memset (credit_in, 0, sizeof (credit_in) );
+	memset (used, 0, sizeof (used) );
+
+	/* rx event is one-shot, so there's only one reader at a time */
+	io_enter (t);
+	cl_mutex_unlock (&t->lock);
+
+	for (i = 0;i < READS_PER_EVENT;++i) {
+		space = RBUF_SIZE - t->rlen;
+		r = read (t->fd, t->rbuf + t->rlen, space);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) fail = 1;
+			break;
+		}
+		if (!r) {
+			fail = 1; /* closed by peer */
+			break;
+		}
+
+		t->rlen += r;
+		if (parse_frames (t, credit_in, used) ) {
+			fail = 1; /* garbage, peer is broken */
+			break;
+		}
+		if (r < space) break; /* probably drained */
+	}
+
+	cl_mutex_lock (&t->lock);
+	if (fail) conn_close (t);
+	else if (t->state == conn_connected) {
+		if (cloudvpn_register_event (t->rx) ) conn_close (t);
+		else mux_update (t, credit_in, used);
+	}
+	io_leave (t);
+}
+
+/*
+ * events
+ */
+
+static void connect_finished (struct tcp*t)
+{
+	int err = 0;
+	socklen_t len = sizeof (err);
+
+	if (getsockopt (t->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		conn_close (t);
+		return;
+	}
+
+	/* tx event of the connecting phase isn't needed anymore */
+	cloudvpn_dispose_event (t->tx);
+	t->tx = 0;
+	conn_established (t, t->fd);
+}
+
+static void accept_peer (struct tcp*t)
+{
+	int fd;
+
+	fd = accept (t->lfd, 0, 0);
+	if (fd >= 0) {
+		/* only one peer per part */
+		if (t->state != conn_none || set_nonblock (fd) ) close (fd);
+		else {
+			++t->gen;
+			conn_established (t, fd);
+		}
+	}
+
+	if (cloudvpn_register_event (t->accept) ) {
+		close (t->lfd);
+		t->lfd = -1;
+	}
+}
+
+static void tcp_event (struct tcp*t, struct event_data*e)
+{
+	int kind = ev_tag_kind (e->priv);
+
+	cl_mutex_lock (&t->lock);
+
+	switch (kind) {
+	case ev_accept:
+		if (t->lfd >= 0 && e->fd == t->lfd) accept_peer (t);
+		break;
+
+	case ev_retry:
+		t->retry_armed = 0;
+		conn_start (t);
+		break;
+
+	case ev_rx:
+		if (ev_tag_gen (e->priv) != t->gen ||
+		        t->state != conn_connected) break;
+		/* error queue makes the socket readable too */
+		if (t->zc_acked != t->zc_seq) zc_reap (t);
+		tcp_read (t);
+		break;
+
+	case ev_tx:
+		if (ev_tag_gen (e->priv) != t->gen) break;
+		if (t->state == conn_connecting) {
+			connect_finished (t);
+			break;
+		}
+		if (t->state != conn_connected) break;
+		if (t->zc_acked != t->zc_seq) zc_reap (t);
+		t->tx_armed = 0;
+		kick (t);
+		break;
+	}
+
+	cl_mutex_unlock (&t->lock);
+}
+
+/*
+ * commands
+ */
+
+static int tcp_listen (struct tcp*t, const char*host, const char*port)
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+	int fd, one = 1;
+
+	if (t->lfd >= 0 || parse_addr (host, port, &sa, &len) ) return 1;
+
+	fd = socket (sa.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one) );
+	if (set_nonblock (fd) || bind (fd, (struct sockaddr*) &sa, len)
+	        || listen (fd, 16) ) {
+		close (fd);
+		return 1;
+	}
+
+	t->lfd = fd;
+	t->accept->data.fd = fd;
+	if (cloudvpn_register_event (t->accept) ) {
+		close (fd);
+		t->lfd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+static int tcp_set_queue (struct tcp*t, int n)
+{
+	struct sendq_slot*q;
+	struct zc_slot*zq;
+	struct zc_hdr*zh;
+	struct mux_entry*sq[MUX_STREAMS];
+	unsigned size;
+	int i, fail = 0;
+
+	if (n <= 0 || t->state != conn_none) return 1;
+	for (size = 1;size < (unsigned) n;size <<= 1);
+
+	q = cl_calloc (size, sizeof (struct sendq_slot) );
+	zq = cl_calloc (size, sizeof (struct zc_slot) );
+	zh = cl_calloc (size, sizeof (struct zc_hdr) );
+	fail = !q || !zq || !zh;
+	for (i = 0;i < MUX_STREAMS;++i) {
+		sq[i] = cl_calloc (size, sizeof (struct mux_entry) );
+		fail |= !sq[i];
+	}
+	if (fail) {
+		cl_free (q);
+		cl_free (zq);
+		cl_free (zh);
+		for (i = 0;i < MUX_STREAMS;++i) cl_free (sq[i]);
+		return 1;
+	}
+
+	cl_free (t->q);
+	cl_free (t->zq);
+	cl_free (t->zh);
+	t->q = q;
+	t->zq = zq;
+	t->zh = zh;
+	t->qsize = size;
+	t->qhead = t->qtail = 0;
+	t->zqhead = t->zqtail = 0;
+	t->zhhead = t->zhtail = 0;
+	for (i = 0;i < MUX_STREAMS;++i) {
+		cl_free (t->s[i].q);
+		t->s[i].q = sq[i];
+		t->s[i].qhead = t->s[i].qtail = 0;
+	}
+	return 0;
+}
+
+static int tcp_set_stream (struct tcp*t, int argc, char**argv)
+{
+	int i = atoi (argv[1]);
+
+	if (i < 0 || i >= MUX_STREAMS) return 1;
+	t->s[i].max_priority = atoi (argv[2]);
+	if (argc > 3) t->s[i].window = atoi (argv[3]);
+	return 0;
+}
+
+static int tcp_set_mark (struct tcp*t, uint32_t mark, int stream)
+{
+	int i;
+
+	if (stream < 0 || stream >= MUX_STREAMS) return 1;
+	for (i = 0;i < t->nmarks && t->marks[i].mark != mark;++i);
+	if (i == MUX_MARKS) return 1;
+	if (i == t->nmarks) ++t->nmarks;
+	t->marks[i].mark = mark;
+	t->marks[i].stream = stream;
+	return 0;
+}
+
+static void tcp_command (struct tcp*t, struct packet*p)
+{
+	struct command c;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&t->lock);
+
+	if (cloudvpn_command_is (&c, "listen", 2) )
+		tcp_listen (t, c.argv[1], c.argv[2]);
+
+	else if (cloudvpn_command_is (&c, "connect", 2) ) {
+		if (!parse_addr (c.argv[1], c.argv[2], &t->addr, &t->addrlen) ) {
+			t->connect_mode = 1;
+			conn_start (t);
+		}
+
+	} else if (cloudvpn_command_is (&c, "next", 1) )
+		t->next = cloudvpn_find_part_by_name (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "queue", 1) )
+		tcp_set_queue (t, atoi (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "cork", 1) )
+		t->cork_at = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "priority", 1) )
+		t->ev_priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "retry", 1) )
+		t->retry_us = 1000ULL * atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "zerocopy", 1) )
+		/* takes effect with the next connection */
+		t->zc_min = strcmp (c.argv[1], "off") ? atoi (c.argv[1]) : 0;
+
+	else if (cloudvpn_command_is (&c, "stream", 2) )
+		tcp_set_stream (t, c.argc, c.argv);
+
+	else if (cloudvpn_command_is (&c, "mark", 2) )
+		tcp_set_mark (t, strtoul (c.argv[1], 0, 0), atoi (c.argv[2]) );
+
+	else if (cloudvpn_command_is (&c, "close", 0) ) {
+		t->connect_mode = 0;
+		conn_close (t);
+	}
+
+	cl_mutex_unlock (&t->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void tcp_process_work (struct part*p, struct work*w)
+{
+	struct tcp*t = p->data;
+
+	if (!t) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		tcp_send (t, w);
+		break;
+	case work_command:
+		tcp_command (t, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		tcp_event (t, &w->e);
+		break;
+	}
+}
+
+static void tcp_init (struct part*p)
+{
+	int i;
+	struct tcp*t = cl_calloc (1, sizeof (struct tcp) );
+	p->data = t;
+	if (!t) return;
+
+	cl_mutex_init (&t->lock, 0);
+	cl_cond_init (&t->idle);
+	t->self = p;
+	t->lfd = t->fd = -1;
+	t->state = conn_none;
+	t->ev_priority = 64;
+	t->cork_at = 16;
+	t->retry_us = 1000000;
+
+	/* control, normal, bulk and the rest */
+	t->s[0].max_priority = 15;
+	t->s[1].max_priority = 63;
+	t->s[2].max_priority = 127;
+	t->s[3].max_priority = 255;
+	for (i = 0;i < MUX_STREAMS;++i) t->s[i].window = MUX_WINDOW;
+
+	t->rbuf = cl_malloc (RBUF_SIZE);
+	t->accept = new_event (t, event_fd_readable, -1, ev_accept);
+	t->retry = new_event (t, event_time, 0, ev_retry);
+	if (!t->rbuf || !t->accept || !t->retry || tcp_set_queue (t, 4096) ) {
+		if (t->rbuf) cl_free (t->rbuf);
+		if (t->accept) cloudvpn_delete_event (t->accept);
+		if (t->retry) cloudvpn_delete_event (t->retry);
+		cl_free (t);
+		p->data = 0;
+	}
+}
+
+static void tcp_fini (struct part*p)
+{
+	int i;
+	struct tcp*t = p->data;
+	if (!t) return;
+
+	cl_mutex_lock (&t->lock);
+	t->connect_mode = 0;
+	conn_close (t);
+
+	/* readers and writers still inside are woken by the shutdown */
+	while (t->io) cl_cond_wait (&t->idle, &t->lock);
+	if (t->lfd >= 0) close (t->lfd);
+	cl_mutex_unlock (&t->lock);
+
+	cloudvpn_dispose_event (t->accept);
+	cloudvpn_dispose_event (t->retry);
+	cl_free (t->q);
+	cl_free (t->zq);
+	cl_free (t->zh);
+	for (i = 0;i < MUX_STREAMS;++i) cl_free (t->s[i].q);
+	cl_free (t->rbuf);
+	cl_cond_destroy (&t->idle);
+	cl_mutex_destroy (&t->lock);
+	cl_free (t);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "tcp";
+
+int cloudvpn_plugin_init()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = tcp_process_work;
+	thisplugin.init = tcp_init;
+	thisplugin.fini = tcp_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
@@ -0,0 +1,705 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tun/tap interface plugin.
+ *
+ * The interface is opened with IFF_MULTI_QUEUE, one queue per worker by
+ * default. Kernel spreads the flows it sends us among the queues, and each
+ * worker sends to its own queue, so the queues don't fight for locks.
+ *
+ * With IFF_VNET_HDR every frame carries a virtio_net_hdr, which describes
+ * checksum and segmentation offload. It's kept in the packet, so the other
+ * end of the tunnel hands the kernel the same big unchecksummed frame that
+ * was read here, and nobody has to segment or checksum it in between. Both
+ * ends have to agree on that, of course.
+ *
+ * Packets look like this:
+ *	tap:	dst mac, src mac, [vnet header], ethertype, payload...
+ *	tun:	[vnet header], ip packet	(no addresses, soff = doff = 0)
+ * The tap layout is read and written with readv/writev, so nothing is
+ * copied around.
+ *
+ * Any fd can stand in for a queue (fd command); if it's a socket, batches
+ * are read and written with recvmmsg/sendmmsg, otherwise frame by frame.
+ * Socketpairs make a fine fake interface for benchmarks.
+ *
+ * Commands:
+ *	mode tun|tap		(default tap)
+ *	vnet on|off		use offload headers (default on)
+ *	open <ifname> [queues]	open the interface (default queues = workers)
+ *	fd <n>			use an open fd as another queue
+ *	next <part>		where the received packets go
+ *	queue <packets>		send queue length per queue (default 1024)
+ *	batch <n>		frames per read/write round (default 32, max 64)
+ *	mtu <bytes>		biggest frame without offloads (default 2048)
+ *	priority <n>		priority of fd events (default 64)
+ *	close
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg/sendmmsg */
+#endif
+
+#include "api.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "command.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+#	include <net/if.h>
+#	include <linux/if_tun.h>
+#endif
+
+#define MAX_QUEUES 64
+#define BATCH_MAX 64
+#define READS_PER_EVENT 4
+#define VNET_HDR_LEN 10 /* struct virtio_net_hdr */
+#define MAC_LEN 6
+
+/* tag is queue index and generation of the whole queue set */
+#define ev_tag(gen, q, tx) \
+	( (void*) (uintptr_t) ( ( (gen) << 8) | ( (q) << 1) | (tx) ) )
+#define ev_tag_tx(tag) ( (uintptr_t) (tag) & 1)
+#define ev_tag_queue(tag) ( ( (uintptr_t) (tag) >> 1) & 127)
+#define ev_tag_gen(tag) ( (uintptr_t) (tag) >> 8)
+
+struct queue {
+	cl_mutex lock;
+	int fd, sock, closing;
+	int io; /* threads that currently use fd */
+	cl_cond idle; /* io went down to 0 */
+
+	struct event*rx, *tx;
+	int tx_armed, flushing;
+
+	struct packet**q;
+	unsigned qsize, qhead, qtail; /* free-running indexes */
+
+	struct packet*rpkt[BATCH_MAX]; /* only the reader touches these */
+
+	uint64_t rx_packets, tx_packets, drops;
+};
+
+struct tun {
+	cl_mutex lock; /* configuration */
+	struct part*self, *next;
+
+	int tap, vnet;
+	unsigned qlen, batch, mtu;
+	uint8_t ev_priority;
+
+	uintptr_t gen;
+	int nq;
+	struct queue qs[MAX_QUEUES];
+};
+
+/*
+ * fd layer: batches of frames in or out of whatever the fd is
+ */
+
+static int fd_recv (struct queue*q, struct mmsghdr*m, int n)
+{
+	ssize_t r;
+	size_t cap;
+	int i, j;
+
+	if (q->sock) return recvmmsg (q->fd, m, n, MSG_DONTWAIT, 0);
+
+	for (i = 0;i < n;++i) {
+		r = readv (q->fd, m[i].msg_hdr.msg_iov, m[i].msg_hdr.msg_iovlen);
+		if (r < 0) return i ? i : -1;
+
+		/* tun cuts what doesn't fit without telling, guess it */
+		for (cap = 0, j = 0;j < m[i].msg_hdr.msg_iovlen;++j)
+			cap += m[i].msg_hdr.msg_iov[j].iov_len;
+		m[i].msg_len = r;
+		m[i].msg_hdr.msg_flags = (r == cap) ? MSG_TRUNC : 0;
+	}
+	return n;
+}
+
+static int fd_send (struct queue*q, struct mmsghdr*m, int n)
+{
+	int i;
+
+	if (q->sock) return sendmmsg (q->fd, m, n, MSG_DONTWAIT);
+
+	for (i = 0;i < n;++i)
+		if (writev (q->fd, m[i].msg_hdr.msg_iov,
+		            m[i].msg_hdr.msg_iovlen) < 0)
+			return i ? i : -1;
+	return n;
+}
+
+/*
+ * where the pieces of a frame go in the packet, returns iov count
+ */
+
+static int frame_iov (struct tun*t, struct iovec*iov, char*d, size_t len)
+{
+	if (t->tap && t->vnet) {
+		if (len < VNET_HDR_LEN + 2 * MAC_LEN) return 0;
+		iov[0].iov_base = d + 2 * MAC_LEN;
+		iov[0].iov_len = VNET_HDR_LEN;
+		iov[1].iov_base = d;
+		iov[1].iov_len = 2 * MAC_LEN;
+		iov[2].iov_base = d + 2 * MAC_LEN + VNET_HDR_LEN;
+		iov[2].iov_len = len - 2 * MAC_LEN - VNET_HDR_LEN;
+		return 3;
+	}
+
+	iov[0].iov_base = d;
+	iov[0].iov_len = len;
+	return 1;
+}
+
+static unsigned frame_min (struct tun*t)
+{
+	return (t->vnet ? VNET_HDR_LEN : 0) + (t->tap ? 2 * MAC_LEN : 1);
+}
+
+static struct event* new_event (struct tun*t, int type, int fd,
+                                int qi, int tx) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = t->ev_priority;
+	e->is_static = 1;
+	e->data.type = type;
+	e->data.fd = fd;
+	e->data.owner = t->self;
+	e->data.priv = ev_tag (t->gen, qi, tx);
+	return e;
+}
+
+/*
+ * queue lifetime. Called with the queue lock held.
+ */
+
+static void queue_cleanup (struct queue*q)
+{
+	int i;
+
+	close (q->fd);
+	q->fd = -1;
+	if (q->rx) cloudvpn_dispose_event (q->rx);
+	if (q->tx) cloudvpn_dispose_event (q->tx);
+	q->rx = q->tx = 0;
+	q->tx_armed = 0;
+	q->closing = 0;
+
+	while (q->qhead != q->qtail)
+		cloudvpn_packet_free (q->q[q->qhead++ & (q->qsize - 1)]);
+	for (i = 0;i < BATCH_MAX;++i) if (q->rpkt[i]) {
+			cloudvpn_packet_free (q->rpkt[i]);
+			q->rpkt[i] = 0;
+		}
+}
+
+static void queue_close (struct queue*q)
+{
+	if (q->fd < 0 || q->closing) return;
+	q->closing = 1;
+	if (!q->io) queue_cleanup (q);
+}
+
+static void io_leave (struct queue*q)
+{
+	if (--q->io) return;
+	if (q->closing) queue_cleanup (q);
+	cl_cond_signal (&q->idle);
+}
+
+/* called with t->lock held */
+static int queue_add (struct tun*t, int fd)
+{
+	struct queue*q;
+	struct packet**ring;
+	struct stat st;
+	int f;
+
+	if (t->nq >= MAX_QUEUES) return 1;
+	q = t->qs + t->nq;
+
+	f = fcntl (fd, F_GETFL);
+	if (f < 0 || fcntl (fd, F_SETFL, f | O_NONBLOCK) < 0) return 1;
+
+	ring = cl_calloc (t->qlen, sizeof (struct packet*) );
+	if (!ring) return 1;
+
+	cl_mutex_lock (&q->lock);
+	if (q->fd >= 0) {
+		/* previous one is still closing */
+		cl_mutex_unlock (&q->lock);
+		cl_free (ring);
+		return 1;
+	}
+	cl_free (q->q);
+	q->q = ring;
+	q->fd = fd;
+	q->sock = !fstat (fd, &st) && S_ISSOCK (st.st_mode);
+	q->qsize = t->qlen;
+	q->qhead = q->qtail = 0;
+	q->rx = new_event (t, event_fd_readable, fd, t->nq, 0);
+	q->tx = new_event (t, event_fd_writeable, fd, t->nq, 1);
+	if (!q->rx || !q->tx || cloudvpn_register_event (q->rx) ) {
+		if (q->rx) cloudvpn_delete_event (q->rx);
+		if (q->tx) cloudvpn_delete_event (q->tx);
+		q->rx = q->tx = 0;
+		q->fd = -1;
+		cl_mutex_unlock (&q->lock);
+		return 1;
+	}
+	cl_mutex_unlock (&q->lock);
+
+	/* senders look at nq without the lock */
+	cl_atomic_store_rel (&t->nq, t->nq + 1);
+	return 0;
+}
+
+static void close_all (struct tun*t)
+{
+	int i;
+
+	cl_atomic_store_rel (&t->nq, 0);
+	/* events that are already out get ignored */
+	cl_atomic_store (&t->gen, t->gen + 1);
+
+	for (i = 0;i < MAX_QUEUES;++i) {
+		cl_mutex_lock (&t->qs[i].lock);
+		queue_close (t->qs + i);
+		cl_mutex_unlock (&t->qs[i].lock);
+	}
+}
+
+/*
+ * sending
+ */
+
+static void flush (struct tun*t, struct queue*q)
+{
+	/* one flusher at a time, lock is dropped while writing */
+
+	struct mmsghdr m[BATCH_MAX];
+	struct iovec iov[BATCH_MAX][3];
+	struct packet*p;
+	unsigned head, tail;
+	int n, r, k;
+
+	for (;;) {
+		head = q->qhead;
+		tail = q->qtail;
+		if (head == tail || q->closing) break;
+
+		for (n = 0;head != tail && n < t->batch;++head) {
+			p = q->q[head & (q->qsize - 1)];
+			memset (&m[n].msg_hdr, 0, sizeof (struct msghdr) );
+			k = frame_iov (t, iov[n], p->data, p->len);
+			if (!k) break; /* malformed one, it gets dropped below */
+			m[n].msg_hdr.msg_iov = iov[n];
+			m[n].msg_hdr.msg_iovlen = k;
+			++n;
+		}
+
+		if (n) {
+			++q->io;
+			cl_mutex_unlock (&q->lock);
+			r = fd_send (q, m, n);
+			cl_mutex_lock (&q->lock);
+			io_leave (q);
+
+			/* closed meanwhile, the queue is (or will be) dropped */
+			if (q->closing || q->fd < 0) break;
+		} else r = -1, errno = EINVAL;
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!q->closing && !cloudvpn_register_event (q->tx) )
+					q->tx_armed = 1;
+				break;
+			}
+			/* kernel didn't like the frame, drop it */
+			cloudvpn_packet_free (q->q[q->qhead++ & (q->qsize - 1)]);
+			++q->drops;
+			continue;
+		}
+
+		q->tx_packets += r;
+		while (r--) cloudvpn_packet_free (q->q[q->qhead++ & (q->qsize - 1)]);
+	}
+
+	q->flushing = 0;
+}
+
+static void tun_send (struct tun*t, struct packet*p)
+{
+	struct queue*q;
+	int nq = cl_atomic_load_acq (&t->nq), id;
+
+	if (!nq) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	id = cloudvpn_worker_id();
+	q = t->qs + (id < 0 ? 0 : id % nq);
+
+	cl_mutex_lock (&q->lock);
+
+	if (q->fd < 0 || q->closing || q->qtail - q->qhead >= q->qsize) {
+		++q->drops;
+		cl_mutex_unlock (&q->lock);
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	q->q[q->qtail++ & (q->qsize - 1)] = p;
+
+	if (!q->flushing && !q->tx_armed) {
+		q->flushing = 1;
+		flush (t, q);
+	}
+
+	cl_mutex_unlock (&q->lock);
+}
+
+/*
+ * receiving
+ */
+
+static void push_works (struct work**w, int n)
+{
+	int i;
+
+	if (n && cloudvpn_schedule_works (w, n) )
+		for (i = 0;i < n;++i) {
+			cloudvpn_packet_free (w[i]->p);
+			cl_free (w[i]);
+		}
+}
+
+static int tun_read (struct tun*t, struct queue*q)
+{
+	/* returns nonzero if the fd is broken */
+
+	struct mmsghdr m[BATCH_MAX];
+	struct iovec iov[BATCH_MAX][3];
+	struct work*works[BATCH_MAX];
+	struct packet*p;
+	struct work*w;
+	unsigned size, n = t->batch;
+	int i, r, round, nw;
+
+	/* one byte more, so that we see when something didn't fit */
+	size = t->vnet ? PACKET_MAX_LEN : t->mtu + 1;
+
+	for (round = 0;round < READS_PER_EVENT;++round) {
+
+		for (i = 0;i < n;++i) {
+			if (!q->rpkt[i] &&
+			        ! (q->rpkt[i] = cloudvpn_packet_alloc_buf (size) ) )
+				break;
+			memset (&m[i].msg_hdr, 0, sizeof (struct msghdr) );
+			m[i].msg_hdr.msg_iov = iov[i];
+			m[i].msg_hdr.msg_iovlen =
+			    frame_iov (t, iov[i], q->rpkt[i]->data, size);
+		}
+		if (!i) break;
+
+		r = fd_recv (q, m, i);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+		if (!r) return q->sock; /* socket peer is gone */
+
+		for (i = 0, nw = 0;i < r;++i) {
+			if (m[i].msg_len < frame_min (t) ||
+			        (m[i].msg_hdr.msg_flags & MSG_TRUNC) ) {
+				++q->drops;
+				continue;
+			}
+			++q->rx_packets;
+			if (!t->next || ! (w = cloudvpn_new_work() ) ) continue;
+
+			p = q->rpkt[i];
+			q->rpkt[i] = 0;
+			p->len = m[i].msg_len;
+			if (t->tap) {
+				p->soff = MAC_LEN;
+				p->doff = 2 * MAC_LEN;
+			}
+			p->src_part = t->self;
+			p->next_part = t->next;
+
+			w->type = work_packet;
+			w->priority = t->ev_priority;
+			w->is_static = 0;
+			w->p = p;
+			works[nw++] = w;
+		}
+		push_works (works, nw);
+
+		if (r < n) break; /* drained */
+	}
+
+	return 0;
+}
+
+/*
+ * events
+ */
+
+static void tun_event (struct tun*t, struct event_data*e)
+{
+	struct queue*q = t->qs + ev_tag_queue (e->priv);
+	int fail;
+
+	cl_mutex_lock (&q->lock);
+
+	if (ev_tag_gen (e->priv) != cl_atomic_load (&t->gen) ||
+	        q->fd < 0 || q->closing) {
+		cl_mutex_unlock (&q->lock);
+		return;
+	}
+
+	if (ev_tag_tx (e->priv) ) {
+		q->tx_armed = 0;
+		if (!q->flushing) {
+			q->flushing = 1;
+			flush (t, q);
+		}
+	} else {
+		/* one-shot, so only one reader */
+		++q->io;
+		cl_mutex_unlock (&q->lock);
+		fail = tun_read (t, q);
+		cl_mutex_lock (&q->lock);
+		if (fail || (!q->closing && cloudvpn_register_event (q->rx) ) )
+			queue_close (q);
+		io_leave (q);
+	}
+
+	cl_mutex_unlock (&q->lock);
+}
+
+/*
+ * commands
+ */
+
+static int tun_open (struct tun*t, const char*name, int queues)
+{
+#if defined(__linux__) && defined(IFF_MULTI_QUEUE)
+	struct ifreq ifr;
+	int fd, i, hdr = VNET_HDR_LEN;
+
+	if (queues <= 0) queues = cloudvpn_worker_count();
+	if (queues <= 0) queues = 1;
+	if (t->nq + queues > MAX_QUEUES) return 1;
+
+	for (i = 0;i < queues;++i) {
+		fd = open ("/dev/net/tun", O_RDWR);
+		if (fd < 0) return 1;
+
+		memset (&ifr, 0, sizeof (ifr) );
+		strncpy (ifr.ifr_name, name, IFNAMSIZ - 1);
+		ifr.ifr_flags = (t->tap ? IFF_TAP : IFF_TUN) | IFF_NO_PI |
+		                IFF_MULTI_QUEUE | (t->vnet ? IFF_VNET_HDR : 0);
+
+		if (ioctl (fd, TUNSETIFF, &ifr) < 0 ||
+		        (t->vnet && ioctl (fd, TUNSETVNETHDRSZ, &hdr) < 0) ) {
+			close (fd);
+			return 1;
+		}
+
+#ifdef TUNSETVNETLE
+		/* same byte order on both ends of the tunnel, whatever they are */
+		if (t->vnet) {
+			int one = 1;
+			ioctl (fd, TUNSETVNETLE, &one);
+		}
+#endif
+		/* ask for the big unchecksummed frames */
+		if (t->vnet && !i)
+			ioctl (fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 |
+			       TUN_F_TSO6 | TUN_F_TSO_ECN);
+
+		if (queue_add (t, fd) ) {
+			close (fd);
+			return 1;
+		}
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+static void tun_command (struct tun*t, struct packet*p)
+{
+	struct command c;
+	int n;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&t->lock);
+
+	if (cloudvpn_command_is (&c, "mode", 1) ) {
+		if (!t->nq) t->tap = strcmp (c.argv[1], "tun") != 0;
+
+	} else if (cloudvpn_command_is (&c, "vnet", 1) ) {
+		if (!t->nq) t->vnet = !strcmp (c.argv[1], "on");
+
+	} else if (cloudvpn_command_is (&c, "open", 1) )
+		tun_open (t, c.argv[1], c.argc > 2 ? atoi (c.argv[2]) : 0);
+
+	else if (cloudvpn_command_is (&c, "fd", 1) )
+		queue_add (t, atoi (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "next", 1) )
+		t->next = cloudvpn_find_part_by_name (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "queue", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > 0 && !t->nq) {
+			for (t->qlen = 1;t->qlen < n;t->qlen <<= 1);
+		}
+
+	} else if (cloudvpn_command_is (&c, "batch", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > 0 && n <= BATCH_MAX) t->batch = n;
+
+	} else if (cloudvpn_command_is (&c, "mtu", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > 0 && n <= PACKET_MAX_LEN) t->mtu = n;
+
+	} else if (cloudvpn_command_is (&c, "priority", 1) )
+		t->ev_priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "close", 0) )
+		close_all (t);
+
+	cl_mutex_unlock (&t->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void tun_process_work (struct part*p, struct work*w)
+{
+	struct tun*t = p->data;
+
+	if (!t) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		tun_send (t, w->p);
+		break;
+	case work_command:
+		tun_command (t, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		tun_event (t, &w->e);
+		break;
+	}
+}
+
+static void tun_init (struct part*p)
+{
+	struct tun*t = cl_calloc (1, sizeof (struct tun) );
+	int i;
+
+	p->data = t;
+	if (!t) return;
+
+	cl_mutex_init (&t->lock, 0);
+	for (i = 0;i < MAX_QUEUES;++i) {
+		cl_mutex_init (&t->qs[i].lock, 0);
+		cl_cond_init (&t->qs[i].idle);
+		t->qs[i].fd = -1;
+	}
+	t->self = p;
+	t->tap = 1;
+	t->vnet = 1;
+	t->qlen = 1024;
+	t->batch = 32;
+	t->mtu = 2048;
+	t->ev_priority = 64;
+}
+
+static void tun_fini (struct part*p)
+{
+	struct tun*t = p->data;
+	int i;
+
+	if (!t) return;
+
+	cl_mutex_lock (&t->lock);
+	close_all (t);
+	cl_mutex_unlock (&t->lock);
+
+	/* each queue is closed by the last thread out of its fd */
+	for (i = 0;i < MAX_QUEUES;++i) {
+		cl_mutex_lock (&t->qs[i].lock);
+		while (t->qs[i].io) cl_cond_wait (&t->qs[i].idle, &t->qs[i].lock);
+		cl_mutex_unlock (&t->qs[i].lock);
+	}
+
+	for (i = 0;i < MAX_QUEUES;++i) {
+		cl_free (t->qs[i].q);
+		cl_cond_destroy (&t->qs[i].idle);
+		cl_mutex_destroy (&t->qs[i].lock);
+	}
+	cl_mutex_destroy (&t->lock);
+	cl_free (t);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "tun";
+
+int cloudvpn_plugin_init ()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = tun_process_work;
+	thisplugin.init = tun_init;
+	thisplugin.fini = tun_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
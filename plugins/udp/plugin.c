@@ -0,0 +1,881 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * udp transport plugin.
+ *
+ * One part is one socket talking to one peer. Every datagram carries
+ * exactly one packet with the wire.h header in front of it.
+ *
+ * The point is to do as few syscalls per packet as possible: datagrams are
+ * received with recvmmsg straight into pooled packets (the header is
+ * scattered away, so the data lands where it should), and sent with
+ * sendmmsg. Where the kernel can, runs of same-sized packets are sent as
+ * one UDP_SEGMENT (GSO) message and received as one UDP_GRO buffer that
+ * gets cut back to packets here. Received packets go to the scheduler in
+ * batches.
+ *
+ * If no peer is set, the first one that sends us something becomes it.
+ *
+ * Commands:
+ *	bind <address> <port>
+ *	peer <address> <port>
+ *	next <part>		where the received packets go
+ *	queue <packets>		send queue length (default 4096)
+ *	batch <n>		datagrams per syscall (default 32, max 64)
+ *	mtu <bytes>		biggest datagram, header included (default 2048)
+ *	buffer <bytes>		socket buffer sizes (default 4M)
+ *	gso on|off		send segmentation offload (default on if possible)
+ *	gro on|off		receive coalescing (default on if possible)
+ *	priority <n>		priority of socket events (default 64)
+ *	close
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg/sendmmsg */
+#endif
+
+#include "api.h"
+#include "alloc.h"
+#include "wire.h"
+#include "command.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+#	define UDP_SEGMENT 103
+#endif
+#if defined(__linux__) && !defined(UDP_GRO)
+#	define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#	define SOL_UDP IPPROTO_UDP
+#endif
+
+#define BATCH_MAX 64
+#define MAX_IOV 1024 /* UIO_MAXIOV */
+#define GSO_MAX_SEGS 64
+#define UDP_MAX_PAYLOAD 65507
+#define READS_PER_EVENT 8
+#define RX_WORKS 256 /* works scheduled at once */
+
+enum { ev_rx, ev_tx };
+
+#define ev_tag(gen, kind) ( (void*) (uintptr_t) ( ( (gen) << 1) | (kind) ) )
+#define ev_tag_kind(tag) ( (uintptr_t) (tag) & 1)
+#define ev_tag_gen(tag) ( (uintptr_t) (tag) >> 1)
+
+struct sendq_slot {
+	struct packet*p;
+	uint8_t hdr[WIRE_HDR_LEN];
+};
+
+struct udp {
+	cl_mutex lock;
+	struct part*self, *next;
+
+	int fd, closing;
+	uintptr_t gen;
+	int io; /* threads that currently use fd */
+	cl_cond idle; /* io went down to 0 */
+
+	struct sockaddr_storage peer;
+	socklen_t peerlen; /* 0 = not known yet */
+	int connected;
+
+	unsigned batch, mtu;
+	int bufsize;
+	int want_gso, want_gro, gso, gro;
+
+	uint8_t ev_priority;
+	struct event*rx, *tx;
+	int tx_armed;
+
+	/* send queue */
+	struct sendq_slot*q;
+	unsigned qsize, qhead, qtail; /* free-running indexes */
+	int flushing;
+
+	/* receive side, only the reader touches these */
+	struct packet*rpkt[BATCH_MAX];
+	uint8_t rhdr[BATCH_MAX][WIRE_HDR_LEN];
+	struct sockaddr_storage rname;
+	struct work*rwork[RX_WORKS];
+	int nwork;
+
+	uint64_t tx_packets, rx_packets, drops;
+};
+
+#define slot(t, i) ( (t)->q + ( (i) & ( (t)->qsize - 1) ) )
+
+/*
+ * helpers
+ */
+
+static int set_nonblock (int fd)
+{
+	int f = fcntl (fd, F_GETFL);
+	if (f < 0) return 1;
+	return fcntl (fd, F_SETFL, f | O_NONBLOCK) < 0;
+}
+
+static int parse_addr (const char*host, const char*port,
+                       struct sockaddr_storage*sa, socklen_t*len)
+{
+	struct addrinfo hints, *res;
+
+	memset (&hints, 0, sizeof (hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+	if (getaddrinfo (host, port, &hints, &res) ) return 1;
+	memcpy (sa, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo (res);
+	return 0;
+}
+
+static struct event* new_event (struct udp*u, int type, int fd, int kind) {
+
+	struct event*e = cloudvpn_new_event();
+	if (!e) return 0;
+
+	e->priority = u->ev_priority;
+	e->is_static = 1;
+	e->data.type = type;
+	e->data.fd = fd;
+	e->data.owner = u->self;
+	e->data.priv = ev_tag (u->gen, kind);
+	return e;
+}
+
+static void set_offloads (struct udp*u)
+{
+	int v;
+
+	u->gso = u->gro = 0;
+#ifdef UDP_SEGMENT
+	/* setting 0 is a no-op, but fails on kernels that can't do it */
+	v = 0;
+	if (u->want_gso && !setsockopt (u->fd, SOL_UDP, UDP_SEGMENT,
+	                                &v, sizeof (v) ) ) u->gso = 1;
+#endif
+#ifdef UDP_GRO
+	v = u->want_gro;
+	if (!setsockopt (u->fd, SOL_UDP, UDP_GRO, &v, sizeof (v) ) ) u->gro = v;
+#endif
+}
+
+/* how big the receive buffers need to be */
+static unsigned rx_size (struct udp*u)
+{
+	return u->gro ? PACKET_MAX_LEN + 1 : u->mtu - WIRE_HDR_LEN;
+}
+
+static void drop_rx_buffers (struct udp*u)
+{
+	int i;
+
+	for (i = 0;i < BATCH_MAX;++i) if (u->rpkt[i]) {
+			cloudvpn_packet_free (u->rpkt[i]);
+			u->rpkt[i] = 0;
+		}
+}
+
+static void drop_queue (struct udp*u)
+{
+	while (u->qhead != u->qtail) {
+		cloudvpn_packet_free (slot (u, u->qhead)->p);
+		++u->qhead;
+	}
+}
+
+/*
+ * socket lifetime. All these are called with u->lock held.
+ */
+
+static void sock_cleanup (struct udp*u)
+{
+	close (u->fd);
+	u->fd = -1;
+	if (u->rx) cloudvpn_dispose_event (u->rx);
+	if (u->tx) cloudvpn_dispose_event (u->tx);
+	u->rx = u->tx = 0;
+	u->tx_armed = 0;
+	u->connected = 0;
+	u->closing = 0;
+	drop_queue (u);
+	drop_rx_buffers (u);
+}
+
+static void sock_close (struct udp*u)
+{
+	if (u->fd < 0 || u->closing) return;
+
+	/* the last one to leave the socket throws it away */
+	u->closing = 1;
+	if (!u->io) sock_cleanup (u);
+}
+
+static void io_enter (struct udp*u)
+{
+	++u->io;
+}
+
+static void io_leave (struct udp*u)
+{
+	if (--u->io) return;
+	if (u->closing) sock_cleanup (u);
+	cl_cond_signal (&u->idle);
+}
+
+static int sock_open (struct udp*u, int family)
+{
+	int fd;
+
+	if (u->fd >= 0) return 0;
+
+	fd = socket (family, SOCK_DGRAM, 0);
+	if (fd < 0) return 1;
+	if (set_nonblock (fd) ) {
+		close (fd);
+		return 1;
+	}
+
+	setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &u->bufsize, sizeof (int) );
+	setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &u->bufsize, sizeof (int) );
+
+	++u->gen;
+	u->fd = fd;
+	u->connected = 0;
+	set_offloads (u);
+
+	u->rx = new_event (u, event_fd_readable, fd, ev_rx);
+	u->tx = new_event (u, event_fd_writeable, fd, ev_tx);
+	if (!u->rx || !u->tx || cloudvpn_register_event (u->rx) ) {
+		sock_close (u);
+		return 1;
+	}
+	return 0;
+}
+
+static void sock_connect (struct udp*u)
+{
+	/* connected socket doesn't need addresses in every message */
+	if (u->fd < 0 || !u->peerlen) return;
+	u->connected = !connect (u->fd, (struct sockaddr*) &u->peer,
+	                         u->peerlen);
+}
+
+/*
+ * sending
+ */
+
+struct tx_batch {
+	struct mmsghdr msg[BATCH_MAX];
+	struct iovec iov[MAX_IOV];
+	unsigned segs[BATCH_MAX]; /* packets in each message */
+#ifdef UDP_SEGMENT
+	char ctl[BATCH_MAX][CMSG_SPACE (sizeof (uint16_t) )];
+#endif
+};
+
+static int build_batch (struct udp*u, struct tx_batch*b,
+                        unsigned head, unsigned tail)
+{
+	struct msghdr*m;
+	struct sendq_slot*s;
+	unsigned n = 0, v = 0, size, bytes, first;
+#ifdef UDP_SEGMENT
+	struct cmsghdr*c;
+#endif
+
+	while (head != tail && n < u->batch && v + 2 <= MAX_IOV) {
+		m = &b->msg[n].msg_hdr;
+		memset (m, 0, sizeof (*m) );
+		m->msg_iov = b->iov + v;
+		first = v;
+		b->segs[n] = 0;
+		size = WIRE_HDR_LEN + slot (u, head)->p->len;
+		bytes = 0;
+
+		/*
+		 * with GSO, all segments but the last must have the same size,
+		 * the last one can be shorter.
+		 */
+		do {
+			s = slot (u, head);
+			b->iov[v].iov_base = s->hdr;
+			b->iov[v].iov_len = WIRE_HDR_LEN;
+			b->iov[v + 1].iov_base = s->p->data;
+			b->iov[v + 1].iov_len = s->p->len;
+			v += 2;
+			bytes += WIRE_HDR_LEN + s->p->len;
+			++b->segs[n];
+			++head;
+			if (WIRE_HDR_LEN + s->p->len < size) break;
+		} while (u->gso && head != tail && b->segs[n] < GSO_MAX_SEGS &&
+		         v + 2 <= MAX_IOV &&
+		         WIRE_HDR_LEN + slot (u, head)->p->len <= size &&
+		         bytes + WIRE_HDR_LEN + slot (u, head)->p->len
+		         <= UDP_MAX_PAYLOAD);
+
+		m->msg_iovlen = v - first;
+
+#ifdef UDP_SEGMENT
+		if (b->segs[n] > 1) {
+			m->msg_control = b->ctl[n];
+			m->msg_controllen = sizeof (b->ctl[n]);
+			c = CMSG_FIRSTHDR (m);
+			c->cmsg_level = SOL_UDP;
+			c->cmsg_type = UDP_SEGMENT;
+			c->cmsg_len = CMSG_LEN (sizeof (uint16_t) );
+			* (uint16_t*) CMSG_DATA (c) = size;
+		}
+#endif
+		++n;
+	}
+
+	return n;
+}
+
+static void consume (struct udp*u, unsigned packets, int sent)
+{
+	while (packets--) {
+		cloudvpn_packet_free (slot (u, u->qhead)->p);
+		++u->qhead;
+		if (sent) ++u->tx_packets;
+		else ++u->drops;
+	}
+}
+
+static void flush (struct udp*u)
+{
+	/*
+	 * only one thread gets here at a time (u->flushing is set). The lock
+	 * is held except while sending, so others can keep queueing.
+	 */
+
+	struct tx_batch b;
+	unsigned head, tail;
+	int n, r, i;
+
+	for (;;) {
+		head = u->qhead;
+		tail = u->qtail;
+		if (head == tail || u->closing || !u->connected) break;
+
+		n = build_batch (u, &b, head, tail);
+		io_enter (u);
+		cl_mutex_unlock (&u->lock);
+
+		r = sendmmsg (u->fd, b.msg, n, 0);
+
+		cl_mutex_lock (&u->lock);
+		io_leave (u);
+
+		/* closed meanwhile, the queue is (or will be) dropped */
+		if (u->closing || u->fd < 0) break;
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!u->closing && !cloudvpn_register_event (u->tx) )
+					u->tx_armed = 1;
+				break;
+			}
+			if (u->gso && (errno == EIO || errno == EINVAL) ) {
+				/* device can't do the offload after all */
+				u->gso = 0;
+				continue;
+			}
+
+			/* datagram can't be sent (ICMP unreachable, too big...) */
+			consume (u, b.segs[0], 0);
+			continue;
+		}
+
+		for (i = 0;i < r;++i) consume (u, b.segs[i], 1);
+	}
+
+	u->flushing = 0;
+}
+
+static void udp_send (struct udp*u, struct work*w)
+{
+	struct packet*p = w->p;
+
+	cl_mutex_lock (&u->lock);
+
+	if (u->fd < 0 || u->closing || !u->connected ||
+	        WIRE_HDR_LEN + p->len > u->mtu ||
+	        u->qtail - u->qhead >= u->qsize) {
+		++u->drops;
+		cl_mutex_unlock (&u->lock);
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	slot (u, u->qtail)->p = p;
+	wire_hdr_from_packet (slot (u, u->qtail)->hdr, p, w->priority, 0);
+	++u->qtail;
+
+	/* if someone's already sending, he will take this one too */
+	if (!u->flushing && !u->tx_armed) {
+		u->flushing = 1;
+		flush (u);
+	}
+
+	cl_mutex_unlock (&u->lock);
+}
+
+/*
+ * receiving
+ */
+
+static void push_works (struct udp*u)
+{
+	int i;
+
+	if (!u->nwork) return;
+	if (cloudvpn_schedule_works (u->rwork, u->nwork) )
+		for (i = 0;i < u->nwork;++i) {
+			cloudvpn_packet_free (u->rwork[i]->p);
+			cl_free (u->rwork[i]);
+		}
+	u->nwork = 0;
+}
+
+static void deliver (struct udp*u, struct packet*p, struct wire_hdr*h)
+{
+	struct work*w;
+
+	++u->rx_packets;
+	if (!u->next || ! (w = cloudvpn_new_work() ) ) {
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	p->len = h->len;
+	p->soff = h->soff;
+	p->doff = h->doff;
+	p->mark = h->mark;
+	p->src_part = u->self;
+	p->next_part = u->next;
+
+	w->type = work_packet;
+	w->priority = h->priority;
+	w->is_static = 0;
+	w->p = p;
+
+	u->rwork[u->nwork++] = w;
+	if (u->nwork == RX_WORKS) push_works (u);
+}
+
+static void cut_segments (struct udp*u, struct packet*p,
+                          const uint8_t*hdr, size_t len, size_t seg)
+{
+	/*
+	 * GRO glued several datagrams of size seg together. The first header
+	 * went to hdr, the rest of the data is in p. The first datagram keeps
+	 * the buffer, the others are copied out (before p gets delivered).
+	 */
+
+	struct wire_hdr h, first;
+	struct packet*n;
+	uint8_t*d = (uint8_t*) p->data;
+	size_t pos, dlen;
+
+	if (wire_hdr_get (hdr, &first) || first.len != seg - WIRE_HDR_LEN) {
+		++u->drops;
+		cloudvpn_packet_free (p);
+		return;
+	}
+
+	for (pos = seg - WIRE_HDR_LEN;pos < len - WIRE_HDR_LEN;pos += dlen) {
+		dlen = len - WIRE_HDR_LEN - pos;
+		if (dlen > seg) dlen = seg;
+
+		if (dlen < WIRE_HDR_LEN || wire_hdr_get (d + pos, &h)
+		        || h.len != dlen - WIRE_HDR_LEN) {
+			++u->drops;
+			continue;
+		}
+
+		n = cloudvpn_packet_alloc_buf (h.len);
+		if (!n) {
+			++u->drops;
+			continue;
+		}
+		memcpy (n->data, d + pos + WIRE_HDR_LEN, h.len);
+		deliver (u, n, &h);
+	}
+
+	deliver (u, p, &first);
+}
+
+#ifdef UDP_GRO
+static size_t gro_size (struct msghdr*m)
+{
+	struct cmsghdr*c;
+
+	for (c = CMSG_FIRSTHDR (m);c;c = CMSG_NXTHDR (m, c) )
+		if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+			return * (int*) CMSG_DATA (c);
+	return 0;
+}
+#endif
+
+static int udp_read (struct udp*u, int learn)
+{
+	/* returns nonzero if the socket is broken */
+
+	struct mmsghdr msg[BATCH_MAX];
+	struct iovec iov[BATCH_MAX][2];
+#ifdef UDP_GRO
+	char ctl[BATCH_MAX][CMSG_SPACE (sizeof (int) )];
+#endif
+	struct packet*p;
+	struct wire_hdr h;
+	unsigned size = rx_size (u), n = u->batch, len;
+	size_t seg;
+	int i, r, round;
+
+	for (round = 0;round < READS_PER_EVENT;++round) {
+
+		for (i = 0;i < n;++i) {
+			if (u->rpkt[i] && u->rpkt[i]->cap < size) {
+				cloudvpn_packet_free (u->rpkt[i]);
+				u->rpkt[i] = 0;
+			}
+			if (!u->rpkt[i] &&
+			        ! (u->rpkt[i] = cloudvpn_packet_alloc_buf (size) ) )
+				break;
+
+			iov[i][0].iov_base = u->rhdr[i];
+			iov[i][0].iov_len = WIRE_HDR_LEN;
+			iov[i][1].iov_base = u->rpkt[i]->data;
+			iov[i][1].iov_len = size;
+
+			memset (&msg[i].msg_hdr, 0, sizeof (struct msghdr) );
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = 2;
+#ifdef UDP_GRO
+			if (u->gro) {
+				msg[i].msg_hdr.msg_control = ctl[i];
+				msg[i].msg_hdr.msg_controllen = sizeof (ctl[i]);
+			}
+#endif
+		}
+		if (!i) break; /* out of memory, try next time */
+
+		/* only the first datagram's sender is interesting */
+		if (learn) {
+			msg[0].msg_hdr.msg_name = &u->rname;
+			msg[0].msg_hdr.msg_namelen = sizeof (u->rname);
+		}
+
+		r = recvmmsg (u->fd, msg, i, MSG_DONTWAIT, 0);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			/* refused sends get reported here, they don't matter */
+			if (errno == ECONNREFUSED) continue;
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+
+		for (i = 0;i < r;++i) {
+			len = msg[i].msg_len;
+			if (len < WIRE_HDR_LEN ||
+			        (msg[i].msg_hdr.msg_flags & MSG_TRUNC) ) {
+				++u->drops;
+				continue;
+			}
+
+			p = u->rpkt[i];
+			u->rpkt[i] = 0;
+
+			seg = 0;
+#ifdef UDP_GRO
+			if (u->gro) seg = gro_size (&msg[i].msg_hdr);
+#endif
+			if (seg && seg < len) {
+				cut_segments (u, p, u->rhdr[i], len, seg);
+				continue;
+			}
+
+			if (wire_hdr_get (u->rhdr[i], &h) ||
+			        h.len != len - WIRE_HDR_LEN) {
+				++u->drops;
+				cloudvpn_packet_free (p);
+				continue;
+			}
+			deliver (u, p, &h);
+		}
+
+		/* buffers that didn't get anything are reused next time */
+		if (r < n) break;
+	}
+
+	push_works (u);
+	return 0;
+}
+
+/*
+ * events
+ */
+
+static void udp_event (struct udp*u, struct event_data*e)
+{
+	int fail, learn;
+
+	cl_mutex_lock (&u->lock);
+
+	if (ev_tag_gen (e->priv) != u->gen || u->fd < 0 || u->closing) {
+		cl_mutex_unlock (&u->lock);
+		return;
+	}
+
+	switch (ev_tag_kind (e->priv) ) {
+	case ev_rx:
+		/* rx event is one-shot, so there's only one reader at a time */
+		io_enter (u);
+		learn = !u->peerlen;
+		u->rname.ss_family = AF_UNSPEC;
+		cl_mutex_unlock (&u->lock);
+
+		fail = udp_read (u, learn);
+
+		cl_mutex_lock (&u->lock);
+		if (!u->peerlen && u->rname.ss_family != AF_UNSPEC) {
+			/* first one to talk to us */
+			memcpy (&u->peer, &u->rname, sizeof (u->rname) );
+			u->peerlen = u->rname.ss_family == AF_INET ?
+			             sizeof (struct sockaddr_in) :
+			             sizeof (struct sockaddr_in6);
+			sock_connect (u);
+		}
+		if (fail || (!u->closing && cloudvpn_register_event (u->rx) ) )
+			sock_close (u);
+		io_leave (u);
+		break;
+
+	case ev_tx:
+		u->tx_armed = 0;
+		if (!u->flushing) {
+			u->flushing = 1;
+			flush (u);
+		}
+		break;
+	}
+
+	cl_mutex_unlock (&u->lock);
+}
+
+/*
+ * commands
+ */
+
+static int udp_bind (struct udp*u, const char*host, const char*port)
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+
+	if (u->fd >= 0 || parse_addr (host, port, &sa, &len) ) return 1;
+	if (sock_open (u, sa.ss_family) ) return 1;
+	if (bind (u->fd, (struct sockaddr*) &sa, len) ) {
+		sock_close (u);
+		return 1;
+	}
+	sock_connect (u);
+	return 0;
+}
+
+static int udp_peer (struct udp*u, const char*host, const char*port)
+{
+	if (parse_addr (host, port, &u->peer, &u->peerlen) ) return 1;
+	if (sock_open (u, u->peer.ss_family) ) return 1;
+	sock_connect (u);
+	return 0;
+}
+
+static int udp_set_queue (struct udp*u, int n)
+{
+	struct sendq_slot*q;
+	unsigned size;
+
+	if (n <= 0 || u->qhead != u->qtail) return 1;
+	for (size = 1;size < (unsigned) n;size <<= 1);
+
+	q = cl_calloc (size, sizeof (struct sendq_slot) );
+	if (!q) return 1;
+	cl_free (u->q);
+	u->q = q;
+	u->qsize = size;
+	u->qhead = u->qtail = 0;
+	return 0;
+}
+
+static int on_off (const char*s)
+{
+	return !strcmp (s, "on");
+}
+
+static void udp_command (struct udp*u, struct packet*p)
+{
+	struct command c;
+	int n;
+
+	if (!cloudvpn_command_parse (p, &c) ) return;
+
+	cl_mutex_lock (&u->lock);
+
+	if (cloudvpn_command_is (&c, "bind", 2) )
+		udp_bind (u, c.argv[1], c.argv[2]);
+
+	else if (cloudvpn_command_is (&c, "peer", 2) )
+		udp_peer (u, c.argv[1], c.argv[2]);
+
+	else if (cloudvpn_command_is (&c, "next", 1) )
+		u->next = cloudvpn_find_part_by_name (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "queue", 1) )
+		udp_set_queue (u, atoi (c.argv[1]) );
+
+	else if (cloudvpn_command_is (&c, "batch", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > 0 && n <= BATCH_MAX) u->batch = n;
+
+	} else if (cloudvpn_command_is (&c, "mtu", 1) ) {
+		n = atoi (c.argv[1]);
+		if (n > WIRE_HDR_LEN && n <= UDP_MAX_PAYLOAD) u->mtu = n;
+
+	} else if (cloudvpn_command_is (&c, "buffer", 1) )
+		u->bufsize = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "gso", 1) ) {
+		u->want_gso = on_off (c.argv[1]);
+		if (u->fd >= 0) set_offloads (u);
+
+	} else if (cloudvpn_command_is (&c, "gro", 1) ) {
+		u->want_gro = on_off (c.argv[1]);
+		if (u->fd >= 0) set_offloads (u);
+
+	} else if (cloudvpn_command_is (&c, "priority", 1) )
+		u->ev_priority = atoi (c.argv[1]);
+
+	else if (cloudvpn_command_is (&c, "close", 0) ) {
+		u->peerlen = 0;
+		sock_close (u);
+	}
+
+	cl_mutex_unlock (&u->lock);
+}
+
+/*
+ * plugin functions
+ */
+
+static void udp_process_work (struct part*p, struct work*w)
+{
+	struct udp*u = p->data;
+
+	if (!u) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+
+	switch (w->type) {
+	case work_packet:
+		udp_send (u, w);
+		break;
+	case work_command:
+		udp_command (u, w->p);
+		cloudvpn_packet_free (w->p);
+		break;
+	case work_event:
+		udp_event (u, &w->e);
+		break;
+	}
+}
+
+static void udp_init (struct part*p)
+{
+	struct udp*u = cl_calloc (1, sizeof (struct udp) );
+	p->data = u;
+	if (!u) return;
+
+	cl_mutex_init (&u->lock, 0);
+	cl_cond_init (&u->idle);
+	u->self = p;
+	u->fd = -1;
+	u->ev_priority = 64;
+	u->batch = 32;
+	u->mtu = 2048;
+	u->bufsize = 4 * 1024 * 1024;
+	u->want_gso = u->want_gro = 1;
+
+	if (udp_set_queue (u, 4096) ) {
+		cl_free (u);
+		p->data = 0;
+	}
+}
+
+static void udp_fini (struct part*p)
+{
+	struct udp*u = p->data;
+	if (!u) return;
+
+	cl_mutex_lock (&u->lock);
+	sock_close (u);
+
+	/* the socket goes with the last sender or receiver, u after it */
+	while (u->io) cl_cond_wait (&u->idle, &u->lock);
+	cl_mutex_unlock (&u->lock);
+
+	cl_free (u->q);
+	cl_cond_destroy (&u->idle);
+	cl_mutex_destroy (&u->lock);
+	cl_free (u);
+	p->data = 0;
+}
+
+/*
+ * plugin interface
+ */
+
+static struct plugin thisplugin;
+static const char pl_name[] = "udp";
+
+int cloudvpn_plugin_init ()
+{
+	thisplugin.name = pl_name;
+	thisplugin.process_work = udp_process_work;
+	thisplugin.init = udp_init;
+	thisplugin.fini = udp_fini;
+
+	return 0;
+}
+
+struct plugin* cloudvpn_plugin_get () {
+	return &thisplugin;
+}
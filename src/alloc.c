@@ -0,0 +1,407 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "alloc.h"
+#include "atomic.h"
+#include "mutex.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * every block has a small header in front of it, so we know who to charge
+ * and where to return it. It's 16 bytes to keep libc's alignment.
+ */
+
+struct block {
+	struct cl_mem_account*owner;
+	uint32_t size; /* usable size */
+	uint32_t cls; /* size class + 1, 0 if it's from libc */
+};
+
+#define HDR sizeof (struct block)
+#define block_of(p) ( ( (struct block*) (p) ) - 1)
+
+/*
+ * size classes. Objects in thread caches are chained through their first
+ * word; whole batches in the depot through the second one.
+ */
+
+static const uint32_t class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+#define NCLASSES (sizeof (class_size) / sizeof (class_size[0]) )
+#define MAX_SMALL 2048
+#define BATCH 32 /* objects moved between thread cache and depot at once */
+#define CHUNK (64*1024) /* slabs are carved from this much memory */
+
+struct free_obj {
+	struct free_obj*next;
+	struct free_obj*next_batch;
+};
+
+struct thread_cache {
+	struct free_obj*list[NCLASSES];
+	unsigned count[NCLASSES];
+	int registered;
+};
+
+static __thread struct thread_cache cache;
+
+static struct {
+	cl_mutex lock;
+	struct free_obj*batches;
+} depot[NCLASSES];
+
+static int use_slabs = 1;
+static __thread struct cl_mem_account*current_owner = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static int size_class (size_t size)
+{
+	int i;
+	for (i = 0;i < NCLASSES;++i) if (size <= class_size[i]) return i;
+	return -1;
+}
+
+/*
+ * depot
+ */
+
+static void depot_put (int c, struct free_obj*batch)
+{
+	cl_mutex_lock (&depot[c].lock);
+	batch->next_batch = depot[c].batches;
+	depot[c].batches = batch;
+	cl_mutex_unlock (&depot[c].lock);
+}
+
+static struct free_obj* depot_get (int c) {
+
+	struct free_obj*b;
+
+	cl_mutex_lock (&depot[c].lock);
+	b = depot[c].batches;
+	if (b) depot[c].batches = b->next_batch;
+	cl_mutex_unlock (&depot[c].lock);
+	return b;
+}
+
+static void flush_cache (void*p)
+{
+	/* thread is exiting, give everything back */
+	struct thread_cache*tc = p;
+	int c;
+
+	for (c = 0;c < NCLASSES;++c) {
+		if (tc->list[c]) depot_put (c, tc->list[c]);
+		tc->list[c] = 0;
+		tc->count[c] = 0;
+	}
+}
+
+static void make_key()
+{
+	pthread_key_create (&cache_key, flush_cache);
+}
+
+static int refill (int c)
+{
+	struct free_obj*o;
+	char*chunk;
+	size_t bs, n, i;
+
+	if (!cache.registered) {
+		pthread_once (&key_once, make_key);
+		pthread_setspecific (cache_key, &cache);
+		cache.registered = 1;
+	}
+
+	o = depot_get (c);
+	if (o) {
+		cache.list[c] = o;
+		for (n = 0;o;o = o->next) ++n;
+		cache.count[c] = n;
+		return 0;
+	}
+
+	/* nothing in depot, carve a new slab */
+	bs = HDR + class_size[c];
+	chunk = malloc (CHUNK);
+	if (!chunk) return 1;
+
+	n = CHUNK / bs;
+	for (i = 0;i < n;++i) {
+		o = (struct free_obj*) (chunk + i * bs);
+		o->next = cache.list[c];
+		cache.list[c] = o;
+	}
+	cache.count[c] += n;
+	return 0;
+}
+
+static struct block* slab_alloc (int c) {
+
+	struct free_obj*o;
+
+	if (!cache.list[c] && refill (c) ) return 0;
+
+	o = cache.list[c];
+	cache.list[c] = o->next;
+	--cache.count[c];
+	return (struct block*) o;
+}
+
+static void slab_free (int c, struct block*b)
+{
+	struct free_obj*o = (struct free_obj*) b, *batch;
+	unsigned i;
+
+	o->next = cache.list[c];
+	cache.list[c] = o;
+
+	if (++cache.count[c] < 2 * BATCH) return;
+
+	/* too much stuff here, move a batch to the depot */
+	batch = cache.list[c];
+	for (i = 1;i < BATCH;++i) o = o->next;
+	cache.list[c] = o->next;
+	o->next = 0;
+	cache.count[c] -= BATCH;
+	depot_put (c, batch);
+}
+
+/*
+ * accounting
+ */
+
+static int charge (struct cl_mem_account*a, size_t size)
+{
+	size_t used;
+
+	if (!a) return 0;
+
+	used = cl_atomic_add (&a->held, size) - 1;
+	if (a->limit && used > a->limit) {
+		cl_atomic_sub (&a->held, size);
+		return 1;
+	}
+
+	if (used > a->peak) a->peak = used; /* racy, but it's just stats */
+	return 0;
+}
+
+static void uncharge (struct cl_mem_account*a, size_t size)
+{
+	/* the account itself holds 1 byte, so 0 means it's dead and empty */
+	if (a && !cl_atomic_sub (&a->held, size) ) free (a);
+}
+
+struct cl_mem_account* cl_mem_account_new (const char*name) {
+
+	/* the account may outlive whoever named it, it keeps its own copy */
+	size_t n = name ? strlen (name) + 1 : 0;
+	struct cl_mem_account*a = calloc (1, sizeof (struct cl_mem_account) + n);
+	if (!a) return 0;
+	if (name) a->name = memcpy (a + 1, name, n);
+	a->held = 1;
+	return a;
+}
+
+void cl_mem_account_release (struct cl_mem_account*a)
+{
+	uncharge (a, 1);
+}
+
+size_t cl_mem_used (struct cl_mem_account*a)
+{
+	return cl_atomic_load (&a->held) - 1;
+}
+
+struct cl_mem_account* cl_alloc_set_owner (struct cl_mem_account*a) {
+
+	struct cl_mem_account*r = current_owner;
+	current_owner = a;
+	return r;
+}
+
+struct cl_mem_account* cl_alloc_owner() {
+	return current_owner;
+}
+
+/*
+ * frontend
+ */
+
+void* cl_malloc (size_t size)
+{
+	struct block*b;
+	int c = -1;
+
+	if (size > UINT32_MAX) return 0;
+	if (use_slabs && size <= MAX_SMALL) {
+		c = size_class (size);
+		size = class_size[c];
+	}
+
+	if (charge (current_owner, size) ) return 0;
+
+	b = (c < 0) ? malloc (HDR + size) : slab_alloc (c);
+	if (!b) {
+		uncharge (current_owner, size);
+		return 0;
+	}
+
+	b->owner = current_owner;
+	b->size = size;
+	b->cls = c + 1;
+	return b + 1;
+}
+
+void* cl_calloc (size_t n, size_t size)
+{
+	void*p;
+
+	if (size && n > UINT32_MAX / size) return 0;
+	p = cl_malloc (n * size);
+	if (p) memset (p, 0, n * size);
+	return p;
+}
+
+void cl_free (void*p)
+{
+	struct block*b;
+
+	if (!p) return;
+	b = block_of (p);
+
+	uncharge (b->owner, b->size);
+	if (b->cls) slab_free (b->cls - 1, b);
+	else free (b);
+}
+
+void* cl_realloc (void*p, size_t size)
+{
+	struct block*b;
+	struct cl_mem_account*o;
+	void*n;
+
+	if (!p) return cl_malloc (size);
+	b = block_of (p);
+	if (size <= b->size) return p;
+
+	/* the new block belongs to the same owner as the old one */
+	o = cl_alloc_set_owner (b->owner);
+	n = cl_malloc (size);
+	cl_alloc_set_owner (o);
+
+	if (!n) return 0;
+	memcpy (n, p, b->size);
+	cl_free (p);
+	return n;
+}
+
+int cl_alloc_select (const char*name)
+{
+	if (!strcmp (name, "slab") ) use_slabs = 1;
+	else if (!strcmp (name, "libc") ) use_slabs = 0;
+	else return 1;
+	return 0;
+}
+
+const char* cl_alloc_selected()
+{
+	return use_slabs ? "slab" : "libc";
+}
+
+/*
+ * arenas
+ */
+
+struct arena_chunk {
+	struct arena_chunk*next;
+	size_t size;
+};
+
+struct cl_arena {
+	struct arena_chunk*chunks;
+	char*pos, *end;
+	size_t chunk_size;
+	struct cl_mem_account*owner;
+};
+
+#define ARENA_DEFAULT_CHUNK (16*1024)
+#define ARENA_ALIGN 16
+#define ARENA_HDR ( (sizeof (struct arena_chunk) + ARENA_ALIGN - 1) \
+                    & ~ (ARENA_ALIGN - 1) )
+
+struct cl_arena* cl_arena_new (size_t chunk_size) {
+
+	struct cl_arena*a = cl_malloc (sizeof (struct cl_arena) );
+	if (!a) return 0;
+
+	a->chunks = 0;
+	a->pos = a->end = 0;
+	a->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+	a->owner = current_owner;
+	return a;
+}
+
+void* cl_arena_alloc (struct cl_arena*a, size_t size)
+{
+	struct arena_chunk*c;
+	struct cl_mem_account*o;
+	size_t cs;
+	char*r;
+
+	size = (size + ARENA_ALIGN - 1) & ~ (ARENA_ALIGN - 1);
+
+	if (a->pos + size > a->end) {
+		cs = ARENA_HDR + (size > a->chunk_size ? size : a->chunk_size);
+
+		o = cl_alloc_set_owner (a->owner);
+		c = cl_malloc (cs);
+		cl_alloc_set_owner (o);
+		if (!c) return 0;
+
+		c->size = cs;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->pos = (char*) c + ARENA_HDR;
+		a->end = (char*) c + cs;
+	}
+
+	r = a->pos;
+	a->pos += size;
+	return r;
+}
+
+void cl_arena_release (struct cl_arena*a)
+{
+	struct arena_chunk*c;
+
+	while (a->chunks) {
+		c = a->chunks;
+		a->chunks = c->next;
+		cl_free (c);
+	}
+	a->pos = a->end = 0;
+}
+
+void cl_arena_free (struct cl_arena*a)
+{
+	cl_arena_release (a);
+	cl_free (a);
+}
@@ -11,14 +11,508 @@
  */
 
 #include "boot.h"
+#include "shutdown.h"
+#include "plugin.h"
+#include "pool.h"
+#include "sched.h"
+#include "event.h"
+#include "alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_WORKERS 256
+#define CONFIG_LINE 1024
+#define CONTROL_PRIORITY (LOWEST_PRIORITY - 1)
+
+/*
+ * what the config says
+ */
+
+struct boot_plugin {
+	struct boot_plugin*next;
+	char*name, *file;
+	struct plugin*p; /* once it's loaded */
+};
+
+struct boot_command {
+	struct boot_command*next;
+	char text[];
+};
+
+enum { part_declared, part_making, part_made, part_failed };
+
+struct boot_part {
+	struct boot_part*next;
+	char*name;
+	struct boot_plugin*pl;
+	int lazy, control, state;
+	struct part*part;
+	struct boot_command*cmds, **cmds_tail;
+};
+
+static struct boot_plugin*plugins = 0;
+static struct boot_part*parts = 0;
+static int nworkers = 0;
+
+static struct cloudvpn_boot_times times;
+
+static cl_mutex boot_lock;
+static cl_cond boot_cond; /* jobs finished or parts made */
+static int pending = 0, control_left = 0, control_parts = 0;
+static uint64_t control_start;
+
+static int keep_running = 0, respawn = 0;
+static pthread_t workers[MAX_WORKERS];
+static char**saved_argv;
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static char* copy (const char*s)
+{
+	char*c = cl_malloc (strlen (s) + 1);
+	if (c) strcpy (c, s);
+	return c;
+}
+
+static struct boot_plugin* find_plugin (const char*name) {
+
+	struct boot_plugin*p;
+
+	for (p = plugins;p;p = p->next) if (!strcmp (p->name, name) ) break;
+	return p;
+}
+
+static struct boot_part* find_part (const char*name) {
+
+	struct boot_part*p;
+
+	for (p = parts;p;p = p->next) if (!strcmp (p->name, name) ) break;
+	return p;
+}
+
+/*
+ * config parsing
+ */
+
+static char* word (char**s)
+{
+	/* cuts the next word off *s */
+	char*w;
+
+	while (**s == ' ' || **s == '\t') ++*s;
+	if (!**s) return 0;
+	w = *s;
+	while (**s && **s != ' ' && **s != '\t') ++*s;
+	if (**s) *(*s)++ = 0;
+	return w;
+}
+
+static int parse_line (char*s)
+{
+	struct boot_plugin*pl;
+	struct boot_part*pt;
+	struct boot_command*c;
+	char*kw, *a, *b;
+
+	if ( (a = strchr (s, '#') ) ) *a = 0;
+	for (a = s + strlen (s);a > s && (a[-1] == '\n' || a[-1] == '\r' ||
+	                                  a[-1] == ' ' || a[-1] == '\t');) *--a = 0;
+	if (! (kw = word (&s) ) ) return 0;
+
+	if (!strcmp (kw, "workers") ) {
+		if (! (a = word (&s) ) || (nworkers = atoi (a) ) < 1) return 1;
+
+	} else if (!strcmp (kw, "plugin") ) {
+		if (! (a = word (&s) ) || ! (b = word (&s) ) || find_plugin (a) )
+			return 1;
+		pl = cl_calloc (1, sizeof (struct boot_plugin) );
+		if (!pl || ! (pl->name = copy (a) ) || ! (pl->file = copy (b) ) )
+			return 1;
+		pl->next = plugins;
+		plugins = pl;
+
+	} else if (!strcmp (kw, "part") ) {
+		if (! (a = word (&s) ) || ! (b = word (&s) ) || find_part (a) ||
+		        ! (pl = find_plugin (b) ) ) return 1;
+		pt = cl_calloc (1, sizeof (struct boot_part) );
+		if (!pt || ! (pt->name = copy (a) ) ) return 1;
+		pt->pl = pl;
+		pt->cmds_tail = &pt->cmds;
+		while ( (a = word (&s) ) ) {
+			if (!strcmp (a, "lazy") ) pt->lazy = 1;
+			else if (!strcmp (a, "control") ) pt->control = 1;
+			else return 1;
+		}
+		pt->next = parts;
+		parts = pt;
+
+	} else if (!strcmp (kw, "command") ) {
+		if (! (a = word (&s) ) || ! (pt = find_part (a) ) ) return 1;
+		while (*s == ' ' || *s == '\t') ++s;
+		if (!*s) return 1;
+		c = cl_malloc (sizeof (struct boot_command) + strlen (s) + 1);
+		if (!c) return 1;
+		strcpy (c->text, s);
+		c->next = 0;
+		*pt->cmds_tail = c;
+		pt->cmds_tail = &c->next;
+
+	} else return 1;
+
+	return 0;
+}
+
+static int parse (const char*file)
+{
+	char line[CONFIG_LINE];
+	FILE*f = fopen (file, "r");
+	int n = 0;
+
+	if (!f) {
+		fprintf (stderr, "boot: can't open %s\n", file);
+		return 1;
+	}
+	while (fgets (line, sizeof (line), f) ) {
+		++n;
+		if (parse_line (line) ) {
+			fprintf (stderr, "boot: %s:%d: bad statement\n", file, n);
+			fclose (f);
+			return 1;
+		}
+	}
+	fclose (f);
+	return 0;
+}
+
+/*
+ * jobs. They run on the workers as events of the boot part.
+ */
+
+struct job {
+	void (*fn) (void*);
+	void*arg;
+	int control;
+};
+
+static struct part*boot_part;
+
+static void report (const char*phase, uint64_t us, const char*what, int n)
+{
+	fprintf (stderr, "boot: %-8s %10.3f ms  %d %s\n", phase, us / 1e3, n, what);
+}
+
+static void job_done (struct job*j)
+{
+	cl_mutex_lock (&boot_lock);
+	--pending;
+	if (j->control && !--control_left) {
+		times.control_us = now_us() - control_start;
+		report ("control", times.control_us, "parts", control_parts);
+	}
+	cl_mutex_unlock (&boot_lock);
+	cl_cond_broadcast (&boot_cond);
+}
+
+static void boot_process (struct part*p, struct work*w)
+{
+	struct job*j;
+
+	if (w->type != work_event) {
+		if (w->type == work_packet || w->type == work_command)
+			cloudvpn_packet_free (w->p);
+		return;
+	}
+	j = w->e.priv;
+	j->fn (j->arg);
+	job_done (j);
+	cl_free (j);
+}
+
+static struct plugin boot_plugin = {
+	"boot", {0}, boot_process, 0, 0
+};
+
+static void run_job (void (*fn) (void*), void*arg, uint8_t priority,
+                     int control)
+{
+	struct job*j = cl_malloc (sizeof (struct job) ), here;
+	struct work*w = cloudvpn_new_work();
+
+	cl_mutex_lock (&boot_lock);
+	++pending;
+	cl_mutex_unlock (&boot_lock);
+
+	if (!j || !w) {
+		/* do it here then */
+		if (w) cl_free (w);
+		if (j) cl_free (j);
+		here.control = control;
+		fn (arg);
+		job_done (&here);
+		return;
+	}
+	j->fn = fn;
+	j->arg = arg;
+	j->control = control;
+
+	w->type = work_event;
+	w->priority = priority;
+	w->is_static = 0;
+	memset (&w->e, 0, sizeof (w->e) );
+	w->e.owner = boot_part;
+	w->e.priv = j;
+	if (cloudvpn_schedule_work (w) ) {
+		cl_free (w);
+		fn (arg);
+		job_done (j);
+		cl_free (j);
+	}
+}
+
+static void wait_jobs()
+{
+	cl_mutex_lock (&boot_lock);
+	while (pending - control_left) cl_cond_wait (&boot_cond, &boot_lock);
+	cl_mutex_unlock (&boot_lock);
+}
+
+/*
+ * plugins and parts
+ */
+
+static void load_plugin (void*arg)
+{
+	struct boot_plugin*p = arg;
+
+	p->p = cloudvpn_open_plugin (p->file);
+	if (!p->p) {
+		fprintf (stderr, "boot: can't load plugin %s from %s\n",
+		         p->name, p->file);
+		cl_atomic_inc (&times.failed);
+	}
+}
+
+static void send_command (struct part*p, const char*text)
+{
+	/* right away, so that the part gets them in order */
+	int len = strlen (text);
+	struct packet*pk = cloudvpn_packet_alloc_buf (len);
+	struct work w;
+
+	if (!pk) return;
+	memcpy (pk->data, text, len);
+	pk->soff = pk->doff = 0;
+	pk->src_part = 0;
+	pk->next_part = p;
+
+	w.type = work_command;
+	w.priority = 0;
+	w.is_static = 1;
+	w.p = pk;
+	cloudvpn_part_process (p, &w);
+}
+
+static int claim (struct boot_part*e)
+{
+	/* 1 if it's ours to make, otherwise waits until it's made */
+	int r = 0;
+
+	cl_mutex_lock (&boot_lock);
+	if (e->state == part_declared) {
+		e->state = part_making;
+		r = 1;
+	} else while (e->state == part_making)
+			cl_cond_wait (&boot_cond, &boot_lock);
+	cl_mutex_unlock (&boot_lock);
+	return r;
+}
+
+static struct part* make_part (struct boot_part*e) {
+
+	struct boot_command*c;
+	struct part*p = 0;
+
+	if (e->pl->p) p = cloudvpn_part_init (e->pl->p, e->name);
+
+	cl_mutex_lock (&boot_lock);
+	e->part = p;
+	e->state = p ? part_made : part_failed;
+	cl_mutex_unlock (&boot_lock);
+	cl_cond_broadcast (&boot_cond);
+
+	if (!p) {
+		fprintf (stderr, "boot: can't make part %s\n", e->name);
+		cl_atomic_inc (&times.failed);
+		return 0;
+	}
+	cl_atomic_inc (&times.parts);
+	for (c = e->cmds;c;c = c->next) send_command (p, c->text);
+	return p;
+}
+
+static void part_job (void*arg)
+{
+	if (claim (arg) ) make_part (arg);
+}
+
+static struct part* lazy_part (const char*name) {
+
+	/* somebody looks for a part that isn't there (yet) */
+	struct boot_part*e = find_part (name);
+
+	if (!e) return 0;
+	if (claim (e) ) return make_part (e);
+	return e->part;
+}
+
+/*
+ * workers
+ */
+
+static void* worker (void*arg)
+{
+	cloudvpn_scheduler_run (&keep_running);
+	return 0;
+}
+
+static int start_workers()
+{
+	int i;
+
+	if (!nworkers) nworkers = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nworkers < 2) nworkers = 2; /* one of them waits for events */
+	if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+	times.workers = nworkers;
+
+	keep_running = 1;
+	for (i = 0;i < nworkers;++i)
+		if (pthread_create (workers + i, 0, worker, 0) ) {
+			nworkers = i;
+			return 1;
+		}
+	return 0;
+}
+
+int cloudvpn_shutdown (int again)
+{
+	struct event*e;
+	struct work*w;
+	int i;
+
+	respawn = again;
+	cl_atomic_store_rel (&keep_running, 0);
+
+	/* wake the sleeping workers with works that do nothing, and the one
+	 * that waits for events with an event that goes nowhere */
+	for (i = 0;i < nworkers;++i)
+		if ( (w = cloudvpn_new_work() ) ) {
+			w->type = work_part_cleanup;
+			w->priority = 0;
+			w->is_static = 0;
+			w->pt = 0;
+			if (cloudvpn_schedule_work (w) ) cl_free (w);
+		}
+	if ( (e = cloudvpn_new_event() ) ) {
+		e->priority = 0;
+		e->is_static = 0;
+		e->data.type = event_async;
+		e->data.owner = 0;
+		if (cloudvpn_event_send_async (e) ) cloudvpn_delete_event (e);
+	}
+	return 0;
+}
+
+/*
+ * boot
+ */
 
 int cloudvpn_boot (int argc, char**argv)
 {
+	struct boot_plugin*pl;
+	struct boot_part*e;
+	uint64_t t = now_us();
+	int n;
+
+	saved_argv = argv;
+	if (argc != 2) {
+		fprintf (stderr, "usage: %s <config>\n", argv[0]);
+		return 1;
+	}
+	if (cl_mutex_init (&boot_lock, 0) || cl_cond_init (&boot_cond) )
+		return 1;
+
+	if (parse (argv[1]) ) return 1;
+	times.parse_us = now_us() - t;
+	for (n = 0, e = parts;e;e = e->next) ++n;
+	report ("parse", times.parse_us, "parts declared", n);
+
+	if (start_workers() ) return 1;
+	boot_part = cloudvpn_part_init (&boot_plugin, 0);
+	if (!boot_part) return 1;
+	cloudvpn_set_part_maker (lazy_part);
+
+	/* all the plugins at once */
+	t = now_us();
+	for (pl = plugins;pl;pl = pl->next) {
+		run_job (load_plugin, pl, 0, 0);
+		++times.plugins;
+	}
+	wait_jobs();
+	times.plugins_us = now_us() - t;
+	report ("plugins", times.plugins_us, "plugins", times.plugins);
+	if (times.failed) return 2;
+
+	/* then the parts that forward stuff; they make whatever they need */
+	t = now_us();
+	for (e = parts;e;e = e->next)
+		if (!e->lazy && !e->control) run_job (part_job, e, 0, 0);
+	wait_jobs();
+	times.parts_us = now_us() - t;
+	for (n = 0, e = parts;e;e = e->next) n += e->state == part_declared;
+	times.lazy_left = n;
+	report ("parts", times.parts_us, "parts", times.parts);
+	if (times.failed) return 3;
+
+	/* control plane comes later; all of it is counted first, so that the
+	 * first one to finish doesn't look like the last one */
+	control_start = now_us();
+	for (n = 0, e = parts;e;e = e->next) n += !e->lazy && e->control;
+	cl_mutex_lock (&boot_lock);
+	control_left = control_parts = n;
+	cl_mutex_unlock (&boot_lock);
+	for (e = parts;e;e = e->next)
+		if (!e->lazy && e->control)
+			run_job (part_job, e, CONTROL_PRIORITY, 1);
+
 	return 0;
 }
 
 int cloudvpn_run ()
 {
+	int i;
+
+	/* events only now, so that they don't hold up boot */
+	cloudvpn_schedule_event_poll();
+	for (i = 0;i < nworkers;++i) pthread_join (workers[i], 0);
+	cloudvpn_set_part_maker (0);
+
+	if (respawn) {
+		execv ("/proc/self/exe", saved_argv);
+		return 1;
+	}
 	return 0;
 }
 
+struct cloudvpn_boot_times* cloudvpn_boot_times() {
+	return &times;
+}
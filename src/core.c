@@ -14,9 +14,21 @@
 
 #include "event.h"
 #include "sched.h"
+#include "mutex.h"
+#include "alloc.h"
+#include "trace.h"
+
+#include <stdlib.h>
 
 int cloudvpn_core_init()
 {
+	/* lock profiling must be on before any of the core mutexes exist */
+	if (getenv ("CLOUDVPN_LOCKSTAT") ) cl_mutex_stats_enable (1);
+	if (getenv ("CLOUDVPN_ALLOC") &&
+	        cl_alloc_select (getenv ("CLOUDVPN_ALLOC") ) ) return 5;
+	if (getenv ("CLOUDVPN_TRACE") )
+		cl_trace_set_every (atoi (getenv ("CLOUDVPN_TRACE") ) );
+
 	if (cloudvpn_event_init() ) return 1;
 	if (cloudvpn_scheduler_init() ) return 2;
 	if (cloudvpn_init_plugins() ) return 3;
@@ -46,7 +46,8 @@ struct event_internal_data {
  */
 
 struct event* cloudvpn_new_event() {
-	return cl_malloc (sizeof (struct event)
+	/* zeroed, so libev sees watchers that were never started as stopped */
+	return cl_calloc (1, sizeof (struct event)
 	                  + sizeof (struct event_internal_data) );
 }
 
@@ -55,7 +56,7 @@ void cloudvpn_delete_event (struct event*e)
 	cl_free (e);
 }
 
-typedef enum {add, remove, send_async} eventlist_op;
+typedef enum {add, remove, dispose, send_async} eventlist_op;
 
 struct eventlist {
 	struct event*e;
@@ -78,12 +79,12 @@ static int push_event_change (eventlist_op op, struct event*e)
 	ne->e = e;
 	ne->op = op;
 
-	cl_mutex_lock (ecq_mutex);
+	cl_mutex_lock (&ecq_mutex);
 
 	ne->next = event_change_queue;
 	event_change_queue = ne;
 
-	cl_mutex_unlock (ecq_mutex);
+	cl_mutex_unlock (&ecq_mutex);
 
 	reload_event_loop();
 
@@ -100,6 +101,11 @@ int cloudvpn_unregister_event (struct event*e)
 	return push_event_change (remove, e);
 }
 
+int cloudvpn_dispose_event (struct event*e)
+{
+	return push_event_change (dispose, e);
+}
+
 int cloudvpn_event_send_async (struct event*e)
 {
 	return push_event_change (send_async, e);
@@ -129,14 +135,14 @@ int cloudvpn_event_init()
 	ev_async_start (loop, &async);
 
 	return (!loop)
-	       || cl_mutex_init (&eventcore_mutex)
-	       || cl_mutex_init (&ecq_mutex);
+	       || cl_mutex_init (&eventcore_mutex, "eventcore_mutex")
+	       || cl_mutex_init (&ecq_mutex, "ecq_mutex");
 }
 
 int cloudvpn_event_finish()
 {
-	return cl_mutex_destroy (eventcore_mutex)
-	       || cl_mutex_destroy (ecq_mutex);
+	return cl_mutex_destroy (&eventcore_mutex)
+	       || cl_mutex_destroy (&ecq_mutex);
 }
 
 /*
@@ -186,22 +192,26 @@ static void add_handler (struct event*e)
 	case event_time:
 		ev_timer_init (& (i->w_timer), libev_timer_cb,
 		               0.000001f*e->data.time, 0);
+		i->w_timer.data = e;
 		ev_timer_start (loop, & (i->w_timer) );
 		break;
 
 	case event_signal:
 		ev_signal_init (& (i->w_signal), libev_signal_cb,
 		                e->data.signal);
+		i->w_signal.data = e;
 		ev_signal_start (loop, & (i->w_signal) );
 		break;
 
 	case event_fd_writeable:
 		ev_io_init (& (i->w_io), libev_io_cb, e->data.fd, EV_WRITE);
+		i->w_io.data = e;
 		ev_io_start (loop, & (i->w_io) );
 		break;
 
 	case event_fd_readable:
 		ev_io_init (& (i->w_io), libev_io_cb, e->data.fd, EV_READ);
+		i->w_io.data = e;
 		ev_io_start (loop, & (i->w_io) );
 		break;
 	}
@@ -273,43 +283,54 @@ static int schedule_event (struct event*e)
 void cloudvpn_wait_for_event()
 {
 	int created_async_work;
+	struct eventlist*q, *p, *t;
 
 	/* don't block if there's already other thread waiting */
-	if (cl_mutex_trylock (eventcore_mutex) ) return;
+	if (cl_mutex_trylock (&eventcore_mutex) ) return;
 
 	/* load stuff from frontend, put it to ev, wait for it. */
 
-	cl_mutex_lock (ecq_mutex);
+	cl_mutex_lock (&ecq_mutex);
+	q = event_change_queue;
+	event_change_queue = 0;
+	cl_mutex_unlock (&ecq_mutex);
+
+	/* changes were pushed to the front, process them in original order */
+	for (p = 0;q;) {
+		t = q->next;
+		q->next = p;
+		p = q;
+		q = t;
+	}
 
 	created_async_work = 0;
 
-	/* i'm so lazy */
-#	define q event_change_queue
-
-	while (q) {
-		switch (q->op) {
+	while (p) {
+		switch (p->op) {
 		case add:
-			add_handler (q->e);
+			add_handler (p->e);
 			break;
 		case remove:
-			remove_handler (q->e);
+			remove_handler (p->e);
+			break;
+		case dispose:
+			remove_handler (p->e);
+			cloudvpn_delete_event (p->e);
 			break;
 		case send_async:
-			schedule_event (q->e);
+			schedule_event (p->e);
 			++created_async_work;
 			break;
 		}
-		q = q->next;
+		t = p;
+		p = p->next;
+		cl_free (t);
 	}
 
-#	undef q
-
-	cl_mutex_unlock (ecq_mutex);
-
 	/* don't wait if it seems that we have other work to do. */
 	if (!created_async_work)
 		ev_loop (loop, EVLOOP_ONESHOT);
 
-	cl_mutex_unlock (eventcore_mutex);
+	cl_mutex_unlock (&eventcore_mutex);
 }
 
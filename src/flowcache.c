@@ -0,0 +1,148 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flowcache.h"
+#include "alloc.h"
+
+#include <string.h>
+
+static inline uint32_t flow_hash (const uint8_t*k, size_t len, const void*in)
+{
+	uint32_t h = 2166136261U ^ (uint32_t) ( (uintptr_t) in >> 4);
+
+	while (len--) h = (h ^ *k++) * 16777619U;
+	return h ^ (h >> 15);
+}
+
+static struct cl_flow_worker* get_worker (struct cl_flow_cache*c, int i) {
+
+	/* only the worker itself ever allocates its table */
+	struct cl_flow_worker*w = c->w[i];
+	unsigned j;
+
+	if (w) return w;
+
+	w = cl_malloc (sizeof (struct cl_flow_worker) + CL_CACHELINE
+	               + c->size * sizeof (struct cl_flow_entry) );
+	if (!w) return 0;
+	w->hits = w->misses = w->evictions = 0;
+	w->e = (struct cl_flow_entry*) ( ( (uintptr_t) (w + 1) + CL_CACHELINE - 1)
+	                                 & ~ (uintptr_t) (CL_CACHELINE - 1) );
+	for (j = 0;j < c->size;++j) {
+		/* can't match until the generation wraps around */
+		w->e[j].gen = cl_atomic_load (&c->gen) - 1;
+		w->e[j].len = 0;
+	}
+
+	cl_atomic_store_rel (c->w + i, w);
+	return w;
+}
+
+static inline int matches (struct cl_flow_entry*e, uint32_t gen, uint32_t h,
+                           const uint8_t*addr, size_t len, const void*in)
+{
+	return e->gen == gen && e->hash == h && e->in == in && e->len == len &&
+	       !memcmp (e->key, addr, len);
+}
+
+/*
+ * the sets have two ways; new entries go to the first one and push the
+ * older one to the second, so two flows that collide don't keep evicting
+ * each other.
+ */
+
+void* cl_flow_cache_get (struct cl_flow_cache*c, int worker,
+                         const uint8_t*addr, size_t len, const void*in,
+                         uint32_t*gen)
+{
+	struct cl_flow_worker*w;
+	struct cl_flow_entry*e;
+	uint32_t h;
+
+	*gen = cl_atomic_load_acq (&c->gen);
+
+	if (worker < 0 || worker >= CL_FLOW_WORKERS || !len || len > CL_FLOW_KEY)
+		return 0;
+	if (! (w = get_worker (c, worker) ) ) return 0;
+
+	h = flow_hash (addr, len, in);
+	e = w->e + (h & (c->size - 2) );
+
+	if (matches (e, *gen, h, addr, len, in) ||
+	        matches (++e, *gen, h, addr, len, in) ) {
+		++w->hits;
+		return e->value;
+	}
+
+	++w->misses;
+	return 0;
+}
+
+void cl_flow_cache_put (struct cl_flow_cache*c, int worker,
+                        const uint8_t*addr, size_t len, const void*in,
+                        void*value, uint32_t gen)
+{
+	struct cl_flow_worker*w;
+	struct cl_flow_entry*e;
+	uint32_t h;
+
+	if (worker < 0 || worker >= CL_FLOW_WORKERS || !len || len > CL_FLOW_KEY)
+		return;
+	if (! (w = c->w[worker]) ) return;
+
+	h = flow_hash (addr, len, in);
+	e = w->e + (h & (c->size - 2) );
+
+	/* some other live flow gets pushed out */
+	if (e[1].gen == cl_atomic_load (&c->gen) && e[1].len) ++w->evictions;
+
+	if (e->gen == cl_atomic_load (&c->gen) && e->len) e[1] = e[0];
+	e->gen = gen;
+	e->hash = h;
+	e->in = in;
+	e->value = value;
+	e->len = len;
+	memcpy (e->key, addr, len);
+}
+
+void cl_flow_cache_stats (struct cl_flow_cache*c, struct cl_flow_stats*s)
+{
+	struct cl_flow_worker*w;
+	int i;
+
+	s->hits = s->misses = s->evictions = 0;
+	for (i = 0;i < CL_FLOW_WORKERS;++i) {
+		if (! (w = cl_atomic_load_acq (c->w + i) ) ) continue;
+		s->hits += cl_atomic_load (&w->hits);
+		s->misses += cl_atomic_load (&w->misses);
+		s->evictions += cl_atomic_load (&w->evictions);
+	}
+}
+
+int cl_flow_cache_init (struct cl_flow_cache*c, unsigned size)
+{
+	memset (c, 0, sizeof (struct cl_flow_cache) );
+	if (size < 2 || (size & (size - 1) ) ) return 1;
+	c->size = size;
+	return 0;
+}
+
+void cl_flow_cache_destroy (struct cl_flow_cache*c)
+{
+	int i;
+
+	for (i = 0;i < CL_FLOW_WORKERS;++i)
+		if (c->w[i]) {
+			cl_free (c->w[i]);
+			c->w[i] = 0;
+		}
+}
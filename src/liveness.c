@@ -0,0 +1,235 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "liveness.h"
+#include "alloc.h"
+
+#include <string.h>
+
+#define NONE 0xffffffffU
+
+/*
+ * the wheel has a slot for every tick (1/8 of the interval, so the probes
+ * are at most that late), and wraps around. A peer sits in the slot of the
+ * tick when it's due; those that are due more than a turn later just stay
+ * there when the slot is run, until their turn comes.
+ */
+
+static uint32_t tx_interval (struct cl_live*l, struct cl_live_peer*p)
+{
+	if (!p->up) return l->interval_us > CL_LIVE_SLOW_US ?
+		                   l->interval_us : CL_LIVE_SLOW_US;
+	return p->peer_us > l->interval_us ? p->peer_us : l->interval_us;
+}
+
+static uint64_t jitter (struct cl_live*l, uint32_t us)
+{
+	l->rnd ^= l->rnd << 13;
+	l->rnd ^= l->rnd >> 7;
+	l->rnd ^= l->rnd << 17;
+	return us - ( (uint64_t) (us / 4) * (uint32_t) (l->rnd >> 32) >> 32);
+}
+
+static uint64_t due (struct cl_live_peer*p)
+{
+	return p->up && p->dead_at < p->tx_at ? p->dead_at : p->tx_at;
+}
+
+static void link_in (struct cl_live*l, uint32_t id)
+{
+	struct cl_live_peer*p = l->p + id;
+	uint64_t t = (p->at + l->tick_us - 1) / l->tick_us;
+	uint32_t*s;
+
+	if (t <= l->done) t = l->done + 1;
+	s = l->slot + t % CL_LIVE_SLOTS;
+
+	p->prev = NONE;
+	p->next = *s;
+	if (*s != NONE) l->p[*s].prev = id;
+	*s = id;
+}
+
+static void unlink_from (struct cl_live*l, uint32_t id)
+{
+	struct cl_live_peer*p = l->p + id;
+	uint64_t t;
+
+	if (p->prev != NONE) l->p[p->prev].next = p->next;
+	else {
+		/* it's the head of some slot, find which */
+		for (t = 0;t < CL_LIVE_SLOTS && l->slot[t] != id;++t);
+		if (t < CL_LIVE_SLOTS) l->slot[t] = p->next;
+	}
+	if (p->next != NONE) l->p[p->next].prev = p->prev;
+}
+
+static void set_tick (struct cl_live*l)
+{
+	/* rebuilds the wheel for the new tick */
+	uint32_t i;
+
+	l->tick_us = l->interval_us / 8;
+	if (l->tick_us < 1000) l->tick_us = 1000;
+
+	for (i = 0;i < CL_LIVE_SLOTS;++i) l->slot[i] = NONE;
+	l->done = 0;
+	for (i = 0;i < l->n;++i) if (l->p[i].used) link_in (l, i);
+}
+
+int cl_live_init (struct cl_live*l, uint32_t interval_us, unsigned mult,
+                  void (*probe) (void*, void*), void (*down) (void*, void*),
+                  void*arg)
+{
+	memset (l, 0, sizeof (struct cl_live) );
+	if (!interval_us || !mult) return 1;
+
+	l->interval_us = interval_us;
+	l->mult = mult;
+	l->free = NONE;
+	l->rnd = 0x9e3779b97f4a7c15ULL ^ (uintptr_t) l;
+	l->probe = probe;
+	l->down = down;
+	l->arg = arg;
+	set_tick (l);
+	return 0;
+}
+
+void cl_live_destroy (struct cl_live*l)
+{
+	if (l->p) cl_free (l->p);
+	l->p = 0;
+	l->n = l->cap = 0;
+}
+
+void cl_live_set (struct cl_live*l, uint32_t interval_us, unsigned mult)
+{
+	/* applies from the next probe on */
+	if (!interval_us || !mult) return;
+	l->interval_us = interval_us;
+	l->mult = mult;
+	set_tick (l);
+}
+
+int cl_live_add (struct cl_live*l, void*ctx, uint64_t now)
+{
+	struct cl_live_peer*p;
+	uint32_t id;
+
+	if (l->free != NONE) {
+		id = l->free;
+		l->free = l->p[id].next;
+	} else {
+		if (l->n == l->cap) {
+			p = cl_realloc (l->p, (l->cap ? 2 * l->cap : 64)
+			                * sizeof (struct cl_live_peer) );
+			if (!p) return -1;
+			l->p = p;
+			l->cap = l->cap ? 2 * l->cap : 64;
+		}
+		id = l->n++;
+	}
+
+	p = l->p + id;
+	memset (p, 0, sizeof (struct cl_live_peer) );
+	p->used = 1;
+	p->ctx = ctx;
+	p->at = p->tx_at = now;
+	link_in (l, id);
+	return id;
+}
+
+void cl_live_remove (struct cl_live*l, int id)
+{
+	if (id < 0 || (uint32_t) id >= l->n || !l->p[id].used) return;
+	unlink_from (l, id);
+	l->p[id].used = 0;
+	l->p[id].next = l->free;
+	l->free = id;
+}
+
+int cl_live_heard (struct cl_live*l, int id, uint32_t peer_us, uint64_t now)
+{
+	struct cl_live_peer*p;
+	uint32_t iv;
+	int came = 0;
+
+	if (id < 0 || (uint32_t) id >= l->n || !l->p[id].used) return 0;
+	p = l->p + id;
+
+	if (peer_us) p->peer_us = peer_us;
+	iv = p->peer_us > l->interval_us ? p->peer_us : l->interval_us;
+	p->dead_at = now + (uint64_t) l->mult * iv;
+
+	if (!p->up) {
+		/* tell it right away that we see it too */
+		p->up = came = 1;
+		p->tx_at = now;
+		++l->ups;
+	}
+
+	/* only gets moved if it's due earlier than it's waiting for */
+	if (due (p) < p->at) {
+		unlink_from (l, id);
+		p->at = due (p);
+		link_in (l, id);
+	}
+	return came;
+}
+
+static void run_peer (struct cl_live*l, uint32_t id, uint64_t now)
+{
+	struct cl_live_peer*p = l->p + id;
+
+	if (p->up && p->dead_at <= now) {
+		p->up = 0;
+		p->tx_at = now;
+		++l->downs;
+		l->down (l->arg, p->ctx);
+	}
+	if (p->tx_at <= now) {
+		++l->probes;
+		l->probe (l->arg, p->ctx);
+		p->tx_at = now + jitter (l, tx_interval (l, p) );
+	}
+	p->at = due (p);
+}
+
+uint64_t cl_live_run (struct cl_live*l, uint64_t now)
+{
+	uint64_t end = now / l->tick_us, t;
+	uint32_t id, next;
+
+	if (end > l->done) {
+		t = end - l->done > CL_LIVE_SLOTS ? end - CL_LIVE_SLOTS : l->done;
+
+		/* done goes first, so that nothing is put back to the slot
+		 * that is just being run */
+		while (t < end) {
+			l->done = ++t;
+			id = l->slot[t % CL_LIVE_SLOTS];
+			l->slot[t % CL_LIVE_SLOTS] = NONE;
+
+			for (;id != NONE;id = next) {
+				next = l->p[id].next;
+				if (l->p[id].at <= now) run_peer (l, id, now);
+				link_in (l, id);
+			}
+		}
+	}
+
+	/* the next slot that has something */
+	for (t = l->done + 1;t <= l->done + CL_LIVE_SLOTS;++t)
+		if (l->slot[t % CL_LIVE_SLOTS] != NONE)
+			return t * l->tick_us > now ? t * l->tick_us - now : 1;
+	return 0;
+}
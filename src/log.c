@@ -0,0 +1,425 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "mutex.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+int cl_log_level = -1;
+uint32_t cl_log_rate = 1000;
+
+static int attached = 0;
+
+/*
+ * every thread that logs gets its own ring, the drain is the only
+ * consumer of all of them. The rings of exited threads are freed by the
+ * drain when it has emptied them.
+ *
+ * The ring also keeps the thread's budget and counts of the sites it logs
+ * from, so a busy site doesn't bounce a shared cache line between the
+ * workers. Others only read the counts; when the ring goes, they're added
+ * to the site. A thread that logs from more than SITE_SLOTS sites counts
+ * the rest at the site itself.
+ */
+
+#define SITE_SLOTS 64
+
+struct site_count {
+	struct cl_log_site*site; /* 0 if free */
+	uint64_t window;
+	uint32_t used;
+	uint64_t logged, dropped;
+};
+
+struct ring {
+	size_t head cl_cacheline_aligned; /* drain's */
+	size_t tail cl_cacheline_aligned; /* thread's */
+	size_t head_cache;
+	int dead;
+	struct ring*next;
+	struct site_count sites[SITE_SLOTS];
+	struct cl_log_rec rec[CL_LOG_RING];
+};
+
+/* for the budget, a few ns instead of the exact time */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define WINDOW_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define WINDOW_CLOCK CLOCK_MONOTONIC
+#endif
+
+static __thread struct ring*my_ring = 0;
+static struct ring*rings = 0;
+static cl_mutex rings_lock; /* zeroes are an unlocked mutex */
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static struct cl_log_site*sites = 0;
+
+static void ring_exit (void*p)
+{
+	struct ring*r = p;
+
+	my_ring = 0;
+	cl_atomic_store_rel (&r->dead, 1);
+}
+
+static void make_key()
+{
+	pthread_key_create (&ring_key, ring_exit);
+}
+
+static struct ring* new_ring() {
+
+	struct cl_mem_account*o;
+	struct ring*r;
+
+	/* it outlives whatever part logged first on the thread */
+	o = cl_alloc_set_owner (0);
+	r = cl_malloc (sizeof (struct ring) );
+	cl_alloc_set_owner (o);
+
+	if (!r) return 0;
+	r->head = r->tail = r->head_cache = 0;
+	r->dead = 0;
+	memset (r->sites, 0, sizeof (r->sites) );
+
+	pthread_once (&key_once, make_key);
+	pthread_setspecific (ring_key, r);
+
+	cl_mutex_lock (&rings_lock);
+	r->next = rings;
+	rings = r;
+	cl_mutex_unlock (&rings_lock);
+
+	return my_ring = r;
+}
+
+static void register_site (struct cl_log_site*s)
+{
+	int z = 0;
+
+	if (!cl_atomic_cas (&s->registered, &z, 1) ) return;
+	s->next = cl_atomic_load (&sites);
+	while (!cl_atomic_cas_weak (&sites, &s->next, s) );
+}
+
+static inline unsigned site_hash (struct cl_log_site*s)
+{
+	return ( (uint32_t) ( (uintptr_t) s >> 4) * 2654435761U) >> 26;
+}
+
+static struct site_count* find_count (struct ring*r, struct cl_log_site*s)
+{
+	/* for any thread, 0 if the ring has none for s */
+	struct site_count*c;
+	unsigned i, h = site_hash (s);
+
+	for (i = 0;i < SITE_SLOTS;++i) {
+		c = r->sites + ( (h + i) & (SITE_SLOTS - 1) );
+		if (cl_atomic_load_acq (&c->site) == s) return c;
+		if (!cl_atomic_load_acq (&c->site) ) break;
+	}
+	return 0;
+}
+
+static struct site_count* my_count (struct ring*r, struct cl_log_site*s)
+{
+	/* the owner's, taken if it isn't there yet; 0 if all are taken */
+	struct site_count*c;
+	unsigned i, h = site_hash (s);
+
+	for (i = 0;i < SITE_SLOTS;++i) {
+		c = r->sites + ( (h + i) & (SITE_SLOTS - 1) );
+		if (c->site == s) return c;
+		if (!c->site) {
+			cl_atomic_store_rel (&c->site, s);
+			return c;
+		}
+	}
+	return 0;
+}
+
+static int over_rate (struct cl_log_site*s, struct site_count*c)
+{
+	/* "seconds" are 2^30 ns, that's close enough and costs no division.
+	 * Threads that race at the window change of a shared budget may let a
+	 * few more through. */
+	uint32_t rate = s->rate == ~0U ? cl_log_rate : s->rate;
+	struct timespec ts;
+	uint64_t w;
+
+	if (!rate) return 0;
+	clock_gettime (WINDOW_CLOCK, &ts);
+	w = (ts.tv_sec * 1000000000ULL + ts.tv_nsec) >> 30;
+
+	if (c) {
+		if (c->window != w) {
+			c->window = w;
+			c->used = 0;
+		}
+		return ++c->used > rate;
+	}
+
+	if (cl_atomic_load (&s->window) != w) {
+		cl_atomic_store (&s->window, w);
+		cl_atomic_store (&s->in_window, 0);
+	}
+	return cl_atomic_add_relaxed (&s->in_window, 1) > rate;
+}
+
+void cl_log_write (struct cl_log_site*s, struct part*pt,
+                   const uint64_t*args, int nargs)
+{
+	struct ring*r = my_ring;
+	struct site_count*c = 0;
+	struct cl_log_rec*rec;
+	struct timespec ts;
+	size_t t, n;
+
+	if (!s->registered) register_site (s);
+
+	if (r || (r = new_ring() ) ) c = my_count (r, s);
+	if (over_rate (s, c) || !r) goto drop;
+
+	t = r->tail;
+	if (t - r->head_cache >= CL_LOG_RING) {
+		r->head_cache = cl_atomic_load_acq (&r->head);
+		if (t - r->head_cache >= CL_LOG_RING) goto drop;
+	}
+
+	/* the exact time only for what goes in */
+	clock_gettime (CLOCK_REALTIME, &ts);
+	rec = r->rec + (t & (CL_LOG_RING - 1) );
+	rec->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->site = s;
+	/* cut, not necessarily terminated */
+	n = pt && pt->name ? strnlen (pt->name, CL_LOG_NAME) : 0;
+	if (n) memcpy (rec->part, pt->name, n);
+	if (n < CL_LOG_NAME) rec->part[n] = 0;
+	if (nargs > CL_LOG_ARGS) nargs = CL_LOG_ARGS;
+	rec->nargs = nargs;
+	memcpy (rec->arg, args, nargs * sizeof (uint64_t) );
+
+	cl_atomic_store_rel (&r->tail, t + 1);
+	if (c) cl_atomic_store (&c->logged, c->logged + 1);
+	else cl_atomic_add_relaxed (&s->logged, 1);
+	return;
+
+drop:
+	if (c) cl_atomic_store (&c->dropped, c->dropped + 1);
+	else cl_atomic_add_relaxed (&s->dropped, 1);
+}
+
+/*
+ * drain side
+ */
+
+int cl_log_attach (int level)
+{
+	int z = 0;
+
+	if (!cl_atomic_cas (&attached, &z, 1) ) return 1;
+	cl_atomic_store (&cl_log_level, level);
+	return 0;
+}
+
+void cl_log_detach()
+{
+	cl_atomic_store (&cl_log_level, -1);
+	cl_atomic_store_rel (&attached, 0);
+}
+
+static void fold_counts (struct ring*r)
+{
+	/* what the thread counted stays with the sites */
+	struct site_count*c;
+
+	for (c = r->sites;c < r->sites + SITE_SLOTS;++c) {
+		if (!c->site) continue;
+		cl_atomic_add_relaxed (&c->site->logged, c->logged);
+		cl_atomic_add_relaxed (&c->site->dropped, c->dropped);
+	}
+}
+
+int cl_log_drain (void (*fn) (struct cl_log_rec*, void*), void*arg)
+{
+	struct ring*r, **rp;
+	size_t h, t;
+	int n = 0;
+
+	cl_mutex_lock (&rings_lock);
+	for (rp = &rings;(r = *rp);) {
+		t = cl_atomic_load_acq (&r->tail);
+		for (h = r->head;h != t;++h, ++n)
+			fn (r->rec + (h & (CL_LOG_RING - 1) ), arg);
+		cl_atomic_store_rel (&r->head, h);
+
+		/* its thread is gone; dead is set after the last write */
+		if (cl_atomic_load_acq (&r->dead) &&
+		        cl_atomic_load_acq (&r->tail) == h) {
+			*rp = r->next;
+			fold_counts (r);
+			cl_free (r);
+			continue;
+		}
+		rp = &r->next;
+	}
+	cl_mutex_unlock (&rings_lock);
+	return n;
+}
+
+struct cl_log_site* cl_log_sites() {
+	return cl_atomic_load_acq (&sites);
+}
+
+void cl_log_counts (struct cl_log_site*s, uint64_t*logged, uint64_t*dropped)
+{
+	struct site_count*c;
+	struct ring*r;
+
+	cl_mutex_lock (&rings_lock);
+	*logged = cl_atomic_load (&s->logged);
+	*dropped = cl_atomic_load (&s->dropped);
+	for (r = rings;r;r = r->next)
+		if ( (c = find_count (r, s) ) ) {
+			*logged += cl_atomic_load (&c->logged);
+			*dropped += cl_atomic_load (&c->dropped);
+		}
+	cl_mutex_unlock (&rings_lock);
+}
+
+uint64_t cl_log_dropped()
+{
+	struct cl_log_site*s;
+	struct ring*r;
+	uint64_t n = 0;
+	int i;
+
+	cl_mutex_lock (&rings_lock);
+	for (s = cl_log_sites();s;s = s->next) n += cl_atomic_load (&s->dropped);
+	for (r = rings;r;r = r->next)
+		for (i = 0;i < SITE_SLOTS;++i)
+			n += cl_atomic_load (&r->sites[i].dropped);
+	cl_mutex_unlock (&rings_lock);
+	return n;
+}
+
+/*
+ * formatting
+ */
+
+static const char*level_name[] = {"error", "warn", "info", "debug"};
+
+static int format_arg (char*buf, int size, const char*spec, char conv,
+                       const char*len, uint64_t a)
+{
+	/* the argument gets the type the spec says */
+	int l = !strcmp (len, "l") || !strcmp (len, "z") || !strcmp (len, "t"),
+	    ll = !strcmp (len, "ll") || !strcmp (len, "j");
+
+	switch (conv) {
+	case 'd':
+	case 'i':
+		if (ll) return snprintf (buf, size, spec, (long long) a);
+		if (l) return snprintf (buf, size, spec, (long) a);
+		return snprintf (buf, size, spec, (int) a);
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		if (ll) return snprintf (buf, size, spec, (unsigned long long) a);
+		if (l) return snprintf (buf, size, spec, (unsigned long) a);
+		return snprintf (buf, size, spec, (unsigned) a);
+	case 'c':
+		return snprintf (buf, size, spec, (int) a);
+	case 'p':
+		return snprintf (buf, size, spec, (void*) (uintptr_t) a);
+	case 's':
+		return snprintf (buf, size, spec,
+		                 a ? (const char*) (uintptr_t) a : "(null)");
+	}
+	return snprintf (buf, size, "%s", spec);
+}
+
+int cl_log_format (struct cl_log_rec*r, char*buf, int size)
+{
+	static __thread time_t last_sec = -1;
+	static __thread char stamp[32];
+	const char*f = r->site->fmt, *s;
+	char spec[32], len[4];
+	time_t sec = r->time_ns / 1000000000ULL;
+	struct tm tm;
+	int n = 0, i = 0, k;
+
+#define room (n < size ? size - n : 0)
+#define out (n < size ? buf + n : 0)
+
+	if (sec != last_sec) {
+		/* the date only changes every second */
+		localtime_r (&sec, &tm);
+		strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		last_sec = sec;
+	}
+	n += snprintf (out, room, "%s.%06u %s %.*s: ", stamp,
+	               (unsigned) (r->time_ns % 1000000000ULL / 1000),
+	               r->site->level >= 0 && r->site->level <= CL_LOG_DEBUG ?
+	               level_name[r->site->level] : "?",
+	               CL_LOG_NAME, r->part[0] ? r->part : "-");
+
+	while (*f) {
+		if (*f != '%') {
+			if (room > 1) buf[n] = *f;
+			++n;
+			++f;
+			continue;
+		}
+		if (f[1] == '%') {
+			if (room > 1) buf[n] = '%';
+			++n;
+			f += 2;
+			continue;
+		}
+
+		/* %[flags][width][.precision][length]conversion */
+		s = f++;
+		while (*f && strchr ("-+ #0", *f) ) ++f;
+		while (*f >= '0' && *f <= '9') ++f;
+		if (*f == '.') for (++f;*f >= '0' && *f <= '9';++f);
+		for (k = 0;k < 2 && *f && strchr ("hlzjt", *f);++f) len[k++] = *f;
+		len[k] = 0;
+		if (*f) ++f;
+		if (f - s >= (int) sizeof (spec) ) break;
+		memcpy (spec, s, f - s);
+		spec[f - s] = 0;
+
+		if (i < (int) r->nargs)
+			n += format_arg (out, room, spec, f[-1], len, r->arg[i++]);
+		else n += snprintf (out, room, "?");
+	}
+
+	if (room > 1) buf[n] = '\n';
+	++n;
+	if (size) buf[n < size ? n : size - 1] = 0;
+	return n;
+
+#undef room
+#undef out
+}
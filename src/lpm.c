@@ -0,0 +1,494 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lpm.h"
+#include "alloc.h"
+
+/* include/sched.h shadows the system one, so this is declared by hand */
+int sched_yield (void);
+
+/*
+ * Writers only ever publish complete nodes, by storing one pointer, so a
+ * reader sees either the old or the new shape of the trie, both valid.
+ * Nodes that are cut out are freed after all readers that might be looking
+ * at them leave: the writer flips the epoch, and waits until the readers
+ * counted in the old one are gone. Readers that come after the flip can't
+ * reach the cut-out nodes anymore.
+ *
+ * The top of a big trie is almost a complete binary tree, so walking it
+ * costs a cache miss per bit. The direct table (if there is one) skips it:
+ * for every value of the first direct_bits bits of the address it keeps
+ * the deepest node that is at most that long and lies on the way (the
+ * "anchor"). Lookup starts there; only if nothing is found below the
+ * anchor, the shorter prefixes above it are tried by a walk from the root.
+ * The bits go with the anchors, so that a new direct table can be swapped
+ * in by one pointer too.
+ */
+
+struct cl_lpm_node {
+	struct cl_lpm_node*child[2];
+	void*value;
+	unsigned bits;
+	uint8_t key[]; /* (bits+7)/8 bytes, the rest of last byte is zero */
+};
+
+struct cl_lpm_direct {
+	unsigned bits;
+	struct cl_lpm_node*anchor[]; /* 1<<bits of them */
+};
+
+static inline int get_bit (const uint8_t*k, unsigned i)
+{
+	return (k[i >> 3] >> (7 - (i & 7) ) ) & 1;
+}
+
+static int bits_equal (const uint8_t*a, const uint8_t*b,
+                       unsigned from, unsigned to)
+{
+	/* are bits from..to-1 the same? */
+	unsigned i = from >> 3, e = to >> 3;
+	uint8_t m;
+
+	if (from >= to) return 1;
+
+	m = 0xff >> (from & 7);
+	if (i == e) return ! ( (a[i] ^ b[i]) & m & ~ (0xff >> (to & 7) ) );
+	if ( (a[i] ^ b[i]) & m) return 0;
+
+	++i;
+	if (e > i && memcmp (a + i, b + i, e - i) ) return 0;
+	if (! (to & 7) ) return 1;
+	return ! ( (a[e] ^ b[e]) & ~ (0xff >> (to & 7) ) );
+}
+
+static unsigned first_diff (const uint8_t*a, const uint8_t*b,
+                            unsigned from, unsigned to)
+{
+	unsigned i = from;
+
+	while (i < to) {
+		if (! (i & 7) && i + 8 <= to && a[i >> 3] == b[i >> 3]) {
+			i += 8;
+			continue;
+		}
+		if (get_bit (a, i) != get_bit (b, i) ) return i;
+		++i;
+	}
+	return to;
+}
+
+static struct cl_lpm_node* new_node (const uint8_t*key, unsigned bits,
+                                     void*value) {
+
+	unsigned len = (bits + 7) / 8;
+	struct cl_lpm_node*n = cl_malloc (sizeof (struct cl_lpm_node) + len);
+
+	if (!n) return 0;
+	n->child[0] = n->child[1] = 0;
+	n->value = value;
+	n->bits = bits;
+	if (len) {
+		memcpy (n->key, key, len);
+		if (bits & 7) n->key[len - 1] &= ~ (0xff >> (bits & 7) );
+	}
+	return n;
+}
+
+/*
+ * readers
+ */
+
+static __thread int reader_slot = -1;
+static int next_slot;
+
+unsigned cl_lpm_enter (struct cl_lpm*t)
+{
+	int e, s = reader_slot;
+
+	if (s < 0) s = reader_slot = cl_atomic_inc (&next_slot) % CL_LPM_SLOTS;
+
+	for (;;) {
+		e = cl_atomic_load (&t->epoch);
+		cl_atomic_inc (&t->readers[s].n[e]);
+		cl_fence();
+		/* the writer might have flipped it meanwhile, and not seen us */
+		if (cl_atomic_load (&t->epoch) == e) return s * 2 + e;
+		cl_atomic_dec (&t->readers[s].n[e]);
+	}
+}
+
+void cl_lpm_leave (struct cl_lpm*t, unsigned token)
+{
+	cl_atomic_dec (&t->readers[token >> 1].n[token & 1]);
+}
+
+static inline unsigned direct_index (const uint8_t*k, unsigned bits,
+                                     unsigned direct_bits)
+{
+	/* first direct_bits of the key, the ones after bits are zero */
+	unsigned i, idx = 0;
+
+	for (i = 0;i < direct_bits;i += 8)
+		idx = (idx << 8) | (i < bits ? k[i >> 3] : 0);
+	return idx;
+}
+
+static inline void* walk (struct cl_lpm_node*n, const uint8_t*addr,
+                          unsigned bits) {
+
+	struct cl_lpm_node*c;
+	void*best = cl_atomic_load_acq (&n->value), *v;
+
+	while (n->bits < bits) {
+		c = cl_atomic_load_acq (&n->child[get_bit (addr, n->bits)]);
+
+		/* the bit that chose the child matches already */
+		if (!c || c->bits > bits ||
+		        !bits_equal (c->key, addr, n->bits + 1, c->bits) ) break;
+
+		if ( (v = cl_atomic_load_acq (&c->value) ) ) best = v;
+		n = c;
+	}
+
+	return best;
+}
+
+void* cl_lpm_lookup (struct cl_lpm*t, const uint8_t*addr, size_t len)
+{
+	struct cl_lpm_direct*dt = cl_atomic_load_acq (&t->direct);
+	unsigned bits = len * 8;
+	void*v;
+
+	if (dt && bits >= dt->bits) {
+		v = walk (cl_atomic_load_acq (dt->anchor + direct_index
+		                              (addr, bits, dt->bits) ),
+		          addr, bits);
+		if (v) return v;
+	}
+
+	return walk (t->root, addr, bits);
+}
+
+/*
+ * writers
+ */
+
+static void synchronize (struct cl_lpm*t)
+{
+	/* wait until nobody can see what was cut out before */
+	int i, spins, e = t->epoch;
+
+	cl_atomic_store (&t->epoch, !e);
+	cl_fence();
+
+	for (i = 0;i < CL_LPM_SLOTS;++i)
+		for (spins = 0;cl_atomic_load_acq (&t->readers[i].n[e]);++spins)
+			if (spins < 1000) cl_cpu_relax();
+			else sched_yield(); /* reader got preempted */
+}
+
+static void free_dead (struct cl_lpm*t)
+{
+	/* only after synchronize */
+	t->nodes -= t->ndead;
+	while (t->ndead) cl_free (t->dead[--t->ndead]);
+}
+
+static void bury (struct cl_lpm*t, struct cl_lpm_node*n)
+{
+	/* cut out, freed by the next synchronize */
+	struct cl_lpm_node**d;
+	size_t size;
+
+	if (t->ndead == t->dead_size) {
+		size = t->dead_size ? 2 * t->dead_size : 16;
+		d = cl_realloc (t->dead, size * sizeof (struct cl_lpm_node*) );
+		if (!d) {
+			/* can't wait for it then */
+			synchronize (t);
+			free_dead (t);
+			--t->nodes;
+			cl_free (n);
+			return;
+		}
+		t->dead = d;
+		t->dead_size = size;
+	}
+	t->dead[t->ndead++] = n;
+}
+
+void cl_lpm_synchronize (struct cl_lpm*t)
+{
+	cl_mutex_lock (&t->lock);
+	synchronize (t);
+	free_dead (t);
+	cl_mutex_unlock (&t->lock);
+}
+
+static void direct_add (struct cl_lpm_direct*dt, struct cl_lpm_node*n)
+{
+	/* new node is the anchor for its range, unless there's a deeper one */
+	struct cl_lpm_node**d;
+	unsigned i, count;
+
+	if (!dt || n->bits > dt->bits) return;
+
+	d = dt->anchor + direct_index (n->key, n->bits, dt->bits);
+	count = 1U << (dt->bits - n->bits);
+	for (i = 0;i < count;++i)
+		if (d[i]->bits < n->bits) cl_atomic_store_rel (d + i, n);
+}
+
+static void direct_del (struct cl_lpm_direct*dt, struct cl_lpm_node*n,
+                        struct cl_lpm_node*up)
+{
+	/* node is cut out, its range falls back to the node above */
+	struct cl_lpm_node**d;
+	unsigned i, count;
+
+	if (!dt || n->bits > dt->bits) return;
+
+	d = dt->anchor + direct_index (n->key, n->bits, dt->bits);
+	count = 1U << (dt->bits - n->bits);
+	for (i = 0;i < count;++i)
+		if (d[i] == n) cl_atomic_store_rel (d + i, up);
+}
+
+static void direct_fill (struct cl_lpm_direct*dt, struct cl_lpm_node*n)
+{
+	/* anchors of the nodes that are already there, nobody sees it yet */
+	if (!n || n->bits > dt->bits) return;
+	direct_add (dt, n);
+	direct_fill (dt, n->child[0]);
+	direct_fill (dt, n->child[1]);
+}
+
+static struct cl_lpm_direct* new_direct (struct cl_lpm*t, unsigned bits) {
+
+	struct cl_lpm_direct*dt;
+	unsigned i;
+
+	dt = cl_malloc (sizeof (struct cl_lpm_direct)
+	                + (sizeof (struct cl_lpm_node*) << bits) );
+	if (!dt) return 0;
+	dt->bits = bits;
+	for (i = 0;i < 1U << bits;++i) dt->anchor[i] = t->root;
+	direct_fill (dt, t->root->child[0]);
+	direct_fill (dt, t->root->child[1]);
+	return dt;
+}
+
+int cl_lpm_set_direct (struct cl_lpm*t, unsigned direct_bits)
+{
+	struct cl_lpm_direct*dt = 0, *old;
+
+	if (direct_bits % 8 || direct_bits > 24) return 1;
+
+	cl_mutex_lock (&t->lock);
+	if (direct_bits && ! (dt = new_direct (t, direct_bits) ) ) {
+		cl_mutex_unlock (&t->lock);
+		return 1;
+	}
+
+	/* readers that took the old one finish with it */
+	old = t->direct;
+	cl_atomic_store_rel (&t->direct, dt);
+	synchronize (t);
+	free_dead (t);
+	if (old) cl_free (old);
+
+	cl_mutex_unlock (&t->lock);
+	return 0;
+}
+
+int cl_lpm_insert (struct cl_lpm*t, const uint8_t*key, unsigned bits,
+                   void*value)
+{
+	struct cl_lpm_node*n, *c, *m, *leaf;
+	unsigned common;
+	int b;
+
+	if (!value) return 1;
+
+	cl_mutex_lock (&t->lock);
+
+	for (n = t->root;;) {
+		if (n->bits == bits) {
+			if (!n->value) ++t->count;
+			cl_atomic_store_rel (&n->value, value);
+			break;
+		}
+
+		b = get_bit (key, n->bits);
+		c = n->child[b];
+
+		if (!c) {
+			if (! (leaf = new_node (key, bits, value) ) ) goto fail;
+			cl_atomic_store_rel (&n->child[b], leaf);
+			direct_add (t->direct, leaf);
+			++t->count;
+			++t->nodes;
+			break;
+		}
+
+		common = first_diff (c->key, key, n->bits + 1,
+		                     c->bits < bits ? c->bits : bits);
+
+		/* whole child is a prefix of the key, go on */
+		if (common == c->bits) {
+			n = c;
+			continue;
+		}
+
+		/* key is a prefix of the child, goes between */
+		if (common == bits) {
+			if (! (m = new_node (key, bits, value) ) ) goto fail;
+			m->child[get_bit (c->key, bits)] = c;
+			cl_atomic_store_rel (&n->child[b], m);
+			direct_add (t->direct, m);
+			++t->count;
+			++t->nodes;
+			break;
+		}
+
+		/* they split somewhere in the middle */
+		m = new_node (key, common, 0);
+		leaf = new_node (key, bits, value);
+		if (!m || !leaf) {
+			if (m) cl_free (m);
+			if (leaf) cl_free (leaf);
+			goto fail;
+		}
+		m->child[get_bit (key, common)] = leaf;
+		m->child[get_bit (c->key, common)] = c;
+		cl_atomic_store_rel (&n->child[b], m);
+		direct_add (t->direct, m);
+		direct_add (t->direct, leaf);
+		++t->count;
+		t->nodes += 2;
+		break;
+	}
+
+	cl_mutex_unlock (&t->lock);
+	return 0;
+
+fail:
+	cl_mutex_unlock (&t->lock);
+	return 1;
+}
+
+static int unlink_prefix (struct cl_lpm*t, const uint8_t*key, unsigned bits)
+{
+	struct cl_lpm_node*n, *parent = 0, *gparent = 0, *c;
+	int b = 0, pb = 0;
+
+	for (n = t->root;n && n->bits < bits;) {
+		gparent = parent;
+		pb = b;
+		parent = n;
+		b = get_bit (key, n->bits);
+		n = n->child[b];
+		if (n && (n->bits > bits ||
+		          !bits_equal (n->key, key, parent->bits + 1, n->bits) ) )
+			n = 0;
+	}
+
+	if (!n || n->bits != bits || !n->value) return 1;
+
+	cl_atomic_store_rel (&n->value, (void*) 0);
+	--t->count;
+
+	/* cut out the nodes that don't branch anymore */
+	if (n != t->root && ! (n->child[0] && n->child[1]) ) {
+		c = n->child[0] ? n->child[0] : n->child[1];
+		cl_atomic_store_rel (&parent->child[b], c);
+		direct_del (t->direct, n, parent);
+		bury (t, n);
+
+		if (!c && parent != t->root && !parent->value) {
+			c = parent->child[!b];
+			cl_atomic_store_rel (&gparent->child[pb], c);
+			direct_del (t->direct, parent, gparent);
+			bury (t, parent);
+		}
+	}
+
+	return 0;
+}
+
+int cl_lpm_remove (struct cl_lpm*t, const uint8_t*key, unsigned bits)
+{
+	int r;
+
+	cl_mutex_lock (&t->lock);
+	r = unlink_prefix (t, key, bits);
+
+	/* also the value itself may be in use by someone */
+	if (!r) {
+		synchronize (t);
+		free_dead (t);
+	}
+
+	cl_mutex_unlock (&t->lock);
+	return r;
+}
+
+int cl_lpm_unlink (struct cl_lpm*t, const uint8_t*key, unsigned bits)
+{
+	int r;
+
+	cl_mutex_lock (&t->lock);
+	r = unlink_prefix (t, key, bits);
+	cl_mutex_unlock (&t->lock);
+	return r;
+}
+
+/*
+ * init/deinit
+ */
+
+int cl_lpm_init (struct cl_lpm*t, unsigned direct_bits)
+{
+	memset (t, 0, sizeof (struct cl_lpm) );
+	if (direct_bits % 8 || direct_bits > 24) return 1;
+
+	t->root = new_node (0, 0, 0);
+	if (!t->root) return 1;
+
+	if (direct_bits && ! (t->direct = new_direct (t, direct_bits) ) ) {
+		cl_free (t->root);
+		return 1;
+	}
+
+	return cl_mutex_init (&t->lock, 0);
+}
+
+static void free_nodes (struct cl_lpm_node*n)
+{
+	if (!n) return;
+	free_nodes (n->child[0]);
+	free_nodes (n->child[1]);
+	cl_free (n);
+}
+
+void cl_lpm_destroy (struct cl_lpm*t)
+{
+	free_nodes (t->root);
+	t->root = 0;
+	free_dead (t);
+	if (t->dead) cl_free (t->dead);
+	t->dead = 0;
+	t->dead_size = 0;
+	if (t->direct) cl_free (t->direct);
+	t->direct = 0;
+	cl_mutex_destroy (&t->lock);
+}
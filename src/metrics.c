@@ -0,0 +1,316 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "pool.h"
+#include "alloc.h"
+#include "mutex.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_HELP 256
+
+static cl_mutex lock; /* zeroes are an unlocked mutex */
+static struct cl_metric*metrics; /* sorted by name */
+
+/*
+ * registering
+ */
+
+static int valid_name (const char*n)
+{
+	int i;
+
+	for (i = 0;n[i];++i)
+		if (! ( (n[i] >= 'a' && n[i] <= 'z') || (n[i] >= 'A' && n[i] <= 'Z')
+		        || n[i] == '_' || n[i] == ':'
+		        || (i && n[i] >= '0' && n[i] <= '9') ) ) return 0;
+	return i && i <= CL_METRIC_NAME;
+}
+
+/* backslash and newline, and quotes in label values; out has 2*max+1 */
+static void escape (char*out, const char*s, int max, int quotes)
+{
+	for (;*s && max;++s, --max) {
+		if (*s == '\\' || *s == '\n' || (quotes && *s == '"') )
+			*out++ = '\\';
+		*out++ = *s == '\n' ? 'n' : *s;
+	}
+	*out = 0;
+}
+
+static int same_label (struct cl_metric*a, struct cl_metric*b)
+{
+	if (!a->label || !b->label) return a->label == b->label;
+	return !strcmp (a->label, b->label);
+}
+
+static struct cl_metric* new_metric (struct part*p, int type,
+                                     const char*name, const char*help,
+                                     const uint64_t*bounds, int nbounds,
+                                     uint64_t (*read) (void*), void*arg) {
+
+	struct cl_metric*m, **i;
+	int b;
+
+	if (!valid_name (name) ) return 0;
+	if (nbounds < 0 || nbounds > CL_METRIC_BUCKETS) return 0;
+	for (b = 1;b < nbounds;++b) if (bounds[b] <= bounds[b - 1]) return 0;
+	if (!help) help = "";
+
+	m = cl_calloc (1, sizeof (struct cl_metric) + strlen (name) + 1
+	               + 2 * MAX_HELP + 1 + 2 * CL_METRIC_LABEL + 1);
+	if (!m) return 0;
+	m->type = type;
+	m->name = (char*) (m + 1);
+	strcpy (m->name, name);
+	m->help = m->name + strlen (name) + 1;
+	escape (m->help, help, MAX_HELP, 0);
+	if (p && p->name) {
+		m->label = m->help + strlen (m->help) + 1;
+		escape (m->label, p->name, CL_METRIC_LABEL, 1);
+	}
+	m->nbounds = nbounds;
+	for (b = 0;b < nbounds;++b) m->bound[b] = bounds[b];
+	m->read = read;
+	m->arg = arg;
+
+	/* the copies, each on its own cache lines */
+	m->stride = type == CL_METRIC_HISTOGRAM ?
+	            (sizeof (struct cl_metric_slot) + CL_CACHELINE - 1)
+	            & ~ (CL_CACHELINE - 1) : CL_CACHELINE;
+	m->mem = cl_calloc (1, CL_METRIC_SLOTS * m->stride + CL_CACHELINE);
+	if (!m->mem) {
+		cl_free (m);
+		return 0;
+	}
+	m->slots = (char*) ( ( (uintptr_t) m->mem + CL_CACHELINE - 1)
+	                     & ~ (uintptr_t) (CL_CACHELINE - 1) );
+
+	cl_mutex_lock (&lock);
+	for (i = &metrics;*i && strcmp ( (*i)->name, name) <= 0;i = & (*i)->next) {
+		if (strcmp ( (*i)->name, name) ) continue;
+		if ( (*i)->type == type && !same_label (*i, m) ) continue;
+
+		/* the same one again, or another type of the same name */
+		cl_mutex_unlock (&lock);
+		cl_free (m->mem);
+		cl_free (m);
+		return 0;
+	}
+	for (i = &metrics;*i && cl_metric_cmp (*i, name, m->label) < 0;
+	        i = & (*i)->next);
+	m->next = *i;
+	*i = m;
+	cl_mutex_unlock (&lock);
+	return m;
+}
+
+struct cl_metric* cl_metric_counter (struct part*p, const char*name,
+                                     const char*help) {
+
+	return new_metric (p, CL_METRIC_COUNTER, name, help, 0, 0, 0, 0);
+}
+
+struct cl_metric* cl_metric_counter_fn (struct part*p, const char*name,
+                                        const char*help,
+                                        uint64_t (*read) (void*), void*arg) {
+
+	if (!read) return 0;
+	return new_metric (p, CL_METRIC_COUNTER, name, help, 0, 0, read, arg);
+}
+
+struct cl_metric* cl_metric_gauge (struct part*p, const char*name,
+                                   const char*help) {
+
+	return new_metric (p, CL_METRIC_GAUGE, name, help, 0, 0, 0, 0);
+}
+
+struct cl_metric* cl_metric_histogram (struct part*p, const char*name,
+                                       const char*help,
+                                       const uint64_t*bounds, int nbounds) {
+
+	return new_metric (p, CL_METRIC_HISTOGRAM, name, help, bounds, nbounds,
+	                   0, 0);
+}
+
+void cl_metric_free (struct cl_metric*m)
+{
+	struct cl_metric**i;
+
+	if (!m) return;
+	cl_mutex_lock (&lock);
+	for (i = &metrics;*i;i = & (*i)->next)
+		if (*i == m) {
+			*i = m->next;
+			break;
+		}
+	cl_mutex_unlock (&lock);
+	cl_free (m->mem);
+	cl_free (m);
+}
+
+/*
+ * reading
+ */
+
+void cl_metric_read (struct cl_metric*m, struct cl_metric_slot*v)
+{
+	struct cl_metric_slot*s;
+	int i, b;
+
+	memset (v, 0, sizeof (*v) );
+	v->value = cl_atomic_load (&m->set);
+	if (m->read) v->value += m->read (m->arg);
+	for (i = 0;i < CL_METRIC_SLOTS;++i) {
+		s = (struct cl_metric_slot*) (m->slots + i * m->stride);
+		if (m->type != CL_METRIC_HISTOGRAM) {
+			v->value += cl_atomic_load (&s->value);
+			continue;
+		}
+		v->sum += cl_atomic_load (&s->sum);
+		for (b = 0;b <= m->nbounds;++b) {
+			v->bucket[b] += cl_atomic_load (&s->bucket[b]);
+			v->value += cl_atomic_load (&s->bucket[b]);
+		}
+	}
+}
+
+int cl_metric_cmp (struct cl_metric*m, const char*name, const char*label)
+{
+	int r = strcmp (m->name, name);
+
+	if (r) return r;
+	if (!m->label || !label) return !!m->label - !!label;
+	return strcmp (m->label, label);
+}
+
+int cl_metric_walk (int (*cb) (struct cl_metric*, int, void*), void*arg)
+{
+	struct cl_metric*m, *prev = 0;
+	int r = 0;
+
+	cl_mutex_lock (&lock);
+	for (m = metrics;m && !r;prev = m, m = m->next)
+		r = cb (m, !prev || strcmp (prev->name, m->name), arg);
+	cl_mutex_unlock (&lock);
+	return r;
+}
+
+/*
+ * text
+ */
+
+static void put (char*buf, int size, int*len, const char*fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (*len < 0) return;
+	va_start (ap, fmt);
+	n = vsnprintf (buf + *len, size - *len, fmt, ap);
+	va_end (ap);
+	*len = n < 0 || n >= size - *len ? -1 : *len + n;
+}
+
+int cl_metric_format (struct cl_metric*m, int family, char*buf, int size)
+{
+	static const char*types[] = { "counter", "gauge", "histogram" };
+	const char*l = m->label ? m->label : "";
+	struct cl_metric_slot v;
+	uint64_t n = 0;
+	int len = 0, b;
+
+	cl_metric_read (m, &v);
+
+	if (family) {
+		if (*m->help) put (buf, size, &len, "# HELP %s %s\n", m->name,
+			                   m->help);
+		put (buf, size, &len, "# TYPE %s %s\n", m->name, types[m->type]);
+	}
+
+	switch (m->type) {
+	case CL_METRIC_COUNTER:
+		put (buf, size, &len, "%s%s%s%s %llu\n", m->name,
+		     m->label ? "{part=\"" : "", l, m->label ? "\"}" : "",
+		     (unsigned long long) v.value);
+		break;
+
+	case CL_METRIC_GAUGE:
+		put (buf, size, &len, "%s%s%s%s %lld\n", m->name,
+		     m->label ? "{part=\"" : "", l, m->label ? "\"}" : "",
+		     (long long) v.value);
+		break;
+
+	case CL_METRIC_HISTOGRAM:
+		/* buckets count everything up to the bound */
+		for (b = 0;b < m->nbounds;++b) {
+			n += v.bucket[b];
+			put (buf, size, &len, "%s_bucket{%s%s%sle=\"%llu\"} %llu\n",
+			     m->name, m->label ? "part=\"" : "", l,
+			     m->label ? "\"," : "", (unsigned long long) m->bound[b],
+			     (unsigned long long) n);
+		}
+		put (buf, size, &len, "%s_bucket{%s%s%sle=\"+Inf\"} %llu\n",
+		     m->name, m->label ? "part=\"" : "", l, m->label ? "\"," : "",
+		     (unsigned long long) v.value);
+		put (buf, size, &len, "%s_sum%s%s%s %llu\n", m->name,
+		     m->label ? "{part=\"" : "", l, m->label ? "\"}" : "",
+		     (unsigned long long) v.sum);
+		put (buf, size, &len, "%s_count%s%s%s %llu\n", m->name,
+		     m->label ? "{part=\"" : "", l, m->label ? "\"}" : "",
+		     (unsigned long long) v.value);
+		break;
+	}
+	return len;
+}
+
+struct dump {
+	FILE*f;
+	char*buf;
+};
+
+static int dump_metric (struct cl_metric*m, int family, void*arg)
+{
+	struct dump*d = arg;
+	int n = cl_metric_format (m, family, d->buf, CL_METRIC_TEXT);
+
+	if (n > 0) fwrite (d->buf, n, 1, d->f);
+	return 0;
+}
+
+int cl_metric_write (const char*path)
+{
+	struct dump d;
+	char*tmp;
+	int r = 1;
+
+	/* written aside and renamed, so a reader never sees half of it */
+	tmp = cl_malloc (strlen (path) + 5);
+	d.buf = cl_malloc (CL_METRIC_TEXT);
+	if (!tmp || !d.buf) goto out;
+	sprintf (tmp, "%s.tmp", path);
+	if (! (d.f = fopen (tmp, "w") ) ) goto out;
+
+	cl_metric_walk (dump_metric, &d);
+	r = ferror (d.f);
+	if (fclose (d.f) ) r = 1;
+	if (!r) r = rename (tmp, path) != 0;
+	if (r) unlink (tmp);
+out:
+	if (tmp) cl_free (tmp);
+	if (d.buf) cl_free (d.buf);
+	return r;
+}
@@ -14,106 +14,243 @@
 #include "mutex.h"
 
 /*
- * this wraps pthread mutexes. Feel free to supply anything better.
+ * futex-based locking. Fast paths live in mutex.h, here are only the parts
+ * that need to sleep, wake someone or measure time.
  */
 
 #include "alloc.h"
-#include <pthread.h>
-#include <semaphore.h>
 
-int cl_mutex_init (cl_mutex* mp)
+#include <time.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void futex_wait (int*addr, int val)
 {
-	*mp = cl_malloc (sizeof (pthread_mutex_t) );
-	if (! (*mp) ) return 1;
-	if (!pthread_mutex_init ( (pthread_mutex_t*) *mp, 0) ) return 0;
-	cl_free (*mp);
-	return 1;
+	syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, 0, 0, 0);
 }
 
-int cl_mutex_destroy (cl_mutex m)
+static void futex_wake (int*addr, int n)
 {
-	int r = pthread_mutex_destroy ( (pthread_mutex_t*) m);
-	cl_free (m);
-	return r;
+	syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, 0, 0, 0);
 }
 
-int cl_mutex_lock (cl_mutex m)
+#else
+#include <sched.h>
+
+/* no futexes here, just be polite and let others run. */
+static void futex_wait (int*addr, int val)
 {
-	return pthread_mutex_lock ( (pthread_mutex_t*) m);
+	sched_yield();
 }
 
-int cl_mutex_trylock (cl_mutex m)
+static void futex_wake (int*addr, int n) {}
+
+#endif
+
+/* how many times to retry before going to sleep */
+#define SPIN_COUNT 100
+
+static uint64_t now_ns()
 {
-	return pthread_mutex_trylock ( (pthread_mutex_t*) m);
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int cl_mutex_unlock (cl_mutex m)
+/*
+ * lock statistics registry
+ */
+
+static int stats_enabled = 0;
+static struct cl_mutex_stats* stats_list = 0;
+static cl_mutex stats_mutex; /* zeroed = unlocked, and never profiled */
+
+void cl_mutex_stats_enable (int e)
 {
-	return pthread_mutex_unlock ( (pthread_mutex_t*) m);
+	stats_enabled = e;
 }
 
+int cl_mutex_stats_walk (int (*cb) (struct cl_mutex_stats*, void*), void*priv)
+{
+	struct cl_mutex_stats*s;
+	int r = 0;
 
-int cl_cond_init (cl_cond* cp)
+	cl_mutex_lock (&stats_mutex);
+	for (s = stats_list;s;s = s->next)
+		if ( (r = cb (s, priv) ) ) break;
+	cl_mutex_unlock (&stats_mutex);
+
+	return r;
+}
+
+/*
+ * mutexes
+ */
+
+int cl_mutex_init (cl_mutex* m, const char*name)
 {
-	*cp = cl_malloc (sizeof (pthread_cond_t) );
-	if (! (*cp) ) return 1;
-	if (!pthread_cond_init ( (pthread_cond_t*) *cp, 0) ) return 0;
-	cl_free (*cp);
+	m->state = 0;
+	m->stats = 0;
+	m->locked_at = 0;
+
+	if (!name || !stats_enabled) return 0;
+
+	m->stats = cl_calloc (1, sizeof (struct cl_mutex_stats) );
+	if (!m->stats) return 1;
+	m->stats->name = name;
+
+	cl_mutex_lock (&stats_mutex);
+	m->stats->next = stats_list;
+	stats_list = m->stats;
+	cl_mutex_unlock (&stats_mutex);
+
 	return 0;
 }
 
-int cl_cond_destroy (cl_cond c)
+int cl_mutex_destroy (cl_mutex* m)
 {
-	int r = pthread_cond_destroy ( (pthread_cond_t*) c);
-	cl_free (c);
-	return r;
+	struct cl_mutex_stats**s;
+
+	if (m->state) return 1; /* still locked */
+	if (!m->stats) return 0;
+
+	cl_mutex_lock (&stats_mutex);
+	for (s = &stats_list;*s;s = & ( (*s)->next) )
+		if (*s == m->stats) {
+			*s = m->stats->next;
+			break;
+		}
+	cl_mutex_unlock (&stats_mutex);
+
+	cl_free (m->stats);
+	m->stats = 0;
+	return 0;
+}
+
+int cl_mutex_lock_slow (cl_mutex* m)
+{
+	int i, s, waited = 0;
+	uint64_t start = 0, t;
+
+	if (m->stats) start = now_ns();
+
+	/* the lock is usually held only for a few instructions, so spin */
+	for (i = 0;i < SPIN_COUNT;++i) {
+		s = 0;
+		if (cl_atomic_cas (&m->state, &s, 1) ) goto locked;
+		waited = 1;
+		if (s == 2) break; /* others are already sleeping */
+		cl_cpu_relax();
+	}
+
+	/* mark it contended and sleep until the holder wakes us */
+	waited = 1;
+	while (cl_atomic_xchg (&m->state, 2) )
+		futex_wait (&m->state, 2);
+
+locked:
+	if (m->stats) {
+		t = now_ns();
+		++m->stats->acquired;
+		if (waited) {
+			++m->stats->contended;
+			m->stats->wait_ns += t - start;
+		}
+		m->locked_at = t;
+	}
+	return 0;
 }
 
-int cl_cond_wait (cl_cond c, cl_mutex m)
+void cl_mutex_locked (cl_mutex* m)
 {
-	return pthread_cond_wait ( (pthread_cond_t*) c, (pthread_mutex_t*) m);
+	++m->stats->acquired;
+	m->locked_at = now_ns();
 }
 
-int cl_cond_signal (cl_cond c)
+void cl_mutex_wake (cl_mutex* m)
 {
-	return pthread_cond_signal ( (pthread_cond_t*) c);
+	futex_wake (&m->state, 1);
 }
 
-int cl_cond_broadcast (cl_cond c)
+int cl_mutex_unlock_slow (cl_mutex* m)
 {
-	return pthread_cond_broadcast ( (pthread_cond_t*) c);
+	uint64_t t;
+
+	if (m->stats && m->locked_at) {
+		t = now_ns() - m->locked_at;
+		if (t > m->stats->max_hold_ns) m->stats->max_hold_ns = t;
+	}
+
+	if (cl_atomic_xchg (&m->state, 0) == 2)
+		cl_mutex_wake (m);
+	return 0;
 }
 
-int cl_sem_init (cl_sem* sp, unsigned int value)
+/*
+ * condition variables are just sequence counters that waiters sleep on.
+ * Signalling only goes to the kernel if there's someone to wake up.
+ */
+
+int cl_cond_init (cl_cond* c)
 {
-	*sp = cl_malloc (sizeof (sem_t) );
-	if (! (*sp) ) return 1;
-	if (!sem_init ( (sem_t*) sp, 0, value) ) return 0;
-	cl_free (*sp);
+	c->seq = 0;
+	c->waiters = 0;
 	return 0;
 }
 
-int cl_sem_destroy (cl_sem s)
+int cl_cond_destroy (cl_cond* c)
 {
-	int r = sem_destroy ( (sem_t*) s);
-	cl_free (s);
-	return r;
+	return c->waiters ? 1 : 0;
 }
 
-int cl_sem_post (cl_sem s)
+int cl_cond_wait (cl_cond* c, cl_mutex* m)
 {
-	return sem_post ( (sem_t*) s);
+	int seq;
+
+	cl_atomic_inc (&c->waiters);
+	cl_fence();
+	seq = cl_atomic_load (&c->seq);
+
+	cl_mutex_unlock (m);
+	futex_wait (&c->seq, seq);
+	cl_atomic_dec (&c->waiters);
+
+	return cl_mutex_lock (m);
 }
 
-int cl_sem_get (cl_sem s)
+int cl_cond_signal (cl_cond* c)
 {
-	return sem_trywait ( (sem_t*) s);
+	cl_atomic_inc (&c->seq);
+	cl_fence();
+	if (cl_atomic_load (&c->waiters) )
+		futex_wake (&c->seq, 1);
+	return 0;
+}
+
+int cl_cond_broadcast (cl_cond* c)
+{
+	cl_atomic_inc (&c->seq);
+	cl_fence();
+	if (cl_atomic_load (&c->waiters) )
+		futex_wake (&c->seq, INT_MAX);
+	return 0;
 }
 
-int cl_sem_value (cl_sem s)
+/*
+ * semaphores (see mutex.h for the rest)
+ */
+
+int cl_sem_init (cl_sem* s, unsigned int value)
 {
-	int v;
-	if (! (sem_getvalue ( (sem_t*) s, &v) ) ) return v;
-	else return -1;
+	s->value = value;
+	return 0;
 }
 
+int cl_sem_destroy (cl_sem* s)
+{
+	return 0;
+}
@@ -12,25 +12,176 @@
 
 #include "packet.h"
 #include "alloc.h"
+#include "atomic.h"
+#include "trace.h"
+
+#include <pthread.h>
+
+/*
+ * pooled packets have their data right behind the structure. Every thread
+ * keeps a few of them of each size; they're chained through the first word
+ * of the data.
+ */
+
+#define PACKET_HDR ( (sizeof (struct packet) + 15) & ~15)
+#define inline_data(p) ( (char*) (p) + PACKET_HDR)
+
+static const uint32_t pool_size[] = { 2048, PACKET_MAX_LEN + 1 };
+static const unsigned pool_max[] = { 1024, 64 }; /* per thread */
+
+#define NPOOLS (sizeof (pool_size) / sizeof (pool_size[0]) )
+
+struct packet_pool {
+	struct packet*list[NPOOLS];
+	unsigned count[NPOOLS];
+	int registered;
+};
+
+static __thread struct packet_pool pool;
+
+/* counted only where the pools miss or overflow, the fast path stays clean */
+static uint64_t pool_mallocs[NPOOLS], pool_frees[NPOOLS];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+
+#define pool_next(p) (* (struct packet**) inline_data (p) )
+
+static void flush_pool (void*v)
+{
+	struct packet_pool*pp = v;
+	struct packet*p;
+	int c;
+
+	for (c = 0;c < NPOOLS;++c) {
+		while ( (p = pp->list[c]) ) {
+			pp->list[c] = pool_next (p);
+			cl_free (p);
+			cl_atomic_add_relaxed (&pool_frees[c], 1);
+		}
+		pp->count[c] = 0;
+	}
+}
+
+static void make_key()
+{
+	pthread_key_create (&pool_key, flush_pool);
+}
 
 struct packet* cloudvpn_packet_alloc() {
-	return cl_calloc (1, sizeof (struct packet) ); /* note the zeroes! */
+
+	struct packet*p = cl_calloc (1, sizeof (struct packet) ); /* zeroes! */
+
+	if (p && cl_atomic_load (&cl_trace_every) ) cl_trace_sample (p);
+	return p;
+}
+
+struct packet* cloudvpn_packet_alloc_buf (size_t size) {
+
+	struct packet*p;
+	struct cl_mem_account*o;
+	int c;
+
+	for (c = 0;c < NPOOLS;++c) if (size <= pool_size[c]) break;
+	if (c == NPOOLS) return 0;
+
+	if ( (p = pool.list[c]) ) {
+		pool.list[c] = pool_next (p);
+		--pool.count[c];
+	} else {
+		if (!pool.registered) {
+			pthread_once (&key_once, make_key);
+			pthread_setspecific (pool_key, &pool);
+			pool.registered = 1;
+		}
+
+		o = cl_alloc_set_owner (0);
+		p = cl_malloc (PACKET_HDR + pool_size[c]);
+		cl_alloc_set_owner (o);
+		if (!p) return 0;
+		cl_atomic_add_relaxed (&pool_mallocs[c], 1);
+	}
+
+	memset (p, 0, sizeof (struct packet) );
+	p->data = inline_data (p);
+	p->len = size;
+	p->cap = pool_size[c];
+	p->pool = c + 1;
+	if (cl_atomic_load (&cl_trace_every) ) cl_trace_sample (p);
+	return p;
 }
 
 void cloudvpn_packet_free (struct packet* p)
 {
-	if (p->data) cl_free (p->data);
-	cl_free (p);
+	int c;
+
+	if (p->trace) cl_trace_free (p->trace);
+
+	if (!p->pool) {
+		if (p->data) cl_free (p->data);
+		cl_free (p);
+		return;
+	}
+
+	/* data could have been grown out of the pooled buffer */
+	if (p->data != inline_data (p) ) cl_free (p->data);
+
+	c = p->pool - 1;
+	if (pool.count[c] >= pool_max[c]) {
+		cl_free (p);
+		cl_atomic_add_relaxed (&pool_frees[c], 1);
+		return;
+	}
+
+	pool_next (p) = pool.list[c];
+	pool.list[c] = p;
+	++pool.count[c];
+}
+
+int cloudvpn_packet_pool_stats (int c, uint32_t*size,
+                                uint64_t*mallocs, uint64_t*frees)
+{
+	if (c < 0 || c >= (int) NPOOLS) return 1;
+	*size = pool_size[c];
+	*mallocs = cl_atomic_load (&pool_mallocs[c]);
+	*frees = cl_atomic_load (&pool_frees[c]);
+	return 0;
 }
 
 int cloudvpn_alloc_data (struct packet* p)
 {
-	char*t = cl_realloc (p->data, p->len);
+	char*t;
+
+	if (p->data && p->len <= p->cap) return 0;
+
+	if (p->pool && p->data == inline_data (p) ) {
+		t = cl_malloc (p->len);
+		if (t) cl_memcpy (t, p->data, p->cap);
+	} else t = cl_realloc (p->data, p->len);
 
 	if (t) {
 		p->data = t;
+		p->cap = p->len;
 		return 0;
 	} else
 		return 1;
 }
 
+uint32_t cloudvpn_packet_flow_hash (struct packet*p)
+{
+	const uint8_t*d = (const uint8_t*) p->data;
+	uint32_t h = 2166136261U;
+	unsigned i, len = p->doff <= p->len ? p->doff : p->len;
+
+	if (p->hash) return p->hash;
+
+	for (i = 0;i < len;++i) h = (h ^ d[i]) * 16777619U;
+	/* low bits of fnv are poor, users take them modulo something */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	p->hash = h ? h : 1;
+	return p->hash;
+}
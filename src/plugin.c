@@ -32,7 +32,7 @@ static int plugin_add (struct plugin*p, void*dl_handle)
 	struct plugin_list* pl = cl_malloc (sizeof (struct plugin_list) );
 	if (!pl) return 1;
 
-	cl_mutex_lock (plugins_mutex);
+	cl_mutex_lock (&plugins_mutex);
 
 	pl->p = p;
 	pl->next = plugins;
@@ -40,7 +40,7 @@ static int plugin_add (struct plugin*p, void*dl_handle)
 
 	plugins = pl;
 
-	cl_mutex_unlock (plugins_mutex);
+	cl_mutex_unlock (&plugins_mutex);
 
 	return 0;
 }
@@ -54,10 +54,10 @@ static int plugin_safe_remove (struct plugin*p)
 	struct plugin_list**pl;
 	struct plugin_list* t;
 
-	if (cl_sem_value (p->refcount) )
+	if (cl_sem_value (&p->refcount) )
 		return 1;
 
-	cl_mutex_lock (plugins_mutex);
+	cl_mutex_lock (&plugins_mutex);
 
 	pl = &plugins;
 
@@ -66,13 +66,13 @@ static int plugin_safe_remove (struct plugin*p)
 			t = *pl;
 			*pl = (*pl)->next;
 			cl_free (t);
-			cl_mutex_unlock (plugins_mutex);
+			cl_mutex_unlock (&plugins_mutex);
 			return 0;
 		} else
 			pl = & ( (*pl)->next);
 	}
 
-	cl_mutex_unlock (plugins_mutex);
+	cl_mutex_unlock (&plugins_mutex);
 	return 1;
 }
 
@@ -81,9 +81,9 @@ static struct plugin_list* find_pl_by_plugin (struct plugin*p) {
 
 	struct plugin_list*pl;
 
-	cl_mutex_lock (plugins_mutex);
+	cl_mutex_lock (&plugins_mutex);
 	for (pl = plugins;pl;pl = pl->next) if (pl->p == p) break;
-	cl_mutex_unlock (plugins_mutex);
+	cl_mutex_unlock (&plugins_mutex);
 	return pl;
 }
 
@@ -92,7 +92,7 @@ static struct plugin_list* find_pl_by_name (const char* name) {
 	int i;
 	struct plugin_list*pl;
 
-	cl_mutex_lock (plugins_mutex);
+	cl_mutex_lock (&plugins_mutex);
 	for (pl = plugins;pl;pl = pl->next) {
 
 		if (!pl->p->name) continue;
@@ -100,11 +100,11 @@ static struct plugin_list* find_pl_by_name (const char* name) {
 		        (name[i] == pl->p->name[i]);
 		        ++i);
 		if ( (name[i] == 0) && (pl->p->name[i] == 0) ) {
-			cl_mutex_unlock (plugins_mutex);
+			cl_mutex_unlock (&plugins_mutex);
 			return pl;
 		}
 	}
-	cl_mutex_unlock (plugins_mutex);
+	cl_mutex_unlock (&plugins_mutex);
 	return 0;
 }
 
@@ -142,14 +142,14 @@ struct plugin* cloudvpn_open_plugin (const char*filename) {
 
 	p = plugin_get_func();
 
-	if (cl_sem_init (p->refcount, 0) ) goto error_getfunc;
+	if (cl_sem_init (&p->refcount, 0) ) goto error_getfunc;
 
 	if (plugin_add (p, dl) ) goto error_plugadd;
 
 	return p;
 
 error_plugadd:
-	cl_sem_destroy (p->refcount);
+	cl_sem_destroy (&p->refcount);
 
 error_getfunc:
 	dlclose (dl);
@@ -184,10 +184,10 @@ int cloudvpn_close_plugin (struct plugin*p)
 
 int cloudvpn_init_plugins()
 {
-	return cl_mutex_init (&plugins_mutex);
+	return cl_mutex_init (&plugins_mutex, "plugins_mutex");
 }
 
 void cloudvpn_finish_plugins()
 {
-	cl_mutex_destroy (plugins_mutex);
+	cl_mutex_destroy (&plugins_mutex);
 }
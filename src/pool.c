@@ -26,6 +26,7 @@ struct part_list {
 
 static struct part_list* parts;
 static cl_mutex parts_mutex;
+static struct part* (*part_maker) (const char*) = 0;
 
 static int part_add (struct part*p)
 {
@@ -36,12 +37,12 @@ static int part_add (struct part*p)
 	struct part_list* pl = cl_malloc (sizeof (struct part_list) );
 	if (!pl) return 1;
 
-	cl_mutex_lock (parts_mutex);
+	cl_mutex_lock (&parts_mutex);
 	pl->p = p;
 	pl->next = parts;
 
 	parts = pl;
-	cl_mutex_unlock (parts_mutex);
+	cl_mutex_unlock (&parts_mutex);
 
 	return 0;
 }
@@ -55,7 +56,7 @@ static int part_remove (struct part*p)
 	struct part_list**pl;
 	struct part_list* t;
 
-	cl_mutex_lock (parts_mutex);
+	cl_mutex_lock (&parts_mutex);
 
 	pl = &parts;
 
@@ -64,13 +65,13 @@ static int part_remove (struct part*p)
 			t = *pl;
 			*pl = (*pl)->next;
 			cl_free (t);
-			cl_mutex_unlock (parts_mutex);
+			cl_mutex_unlock (&parts_mutex);
 			return 0;
 		} else
 			pl = & ( (*pl)->next);
 	}
 
-	cl_mutex_unlock (parts_mutex);
+	cl_mutex_unlock (&parts_mutex);
 	return 1;
 }
 
@@ -81,7 +82,7 @@ struct part* cloudvpn_find_part_by_name (const char*name) {
 
 	int i;
 	struct part_list*pl;
-	cl_mutex_lock (parts_mutex);
+	cl_mutex_lock (&parts_mutex);
 	for (pl = parts;pl;pl = pl->next) {
 
 		if (!pl->p->name) continue;
@@ -89,12 +90,19 @@ struct part* cloudvpn_find_part_by_name (const char*name) {
 		        (name[i] == pl->p->name[i]);
 		        ++i);
 		if ( (name[i] == 0) && (pl->p->name[i] == 0) ) {
-			cl_mutex_unlock (parts_mutex);
+			cl_mutex_unlock (&parts_mutex);
 			return pl->p;
 		}
 	}
-	cl_mutex_unlock (parts_mutex);
-	return 0;
+	cl_mutex_unlock (&parts_mutex);
+
+	/* maybe it's just not there yet */
+	return part_maker ? part_maker (name) : 0;
+}
+
+void cloudvpn_set_part_maker (struct part* (*maker) (const char*) )
+{
+	part_maker = maker;
 }
 
 /*
@@ -116,15 +124,13 @@ struct part* cloudvpn_part_init (struct plugin* plug, const char*name) {
 	struct part*p = cl_malloc (sizeof (struct part) );
 	if (!p) return 0;
 
-	cl_sem_post (plug->refcount);
-
-	if (part_add (p) ) goto dealloc_error;
+	cl_sem_post (&plug->refcount);
 
 	p->p = plug;
 	p->data = 0;
 
-	if (cl_sem_init (p->refcount, 1) ) /* got one ref from this right? */
-		goto remove_error;
+	if (cl_sem_init (&p->refcount, 1) ) /* got one ref from this right? */
+		goto dealloc_error;
 
 	if (name) { /* copy the name */
 		for (i = 0;name[i];++i);
@@ -134,21 +140,33 @@ struct part* cloudvpn_part_init (struct plugin* plug, const char*name) {
 		for (i = i - 1;i >= 0;--i) p->name[i] = name[i];
 	} else p->name = 0;
 
+	p->mem = cl_mem_account_new (p->name);
+	if (!p->mem) goto name_error;
+
+	/* part is complete now, others may find it */
+	if (part_add (p) ) goto mem_error;
+
 	/* call the constructor */
-	if (p->p->init) p->p->init (p);
+	if (p->p->init) {
+		struct cl_mem_account*o = cl_alloc_set_owner (p->mem);
+		p->p->init (p);
+		cl_alloc_set_owner (o);
+	}
 
 	return p;
 
-sem_error:
-	cl_sem_destroy (p->refcount);
+mem_error:
+	cl_mem_account_release (p->mem);
 
-remove_error:
+name_error:
+	if (p->name) cl_free (p->name);
 
-	part_remove (p);
+sem_error:
+	cl_sem_destroy (&p->refcount);
 
 dealloc_error:
 
-	cl_sem_get (plug->refcount);
+	cl_sem_get (&plug->refcount);
 	cl_free (p);
 
 	return 0;
@@ -157,7 +175,7 @@ dealloc_error:
 struct part* cloudvpn_part_acquire (struct part*p) {
 
 	/* only increase refcount */
-	cl_sem_post (p->refcount);
+	cl_sem_post (&p->refcount);
 
 	return 0;
 }
@@ -169,31 +187,60 @@ static void cloudvpn_part_destroy (struct part*p)
 	/* call the destructor */
 	if (p->p->fini) p->p->fini (p);
 
-	cl_sem_get (p->p->refcount);
+	cl_sem_get (&p->p->refcount);
 
-	cl_sem_destroy (p->refcount);
+	cl_sem_destroy (&p->refcount);
+	cl_mem_account_release (p->mem);
+	if (p->name) cl_free (p->name);
 	cl_free (p);
 }
 
 void cloudvpn_part_close (struct part*p)
 {
-	/* decrease refcount and probably delete the part */
-	cl_sem_get (p->refcount);
-
-	if (cl_sem_value (p->refcount) )
+	/* decrease refcount; whoever takes the last one deletes the part */
+	if (!cl_sem_drop (&p->refcount) )
 		cloudvpn_part_destroy (p);
 }
 
+void cloudvpn_part_process (struct part*p, struct work*w)
+{
+	struct cl_mem_account*o;
+
+	if (!p->p->process_work) return;
+
+	o = cl_alloc_set_owner (p->mem);
+	p->p->process_work (p, w);
+	cl_alloc_set_owner (o);
+}
+
+void cloudvpn_part_mem_limit (struct part*p, size_t bytes)
+{
+	p->mem->limit = bytes;
+}
+
+int cloudvpn_walk_parts (int (*cb) (struct part*, void*), void*priv)
+{
+	struct part_list*pl;
+	int r = 0;
+
+	cl_mutex_lock (&parts_mutex);
+	for (pl = parts;pl;pl = pl->next)
+		if ( (r = cb (pl->p, priv) ) ) break;
+	cl_mutex_unlock (&parts_mutex);
+
+	return r;
+}
+
 /*
  * init/deinit
  */
 
 int cloudvpn_init_pool()
 {
-	return cl_mutex_init (&parts_mutex);
+	return cl_mutex_init (&parts_mutex, "parts_mutex");
 }
 
 void cloudvpn_finish_pool()
 {
-	cl_mutex_destroy (parts_mutex);
+	cl_mutex_destroy (&parts_mutex);
 }
@@ -14,6 +14,9 @@
 #include "event.h"
 #include "alloc.h"
 #include "mutex.h"
+#include "atomic.h"
+#include "packet.h"
+#include "trace.h"
 
 /*
  * simple list that contains tasks that need to be done.
@@ -33,6 +36,17 @@ static cl_cond queue_just_filled;
 /* static work for event waiting that gets never deleted */
 static struct work event_poll_work;
 
+/* written under queue_mutex, read without it */
+static struct cloudvpn_sched_stats stats;
+
+/* workers get numbered as they come */
+static int workers;
+static __thread int worker_id = -1;
+
+/* sampled packets get stamped on the way, see trace.h */
+#define traced(w) ( ( (w)->type == work_packet || \
+                      (w)->type == work_command) && (w)->p->trace)
+
 struct work* cloudvpn_new_work() {
 	return cl_malloc (sizeof (struct work) );
 }
@@ -46,8 +60,9 @@ int cloudvpn_schedule_work (struct work*w)
 	nw = cl_malloc (sizeof (struct work_queue) );
 	if (!nw) return 1;
 	nw->w = w;
+	if (traced (w) ) cl_trace_enqueue (w->p->trace, w->p->next_part);
 
-	cl_mutex_lock (queue_mutex);
+	cl_mutex_lock (&queue_mutex);
 
 	q = &queue;
 
@@ -56,8 +71,10 @@ int cloudvpn_schedule_work (struct work*w)
 
 	nw->next = *q;
 	*q = nw;
+	++stats.queued;
+	++stats.scheduled;
 
-	cl_mutex_unlock (queue_mutex);
+	cl_mutex_unlock (&queue_mutex);
 
 	/*
 	 * Now wake up some thread that processes the event. Note that waking
@@ -66,9 +83,74 @@ int cloudvpn_schedule_work (struct work*w)
 	 * called for every scheduled work, waking as many threads as needed.
 	 */
 
-	cl_cond_signal (queue_just_filled);
+	cl_cond_signal (&queue_just_filled);
+
+	return 0;
+}
+
+int cloudvpn_schedule_works (struct work**w, int n)
+/* inserts a bunch of works at once, taking the lock only once */
+{
+	struct work_queue** q;
+	struct work_queue* nw, *batch = 0, *last = 0, *t;
+	int i;
+
+	/*
+	 * build a list of queue entries sorted by priority. Batches come mostly
+	 * with the same priority from one transport, so the insertion is
+	 * usually just an append. Sort is stable, works with the same priority
+	 * keep their order.
+	 */
+
+	for (i = 0;i < n;++i) {
+		nw = cl_malloc (sizeof (struct work_queue) );
+		if (!nw) goto nomem;
+		nw->w = w[i];
+
+		if (last && last->w->priority <= w[i]->priority) q = &last->next;
+		else q = &batch;
+		while ( (*q) && ( (*q)->w->priority <= w[i]->priority) )
+			q = & ( (*q)->next);
+		nw->next = *q;
+		*q = nw;
+		last = nw;
+	}
+	for (i = 0;i < n;++i)
+		if (traced (w[i]) )
+			cl_trace_enqueue (w[i]->p->trace, w[i]->p->next_part);
+
+	/* merge it into the queue in one pass */
+	cl_mutex_lock (&queue_mutex);
+
+	q = &queue;
+	while (batch) {
+		nw = batch;
+		batch = batch->next;
+
+		while ( (*q) && ( (*q)->w->priority <= nw->w->priority) )
+			q = & ( (*q)->next);
+
+		nw->next = *q;
+		*q = nw;
+		q = &nw->next;
+	}
+	stats.queued += n;
+	stats.scheduled += n;
+
+	cl_mutex_unlock (&queue_mutex);
+
+	if (n == 1) cl_cond_signal (&queue_just_filled);
+	else if (n) cl_cond_broadcast (&queue_just_filled);
 
 	return 0;
+
+nomem:
+	while (batch) {
+		t = batch;
+		batch = batch->next;
+		cl_free (t);
+	}
+	return 1;
 }
 
 int cloudvpn_scheduler_init()
@@ -79,7 +161,7 @@ int cloudvpn_scheduler_init()
 	event_poll_work.priority = LOWEST_PRIORITY;
 	event_poll_work.is_static = 1;
 
-	return cl_mutex_init (&queue_mutex) ||
+	return cl_mutex_init (&queue_mutex, "queue_mutex") ||
 	       cl_cond_init (&queue_just_filled);
 }
 
@@ -94,8 +176,8 @@ int cloudvpn_scheduler_destroy()
 		cl_free (p);
 	}
 
-	return cl_mutex_destroy (queue_mutex) ||
-	       cl_cond_destroy (queue_just_filled);
+	return cl_mutex_destroy (&queue_mutex) ||
+	       cl_cond_destroy (&queue_just_filled);
 }
 
 void cloudvpn_schedule_event_poll()
@@ -106,14 +188,30 @@ void cloudvpn_schedule_event_poll()
 	cloudvpn_schedule_work (&event_poll_work);
 }
 
+static void traced_process (struct work*w)
+{
+	/* the packet may be gone when the part returns */
+	struct cl_trace*t = w->p->trace;
+	int hop = cl_trace_begin (t);
+
+	cloudvpn_part_process (w->p->next_part, w);
+	cl_trace_end (t, hop);
+}
+
 static void do_work (struct work* w)
 {
 	/* TODO fill this with functionality */
 	switch (w->type) {
 	case work_packet:
+	case work_command:
+		/* the part takes the packet over; if there's none, drop it */
+		if (!w->p->next_part) cloudvpn_packet_free (w->p);
+		else if (w->p->trace) traced_process (w);
+		else cloudvpn_part_process (w->p->next_part, w);
 		break;
 
 	case work_event:
+		if (w->e.owner) cloudvpn_part_process (w->e.owner, w);
 		break;
 
 	case work_part_cleanup:
@@ -122,9 +220,6 @@ static void do_work (struct work* w)
 	case work_plugin_cleanup:
 		break;
 
-	case work_command:
-		break;
-
 	case work_poll:
 		cloudvpn_wait_for_event();
 		cloudvpn_schedule_event_poll();
@@ -132,29 +227,51 @@ static void do_work (struct work* w)
 	}
 }
 
+int cloudvpn_worker_id()
+{
+	return worker_id;
+}
+
+int cloudvpn_worker_count()
+{
+	return cl_atomic_load (&workers);
+}
+
+void cloudvpn_scheduler_stats (struct cloudvpn_sched_stats*s)
+{
+	s->queued = cl_atomic_load (&stats.queued);
+	s->scheduled = cl_atomic_load (&stats.scheduled);
+	s->done = cl_atomic_load (&stats.done);
+}
+
 int cloudvpn_scheduler_run (int* keep_running)
 {
 	struct work_queue*p;
 	struct work*w;
 
+	if (worker_id < 0) worker_id = cl_atomic_inc (&workers) - 1;
+
 	while (*keep_running) {
 
-		cl_mutex_lock (queue_mutex);
+		cl_mutex_lock (&queue_mutex);
 
 		if (!queue) {
 			/* just wait for the signal and retry */
-			cl_cond_wait (queue_just_filled, queue_mutex);
-			cl_mutex_unlock (queue_mutex);
+			cl_cond_wait (&queue_just_filled, &queue_mutex);
+			cl_mutex_unlock (&queue_mutex);
 
 		} else {
 
 			p = queue;
 			queue = queue->next;
+			--stats.queued;
+			++stats.done;
 
-			cl_mutex_unlock (queue_mutex);
+			cl_mutex_unlock (&queue_mutex);
 
 			w = p->w;
 			cl_free (p);
+			if (traced (w) ) cl_trace_dequeue (w->p->trace);
 
 			do_work (w);
 
@@ -0,0 +1,349 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "packet.h"
+#include "pool.h"
+#include "sched.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "mutex.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint32_t cl_trace_every = 0;
+
+static __thread uint32_t countdown;
+static uint64_t next_id, sampled, finished, dropped;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cl_trace_set_every (uint32_t n)
+{
+	cl_atomic_store (&cl_trace_every, n);
+}
+
+/*
+ * the packet's way, stamped by whoever has it at the moment. Scheduler
+ * hands it from one to another, so nothing here needs to be atomic but
+ * the refcount.
+ */
+
+void cl_trace_sample (struct packet*p)
+{
+	uint32_t every = cl_atomic_load (&cl_trace_every);
+	struct cl_mem_account*o;
+	struct cl_trace*t;
+
+	if (!every || ++countdown < every) return;
+	countdown = 0;
+
+	/* same as the pooled packets, it's the core's memory */
+	o = cl_alloc_set_owner (0);
+	t = cl_malloc (sizeof (struct cl_trace) );
+	cl_alloc_set_owner (o);
+	if (!t) {
+		cl_atomic_add_relaxed (&dropped, 1);
+		return;
+	}
+
+	t->id = cl_atomic_inc (&next_id);
+	t->born_ns = now_ns();
+	t->freed_ns = 0;
+	t->refs = 1;
+	t->hops = t->full = 0;
+	p->trace = t;
+	cl_atomic_add_relaxed (&sampled, 1);
+}
+
+void cl_trace_enqueue (struct cl_trace*t, struct part*p)
+{
+	struct cl_trace_hop*h;
+	size_t n;
+
+	if (t->hops == CL_TRACE_HOPS) {
+		/* the rest of the way isn't known, it's not counted */
+		t->full = 1;
+		return;
+	}
+
+	h = t->hop + t->hops;
+	n = p && p->name ? strnlen (p->name, CL_TRACE_NAME) : 0;
+	if (n) memcpy (h->part, p->name, n);
+	if (n < CL_TRACE_NAME) h->part[n] = 0;
+	h->worker = -1;
+	h->enqueue_ns = now_ns();
+	h->dequeue_ns = h->start_ns = h->end_ns = 0;
+	++t->hops;
+}
+
+void cl_trace_dequeue (struct cl_trace*t)
+{
+	if (!t->full && t->hops) t->hop[t->hops - 1].dequeue_ns = now_ns();
+}
+
+int cl_trace_begin (struct cl_trace*t)
+{
+	/* the part may free the packet, the trace has to stay for the end */
+	cl_atomic_inc (&t->refs);
+	if (t->full || !t->hops) return -1;
+
+	t->hop[t->hops - 1].worker = cloudvpn_worker_id();
+	t->hop[t->hops - 1].start_ns = now_ns();
+	return t->hops - 1;
+}
+
+static void finish (struct cl_trace*);
+
+static void release (struct cl_trace*t)
+{
+	if (!cl_atomic_dec (&t->refs) ) finish (t);
+}
+
+void cl_trace_end (struct cl_trace*t, int hop)
+{
+	if (hop >= 0) t->hop[hop].end_ns = now_ns();
+	release (t);
+}
+
+void cl_trace_free (struct cl_trace*t)
+{
+	t->freed_ns = now_ns();
+	release (t);
+}
+
+/*
+ * finished traces, all of this is under the lock
+ */
+
+#define BUCKETS 256 /* 4 per power of two */
+
+struct hist {
+	uint64_t b[BUCKETS];
+	uint64_t max, sum;
+};
+
+struct agg {
+	char part[CL_TRACE_NAME + 1];
+	uint64_t count;
+	struct hist queue, dispatch, process;
+	struct agg*next;
+};
+
+static cl_mutex lock; /* zeroes are an unlocked mutex */
+static struct agg total = { "*" }, *aggs = 0;
+static struct cl_trace*kept[CL_TRACE_KEEP];
+static int kept_next;
+
+static int bucket (uint64_t v)
+{
+	int k;
+
+	if (v < 4) return v;
+	k = 63 - __builtin_clzll (v);
+	return 4 * (k - 1) + ( (v >> (k - 2) ) & 3);
+}
+
+static uint64_t bucket_top (int b)
+{
+	int k = b / 4 + 1;
+
+	if (b < 4) return b;
+	return ( (uint64_t) (4 + b % 4 + 1) << (k - 2) ) - 1;
+}
+
+static void hist_add (struct hist*h, uint64_t from, uint64_t to)
+{
+	uint64_t v = to > from ? to - from : 0;
+
+	++h->b[bucket (v)];
+	h->sum += v;
+	if (v > h->max) h->max = v;
+}
+
+static void hist_get (struct hist*h, uint64_t count, struct cl_trace_lat*l)
+{
+	uint64_t n = 0, p50 = (count + 1) / 2, p99 = (count * 99 + 99) / 100;
+	int b;
+
+	l->p50 = l->p99 = 0;
+	for (b = 0;b < BUCKETS && n < p99;++b) {
+		n += h->b[b];
+		if (!l->p50 && n >= p50) l->p50 = bucket_top (b);
+		if (n >= p99) l->p99 = bucket_top (b);
+	}
+	l->max = h->max;
+	l->sum = h->sum;
+}
+
+static struct agg* find_agg (const char*part) {
+
+	struct agg*a;
+
+	for (a = aggs;a;a = a->next)
+		if (!strncmp (a->part, part, CL_TRACE_NAME) ) return a;
+
+	if (! (a = cl_calloc (1, sizeof (struct agg) ) ) ) return 0;
+	memcpy (a->part, part, CL_TRACE_NAME);
+	a->next = aggs;
+	aggs = a;
+	return a;
+}
+
+static void finish (struct cl_trace*t)
+{
+	struct cl_trace_hop*h;
+	struct cl_mem_account*o;
+	uint64_t queued = 0, dispatched = 0;
+	struct agg*a;
+	int i;
+
+	cl_atomic_add_relaxed (&finished, 1);
+	o = cl_alloc_set_owner (0);
+	cl_mutex_lock (&lock);
+
+	for (i = 0;i < t->hops;++i) {
+		h = t->hop + i;
+		if (!h->end_ns || ! (a = find_agg (h->part) ) ) continue;
+		++a->count;
+		hist_add (&a->queue, h->enqueue_ns, h->dequeue_ns);
+		hist_add (&a->dispatch, h->dequeue_ns, h->start_ns);
+		hist_add (&a->process, h->start_ns, h->end_ns);
+		queued += h->dequeue_ns - h->enqueue_ns;
+		dispatched += h->start_ns - h->dequeue_ns;
+	}
+	++total.count;
+	hist_add (&total.queue, 0, queued);
+	hist_add (&total.dispatch, 0, dispatched);
+	hist_add (&total.process, t->born_ns, t->freed_ns);
+
+	if (t->full) cl_atomic_add_relaxed (&dropped, 1);
+	if (kept[kept_next]) cl_free (kept[kept_next]);
+	kept[kept_next] = t;
+	kept_next = (kept_next + 1) % CL_TRACE_KEEP;
+
+	cl_mutex_unlock (&lock);
+	cl_alloc_set_owner (o);
+}
+
+int cl_trace_walk (int (*cb) (struct cl_trace_stats*, void*), void*arg)
+{
+	struct cl_trace_stats s;
+	struct agg*a;
+	int r;
+
+	cl_mutex_lock (&lock);
+	for (a = &total, r = 0;a && !r;a = (a == &total ? aggs : a->next) ) {
+		s.part = a->part;
+		s.count = a->count;
+		hist_get (&a->queue, a->count, &s.queue);
+		hist_get (&a->dispatch, a->count, &s.dispatch);
+		hist_get (&a->process, a->count, &s.process);
+		r = cb (&s, arg);
+	}
+	cl_mutex_unlock (&lock);
+	return r;
+}
+
+void cl_trace_counts (uint64_t*s, uint64_t*f, uint64_t*d)
+{
+	*s = cl_atomic_load (&sampled);
+	*f = cl_atomic_load (&finished);
+	*d = cl_atomic_load (&dropped);
+}
+
+void cl_trace_reset()
+{
+	struct agg*a;
+
+	cl_mutex_lock (&lock);
+	while ( (a = aggs) ) {
+		aggs = a->next;
+		cl_free (a);
+	}
+	memset (&total, 0, sizeof (total) );
+	total.part[0] = '*';
+	cl_mutex_unlock (&lock);
+}
+
+/*
+ * chrome trace, a row (tid) per packet
+ */
+
+static void json_event (FILE*f, int*first, const char*name, int len,
+                        const char*what, uint64_t id, uint64_t from,
+                        uint64_t to, int worker)
+{
+	fprintf (f, "%s\n{\"name\":\"%s%.*s\",\"ph\":\"X\",\"pid\":1,"
+	         "\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"worker\":%d}}",
+	         *first ? "" : ",", what, len, name, (unsigned long long) id,
+	         from / 1e3, (to > from ? to - from : 0) / 1e3, worker);
+	*first = 0;
+}
+
+int cl_trace_write_json (const char*path)
+{
+	struct cl_trace**t, *tr;
+	struct cl_trace_hop*h;
+	uint64_t end;
+	int n = 0, i, j, first = 1, r;
+	FILE*f;
+
+	/* taken away from the buffer, so nobody waits for the file */
+	if (! (t = cl_malloc (CL_TRACE_KEEP * sizeof (struct cl_trace*) ) ) )
+		return 1;
+	cl_mutex_lock (&lock);
+	for (i = 0;i < CL_TRACE_KEEP;++i) {
+		j = (kept_next + i) % CL_TRACE_KEEP;
+		if (kept[j]) t[n++] = kept[j];
+		kept[j] = 0;
+	}
+	cl_mutex_unlock (&lock);
+
+	if ( (f = fopen (path, "w") ) ) {
+		fprintf (f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+		for (i = 0;i < n;++i) {
+			tr = t[i];
+			end = tr->freed_ns;
+			for (j = 0;j < tr->hops;++j)
+				if (tr->hop[j].end_ns > end) end = tr->hop[j].end_ns;
+			json_event (f, &first, "packet", 6, "", tr->id, tr->born_ns,
+			            end, -1);
+
+			for (j = 0;j < tr->hops;++j) {
+				h = tr->hop + j;
+				if (!h->dequeue_ns) continue;
+				json_event (f, &first, h->part,
+				            strnlen (h->part, CL_TRACE_NAME), "queue ",
+				            tr->id, h->enqueue_ns, h->dequeue_ns, -1);
+				if (!h->end_ns) continue;
+				json_event (f, &first, h->part,
+				            strnlen (h->part, CL_TRACE_NAME), "", tr->id,
+				            h->start_ns, h->end_ns, h->worker);
+			}
+		}
+		fprintf (f, "\n]}\n");
+	}
+	r = !f || ferror (f);
+	if (f && fclose (f) ) r = 1;
+
+	for (i = 0;i < n;++i) cl_free (t[i]);
+	cl_free (t);
+	return r;
+}